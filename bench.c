@@ -0,0 +1,2152 @@
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "valloc.h"
+#include "vconvert.h"
+#include "vkernels.h"
+#include "vref.h"
+
+// Every sample runs a kernel back to back for at least this long, so timer
+// resolution and call overhead do not show in small sizes
+#define SAMPLE_NS 200000.0
+// Calls before the first sample: page faults, frequency ramp, cache warmup
+#define WARMUP_NS 20000000.0
+#define DEFAULT_REPS 11
+#define DEFAULT_MIN_SIZE 64
+// Working sets past the last-level cache reach DRAM
+#define DEFAULT_MAX_SIZE (32 * 1024 * 1024)
+#define MAX_REPS 1000
+// Accuracy runs: condition numbers 1e2, 1e4, ... 1e16
+#define NCONDS 8
+#define DEFAULT_ACCURACY_SIZE 4096
+#define DEFAULT_TRIALS 10
+#define MAX_TRIALS 1000
+// compare: a slowdown must exceed this (percent) and be significant at this
+// level to count as a regression
+#define DEFAULT_THRESHOLD 5.0
+#define DEFAULT_ALPHA 0.05
+// below 4 runs a side no ordering is significant at 0.05: 3 vs 3 bottoms out
+// at p = 1/20
+#define MIN_RUNS 4
+// Mann-Whitney enumerates the exact distribution up to this many per side
+#define EXACT_MAX 8
+
+enum format_t {
+  FORMAT_CSV = 0,
+  FORMAT_JSON = 1,
+  // accuracy only: text speed / accuracy chart
+  FORMAT_CHART = 2,
+};
+
+// Inputs for every kernel type, sized for the largest run. batch4 kernels
+// read a and four rows of b; the others read a and the start of b.
+typedef struct bench_data_t {
+  size_t max;
+  float *a;
+  float *b;
+  int8_t *a8;
+  int8_t *b8;
+  uint16_t *f16;
+  uint16_t *bf16;
+} bench_data_t;
+
+// Hardware counters read around each kernel in `perf` runs
+enum counter_t {
+  COUNTER_CYCLES = 0,
+  COUNTER_INSTRUCTIONS = 1,
+  COUNTER_L1D_MISSES = 2,
+  COUNTER_LLC_MISSES = 3,
+  COUNTER_STALLED_CYCLES = 4,
+  // cycles spent at the AVX-512 (license 1) and heavy AVX-512 (license 2)
+  // frequency levels
+  COUNTER_LICENSE1_CYCLES = 5,
+  COUNTER_LICENSE2_CYCLES = 6,
+  NCOUNTERS = 7,
+};
+
+typedef struct counters_t {
+  // -1 where the kernel or the CPU has no such event
+  int fd[NCOUNTERS];
+  // per call, NAN where unavailable
+  double value[NCOUNTERS];
+} counters_t;
+
+// One row of output: named columns, then the raw samples (JSON only)
+#define MAX_FIELDS 24
+
+typedef struct report_t {
+  int format;
+  size_t rows;
+  const char *keys[MAX_FIELDS];
+  char values[MAX_FIELDS][96];
+  // 1 for a number, 0 for a string
+  int numeric[MAX_FIELDS];
+  size_t nfields;
+  double *samples;
+  size_t nsamples;
+} report_t;
+
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double median(double *x, size_t n) {
+  double *sorted = (double *)malloc(n * sizeof(double));
+  memcpy(sorted, x, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), compare_double);
+  double m = n % 2 ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+  free(sorted);
+  return m;
+}
+
+static double minimum(double *x, size_t n) {
+  double m = x[0];
+  for (size_t i = 1; i < n; i++) {
+    m = x[i] < m ? x[i] : m;
+  }
+  return m;
+}
+
+static void cpu_model(char *out, size_t size) {
+  snprintf(out, size, "unknown");
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) {
+    return;
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    // x86 names the model; arm64 only has implementer / part numbers
+    if (strncmp(line, "model name", 10) == 0 ||
+        strncmp(line, "CPU part", 8) == 0) {
+      char *p = strchr(line, ':');
+      if (p != NULL) {
+        p += 1 + (p[1] == ' ');
+        p[strcspn(p, "\n")] = 0;
+        snprintf(out, size, "%s", p);
+        break;
+      }
+    }
+  }
+  fclose(f);
+}
+
+// The smallest cache level the working set fits in
+static const char *cache_level(double bytes) {
+  long sizes[] = {sysconf(_SC_LEVEL1_DCACHE_SIZE), sysconf(_SC_LEVEL2_CACHE_SIZE),
+                  sysconf(_SC_LEVEL3_CACHE_SIZE)};
+  const char *names[] = {"L1", "L2", "L3"};
+  for (int i = 0; i < 3; i++) {
+    if (sizes[i] > 0 && bytes <= (double)sizes[i]) {
+      return names[i];
+    }
+  }
+  return "DRAM";
+}
+
+// (Re)fill the inputs with uniform values in [-1, 1)
+static void bench_data_init_values(bench_data_t *d) {
+  size_t max = d->max;
+  unsigned s = 12345;
+  for (size_t i = 0; i < 5 * max; i++) {
+    s = s * 1103515245u + 12345u;
+    d->a[i] = (float)((s >> 8) & 0xffff) / 32768.0f - 1.0f;
+  }
+  for (size_t i = 0; i < max; i++) {
+    d->a8[i] = (int8_t)((int)(d->a[i] * 127.0f));
+    d->b8[i] = (int8_t)((int)(d->b[i] * 127.0f));
+  }
+  vconvert_f32_to_f16(d->b, d->f16, max);
+  vconvert_f32_to_bf16(d->b, d->bf16, max);
+}
+
+static int bench_data_init(bench_data_t *d, size_t max) {
+  d->max = max;
+  size_t f32_bytes = 5 * max * sizeof(float);
+  size_t other_bytes = 2 * max + 2 * max * sizeof(uint16_t);
+  char *p = (char *)vdot_alloc(f32_bytes + other_bytes + 4 * VALLOC_ALIGN,
+                               VALLOC_THP);
+  if (p == NULL) {
+    return -1;
+  }
+  d->a = (float *)p;
+  d->b = d->a + max;
+  d->a8 = (int8_t *)(d->b + 4 * max);
+  d->b8 = d->a8 + max;
+  d->f16 = (uint16_t *)(d->b8 + max);
+  d->bf16 = d->f16 + max;
+  bench_data_init_values(d);
+  return 0;
+}
+
+static void bench_data_free(bench_data_t *d) {
+  vdot_free(d->a);
+}
+
+// Run k once over n elements and return its result (for batch4, the sum of
+// the four dot products)
+static double run_kernel(vkernel_t *k, bench_data_t *d, size_t n) {
+  float out[4];
+  switch (k->type) {
+  case VKERNEL_F32:
+    return k->fn.f32(d->a, d->b, n);
+  case VKERNEL_BATCH4_F32:
+    k->fn.batch4(d->a, d->b, d->b + n, d->b + 2 * n, d->b + 3 * n, n, out);
+    return (double)out[0] + out[1] + out[2] + out[3];
+  case VKERNEL_I8:
+    return k->fn.i8(d->a8, d->b8, n);
+  case VKERNEL_F16_F32:
+    return k->fn.half(d->a, d->f16, n);
+  case VKERNEL_BF16_F32:
+    return k->fn.half(d->a, d->bf16, n);
+  }
+  return 0.0;
+}
+
+// Arithmetic (multiply and add counted separately) and bytes read per call
+static void kernel_cost(vkernel_t *k, size_t n, double *flops, double *bytes) {
+  double dn = (double)n;
+  switch (k->type) {
+  case VKERNEL_BATCH4_F32:
+    *flops = 8.0 * dn;
+    *bytes = 5.0 * dn * sizeof(float);
+    break;
+  case VKERNEL_I8:
+    *flops = 2.0 * dn;
+    *bytes = 2.0 * dn;
+    break;
+  case VKERNEL_F16_F32:
+  case VKERNEL_BF16_F32:
+    *flops = 2.0 * dn;
+    *bytes = dn * (sizeof(float) + sizeof(uint16_t));
+    break;
+  default:
+    *flops = 2.0 * dn;
+    *bytes = 2.0 * dn * sizeof(float);
+    break;
+  }
+}
+
+// Results are summed into this so no call can be optimized away
+static volatile double sink;
+
+// Time reps samples of k over n elements, in nanoseconds per call. Returns
+// the number of calls in one sample.
+static size_t measure(vkernel_t *k, bench_data_t *d, size_t n, size_t reps,
+                      double *samples) {
+  size_t iters = 1;
+  double start = now_ns();
+  double acc = 0.0;
+  // warm up while finding how many calls fill a sample
+  for (;;) {
+    double t0 = now_ns();
+    for (size_t i = 0; i < iters; i++) {
+      acc += run_kernel(k, d, n);
+    }
+    double t = now_ns() - t0;
+    if (t < SAMPLE_NS) {
+      iters = t > 0 ? (size_t)(iters * 1.5 * SAMPLE_NS / t) + 1 : iters * 2;
+    } else if (now_ns() - start >= WARMUP_NS) {
+      break;
+    }
+  }
+  for (size_t r = 0; r < reps; r++) {
+    double t0 = now_ns();
+    for (size_t i = 0; i < iters; i++) {
+      acc += run_kernel(k, d, n);
+    }
+    samples[r] = (now_ns() - t0) / (double)iters;
+  }
+  sink += acc;
+  return iters;
+}
+
+/* Hardware counters */
+
+// Intel family 6 model number from /proc/cpuinfo, or -1 on other CPUs
+static int intel_model(void) {
+  FILE *f = fopen("/proc/cpuinfo", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  char line[256];
+  int intel = 0, family = -1, model = -1;
+  while (fgets(line, sizeof(line), f) != NULL && strncmp(line, "\n", 1) != 0) {
+    char *p = strchr(line, ':');
+    if (p == NULL) {
+      continue;
+    }
+    if (strncmp(line, "vendor_id", 9) == 0) {
+      intel = strstr(p, "GenuineIntel") != NULL;
+    } else if (strncmp(line, "cpu family", 10) == 0) {
+      family = atoi(p + 1);
+    } else if (strncmp(line, "model\t", 6) == 0) {
+      model = atoi(p + 1);
+    }
+  }
+  fclose(f);
+  return intel && family == 6 ? model : -1;
+}
+
+static int perf_open(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  // user space only: allowed at the default perf_event_paranoid level
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t cache_event(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+// Open every counter this CPU and kernel have. Counters are separate events,
+// not a group, so one missing event does not take the others down; the
+// kernel multiplexes them if they do not all fit, and reads are scaled.
+// Returns how many opened.
+static int counters_open(counters_t *c) {
+  c->fd[COUNTER_CYCLES] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  c->fd[COUNTER_INSTRUCTIONS] =
+      perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  c->fd[COUNTER_L1D_MISSES] =
+      perf_open(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D));
+  c->fd[COUNTER_LLC_MISSES] =
+      perf_open(PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_LL));
+  c->fd[COUNTER_STALLED_CYCLES] =
+      perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND);
+  c->fd[COUNTER_LICENSE1_CYCLES] = -1;
+  c->fd[COUNTER_LICENSE2_CYCLES] = -1;
+  int model = intel_model();
+  // Skylake and later Intel cores have no generic stall event; use
+  // CYCLE_ACTIVITY.STALLS_TOTAL (event 0xa3, umask 0x04, cmask 4)
+  if (c->fd[COUNTER_STALLED_CYCLES] < 0 && model >= 0) {
+    c->fd[COUNTER_STALLED_CYCLES] = perf_open(PERF_TYPE_RAW, 0x040004a3);
+  }
+  // CORE_POWER.LVL1_TURBO_LICENSE / LVL2_TURBO_LICENSE (event 0x28, umask
+  // 0x18 / 0x20) on Skylake-SP and Cascade Lake. Other models encode the
+  // license events differently, so they are left out rather than guessed.
+  if (model == 0x55) {
+    c->fd[COUNTER_LICENSE1_CYCLES] = perf_open(PERF_TYPE_RAW, 0x1828);
+    c->fd[COUNTER_LICENSE2_CYCLES] = perf_open(PERF_TYPE_RAW, 0x2028);
+  }
+  int opened = 0;
+  for (int i = 0; i < NCOUNTERS; i++) {
+    opened += c->fd[i] >= 0;
+  }
+  return opened;
+}
+
+static void counters_close(counters_t *c) {
+  for (int i = 0; i < NCOUNTERS; i++) {
+    if (c->fd[i] >= 0) {
+      close(c->fd[i]);
+    }
+  }
+}
+
+// Count iters calls of k over n elements and store the counts per call
+static void count(vkernel_t *k, bench_data_t *d, size_t n, size_t iters,
+                  counters_t *c) {
+  for (int i = 0; i < NCOUNTERS; i++) {
+    if (c->fd[i] >= 0) {
+      ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  double acc = 0.0;
+  for (size_t i = 0; i < iters; i++) {
+    acc += run_kernel(k, d, n);
+  }
+  for (int i = 0; i < NCOUNTERS; i++) {
+    if (c->fd[i] >= 0) {
+      ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  sink += acc;
+  for (int i = 0; i < NCOUNTERS; i++) {
+    // value, time enabled, time running
+    uint64_t v[3];
+    c->value[i] = NAN;
+    if (c->fd[i] >= 0 && read(c->fd[i], v, sizeof(v)) == sizeof(v) &&
+        v[2] > 0) {
+      c->value[i] = (double)v[0] * ((double)v[1] / (double)v[2]) / iters;
+    }
+  }
+}
+
+static void json_string(const char *s) {
+  putchar('"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      putchar('\\');
+    }
+    putchar(*s);
+  }
+  putchar('"');
+}
+
+// The start of the JSON object; anything printed before report_results
+// goes next to "cpu"
+static void report_open(report_t *r, int format, const char *cpu) {
+  r->format = format;
+  r->rows = 0;
+  if (format == FORMAT_JSON) {
+    printf("{\n  \"cpu\": ");
+    json_string(cpu);
+  }
+}
+
+static void report_results(report_t *r) {
+  if (r->format == FORMAT_JSON) {
+    printf(",\n  \"results\": [");
+  }
+}
+
+static void report_begin(report_t *r, int format, const char *cpu) {
+  report_open(r, format, cpu);
+  report_results(r);
+}
+
+static void report_field(report_t *r, const char *key, int numeric,
+                         const char *fmt, ...) {
+  if (r->nfields == MAX_FIELDS) {
+    return;
+  }
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(r->values[r->nfields], sizeof(r->values[0]), fmt, ap);
+  va_end(ap);
+  r->keys[r->nfields] = key;
+  r->numeric[r->nfields] = numeric;
+  r->nfields++;
+}
+
+// A number that may be missing (NAN): null in JSON, empty in CSV
+static void report_number(report_t *r, const char *key, const char *fmt,
+                          double value) {
+  if (isnan(value)) {
+    report_field(r, key, 1, "%s", r->format == FORMAT_JSON ? "null" : "");
+  } else {
+    report_field(r, key, 1, fmt, value);
+  }
+}
+
+static void report_row(report_t *r) {
+  if (r->format == FORMAT_CSV) {
+    for (size_t i = 0; r->rows == 0 && i < r->nfields; i++) {
+      printf(i ? ",%s" : "%s", r->keys[i]);
+    }
+    if (r->rows == 0) {
+      printf("\n");
+    }
+    for (size_t i = 0; i < r->nfields; i++) {
+      printf(i ? ",%s" : "%s", r->values[i]);
+    }
+    printf("\n");
+  } else {
+    printf(r->rows ? ",\n    {" : "\n    {");
+    for (size_t i = 0; i < r->nfields; i++) {
+      printf(i ? ", " : "");
+      json_string(r->keys[i]);
+      printf(": ");
+      if (r->numeric[i]) {
+        printf("%s", r->values[i]);
+      } else {
+        json_string(r->values[i]);
+      }
+    }
+    if (r->nsamples > 0) {
+      printf(", \"samples_ns\": [");
+      for (size_t i = 0; i < r->nsamples; i++) {
+        printf(i ? ", %.1f" : "%.1f", r->samples[i]);
+      }
+      printf("]");
+    }
+    printf("}");
+  }
+  fflush(stdout);
+  r->rows++;
+  r->nfields = 0;
+  r->nsamples = 0;
+}
+
+static void report_end(report_t *r) {
+  if (r->format == FORMAT_JSON) {
+    printf("\n  ]\n}\n");
+  }
+}
+
+// Kernels whose name contains filter ("" for all) that this CPU can run
+static size_t select_kernels(vkernel_t *kernels, const char *filter) {
+  vkernel_t all[VKERNEL_MAX];
+  size_t n = vkernel_list(all), count = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (all[i].supported && strstr(all[i].name, filter) != NULL) {
+      kernels[count++] = all[i];
+    }
+  }
+  return count;
+}
+
+static int parse_format(const char *s) {
+  if (strcmp(s, "csv") == 0) {
+    return FORMAT_CSV;
+  }
+  if (strcmp(s, "chart") == 0) {
+    return FORMAT_CHART;
+  }
+  return strcmp(s, "json") == 0 ? FORMAT_JSON : -1;
+}
+
+// Time every kernel over sizes doubling from min_size to max_size elements,
+// and with counters, read the hardware counters over the same calls
+static int sweep(int argc, char *argv[], int with_counters) {
+  int format = argc > 2 ? parse_format(argv[2]) : FORMAT_CSV;
+  long min_size = argc > 3 ? atol(argv[3]) : DEFAULT_MIN_SIZE;
+  long max_size = argc > 4 ? atol(argv[4]) : DEFAULT_MAX_SIZE;
+  long reps = argc > 5 ? atol(argv[5]) : DEFAULT_REPS;
+  const char *filter = argc > 6 ? argv[6] : "";
+  if (format < 0 || format == FORMAT_CHART || min_size <= 0 || max_size < min_size || reps <= 0 ||
+      reps > MAX_REPS) {
+    printf("Invalid format, sizes or repetitions\n");
+    return 1;
+  }
+  vkernel_t kernels[VKERNEL_MAX];
+  size_t nk = select_kernels(kernels, filter);
+  bench_data_t d;
+  if (bench_data_init(&d, (size_t)max_size) != 0) {
+    fprintf(stderr, "Memory allocation failed\n");
+    return 1;
+  }
+  counters_t c;
+  if (with_counters && counters_open(&c) == 0) {
+    // EACCES: perf_event_paranoid is above 2; ENOENT: no PMU (most VMs)
+    fprintf(stderr, "No hardware counters available (perf_event_open: %s)\n",
+            strerror(errno));
+  }
+  char cpu[128];
+  cpu_model(cpu, sizeof(cpu));
+  double samples[MAX_REPS];
+  report_t r;
+  memset(&r, 0, sizeof(r));
+  report_begin(&r, format, cpu);
+  for (size_t n = (size_t)min_size; n <= (size_t)max_size; n *= 2) {
+    for (size_t i = 0; i < nk; i++) {
+      vkernel_t *k = &kernels[i];
+      double flops, bytes;
+      kernel_cost(k, n, &flops, &bytes);
+      size_t iters = measure(k, &d, n, (size_t)reps, samples);
+      double med = median(samples, (size_t)reps);
+      report_field(&r, "cpu", 0, "%s", cpu);
+      report_field(&r, "kernel", 0, "%s", k->name);
+      report_field(&r, "isa", 0, "%s", k->isa);
+      report_field(&r, "mode", 0, "%s", vkernel_mode_name(k->mode));
+      report_field(&r, "size", 1, "%zu", n);
+      report_field(&r, "bytes", 1, "%.0f", bytes);
+      report_field(&r, "level", 0, "%s", cache_level(bytes));
+      report_field(&r, "median_ns", 1, "%.1f", med);
+      report_field(&r, "min_ns", 1, "%.1f", minimum(samples, (size_t)reps));
+      report_field(&r, "gflops", 1, "%.3f", flops / med);
+      report_field(&r, "gbs", 1, "%.3f", bytes / med);
+      if (with_counters) {
+        // as many calls as all the timed samples together
+        count(k, &d, n, iters * (size_t)reps, &c);
+        double *v = c.value;
+        report_number(&r, "cycles", "%.1f", v[COUNTER_CYCLES]);
+        report_number(&r, "instructions", "%.1f", v[COUNTER_INSTRUCTIONS]);
+        report_number(&r, "ipc", "%.3f",
+                      v[COUNTER_INSTRUCTIONS] / v[COUNTER_CYCLES]);
+        report_number(&r, "cycles_per_elem", "%.4f", v[COUNTER_CYCLES] / n);
+        report_number(&r, "l1d_misses", "%.1f", v[COUNTER_L1D_MISSES]);
+        report_number(&r, "llc_misses", "%.1f", v[COUNTER_LLC_MISSES]);
+        report_number(&r, "stalled_cycles", "%.1f", v[COUNTER_STALLED_CYCLES]);
+        report_number(&r, "license1_cycles", "%.1f",
+                      v[COUNTER_LICENSE1_CYCLES]);
+        report_number(&r, "license2_cycles", "%.1f",
+                      v[COUNTER_LICENSE2_CYCLES]);
+      }
+      r.samples = samples;
+      r.nsamples = format == FORMAT_JSON ? (size_t)reps : 0;
+      report_row(&r);
+    }
+  }
+  report_end(&r);
+  if (with_counters) {
+    counters_close(&c);
+  }
+  bench_data_free(&d);
+  return 0;
+}
+
+/* Accuracy */
+
+// Run k once over the inputs in d and store every dot product it computes
+// (four for batch4). Returns how many.
+static int evaluate(vkernel_t *k, bench_data_t *d, size_t n, double *out) {
+  float four[4];
+  switch (k->type) {
+  case VKERNEL_F32:
+    out[0] = k->fn.f32(d->a, d->b, n);
+    return 1;
+  case VKERNEL_BATCH4_F32:
+    k->fn.batch4(d->a, d->b, d->b + n, d->b + 2 * n, d->b + 3 * n, n, four);
+    for (int i = 0; i < 4; i++) {
+      out[i] = four[i];
+    }
+    return 4;
+  case VKERNEL_F16_F32:
+    out[0] = k->fn.half(d->a, d->f16, n);
+    return 1;
+  case VKERNEL_BF16_F32:
+    out[0] = k->fn.half(d->a, d->bf16, n);
+    return 1;
+  }
+  return 0;
+}
+
+static float round_f16(float f) {
+  return vconvert_f16_to_f32_scalar(vconvert_f32_to_f16_scalar(f));
+}
+
+static float round_bf16(float f) {
+  return vconvert_bf16_to_f32_scalar(vconvert_f32_to_bf16_scalar(f));
+}
+
+// Put a dot product of condition number about cond into d for kernel type
+// type, with the second operand exactly representable in the type the kernel
+// reads, so the error measured is the kernel's arithmetic only. Returns the
+// condition number reached, or INFINITY when the operands overflow.
+static double accuracy_input(bench_data_t *d, int type, size_t n, double cond,
+                             uint64_t seed, double *ref) {
+  vref_round_fn round_y = type == VKERNEL_F16_F32    ? round_f16
+                          : type == VKERNEL_BF16_F32 ? round_bf16
+                                                     : NULL;
+  double c = vref_gen_dot(d->a, d->b, n, cond, seed, round_y);
+  vconvert_f32_to_f16(d->b, d->f16, n);
+  vconvert_f32_to_bf16(d->b, d->bf16, n);
+  for (size_t r = 1; r < 4; r++) {
+    memcpy(d->b + r * n, d->b, n * sizeof(float));
+  }
+  *ref = vref_dot_f32(d->a, d->b, n);
+  return isfinite(*ref) ? c : INFINITY;
+}
+
+// Errors of one kernel at one condition number
+typedef struct accuracy_t {
+  // median over trials of the condition number reached
+  double cond;
+  size_t trials;
+  double median_rel;
+  double max_rel;
+  double median_ulps;
+  double max_ulps;
+} accuracy_t;
+
+static void accuracy_cell(vkernel_t *k, bench_data_t *d, size_t n, double cond,
+                          size_t trials, accuracy_t *a) {
+  static double rel[4 * MAX_TRIALS], ulps[4 * MAX_TRIALS], conds[MAX_TRIALS];
+  size_t m = 0, t = 0;
+  for (size_t i = 0; i < trials; i++) {
+    double ref, out[4];
+    double c = accuracy_input(d, k->type, n, cond, i + 1, &ref);
+    if (!isfinite(c)) {
+      continue;
+    }
+    conds[t++] = c;
+    int count = evaluate(k, d, n, out);
+    for (int j = 0; j < count; j++) {
+      rel[m] = fabs(out[j] - ref) / fabs(ref);
+      // a non-finite result is as wrong as it gets
+      rel[m] = isnan(rel[m]) ? INFINITY : rel[m];
+      ulps[m] = vref_ulps(out[j], ref);
+      ulps[m] = isnan(ulps[m]) ? INFINITY : ulps[m];
+      m++;
+    }
+  }
+  a->trials = t;
+  if (t == 0) {
+    a->cond = a->median_rel = a->max_rel = a->median_ulps = a->max_ulps = NAN;
+    return;
+  }
+  a->cond = median(conds, t);
+  a->median_rel = median(rel, m);
+  a->max_rel = rel[0];
+  a->max_ulps = ulps[0];
+  for (size_t i = 1; i < m; i++) {
+    a->max_rel = rel[i] > a->max_rel ? rel[i] : a->max_rel;
+    a->max_ulps = ulps[i] > a->max_ulps ? ulps[i] : a->max_ulps;
+  }
+  a->median_ulps = median(ulps, m);
+}
+
+// One number for a kernel's accuracy: the geometric mean of its median
+// relative errors, each clamped to [1e-17, 1] (a float result is at best
+// exact, and past 1 it carries no information)
+static double accuracy_score(accuracy_t *a, size_t count) {
+  double sum = 0.0;
+  size_t used = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (!isnan(a[i].median_rel)) {
+      double e = a[i].median_rel;
+      sum += log10(e < 1e-17 ? 1e-17 : e > 1 ? 1 : e);
+      used++;
+    }
+  }
+  return used ? pow(10, sum / used) : NAN;
+}
+
+// Speed against accuracy for every kernel, fastest first. Kernels marked *
+// are on the Pareto front: no other kernel is both at least as fast and at
+// least as accurate.
+static void accuracy_chart(vkernel_t *kernels, size_t nk, double *gflops,
+                           double *score) {
+  size_t order[VKERNEL_MAX];
+  double max_gflops = 0.0;
+  for (size_t i = 0; i < nk; i++) {
+    order[i] = i;
+    max_gflops = gflops[i] > max_gflops ? gflops[i] : max_gflops;
+  }
+  for (size_t i = 1; i < nk; i++) {
+    for (size_t j = i; j > 0 && gflops[order[j]] > gflops[order[j - 1]]; j--) {
+      size_t t = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = t;
+    }
+  }
+  printf("%-20s %-12s %8s  %-30s %9s  %s\n", "kernel", "mode", "GFLOP/s",
+         "", "rel.err", "digits");
+  for (size_t o = 0; o < nk; o++) {
+    size_t i = order[o];
+    int pareto = !isnan(score[i]);
+    for (size_t j = 0; j < nk && pareto; j++) {
+      if (j != i && gflops[j] >= gflops[i] && score[j] <= score[i] &&
+          (gflops[j] > gflops[i] || score[j] < score[i])) {
+        pareto = 0;
+      }
+    }
+    char speed[31], digits[18];
+    int bar = max_gflops > 0 ? (int)(30 * gflops[i] / max_gflops + 0.5) : 0;
+    // correct decimal digits, 0 to 17
+    int d = isnan(score[i]) ? 0 : (int)(-log10(score[i]) + 0.5);
+    memset(speed, '#', (size_t)bar);
+    speed[bar] = 0;
+    memset(digits, '=', (size_t)d);
+    digits[d] = 0;
+    printf("%-20s %-12s %8.2f  %-30s %9.1e  %-17s %s\n", kernels[i].name,
+           vkernel_mode_name(kernels[i].mode), gflops[i], speed, score[i],
+           digits, pareto ? "*" : "");
+  }
+  printf("\nrel.err: geometric mean over condition numbers 1e2..1e16 of the "
+         "median relative error\n* on the speed / accuracy Pareto front\n");
+}
+
+// Relative error and ulps of every float kernel on inputs of growing
+// condition number, with the throughput at the same size. i8 kernels
+// accumulate in integers and are exact, so they are not listed.
+static int accuracy(int argc, char *argv[]) {
+  int format = argc > 2 ? parse_format(argv[2]) : FORMAT_CSV;
+  long size = argc > 3 ? atol(argv[3]) : DEFAULT_ACCURACY_SIZE;
+  long trials = argc > 4 ? atol(argv[4]) : DEFAULT_TRIALS;
+  const char *filter = argc > 5 ? argv[5] : "";
+  if (format < 0 || size < 6 || trials <= 0 || trials > MAX_TRIALS) {
+    printf("Invalid format, size (at least 6) or trials\n");
+    return 1;
+  }
+  vkernel_t all[VKERNEL_MAX], kernels[VKERNEL_MAX];
+  size_t na = select_kernels(all, filter), nk = 0;
+  for (size_t i = 0; i < na; i++) {
+    if (all[i].type != VKERNEL_I8) {
+      kernels[nk++] = all[i];
+    }
+  }
+  size_t n = (size_t)size;
+  bench_data_t d;
+  if (bench_data_init(&d, n) != 0) {
+    fprintf(stderr, "Memory allocation failed\n");
+    return 1;
+  }
+  char cpu[128];
+  cpu_model(cpu, sizeof(cpu));
+  double samples[DEFAULT_REPS], gflops[VKERNEL_MAX], score[VKERNEL_MAX];
+  accuracy_t cells[NCONDS];
+  report_t r;
+  memset(&r, 0, sizeof(r));
+  if (format != FORMAT_CHART) {
+    report_begin(&r, format, cpu);
+  }
+  for (size_t i = 0; i < nk; i++) {
+    vkernel_t *k = &kernels[i];
+    double flops, bytes;
+    kernel_cost(k, n, &flops, &bytes);
+    // time on the benchmark's own inputs before they are overwritten
+    bench_data_init_values(&d);
+    measure(k, &d, n, DEFAULT_REPS, samples);
+    gflops[i] = flops / median(samples, DEFAULT_REPS);
+    double cond = 1.0;
+    for (size_t c = 0; c < NCONDS; c++) {
+      cond *= 100.0;
+      accuracy_t *a = &cells[c];
+      accuracy_cell(k, &d, n, cond, (size_t)trials, a);
+      if (format == FORMAT_CHART) {
+        continue;
+      }
+      report_field(&r, "cpu", 0, "%s", cpu);
+      report_field(&r, "kernel", 0, "%s", k->name);
+      report_field(&r, "isa", 0, "%s", k->isa);
+      report_field(&r, "mode", 0, "%s", vkernel_mode_name(k->mode));
+      report_field(&r, "size", 1, "%zu", n);
+      report_field(&r, "cond_target", 1, "%.0e", cond);
+      report_number(&r, "cond", "%.3e", a->cond);
+      report_field(&r, "trials", 1, "%zu", a->trials);
+      report_number(&r, "median_rel_err", "%.3e", a->median_rel);
+      report_number(&r, "max_rel_err", "%.3e", a->max_rel);
+      report_number(&r, "median_ulps", "%.3g", a->median_ulps);
+      report_number(&r, "max_ulps", "%.3g", a->max_ulps);
+      report_field(&r, "gflops", 1, "%.3f", gflops[i]);
+      report_row(&r);
+    }
+    score[i] = accuracy_score(cells, NCONDS);
+  }
+  if (format == FORMAT_CHART) {
+    printf("%s, %zu elements, %ld trials per condition number\n\n", cpu, n,
+           trials);
+    accuracy_chart(kernels, nk, gflops, score);
+  } else {
+    report_end(&r);
+  }
+  bench_data_free(&d);
+  return 0;
+}
+
+/* Roofline */
+
+// Peaks are measured with independent multiply-add chains on registers, the
+// chains many enough to cover FMA latency on every port
+#define PEAK_CHAINS 12
+#define PEAK_ITERS 4096
+// Fully unrolled, the chains live in registers instead of an array in memory
+#define PEAK_UNROLL _Pragma("GCC unroll 16")
+// Largest working set for the DRAM level
+#define ROOF_MAX_BYTES (256 * 1024 * 1024)
+
+// The "kernels" below have the f32 kernel signature so measure() can time
+// them: peak_* run size iterations of PEAK_CHAINS multiply-adds on values
+// read from a, read_* sum the first size floats of a. The dot kernels stream
+// two to five arrays at once, and past L2 one stream alone gets less
+// bandwidth, so read_* walk the four quarters of a side by side.
+
+#if defined(__GNUC__) && !defined(__clang__)
+// the chains must stay scalar, as in the serial kernels
+__attribute__((optimize("no-tree-vectorize")))
+#endif
+static float peak_serial(float *a, float *b, size_t size) {
+  float x = a[0], y = a[1], acc[PEAK_CHAINS];
+  PEAK_UNROLL
+  for (int j = 0; j < PEAK_CHAINS; j++) {
+    acc[j] = a[j];
+  }
+  for (size_t i = 0; i < size; i++) {
+    PEAK_UNROLL
+    for (int j = 0; j < PEAK_CHAINS; j++) {
+      acc[j] = acc[j] * x + y;
+    }
+  }
+  float sum = 0.0f;
+  PEAK_UNROLL
+  for (int j = 0; j < PEAK_CHAINS; j++) {
+    sum += acc[j];
+  }
+  return sum;
+}
+
+static float read_serial(float *a, float *b, size_t size) {
+  float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+  size_t q = size / 4;
+  for (size_t i = 0; i < q; i++) {
+    s0 += a[i];
+    s1 += a[q + i];
+    s2 += a[2 * q + i];
+    s3 += a[3 * q + i];
+  }
+  // left over
+  for (size_t i = 4 * q; i < size; i++) {
+    s0 += a[i];
+  }
+  return s0 + s1 + s2 + s3;
+}
+
+#if defined(__AVX__)
+// AVX without FMA, as _vdot_f32_avx: a multiply and an add
+static float peak_avx(float *a, float *b, size_t size) {
+  __m256 x = _mm256_set1_ps(a[0]), y = _mm256_set1_ps(a[1]);
+  __m256 acc[PEAK_CHAINS];
+  PEAK_UNROLL
+  for (int j = 0; j < PEAK_CHAINS; j++) {
+    acc[j] = _mm256_set1_ps(a[j]);
+  }
+  for (size_t i = 0; i < size; i++) {
+    PEAK_UNROLL
+    for (int j = 0; j < PEAK_CHAINS; j++) {
+      acc[j] = _mm256_add_ps(_mm256_mul_ps(acc[j], x), y);
+    }
+  }
+  float out[8], sum = 0.0f;
+  PEAK_UNROLL
+  for (int j = 1; j < PEAK_CHAINS; j++) {
+    acc[0] = _mm256_add_ps(acc[0], acc[j]);
+  }
+  _mm256_storeu_ps(out, acc[0]);
+  for (int j = 0; j < 8; j++) {
+    sum += out[j];
+  }
+  return sum;
+}
+
+static float read_avx(float *a, float *b, size_t size) {
+  __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+  __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+  size_t q = size / 32 * 8;
+  for (size_t i = 0; i < q; i += 8) {
+    s0 = _mm256_add_ps(s0, _mm256_loadu_ps(a + i));
+    s1 = _mm256_add_ps(s1, _mm256_loadu_ps(a + q + i));
+    s2 = _mm256_add_ps(s2, _mm256_loadu_ps(a + 2 * q + i));
+    s3 = _mm256_add_ps(s3, _mm256_loadu_ps(a + 3 * q + i));
+  }
+  float out[8], sum = 0.0f;
+  _mm256_storeu_ps(out, _mm256_add_ps(_mm256_add_ps(s0, s1),
+                                      _mm256_add_ps(s2, s3)));
+  for (int j = 0; j < 8; j++) {
+    sum += out[j];
+  }
+  // left over
+  return sum + read_serial(a + 4 * q, b, size - 4 * q);
+}
+#endif // __AVX__
+
+#if defined(__AVX2__) && defined(__FMA__)
+static float peak_avx2(float *a, float *b, size_t size) {
+  __m256 x = _mm256_set1_ps(a[0]), y = _mm256_set1_ps(a[1]);
+  __m256 acc[PEAK_CHAINS];
+  PEAK_UNROLL
+  for (int j = 0; j < PEAK_CHAINS; j++) {
+    acc[j] = _mm256_set1_ps(a[j]);
+  }
+  for (size_t i = 0; i < size; i++) {
+    PEAK_UNROLL
+    for (int j = 0; j < PEAK_CHAINS; j++) {
+      acc[j] = _mm256_fmadd_ps(acc[j], x, y);
+    }
+  }
+  float out[8], sum = 0.0f;
+  PEAK_UNROLL
+  for (int j = 1; j < PEAK_CHAINS; j++) {
+    acc[0] = _mm256_add_ps(acc[0], acc[j]);
+  }
+  _mm256_storeu_ps(out, acc[0]);
+  for (int j = 0; j < 8; j++) {
+    sum += out[j];
+  }
+  return sum;
+}
+#endif // __AVX2__ && __FMA__
+
+#if defined(__AVX2__)
+// maddubs, as the int8 kernels: a multiply and an add per pair of bytes.
+// Each chain feeds its own result back in, so no maddubs is loop-invariant.
+static float peak_avx2_i8(float *a, float *b, size_t size) {
+  __m256i y = _mm256_set1_epi8((char)a[1]);
+  __m256i acc[PEAK_CHAINS];
+  PEAK_UNROLL
+  for (int j = 0; j < PEAK_CHAINS; j++) {
+    acc[j] = _mm256_set1_epi8((char)a[j]);
+  }
+  for (size_t i = 0; i < size; i++) {
+    PEAK_UNROLL
+    for (int j = 0; j < PEAK_CHAINS; j++) {
+      acc[j] = _mm256_maddubs_epi16(acc[j], y);
+    }
+  }
+  PEAK_UNROLL
+  for (int j = 1; j < PEAK_CHAINS; j++) {
+    acc[0] = _mm256_add_epi16(acc[0], acc[j]);
+  }
+  return (float)_mm256_extract_epi16(acc[0], 0);
+}
+#endif // __AVX2__
+
+#if defined(__AVX512F__)
+static float peak_avx512f(float *a, float *b, size_t size) {
+  __m512 x = _mm512_set1_ps(a[0]), y = _mm512_set1_ps(a[1]);
+  __m512 acc[PEAK_CHAINS];
+  PEAK_UNROLL
+  for (int j = 0; j < PEAK_CHAINS; j++) {
+    acc[j] = _mm512_set1_ps(a[j]);
+  }
+  for (size_t i = 0; i < size; i++) {
+    PEAK_UNROLL
+    for (int j = 0; j < PEAK_CHAINS; j++) {
+      acc[j] = _mm512_fmadd_ps(acc[j], x, y);
+    }
+  }
+  PEAK_UNROLL
+  for (int j = 1; j < PEAK_CHAINS; j++) {
+    acc[0] = _mm512_add_ps(acc[0], acc[j]);
+  }
+  return _mm512_reduce_add_ps(acc[0]);
+}
+
+static float read_avx512f(float *a, float *b, size_t size) {
+  __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+  __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+  size_t q = size / 64 * 16;
+  for (size_t i = 0; i < q; i += 16) {
+    s0 = _mm512_add_ps(s0, _mm512_loadu_ps(a + i));
+    s1 = _mm512_add_ps(s1, _mm512_loadu_ps(a + q + i));
+    s2 = _mm512_add_ps(s2, _mm512_loadu_ps(a + 2 * q + i));
+    s3 = _mm512_add_ps(s3, _mm512_loadu_ps(a + 3 * q + i));
+  }
+  float sum = _mm512_reduce_add_ps(
+      _mm512_add_ps(_mm512_add_ps(s0, s1), _mm512_add_ps(s2, s3)));
+  // left over
+  return sum + read_serial(a + 4 * q, b, size - 4 * q);
+}
+#endif // __AVX512F__
+
+#if defined(__AVX512BW__)
+static float peak_avx512bw_i8(float *a, float *b, size_t size) {
+  __m512i y = _mm512_set1_epi8((char)a[1]);
+  __m512i acc[PEAK_CHAINS];
+  PEAK_UNROLL
+  for (int j = 0; j < PEAK_CHAINS; j++) {
+    acc[j] = _mm512_set1_epi8((char)a[j]);
+  }
+  for (size_t i = 0; i < size; i++) {
+    PEAK_UNROLL
+    for (int j = 0; j < PEAK_CHAINS; j++) {
+      acc[j] = _mm512_maddubs_epi16(acc[j], y);
+    }
+  }
+  PEAK_UNROLL
+  for (int j = 1; j < PEAK_CHAINS; j++) {
+    acc[0] = _mm512_add_epi16(acc[0], acc[j]);
+  }
+  return (float)_mm_extract_epi16(_mm512_castsi512_si128(acc[0]), 0);
+}
+#endif // __AVX512BW__
+
+#if defined(__ARM_FEATURE_SVE)
+static float peak_sve(float *a, float *b, size_t size) {
+  svbool_t all = svptrue_b32();
+  svfloat32_t x = svdup_f32(a[0]), y = svdup_f32(a[1]);
+  svfloat32_t acc[PEAK_CHAINS];
+  PEAK_UNROLL
+  for (int j = 0; j < PEAK_CHAINS; j++) {
+    acc[j] = svdup_f32(a[j]);
+  }
+  for (size_t i = 0; i < size; i++) {
+    PEAK_UNROLL
+    for (int j = 0; j < PEAK_CHAINS; j++) {
+      acc[j] = svmla_f32_x(all, y, acc[j], x);
+    }
+  }
+  PEAK_UNROLL
+  for (int j = 1; j < PEAK_CHAINS; j++) {
+    acc[0] = svadd_f32_x(all, acc[0], acc[j]);
+  }
+  return svaddv_f32(all, acc[0]);
+}
+#endif // __ARM_FEATURE_SVE
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+static float peak_neon(float *a, float *b, size_t size) {
+  float32x4_t x = vdupq_n_f32(a[0]), y = vdupq_n_f32(a[1]);
+  float32x4_t acc[PEAK_CHAINS];
+  PEAK_UNROLL
+  for (int j = 0; j < PEAK_CHAINS; j++) {
+    acc[j] = vdupq_n_f32(a[j]);
+  }
+  for (size_t i = 0; i < size; i++) {
+    PEAK_UNROLL
+    for (int j = 0; j < PEAK_CHAINS; j++) {
+      acc[j] = vfmaq_f32(y, acc[j], x);
+    }
+  }
+  PEAK_UNROLL
+  for (int j = 1; j < PEAK_CHAINS; j++) {
+    acc[0] = vaddq_f32(acc[0], acc[j]);
+  }
+  return vaddvq_f32(acc[0]);
+}
+
+static float read_neon(float *a, float *b, size_t size) {
+  float32x4_t s0 = vdupq_n_f32(0), s1 = vdupq_n_f32(0);
+  float32x4_t s2 = vdupq_n_f32(0), s3 = vdupq_n_f32(0);
+  size_t q = size / 16 * 4;
+  for (size_t i = 0; i < q; i += 4) {
+    s0 = vaddq_f32(s0, vld1q_f32(a + i));
+    s1 = vaddq_f32(s1, vld1q_f32(a + q + i));
+    s2 = vaddq_f32(s2, vld1q_f32(a + 2 * q + i));
+    s3 = vaddq_f32(s3, vld1q_f32(a + 3 * q + i));
+  }
+  float sum = vaddvq_f32(vaddq_f32(vaddq_f32(s0, s1), vaddq_f32(s2, s3)));
+  // left over
+  return sum + read_serial(a + 4 * q, b, size - 4 * q);
+}
+#endif // __ARM_NEON && __aarch64__
+
+// Peak throughput of one instruction set
+typedef struct peak_t {
+  // the kernel isa it bounds, with "_i8" for the int8 kernels
+  const char *isa;
+  vkernel_f32_fn fn;
+  // operations per multiply-add instruction: 2 per lane
+  double ops;
+  double gflops;
+} peak_t;
+
+// Every peak this CPU can measure; returns how many
+static size_t peak_list(peak_t *out) {
+  simdinfo_t info = simdinfo();
+  size_t n = 0;
+  (void)info;
+  out[n++] = (peak_t){"serial", peak_serial, 2, 0};
+
+// x86
+#if defined(__AVX__)
+  if (SIMDINFO_SUPPORTS(info, __AVX__)) {
+    out[n++] = (peak_t){"avx", peak_avx, 2 * 8, 0};
+  }
+#endif // __AVX__
+#if defined(__AVX2__) && defined(__FMA__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__) && SIMDINFO_SUPPORTS(info, __FMA__)) {
+    out[n++] = (peak_t){"avx2", peak_avx2, 2 * 8, 0};
+  }
+#endif // __AVX2__ && __FMA__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    out[n++] = (peak_t){"avx2_i8", peak_avx2_i8, 2 * 32, 0};
+  }
+#endif // __AVX2__
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    out[n++] = (peak_t){"avx512f", peak_avx512f, 2 * 16, 0};
+  }
+#endif // __AVX512F__
+#if defined(__AVX512BW__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512BW__)) {
+    out[n++] = (peak_t){"avx512bw_i8", peak_avx512bw_i8, 2 * 64, 0};
+  }
+#endif // __AVX512BW__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    out[n++] = (peak_t){"sve", peak_sve, 2.0 * svcntw(), 0};
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    out[n++] = (peak_t){"neon", peak_neon, 2 * 4, 0};
+  }
+#endif // __ARM_NEON && __aarch64__
+  return n;
+}
+
+// The widest read loop this CPU runs, to measure bandwidth with
+static vkernel_f32_fn read_fn(void) {
+  simdinfo_t info = simdinfo();
+  (void)info;
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    return read_avx512f;
+  }
+#endif // __AVX512F__
+#if defined(__AVX__)
+  if (SIMDINFO_SUPPORTS(info, __AVX__)) {
+    return read_avx;
+  }
+#endif // __AVX__
+// ARM
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return read_neon;
+  }
+#endif // __ARM_NEON && __aarch64__
+  // Default
+  return read_serial;
+}
+
+// Read bandwidth of one level of the memory hierarchy
+typedef struct level_t {
+  const char *name;
+  // working set: half the cache, or for DRAM several times the last level
+  size_t bytes;
+  double gbs;
+} level_t;
+
+static size_t level_list(level_t *out) {
+  long sizes[] = {sysconf(_SC_LEVEL1_DCACHE_SIZE), sysconf(_SC_LEVEL2_CACHE_SIZE),
+                  sysconf(_SC_LEVEL3_CACHE_SIZE)};
+  const char *names[] = {"L1", "L2", "L3"};
+  size_t n = 0, last = 32 * 1024;
+  for (int i = 0; i < 3; i++) {
+    if (sizes[i] > 0) {
+      out[n++] = (level_t){names[i], (size_t)sizes[i] / 2, 0};
+      last = (size_t)sizes[i];
+    }
+  }
+  size_t dram = 4 * last < ROOF_MAX_BYTES ? 4 * last : ROOF_MAX_BYTES;
+  out[n++] = (level_t){"DRAM", dram > 2 * last ? dram : 2 * last, 0};
+  return n;
+}
+
+static level_t *level_find(level_t *levels, size_t n, const char *name) {
+  for (size_t i = 0; i < n; i++) {
+    if (strcmp(levels[i].name, name) == 0) {
+      return &levels[i];
+    }
+  }
+  return NULL;
+}
+
+static peak_t *peak_find(peak_t *peaks, size_t n, vkernel_t *k) {
+  char isa[32];
+  snprintf(isa, sizeof(isa), "%s%s", k->isa, k->type == VKERNEL_I8 ? "_i8" : "");
+  for (size_t i = 0; i < n; i++) {
+    if (strcmp(peaks[i].isa, isa) == 0) {
+      return &peaks[i];
+    }
+  }
+  return NULL;
+}
+
+// Each kernel at a working set in each memory level, against the roof
+// min(peak of its instruction set, intensity * bandwidth of the level)
+static int roofline(int argc, char *argv[]) {
+  int format = argc > 2 ? parse_format(argv[2]) : FORMAT_CHART;
+  const char *filter = argc > 3 ? argv[3] : "";
+  if (format < 0) {
+    printf("Invalid format\n");
+    return 1;
+  }
+  vkernel_t kernels[VKERNEL_MAX];
+  size_t nk = select_kernels(kernels, filter);
+  peak_t peaks[16];
+  size_t np = peak_list(peaks);
+  level_t levels[4];
+  size_t nl = level_list(levels);
+  // elements for the largest f32 working set; kernels reading fewer bytes
+  // per element stop short of it, in a level they already have a row for
+  size_t max = levels[nl - 1].bytes / (2 * sizeof(float));
+  bench_data_t d;
+  if (bench_data_init(&d, max) != 0) {
+    fprintf(stderr, "Memory allocation failed\n");
+    return 1;
+  }
+  char cpu[128];
+  cpu_model(cpu, sizeof(cpu));
+  double samples[DEFAULT_REPS];
+
+  for (size_t i = 0; i < np; i++) {
+    vkernel_t k = {peaks[i].isa, peaks[i].isa, VKERNEL_F32, VKERNEL_FAST, 1,
+                   {.f32 = peaks[i].fn}};
+    measure(&k, &d, PEAK_ITERS, DEFAULT_REPS, samples);
+    peaks[i].gflops =
+        PEAK_ITERS * PEAK_CHAINS * peaks[i].ops / minimum(samples, DEFAULT_REPS);
+  }
+  vkernel_t reader = {"read", "read", VKERNEL_F32, VKERNEL_FAST, 1,
+                      {.f32 = read_fn()}};
+  for (size_t i = 0; i < nl; i++) {
+    measure(&reader, &d, levels[i].bytes / sizeof(float), DEFAULT_REPS,
+            samples);
+    levels[i].gbs = levels[i].bytes / minimum(samples, DEFAULT_REPS);
+  }
+
+  report_t r;
+  memset(&r, 0, sizeof(r));
+  if (format == FORMAT_JSON) {
+    report_open(&r, format, cpu);
+    printf(",\n  \"peaks\": [");
+    for (size_t i = 0; i < np; i++) {
+      printf("%s\n    {\"isa\": \"%s\", \"gflops\": %.3f}", i ? "," : "",
+             peaks[i].isa, peaks[i].gflops);
+    }
+    printf("\n  ],\n  \"bandwidth\": [");
+    for (size_t i = 0; i < nl; i++) {
+      printf("%s\n    {\"level\": \"%s\", \"bytes\": %zu, \"gbs\": %.3f}",
+             i ? "," : "", levels[i].name, levels[i].bytes, levels[i].gbs);
+    }
+    printf("\n  ]");
+    report_results(&r);
+  } else if (format == FORMAT_CSV) {
+    report_begin(&r, format, cpu);
+  } else {
+    printf("%s\n\npeak GFLOP/s:", cpu);
+    for (size_t i = 0; i < np; i++) {
+      printf("  %s %.1f", peaks[i].isa, peaks[i].gflops);
+    }
+    printf("\nread GB/s:   ");
+    for (size_t i = 0; i < nl; i++) {
+      printf("  %s (%zu KiB) %.1f", levels[i].name, levels[i].bytes / 1024,
+             levels[i].gbs);
+    }
+    printf("\n\n%-20s %-5s %9s %6s %8s %8s %-7s %6s\n", "kernel", "level",
+           "size", "AI", "GFLOP/s", "roof", "bound", "% roof");
+  }
+
+  for (size_t i = 0; i < nk; i++) {
+    vkernel_t *k = &kernels[i];
+    peak_t *peak = peak_find(peaks, np, k);
+    double flops, bytes, elem_bytes;
+    kernel_cost(k, 1, &flops, &elem_bytes);
+    level_t *prev = NULL;
+    for (size_t l = 0; l < nl; l++) {
+      size_t n = (size_t)(levels[l].bytes / elem_bytes);
+      n = n < max ? n : max;
+      kernel_cost(k, n, &flops, &bytes);
+      // the level the working set actually lands in
+      level_t *level = level_find(levels, nl, cache_level(bytes));
+      if (l > 0 && level == prev) {
+        continue;
+      }
+      prev = level;
+      measure(k, &d, n, DEFAULT_REPS, samples);
+      double gflops = flops / median(samples, DEFAULT_REPS);
+      double ai = flops / bytes;
+      double memory_roof = ai * (level ? level->gbs : levels[nl - 1].gbs);
+      // without a measured peak, only the memory roof applies
+      double roof = peak && peak->gflops < memory_roof ? peak->gflops
+                                                       : memory_roof;
+      const char *bound = roof == memory_roof ? "memory" : "compute";
+      double fraction = gflops / roof;
+      const char *level_name = level ? level->name : "DRAM";
+      if (format == FORMAT_CHART) {
+        char bar[41];
+        int width = (int)(40 * (fraction < 1 ? fraction : 1) + 0.5);
+        memset(bar, '#', (size_t)width);
+        memset(bar + width, '.', (size_t)(40 - width));
+        bar[40] = 0;
+        printf("%-20s %-5s %9zu %6.3f %8.2f %8.2f %-7s %5.0f%% |%s|\n",
+               k->name, level_name, n, ai, gflops, roof, bound, 100 * fraction,
+               bar);
+        continue;
+      }
+      report_field(&r, "cpu", 0, "%s", cpu);
+      report_field(&r, "kernel", 0, "%s", k->name);
+      report_field(&r, "isa", 0, "%s", k->isa);
+      report_field(&r, "size", 1, "%zu", n);
+      report_field(&r, "bytes", 1, "%.0f", bytes);
+      report_field(&r, "level", 0, "%s", level_name);
+      report_field(&r, "ai", 1, "%.4f", ai);
+      report_field(&r, "gflops", 1, "%.3f", gflops);
+      report_number(&r, "peak_gflops", "%.3f", peak ? peak->gflops : NAN);
+      report_field(&r, "memory_roof_gflops", 1, "%.3f", memory_roof);
+      report_field(&r, "roof_gflops", 1, "%.3f", roof);
+      report_field(&r, "bound", 0, "%s", bound);
+      report_field(&r, "roof_fraction", 1, "%.4f", fraction);
+      report_row(&r);
+    }
+  }
+  if (format != FORMAT_CHART) {
+    report_end(&r);
+  }
+  bench_data_free(&d);
+  return 0;
+}
+
+/* Dispatch overhead */
+
+// vdot_f32 against the kernel it dispatches to, at every size up to this
+#define DISPATCH_MAX_SIZE 256
+// Fresh threads timed for the first-call rows
+#define DISPATCH_THREADS 101
+// Size of the first vdot_f32 call on a fresh thread
+#define DISPATCH_FIRST_SIZE 16
+
+// Like the roofline "kernels", these have the f32 kernel signature so
+// measure() can time one call of each through the same function pointer.
+
+static float call_empty(float *a, float *b, size_t size) { return a[0]; }
+
+static float call_simdinfo(float *a, float *b, size_t size) {
+  simdinfo_t info = simdinfo();
+  return a[0] + (float)info._supports__AVX__;
+}
+
+static float call_detect(float *a, float *b, size_t size) {
+  simdinfo_t info = simdinfo_internal();
+  return a[0] + (float)info._supports__AVX__;
+}
+
+#if defined(__x86_64__) || defined(__i386)
+static unsigned cpuid_ecx(unsigned leaf, unsigned subleaf) {
+  unsigned eax, ebx, ecx, edx;
+  __asm__ __volatile__("cpuid"
+                       : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+                       : "a"(leaf), "c"(subleaf));
+  return ecx;
+}
+
+static float call_cpuid1(float *a, float *b, size_t size) {
+  return a[0] + (float)(cpuid_ecx(1, 0) & 1);
+}
+
+static float call_cpuid7(float *a, float *b, size_t size) {
+  return a[0] + (float)(cpuid_ecx(7, 0) & 1);
+}
+
+static float call_xgetbv(float *a, float *b, size_t size) {
+  unsigned lo, hi;
+  __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return a[0] + (float)(lo & 1);
+}
+#endif // __x86_64__ || __i386
+
+#if defined(__aarch64__) && defined(__linux__)
+static float call_getauxval(float *a, float *b, size_t size) {
+  return a[0] + (float)(getauxval(AT_HWCAP) & 1);
+}
+#endif // __aarch64__ && __linux__
+
+// The kernel vdot_f32 picks on this CPU, following its ladder
+static vkernel_f32_fn dispatch_target(void) {
+  simdinfo_t info = simdinfo();
+  (void)info;
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    return vdot_avx512f;
+  }
+#endif // __AVX512F__
+#if defined(__AVX__) || defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX__) || SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    return _vdot_f32_avx;
+  }
+#endif // __AVX__ || __AVX2__
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    return vdot_sve;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vdot_f32_neon;
+  }
+#endif // __ARM_NEON
+  // Default
+  return _vdot_f32_serial;
+}
+
+// First and second call on one fresh thread, timer overhead included
+typedef struct first_call_t {
+  bench_data_t *d;
+  double simdinfo[2];
+  double vdot[2];
+} first_call_t;
+
+static void *first_call(void *arg) {
+  first_call_t *c = (first_call_t *)arg;
+  double t0 = now_ns();
+  simdinfo_t info = simdinfo();
+  double t1 = now_ns();
+  info = simdinfo();
+  double t2 = now_ns();
+  c->simdinfo[0] = t1 - t0;
+  c->simdinfo[1] = t2 - t1;
+  sink += info._supports__AVX__;
+  return NULL;
+}
+
+static void *first_vdot(void *arg) {
+  first_call_t *c = (first_call_t *)arg;
+  double t0 = now_ns();
+  float x = vdot_f32(c->d->a, c->d->b, DISPATCH_FIRST_SIZE);
+  double t1 = now_ns();
+  x += vdot_f32(c->d->a, c->d->b, DISPATCH_FIRST_SIZE);
+  double t2 = now_ns();
+  c->vdot[0] = t1 - t0;
+  c->vdot[1] = t2 - t1;
+  sink += x;
+  return NULL;
+}
+
+// One row: a measurement against the baseline it is an overhead over
+static void dispatch_row(report_t *r, const char *cpu, const char *test,
+                         size_t size, double *x, double *base, size_t n,
+                         const char *baseline) {
+  double ns = median(x, n), base_ns = median(base, n);
+  report_field(r, "cpu", 0, "%s", cpu);
+  report_field(r, "test", 0, "%s", test);
+  report_field(r, "size", 1, "%zu", size);
+  report_field(r, "ns", 1, "%.2f", ns);
+  report_field(r, "min_ns", 1, "%.2f", minimum(x, n));
+  report_field(r, "baseline", 0, "%s", baseline);
+  report_field(r, "baseline_ns", 1, "%.2f", base_ns);
+  report_field(r, "overhead_ns", 1, "%.2f", ns - base_ns);
+  report_number(r, "overhead_percent", "%.1f",
+                base_ns > 0 ? 100 * (ns - base_ns) / base_ns : NAN);
+  report_row(r);
+}
+
+// Time one call of fn against one call of the empty function
+static void dispatch_call(report_t *r, const char *cpu, const char *test,
+                          vkernel_f32_fn fn, bench_data_t *d, size_t reps,
+                          double *empty) {
+  vkernel_t k = {test, test, VKERNEL_F32, VKERNEL_FAST, 1, {.f32 = fn}};
+  double *samples = (double *)malloc(reps * sizeof(double));
+  measure(&k, d, 1, reps, samples);
+  dispatch_row(r, cpu, test, 0, samples, empty, reps, "empty");
+  free(samples);
+}
+
+// What runtime dispatch costs: cpuid and the full detection, the first
+// simdinfo() and vdot_f32 calls on a fresh thread (which detect) against
+// the second, the cached simdinfo() against an empty call, and vdot_f32
+// against a direct call of the kernel it picks at sizes 1 to max_size
+static int dispatch(int argc, char *argv[]) {
+  int format = argc > 2 ? parse_format(argv[2]) : FORMAT_CSV;
+  size_t max = argc > 3 ? strtoul(argv[3], NULL, 10) : DISPATCH_MAX_SIZE;
+  size_t reps = argc > 4 ? strtoul(argv[4], NULL, 10) : DEFAULT_REPS;
+  if (format < 0 || format == FORMAT_CHART) {
+    printf("Invalid format\n");
+    return 1;
+  }
+  if (max < 1 || reps < 1 || reps > MAX_REPS) {
+    printf("Invalid arguments\n");
+    return 1;
+  }
+  bench_data_t d;
+  size_t size = max > DISPATCH_FIRST_SIZE ? max : DISPATCH_FIRST_SIZE;
+  if (bench_data_init(&d, size) != 0) {
+    fprintf(stderr, "Memory allocation failed\n");
+    return 1;
+  }
+  char cpu[128];
+  cpu_model(cpu, sizeof(cpu));
+  report_t r;
+  memset(&r, 0, sizeof(r));
+  report_begin(&r, format, cpu);
+
+  // Fresh threads, each timing its own first calls; the timer's own cost
+  // is in both calls and cancels in the overhead
+  first_call_t *calls =
+      (first_call_t *)calloc(DISPATCH_THREADS, sizeof(first_call_t));
+  double *first = (double *)malloc(DISPATCH_THREADS * sizeof(double));
+  double *second = (double *)malloc(DISPATCH_THREADS * sizeof(double));
+  int failed = calls == NULL || first == NULL || second == NULL;
+  if (failed) {
+    fprintf(stderr, "Memory allocation failed\n");
+  }
+  for (size_t i = 0; i < DISPATCH_THREADS && !failed; i++) {
+    pthread_t thread;
+    calls[i].d = &d;
+    if (pthread_create(&thread, NULL, first_call, &calls[i]) != 0 ||
+        pthread_join(thread, NULL) != 0 ||
+        pthread_create(&thread, NULL, first_vdot, &calls[i]) != 0 ||
+        pthread_join(thread, NULL) != 0) {
+      fprintf(stderr, "Thread creation failed\n");
+      failed = 1;
+    }
+  }
+  if (failed) {
+    free(calls);
+    free(first);
+    free(second);
+    bench_data_free(&d);
+    return 1;
+  }
+  for (size_t i = 0; i < DISPATCH_THREADS; i++) {
+    first[i] = calls[i].simdinfo[0];
+    second[i] = calls[i].simdinfo[1];
+  }
+  dispatch_row(&r, cpu, "simdinfo_first_call", 0, first, second,
+               DISPATCH_THREADS, "second_call");
+  for (size_t i = 0; i < DISPATCH_THREADS; i++) {
+    first[i] = calls[i].vdot[0];
+    second[i] = calls[i].vdot[1];
+  }
+  dispatch_row(&r, cpu, "vdot_f32_first_call", DISPATCH_FIRST_SIZE, first,
+               second, DISPATCH_THREADS, "second_call");
+  free(calls);
+  free(first);
+  free(second);
+
+  double *empty = (double *)malloc(reps * sizeof(double));
+  double *x = (double *)malloc(reps * sizeof(double));
+  double *direct = (double *)malloc(reps * sizeof(double));
+  if (empty == NULL || x == NULL || direct == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    free(empty);
+    free(x);
+    free(direct);
+    bench_data_free(&d);
+    return 1;
+  }
+  vkernel_t k = {"empty", "empty", VKERNEL_F32, VKERNEL_FAST, 1,
+                 {.f32 = call_empty}};
+  measure(&k, &d, 1, reps, empty);
+#if defined(__x86_64__) || defined(__i386)
+  dispatch_call(&r, cpu, "cpuid_leaf1", call_cpuid1, &d, reps, empty);
+  dispatch_call(&r, cpu, "cpuid_leaf7", call_cpuid7, &d, reps, empty);
+  if (cpuid_ecx(1, 0) & 0x08000000) { // OSXSAVE
+    dispatch_call(&r, cpu, "xgetbv", call_xgetbv, &d, reps, empty);
+  }
+#endif // __x86_64__ || __i386
+#if defined(__aarch64__) && defined(__linux__)
+  dispatch_call(&r, cpu, "getauxval", call_getauxval, &d, reps, empty);
+#endif // __aarch64__ && __linux__
+  dispatch_call(&r, cpu, "simdinfo_detect", call_detect, &d, reps, empty);
+  dispatch_call(&r, cpu, "simdinfo_cached", call_simdinfo, &d, reps, empty);
+
+  // Both through the same function pointer, so the difference is the
+  // simdinfo() lookup and the branch ladder
+  vkernel_t target = {"direct", "direct", VKERNEL_F32, VKERNEL_FAST, 1,
+                      {.f32 = dispatch_target()}};
+  vkernel_t kernels[VKERNEL_MAX];
+  size_t nk = vkernel_list(kernels);
+  for (size_t i = 0; i < nk; i++) {
+    if (kernels[i].type == VKERNEL_F32 && kernels[i].fn.f32 == target.fn.f32) {
+      target.name = kernels[i].name;
+    }
+  }
+  k = (vkernel_t){"vdot_f32", "dispatch", VKERNEL_F32, VKERNEL_FAST, 1,
+                  {.f32 = vdot_f32}};
+  for (size_t n = 1; n <= max; n++) {
+    measure(&k, &d, n, reps, x);
+    measure(&target, &d, n, reps, direct);
+    dispatch_row(&r, cpu, "vdot_f32", n, x, direct, reps, target.name);
+  }
+  report_end(&r);
+  free(empty);
+  free(x);
+  free(direct);
+  bench_data_free(&d);
+  return 0;
+}
+
+/* Regression comparison */
+
+// One kernel / size / CPU cell of a sweep, with the samples of every run
+// read for it, and each run's median
+typedef struct result_t {
+  char cpu[128];
+  char kernel[48];
+  long size;
+  double *samples;
+  size_t nsamples;
+  double *runs;
+  size_t nruns;
+} result_t;
+
+typedef struct results_t {
+  result_t *items;
+  size_t count;
+  size_t capacity;
+} results_t;
+
+// A cursor over a JSON document; just enough of JSON to read sweep output
+typedef struct parser_t {
+  const char *p;
+  int error;
+} parser_t;
+
+static void parse_space(parser_t *ps) {
+  while (*ps->p == ' ' || *ps->p == '\n' || *ps->p == '\r' || *ps->p == '\t') {
+    ps->p++;
+  }
+}
+
+static int parse_char(parser_t *ps, char c) {
+  parse_space(ps);
+  if (*ps->p != c) {
+    ps->error = 1;
+    return 0;
+  }
+  ps->p++;
+  return 1;
+}
+
+// A string into out (truncated to size), escapes reduced to the character
+static void parse_string(parser_t *ps, char *out, size_t size) {
+  size_t n = 0;
+  if (!parse_char(ps, '"')) {
+    return;
+  }
+  while (*ps->p && *ps->p != '"') {
+    if (*ps->p == '\\' && ps->p[1]) {
+      ps->p++;
+    }
+    if (n + 1 < size) {
+      out[n++] = *ps->p;
+    }
+    ps->p++;
+  }
+  out[n] = 0;
+  parse_char(ps, '"');
+}
+
+static double parse_number(parser_t *ps) {
+  parse_space(ps);
+  char *end;
+  double x = strtod(ps->p, &end);
+  if (end == ps->p) {
+    ps->error = 1;
+  }
+  ps->p = end;
+  return x;
+}
+
+static void parse_skip(parser_t *ps) {
+  parse_space(ps);
+  char c = *ps->p;
+  if (c == '"') {
+    char ignored[1];
+    parse_string(ps, ignored, sizeof(ignored));
+  } else if (c == '[' || c == '{') {
+    ps->p++;
+    parse_space(ps);
+    while (!ps->error && *ps->p != (c == '[' ? ']' : '}')) {
+      if (c == '{') {
+        parse_skip(ps);
+        parse_char(ps, ':');
+      }
+      parse_skip(ps);
+      parse_space(ps);
+      if (*ps->p == ',') {
+        ps->p++;
+      }
+      parse_space(ps);
+      ps->error |= *ps->p == 0;
+    }
+    ps->p++;
+  } else if (strncmp(ps->p, "null", 4) == 0 || strncmp(ps->p, "true", 4) == 0) {
+    ps->p += 4;
+  } else if (strncmp(ps->p, "false", 5) == 0) {
+    ps->p += 5;
+  } else {
+    parse_number(ps);
+  }
+}
+
+static result_t *results_find(results_t *rs, result_t *key) {
+  for (size_t i = 0; i < rs->count; i++) {
+    result_t *r = &rs->items[i];
+    if (r->size == key->size && strcmp(r->kernel, key->kernel) == 0 &&
+        strcmp(r->cpu, key->cpu) == 0) {
+      return r;
+    }
+  }
+  return NULL;
+}
+
+// Add the samples of key to its cell in rs, creating the cell if needed
+static int results_add(results_t *rs, result_t *key) {
+  result_t *r = results_find(rs, key);
+  if (r == NULL) {
+    if (rs->count == rs->capacity) {
+      size_t capacity = rs->capacity ? 2 * rs->capacity : 64;
+      result_t *items =
+          (result_t *)realloc(rs->items, capacity * sizeof(result_t));
+      if (items == NULL) {
+        return -1;
+      }
+      rs->items = items;
+      rs->capacity = capacity;
+    }
+    r = &rs->items[rs->count++];
+    *r = *key;
+    r->samples = NULL;
+    r->nsamples = 0;
+    r->runs = NULL;
+    r->nruns = 0;
+  }
+  double *runs = (double *)realloc(r->runs, (r->nruns + 1) * sizeof(double));
+  if (runs == NULL) {
+    return -1;
+  }
+  runs[r->nruns++] = median(key->samples, key->nsamples);
+  r->runs = runs;
+  double *samples = (double *)realloc(
+      r->samples, (r->nsamples + key->nsamples) * sizeof(double));
+  if (samples == NULL) {
+    return -1;
+  }
+  memcpy(samples + r->nsamples, key->samples, key->nsamples * sizeof(double));
+  r->samples = samples;
+  r->nsamples += key->nsamples;
+  return 0;
+}
+
+// Read the results of a sweep ... json file into rs
+static int results_read(results_t *rs, const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  size_t length = 0, capacity = 1 << 16;
+  char *text = (char *)malloc(capacity);
+  size_t got;
+  while (text != NULL && (got = fread(text + length, 1, capacity - length - 1,
+                                      f)) > 0) {
+    length += got;
+    if (length + 1 == capacity) {
+      capacity *= 2;
+      char *grown = (char *)realloc(text, capacity);
+      if (grown == NULL) {
+        free(text);
+      }
+      text = grown;
+    }
+  }
+  fclose(f);
+  if (text == NULL) {
+    return -1;
+  }
+  text[length] = 0;
+
+  parser_t ps = {text, 0};
+  double samples[MAX_REPS];
+  int found = 0;
+  parse_char(&ps, '{');
+  while (!ps.error && !found) {
+    char key[32];
+    parse_string(&ps, key, sizeof(key));
+    parse_char(&ps, ':');
+    if (strcmp(key, "results") != 0) {
+      parse_skip(&ps);
+      parse_char(&ps, ',');
+      continue;
+    }
+    found = 1;
+    parse_char(&ps, '[');
+    parse_space(&ps);
+    while (!ps.error && *ps.p == '{') {
+      result_t r;
+      memset(&r, 0, sizeof(r));
+      r.samples = samples;
+      ps.p++;
+      parse_space(&ps);
+      while (!ps.error && *ps.p != '}') {
+        parse_string(&ps, key, sizeof(key));
+        parse_char(&ps, ':');
+        if (strcmp(key, "cpu") == 0) {
+          parse_string(&ps, r.cpu, sizeof(r.cpu));
+        } else if (strcmp(key, "kernel") == 0) {
+          parse_string(&ps, r.kernel, sizeof(r.kernel));
+        } else if (strcmp(key, "size") == 0) {
+          r.size = (long)parse_number(&ps);
+        } else if (strcmp(key, "samples_ns") == 0) {
+          parse_char(&ps, '[');
+          parse_space(&ps);
+          while (!ps.error && *ps.p != ']') {
+            double x = parse_number(&ps);
+            if (r.nsamples < MAX_REPS) {
+              samples[r.nsamples++] = x;
+            }
+            parse_space(&ps);
+            if (*ps.p == ',') {
+              ps.p++;
+            }
+            parse_space(&ps);
+          }
+          parse_char(&ps, ']');
+        } else {
+          parse_skip(&ps);
+        }
+        parse_space(&ps);
+        if (*ps.p == ',') {
+          ps.p++;
+          parse_space(&ps);
+        }
+      }
+      parse_char(&ps, '}');
+      if (!ps.error && r.nsamples > 0 && results_add(rs, &r) != 0) {
+        ps.error = 1;
+      }
+      parse_space(&ps);
+      if (*ps.p == ',') {
+        ps.p++;
+        parse_space(&ps);
+      }
+    }
+  }
+  free(text);
+  if (ps.error || !found) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+static void results_free(results_t *rs) {
+  for (size_t i = 0; i < rs->count; i++) {
+    free(rs->items[i].samples);
+    free(rs->items[i].runs);
+  }
+  free(rs->items);
+}
+
+// Read a comma-separated list of sweep json files (repeated runs of the
+// same sweep) into one set of results
+static int results_read_all(results_t *rs, char *paths) {
+  for (char *path = strtok(paths, ","); path != NULL;
+       path = strtok(NULL, ",")) {
+    if (results_read(rs, path) != 0) {
+      fprintf(stderr, "Could not read %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// One-sided Mann-Whitney U test: the probability of samples y ranking this
+// far above samples x if both came from the same distribution. Exact up to
+// EXACT_MAX samples a side, counting every way to deal the pooled ranks (ties
+// included) to y; beyond that the normal approximation with tie correction,
+// which is fine from about 8 samples a side.
+static double mann_whitney(double *x, size_t nx, double *y, size_t ny) {
+  size_t n = nx + ny;
+  // pooled values, each tagged with its side, and their ranks
+  double *v = (double *)malloc(n * sizeof(double));
+  int *from_y = (int *)malloc(n * sizeof(int));
+  size_t *order = (size_t *)malloc(n * sizeof(size_t));
+  double *ranks = (double *)malloc(n * sizeof(double));
+  if (v == NULL || from_y == NULL || order == NULL || ranks == NULL) {
+    free(v);
+    free(from_y);
+    free(order);
+    free(ranks);
+    return 1.0;
+  }
+  for (size_t i = 0; i < n; i++) {
+    v[i] = i < nx ? x[i] : y[i - nx];
+    from_y[i] = i >= nx;
+    order[i] = i;
+  }
+  // insertion sort by value: a few dozen samples
+  for (size_t i = 1; i < n; i++) {
+    for (size_t j = i; j > 0 && v[order[j]] < v[order[j - 1]]; j--) {
+      size_t t = order[j];
+      order[j] = order[j - 1];
+      order[j - 1] = t;
+    }
+  }
+  double rank_sum_y = 0.0, ties = 0.0;
+  for (size_t i = 0; i < n;) {
+    size_t j = i;
+    while (j + 1 < n && v[order[j + 1]] == v[order[i]]) {
+      j++;
+    }
+    // tied values share the mean of their ranks (1-based)
+    double rank = 0.5 * (double)(i + j) + 1.0;
+    for (size_t t = i; t <= j; t++) {
+      rank_sum_y += from_y[order[t]] ? rank : 0.0;
+      ranks[t] = rank;
+    }
+    double count = (double)(j - i + 1);
+    ties += count * count * count - count;
+    i = j + 1;
+  }
+  free(v);
+  free(from_y);
+  free(order);
+  if (nx <= EXACT_MAX && ny <= EXACT_MAX) {
+    // at most 2^16 subsets; rank sums are exact in double
+    size_t hits = 0, total = 0;
+    for (unsigned long mask = 0; mask < 1ul << n; mask++) {
+      if ((size_t)__builtin_popcountl(mask) != ny) {
+        continue;
+      }
+      double sum = 0.0;
+      for (size_t i = 0; i < n; i++) {
+        sum += mask >> i & 1 ? ranks[i] : 0.0;
+      }
+      hits += sum >= rank_sum_y;
+      total++;
+    }
+    free(ranks);
+    return (double)hits / (double)total;
+  }
+  free(ranks);
+  double dnx = (double)nx, dny = (double)ny, dn = (double)n;
+  double u = rank_sum_y - dny * (dny + 1) / 2;
+  double mean = dnx * dny / 2;
+  double var = dnx * dny / 12 * ((dn + 1) - ties / (dn * (dn - 1)));
+  if (var <= 0) {
+    return 1.0;
+  }
+  // continuity correction
+  double z = (u - mean - 0.5) / sqrt(var);
+  return 0.5 * erfc(z / sqrt(2.0));
+}
+
+// Compare a candidate sweep against a baseline, cell by cell. A cell
+// regresses when the candidate's median is more than threshold percent
+// slower and Mann-Whitney says the slowdown is significant at alpha. Exits
+// 1 if any cell regressed, else 2 if the sweeps cannot be gated: no cell
+// matched, a baseline cell is missing from the candidate, or a cell is
+// inconclusive.
+//
+// Samples from one run share its frequency, placement and neighbours, so
+// they spread less than runs do and overstate significance. The test
+// compares run medians, and a cell with fewer than MIN_RUNS runs on either
+// side is inconclusive; its within-run p is printed for reference only.
+static int compare(int argc, char *argv[]) {
+  if (argc < 4) {
+    printf("Usage: %s compare <baseline.json[,...]> <candidate.json[,...]> "
+           "[threshold_percent] [alpha]\n",
+           argv[0]);
+    return 2;
+  }
+  double threshold = (argc > 4 ? atof(argv[4]) : DEFAULT_THRESHOLD) / 100.0;
+  double alpha = argc > 5 ? atof(argv[5]) : DEFAULT_ALPHA;
+  if (threshold < 0 || alpha <= 0 || alpha >= 1) {
+    printf("Invalid threshold or alpha\n");
+    return 2;
+  }
+  results_t base = {NULL, 0, 0}, cand = {NULL, 0, 0};
+  if (results_read_all(&base, argv[2]) != 0 ||
+      results_read_all(&cand, argv[3]) != 0) {
+    results_free(&base);
+    results_free(&cand);
+    return 2;
+  }
+  size_t regressions = 0, improvements = 0, missing = 0, inconclusive = 0;
+  printf("%-20s %9s %12s %12s %8s %9s  %s\n", "kernel", "size", "base_ns",
+         "new_ns", "change", "p", "verdict");
+  for (size_t i = 0; i < base.count; i++) {
+    result_t *b = &base.items[i];
+    result_t *c = results_find(&cand, b);
+    if (c == NULL) {
+      printf("%-20s %9ld %12.1f %12s %8s %9s  missing\n", b->kernel, b->size,
+             median(b->samples, b->nsamples), "-", "-", "-");
+      missing++;
+      continue;
+    }
+    double mb = median(b->samples, b->nsamples);
+    double mc = median(c->samples, c->nsamples);
+    double change = mc / mb - 1.0;
+    int by_run = b->nruns >= MIN_RUNS && c->nruns >= MIN_RUNS;
+    double *xb = by_run ? b->runs : b->samples;
+    double *xc = by_run ? c->runs : c->samples;
+    size_t nb = by_run ? b->nruns : b->nsamples;
+    size_t nc = by_run ? c->nruns : c->nsamples;
+    double p_slower = mann_whitney(xb, nb, xc, nc);
+    double p_faster = mann_whitney(xc, nc, xb, nb);
+    const char *verdict = "ok";
+    double p = p_slower < p_faster ? p_slower : p_faster;
+    if (!by_run) {
+      verdict = "inconclusive";
+      inconclusive++;
+    } else if (change > threshold && p_slower < alpha) {
+      verdict = "REGRESSION";
+      regressions++;
+    } else if (change < -threshold && p_faster < alpha) {
+      verdict = "faster";
+      improvements++;
+    } else if (fabs(change) > threshold) {
+      // a large change the samples cannot tell from noise
+      verdict = "noisy";
+    }
+    printf("%-20s %9ld %12.1f %12.1f %+7.1f%% %9.2g  %s\n", b->kernel, b->size,
+           mb, mc, 100 * change, p, verdict);
+  }
+  printf("\n%zu cells: %zu regressed, %zu faster, %zu inconclusive, %zu "
+         "missing from the candidate (threshold %.1f%%, alpha %g)\n",
+         base.count, regressions, improvements, inconclusive, missing,
+         100 * threshold, alpha);
+  if (inconclusive > 0) {
+    printf("%zu cells had fewer than %d runs a side; samples within a run "
+           "understate run-to-run noise, so they were not gated\n",
+           inconclusive, MIN_RUNS);
+  }
+  int status = 0;
+  if (regressions > 0) {
+    status = 1;
+  } else if (missing > 0 || inconclusive > 0 || base.count == 0) {
+    printf("Cannot gate: %s\n",
+           base.count == missing ? "no cell matched"
+           : missing > 0         ? "cells are missing from the candidate"
+                                 : "cells are inconclusive");
+    status = 2;
+  }
+  results_free(&base);
+  results_free(&cand);
+  return status;
+}
+
+static int list(void) {
+  vkernel_t kernels[VKERNEL_MAX];
+  size_t n = vkernel_list(kernels);
+  for (size_t i = 0; i < n; i++) {
+    printf("%-20s %-9s %-12s %s\n", kernels[i].name, kernels[i].isa,
+           vkernel_mode_name(kernels[i].mode),
+           kernels[i].supported ? "supported" : "not supported");
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc >= 2 && strcmp(argv[1], "list") == 0) {
+    return list();
+  }
+  if (argc >= 2 && strcmp(argv[1], "sweep") == 0) {
+    return sweep(argc, argv, 0);
+  }
+  if (argc >= 2 && strcmp(argv[1], "perf") == 0) {
+    return sweep(argc, argv, 1);
+  }
+  if (argc >= 2 && strcmp(argv[1], "accuracy") == 0) {
+    return accuracy(argc, argv);
+  }
+  if (argc >= 2 && strcmp(argv[1], "compare") == 0) {
+    return compare(argc, argv);
+  }
+  if (argc >= 2 && strcmp(argv[1], "roofline") == 0) {
+    return roofline(argc, argv);
+  }
+  if (argc >= 2 && strcmp(argv[1], "dispatch") == 0) {
+    return dispatch(argc, argv);
+  }
+  printf("Usage: %s list\n", argv[0]);
+  printf("       %s sweep [csv|json] [min_size] [max_size] [reps] "
+         "[kernel-filter]\n",
+         argv[0]);
+  printf("       %s perf [csv|json] [min_size] [max_size] [reps] "
+         "[kernel-filter]\n",
+         argv[0]);
+  printf("       %s accuracy [csv|json|chart] [size] [trials] "
+         "[kernel-filter]\n",
+         argv[0]);
+  printf("       %s compare <baseline.json[,...]> <candidate.json[,...]> "
+         "[threshold_percent] [alpha]\n",
+         argv[0]);
+  printf("       %s roofline [chart|csv|json] [kernel-filter]\n", argv[0]);
+  printf("       %s dispatch [csv|json] [max_size] [reps]\n", argv[0]);
+  return 1;
+}
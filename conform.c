@@ -0,0 +1,754 @@
+#define _GNU_SOURCE
+#include <float.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "vattention.h"
+#include "vkernels.h"
+#include "vref.h"
+#include "vscan.h"
+
+// Every kernel, and the dispatched entry point for each type, is compared
+// against vref.h on:
+//
+//   - every size from 0 to SMALL_SIZES, then RANDOM_SIZES random sizes up to
+//     max_size (10000 by default)
+//   - every start misalignment within a cache line, for both operands
+//   - inputs ending right at an unmapped page, so a read past the end faults
+//   - inputs surrounded by poison (NaN, or 127 for int8), so a read past
+//     either end that reaches the result shows up in it
+//   - subnormal, infinite and NaN inputs
+//
+// vattention, serial and dispatched, is compared against a double reference
+// over strided f16 / bf16 caches, whole and as two merged halves.
+//
+// Float results must be within the worst-case rounding error of any
+// summation order, gamma(n) * sum |a_i * b_i|; int8 results must be exact.
+// Non-finite results must match the reference: NaN for NaN, the same
+// infinity for infinity.
+
+#define SMALL_SIZES 64
+#define RANDOM_SIZES 150
+#define DEFAULT_MAX_SIZE 10000
+// Largest alignment any kernel cares about: one AVX-512 register
+#define LINE 64
+// Poison on either side of an operand
+#define MARGIN 256
+// Failures printed per kernel; the rest are only counted
+#define MAX_PRINTED 10
+
+// An operand buffer whose mapping ends in a PROT_NONE page
+typedef struct region_t {
+  char *base;
+  // first byte of the guard page
+  char *guard;
+  size_t mapped;
+} region_t;
+
+// A kernel under test: the listed ones plus the dispatched entry points
+typedef struct target_t {
+  vkernel_t k;
+  size_t failures;
+  size_t checks;
+} target_t;
+
+typedef struct conform_t {
+  region_t a;
+  region_t b;
+  // the reference reads decoded copies of f16 / bf16 operands
+  float *decoded;
+  uint64_t rng;
+} conform_t;
+
+// The check running, for the fault handler: a read past the end of an
+// operand faults on the guard page instead of returning a result
+static struct {
+  const char *name;
+  size_t size;
+  long offset_a;
+  long offset_b;
+} running;
+
+static void on_fault(int sig) {
+  char line[256];
+  int len = snprintf(line, sizeof(line),
+                     "FAIL %-20s size=%zu offset_a=%ld offset_b=%ld: %s "
+                     "(read outside the operands)\n",
+                     running.name, running.size, running.offset_a,
+                     running.offset_b, sig == SIGSEGV ? "SIGSEGV" : "SIGBUS");
+  fflush(stdout);
+  if (len > 0) {
+    write(STDOUT_FILENO, line, (size_t)len);
+  }
+  _exit(1);
+}
+
+static int region_init(region_t *r, size_t bytes) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t usable = (bytes + 2 * MARGIN + LINE + page - 1) / page * page;
+  r->mapped = usable + page;
+  r->base = (char *)mmap(NULL, r->mapped, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->base == MAP_FAILED) {
+    return -1;
+  }
+  r->guard = r->base + usable;
+  return mprotect(r->guard, page, PROT_NONE);
+}
+
+static void region_free(region_t *r) {
+  munmap(r->base, r->mapped);
+}
+
+// Where an operand of bytes starts: offset bytes past a line boundary with
+// room for poison on both sides, or (offset < 0) ending at the guard page
+static char *region_place(region_t *r, size_t bytes, long offset) {
+  return offset < 0 ? r->guard - bytes : r->base + MARGIN + offset;
+}
+
+// Fill n elements of size elem at p, and the margins around them, with the
+// poison pattern
+static void poison(region_t *r, char *p, size_t n, size_t elem,
+                   const void *pattern) {
+  char *lo = p - MARGIN < r->base ? r->base : p - MARGIN;
+  char *hi = p + n * elem + MARGIN > r->guard ? r->guard : p + n * elem + MARGIN;
+  // step from p so the pattern stays aligned to the elements
+  for (char *q = p; q >= lo + elem; q -= elem) {
+    memcpy(q - elem, pattern, elem);
+  }
+  for (char *q = p + n * elem; q + elem <= hi; q += elem) {
+    memcpy(q, pattern, elem);
+  }
+}
+
+static size_t elem_size(int type) {
+  switch (type) {
+  case VKERNEL_I8:
+    return 1;
+  case VKERNEL_F16_F32:
+  case VKERNEL_BF16_F32:
+    return 2;
+  }
+  return 4;
+}
+
+static double uniform(conform_t *c) {
+  return 2 * vref_rand(&c->rng) - 1;
+}
+
+// Input classes
+enum input_t {
+  INPUT_RANDOM = 0,
+  // a mix of subnormal, tiny and normal values
+  INPUT_SUBNORMAL = 1,
+  // one +inf against a positive value: +inf
+  INPUT_INF = 2,
+  // +inf and -inf: NaN
+  INPUT_INF_MINUS_INF = 3,
+  // inf times 0: NaN
+  INPUT_INF_ZERO = 4,
+  INPUT_NAN = 5,
+  NINPUTS = 6,
+};
+
+static const char *input_name(int input) {
+  const char *names[] = {"random", "subnormal", "inf",
+                         "inf-inf", "inf*0", "nan"};
+  return names[input];
+}
+
+static float random_value(conform_t *c, int input) {
+  if (input != INPUT_SUBNORMAL) {
+    return (float)uniform(c);
+  }
+  double r = vref_rand(&c->rng);
+  if (r < 0.5) {
+    // subnormal: below 2^-126
+    return (float)ldexp(uniform(c), -127 - (int)(vref_rand(&c->rng) * 20));
+  }
+  if (r < 0.75) {
+    // normal, with subnormal products
+    return (float)ldexp(uniform(c), -70);
+  }
+  return (float)uniform(c);
+}
+
+// Set a[pos] (and, for inf-inf, a[pos2]) and the b values they meet
+static void special_values(int input, float *a, float *b, size_t pos,
+                           size_t pos2) {
+  switch (input) {
+  case INPUT_INF:
+    a[pos] = INFINITY;
+    b[pos] = 0.5f;
+    break;
+  case INPUT_INF_MINUS_INF:
+    a[pos] = INFINITY;
+    b[pos] = 0.5f;
+    a[pos2] = -INFINITY;
+    b[pos2] = 0.5f;
+    break;
+  case INPUT_INF_ZERO:
+    a[pos] = INFINITY;
+    b[pos] = 0.0f;
+    break;
+  case INPUT_NAN:
+    a[pos] = NAN;
+    break;
+  }
+}
+
+static int check_float(double got, double ref, double abs_sum, size_t n,
+                       double *tol) {
+  // worst case over every summation order, plus underflow in each product
+  double u = ldexp(1.0, -24);
+  double nu = (double)(n + 1) * u;
+  *tol = nu / (1 - nu) * abs_sum + (double)n * FLT_MIN * u;
+  if (isnan(ref)) {
+    return isnan(got);
+  }
+  if (isinf(ref)) {
+    return got == ref;
+  }
+  return isfinite(got) && fabs(got - ref) <= *tol;
+}
+
+static void report(target_t *t, size_t n, long oa, long ob, int input,
+                   int row, double got, double ref, double tol) {
+  t->failures++;
+  if (t->failures <= MAX_PRINTED) {
+    printf("FAIL %-20s size=%zu offset_a=%ld offset_b=%ld input=%s", t->k.name,
+           n, oa, ob, input_name(input));
+    if (t->k.type == VKERNEL_BATCH4_F32) {
+      printf(" row=%d", row);
+    }
+    printf(" got=%.9g expected=%.9g tolerance=%.3g\n", got, ref, tol);
+  }
+}
+
+// One check: size n, operands at offsets oa / ob (negative: at the guard
+// page), inputs of the given class
+static void check(conform_t *c, target_t *t, size_t n, long oa, long ob,
+                  int input) {
+  vkernel_t *k = &t->k;
+  size_t elem = elem_size(k->type);
+  size_t rows = k->type == VKERNEL_BATCH4_F32 ? 4 : 1;
+  size_t elem_a = k->type == VKERNEL_I8 ? 1 : 4;
+  char *pa = region_place(&c->a, n * elem_a, oa);
+  char *pb = region_place(&c->b, rows * n * elem, ob);
+  t->checks++;
+  running.name = k->name;
+  running.size = n;
+  running.offset_a = oa;
+  running.offset_b = ob;
+
+  if (k->type == VKERNEL_I8) {
+    const int8_t pattern = 127;
+    poison(&c->a, pa, n, 1, &pattern);
+    poison(&c->b, pb, n, 1, &pattern);
+    int8_t *a = (int8_t *)pa, *b = (int8_t *)pb;
+    int64_t ref = 0;
+    for (size_t i = 0; i < n; i++) {
+      // a takes the full range, -128 included; vdot_i8 rules -128 out of b
+      a[i] = (int8_t)((int)(vref_rand(&c->rng) * 256) - 128);
+      b[i] = (int8_t)((int)(vref_rand(&c->rng) * 255) - 127);
+      ref += (int64_t)a[i] * b[i];
+    }
+    int32_t got = k->fn.i8(a, b, n);
+    if (got != ref) {
+      report(t, n, oa, ob, input, 0, (double)got, (double)ref, 0.0);
+    }
+    return;
+  }
+
+  const float nan = NAN;
+  poison(&c->a, pa, n, 4, &nan);
+  float *a = (float *)pa;
+  float *b = c->decoded;
+  for (size_t i = 0; i < n; i++) {
+    a[i] = random_value(c, input);
+  }
+  for (size_t i = 0; i < rows * n; i++) {
+    b[i] = random_value(c, input);
+  }
+  if (n > 0 && input >= INPUT_INF) {
+    size_t pos = (size_t)(vref_rand(&c->rng) * n);
+    size_t pos2 = (size_t)(vref_rand(&c->rng) * n);
+    if (input == INPUT_INF_MINUS_INF && pos2 == pos) {
+      pos2 = (pos + 1) % n;
+    }
+    if (pos2 != pos || input != INPUT_INF_MINUS_INF) {
+      for (size_t r = 0; r < rows; r++) {
+        special_values(input, a, b + r * n, pos, pos2);
+      }
+    }
+  }
+
+  float out[4];
+  if (k->type == VKERNEL_F16_F32 || k->type == VKERNEL_BF16_F32) {
+    uint16_t pattern = k->type == VKERNEL_F16_F32 ? 0x7e00 : 0x7fc0;
+    poison(&c->b, pb, n, 2, &pattern);
+    uint16_t *h = (uint16_t *)pb;
+    // the reference sees exactly the values the kernel decodes
+    if (k->type == VKERNEL_F16_F32) {
+      vconvert_f32_to_f16(b, h, n);
+      vconvert_f16_to_f32(h, b, n);
+    } else {
+      vconvert_f32_to_bf16(b, h, n);
+      vconvert_bf16_to_f32(h, b, n);
+    }
+    out[0] = k->fn.half(a, h, n);
+  } else {
+    poison(&c->b, pb, rows * n, 4, &nan);
+    float *pbf = (float *)pb;
+    memcpy(pbf, b, rows * n * sizeof(float));
+    if (k->type == VKERNEL_BATCH4_F32) {
+      k->fn.batch4(a, pbf, pbf + n, pbf + 2 * n, pbf + 3 * n, n, out);
+    } else {
+      out[0] = k->fn.f32(a, pbf, n);
+    }
+  }
+
+  for (size_t r = 0; r < rows; r++) {
+    float *row = b + r * n;
+    double ref = vref_dot_f32(a, row, n);
+    double abs_sum = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      abs_sum += fabs((double)a[i] * (double)row[i]);
+    }
+    double tol;
+    if (!check_float(out[r], ref, abs_sum, n, &tol)) {
+      report(t, n, oa, ob, input, (int)r, out[r], ref, tol);
+    }
+  }
+}
+
+// Every misalignment of both operands at size n, and both ending at the
+// guard page
+static void check_size(conform_t *c, target_t *t, size_t n) {
+  long elem_a = t->k.type == VKERNEL_I8 ? 1 : 4;
+  long elem_b = (long)elem_size(t->k.type);
+  long lanes_a = LINE / elem_a, lanes_b = LINE / elem_b;
+  long count = lanes_a > lanes_b ? lanes_a : lanes_b;
+  for (long i = 0; i < count; i++) {
+    // a steps through its offsets in order, b through its own in a
+    // different order, so offsets are also paired differently
+    long oa = i % lanes_a * elem_a;
+    long ob = (i * 7 + 3) % lanes_b * elem_b;
+    check(c, t, n, oa, ob, INPUT_RANDOM);
+  }
+  check(c, t, n, -1, -1, INPUT_RANDOM);
+}
+
+/* Attention */
+
+// vattention over an f16 / bf16 cache, serial and dispatched, against
+// softmax(scale * q . K^T) V computed in double from the decoded cache
+
+// Largest cache and head size checked
+#define ATTENTION_MAX_KEYS 300
+#define ATTENTION_MAX_DIM 96
+
+typedef float (*attention_fn)(float *, uint16_t *, uint16_t *, size_t, size_t,
+                              size_t, size_t, float, float *);
+
+static float attention_f16_serial(float *q, uint16_t *k, uint16_t *v,
+                                  size_t n, size_t dim, size_t k_stride,
+                                  size_t v_stride, float scale, float *out) {
+  return _vattention(q, k, v, n, dim, k_stride, v_stride, scale, out,
+                     _vdot_f16_f32_serial, _vattention_axpy_f16_serial);
+}
+
+static float attention_bf16_serial(float *q, uint16_t *k, uint16_t *v,
+                                   size_t n, size_t dim, size_t k_stride,
+                                   size_t v_stride, float scale, float *out) {
+  return _vattention(q, k, v, n, dim, k_stride, v_stride, scale, out,
+                     _vdot_bf16_f32_serial, _vattention_axpy_bf16_serial);
+}
+
+// Reference output and log-sum-exp over keys [begin, end) of the decoded
+// cache (stride floats apart); returns the tolerance of a float result
+static double attention_ref(float *q, float *k, float *v, size_t begin,
+                            size_t end, size_t dim, size_t stride,
+                            float scale, double *out, double *lse) {
+  double u = ldexp(1.0, -24), gamma = (double)(dim + 1) * u;
+  double max = -INFINITY, err = 0.0, sum = 0.0, vmax = 0.0;
+  double *s = (double *)malloc((end - begin + 1) * sizeof(double));
+  for (size_t j = begin; j < end; j++) {
+    double dot = 0.0, abs_sum = 0.0;
+    for (size_t i = 0; i < dim; i++) {
+      double p = (double)q[i] * (double)k[j * stride + i];
+      dot += p;
+      abs_sum += fabs(p);
+      vmax = fabs(v[j * stride + i]) > vmax ? fabs(v[j * stride + i]) : vmax;
+    }
+    s[j - begin] = scale * dot;
+    max = s[j - begin] > max ? s[j - begin] : max;
+    // the float dot product and scaling, then exp(s - max)
+    double e = gamma * scale * abs_sum + 4 * u * (fabs(s[j - begin]) + 1);
+    err = e > err ? e : err;
+  }
+  memset(out, 0, dim * sizeof(double));
+  for (size_t j = begin; j < end; j++) {
+    double w = exp(s[j - begin] - max);
+    sum += w;
+    for (size_t i = 0; i < dim; i++) {
+      out[i] += w * (double)v[j * stride + i];
+    }
+  }
+  for (size_t i = 0; i < dim; i++) {
+    out[i] = sum > 0 ? out[i] / sum : 0.0;
+  }
+  *lse = sum > 0 ? max + log(sum) : -INFINITY;
+  free(s);
+  // every weight is off by at most a factor exp(2 err), plus rounding in
+  // the running sums, which are rescaled once per tile
+  double n = (double)(end - begin);
+  return vmax * (4 * err + 2 * (n + n / VATTENTION_TILE + 8) * u) +
+         2 * err + (n + 8) * u * (1 + fabs(*lse));
+}
+
+// Compare out / lse against the reference; returns 1 on a mismatch
+static int attention_compare(const char *name, const char *what, size_t n,
+                             size_t dim, float *out, float lse, double *ref,
+                             double ref_lse, double tol, size_t *failures) {
+  int bad = isinf(ref_lse) ? lse != ref_lse : !(fabs(lse - ref_lse) <= tol);
+  for (size_t i = 0; i < dim && !bad; i++) {
+    bad = !(fabs(out[i] - ref[i]) <= tol);
+  }
+  if (bad && ++*failures <= MAX_PRINTED) {
+    size_t i = 0;
+    while (i + 1 < dim && fabs(out[i] - ref[i]) <= tol) {
+      i++;
+    }
+    printf("FAIL %-20s %s keys=%zu dim=%zu lse=%.9g expected=%.9g "
+           "out[%zu]=%.9g expected=%.9g tolerance=%.3g\n",
+           name, what, n, dim, lse, ref_lse, i, out[i], ref[i], tol);
+  }
+  return bad;
+}
+
+static int attention_check(conform_t *c) {
+  struct {
+    const char *name;
+    const char *isa;
+    int bf16;
+    attention_fn fn;
+  } targets[] = {
+      {"attention_f16", "serial", 0, attention_f16_serial},
+      {"attention_bf16", "serial", 1, attention_bf16_serial},
+      {"attention_f16", "dispatch", 0, vattention_f16},
+      {"attention_bf16", "dispatch", 1, vattention_bf16},
+  };
+  size_t keys[] = {0, 1, 3, 63, 64, 65, 129, ATTENTION_MAX_KEYS};
+  size_t dims[] = {1, 8, 17, 64, ATTENTION_MAX_DIM};
+  size_t cap = ATTENTION_MAX_KEYS * (ATTENTION_MAX_DIM + 5);
+  float *q = (float *)malloc(ATTENTION_MAX_DIM * sizeof(float));
+  float *kf = (float *)malloc(cap * sizeof(float));
+  float *vf = (float *)malloc(cap * sizeof(float));
+  uint16_t *k = (uint16_t *)malloc(cap * sizeof(uint16_t));
+  uint16_t *v = (uint16_t *)malloc(cap * sizeof(uint16_t));
+  float *out = (float *)malloc(2 * ATTENTION_MAX_DIM * sizeof(float));
+  double *ref = (double *)malloc(ATTENTION_MAX_DIM * sizeof(double));
+  if (q == NULL || kf == NULL || vf == NULL || k == NULL || v == NULL ||
+      out == NULL || ref == NULL) {
+    fprintf(stderr, "Memory allocation failed\n");
+    exit(1);
+  }
+  int failed = 0;
+  for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); t++) {
+    size_t failures = 0, checks = 0;
+    running.name = targets[t].name;
+    running.offset_a = running.offset_b = 0;
+    for (size_t ki = 0; ki < sizeof(keys) / sizeof(size_t); ki++) {
+      for (size_t di = 0; di < sizeof(dims) / sizeof(size_t); di++) {
+        // rising: every key scores higher than the last, so the running
+        // max grows in every tile and the output is rescaled each time
+        for (int rising = 0; rising < 2; rising++) {
+          size_t n = keys[ki], dim = dims[di];
+          // an odd stride misaligns every other row
+          size_t stride = dim + (size_t)(di % 2) * 5;
+          float scale = 1.0f / sqrtf((float)dim);
+          running.size = n;
+          for (size_t i = 0; i < dim; i++) {
+            q[i] = (float)uniform(c);
+          }
+          for (size_t j = 0; j < n; j++) {
+            for (size_t i = 0; i < stride; i++) {
+              float w = rising ? 4.0f * (float)j / (float)n : 0.0f;
+              kf[j * stride + i] =
+                  i < dim ? (rising ? w * q[i] : (float)uniform(c)) : NAN;
+              vf[j * stride + i] = i < dim ? (float)uniform(c) : NAN;
+            }
+          }
+          // the reference sees exactly the values the kernels decode
+          if (targets[t].bf16) {
+            vconvert_f32_to_bf16(kf, k, n * stride);
+            vconvert_f32_to_bf16(vf, v, n * stride);
+            vconvert_bf16_to_f32(k, kf, n * stride);
+            vconvert_bf16_to_f32(v, vf, n * stride);
+          } else {
+            vconvert_f32_to_f16(kf, k, n * stride);
+            vconvert_f32_to_f16(vf, v, n * stride);
+            vconvert_f16_to_f32(k, kf, n * stride);
+            vconvert_f16_to_f32(v, vf, n * stride);
+          }
+          double ref_lse;
+          double tol = attention_ref(q, kf, vf, 0, n, dim, stride, scale, ref,
+                                     &ref_lse);
+          float lse = targets[t].fn(q, k, v, n, dim, stride, stride, scale,
+                                    out);
+          failed |= attention_compare(targets[t].name, "whole", n, dim, out,
+                                      lse, ref, ref_lse, tol, &failures);
+          // the two halves of the cache, merged
+          size_t h = n / 2;
+          float lse0 = targets[t].fn(q, k, v, h, dim, stride, stride, scale,
+                                     out);
+          float lse1 = targets[t].fn(q, k + h * stride, v + h * stride,
+                                     n - h, dim, stride, stride, scale,
+                                     out + dim);
+          lse = vattention_merge(out, lse0, out + dim, lse1, dim);
+          failed |= attention_compare(targets[t].name, "merged", n, dim, out,
+                                      lse, ref, ref_lse, 2 * tol, &failures);
+          checks += 2;
+        }
+      }
+    }
+    // one NaN or +inf score makes the output and log-sum-exp NaN, whole or
+    // merged in from the half that holds it
+    for (int poison = 0; poison < 2; poison++) {
+      size_t n = 5, dim = 8;
+      running.size = n;
+      for (size_t i = 0; i < dim; i++) {
+        q[i] = 1.0f;
+      }
+      for (size_t i = 0; i < n * dim; i++) {
+        kf[i] = (float)uniform(c);
+        vf[i] = (float)uniform(c);
+      }
+      kf[3 * dim] = poison ? INFINITY : NAN;
+      if (targets[t].bf16) {
+        vconvert_f32_to_bf16(kf, k, n * dim);
+        vconvert_f32_to_bf16(vf, v, n * dim);
+      } else {
+        vconvert_f32_to_f16(kf, k, n * dim);
+        vconvert_f32_to_f16(vf, v, n * dim);
+      }
+      float lse = targets[t].fn(q, k, v, n, dim, dim, dim, 1.0f, out);
+      float lse0 = targets[t].fn(q, k, v, 2, dim, dim, dim, 1.0f, out + dim);
+      float lse1 = targets[t].fn(q, k + 2 * dim, v + 2 * dim, n - 2, dim, dim,
+                                 dim, 1.0f, out + 2 * dim);
+      float merged = vattention_merge(out + dim, lse0, out + 2 * dim, lse1,
+                                      dim);
+      int bad = !isnan(lse) || !isnan(merged);
+      for (size_t i = 0; i < 2 * dim; i++) {
+        bad |= !isnan(out[i]);
+      }
+      if (bad && ++failures <= MAX_PRINTED) {
+        printf("FAIL %-20s %s score keys=%zu dim=%zu lse=%.9g merged=%.9g "
+               "expected=nan\n",
+               targets[t].name, poison ? "+inf" : "NaN", n, dim, lse, merged);
+      }
+      failed |= bad;
+      checks++;
+    }
+    printf("%-20s %-9s %8zu checks  %s\n", targets[t].name, targets[t].isa,
+           checks, failures ? "FAILED" : "ok");
+  }
+  free(q);
+  free(kf);
+  free(vf);
+  free(k);
+  free(v);
+  free(out);
+  free(ref);
+  return failed;
+}
+
+/* Scan */
+
+// vscan_search has to refuse a store it cannot chunk without touching any
+// descriptor it did not open itself
+static int scan_check(void) {
+  int failed = 0;
+  // make sure fd 0 is open, so closing it by mistake shows
+  int stdin_opened =
+      fcntl(0, F_GETFD) == -1 && open("/dev/null", O_RDONLY) == 0;
+  char path[] = "/tmp/conform-XXXXXX";
+  int fd = mkstemp(path);
+  vstore_t store;
+  if (fd < 0 || vstore_create(path, VSTORE_F32, 0, 4, &store) != 0) {
+    perror("scan store");
+    if (fd >= 0) {
+      close(fd);
+      unlink(path);
+    }
+    return 1;
+  }
+  close(fd);
+  vstore_close(&store);
+  size_t idx[2];
+  float val[2], query = 0.0f;
+  errno = 0;
+  int status = vscan_search(path, &query, 1, 2, VKNN_DOT, 1, idx, val);
+  int err = errno;
+  if (status != -1 || err != EINVAL) {
+    printf("FAIL %-20s dim 0 returned %d, errno %s, expected EINVAL\n",
+           "vscan_search", status, strerror(err));
+    failed = 1;
+  }
+  if (fcntl(0, F_GETFD) == -1) {
+    printf("FAIL %-20s dim 0 closed fd 0\n", "vscan_search");
+    failed = 1;
+  }
+  printf("%-20s %-9s %8d checks  %s\n", "vscan_search", "dispatch", 2,
+         failed ? "FAILED" : "ok");
+  unlink(path);
+  if (stdin_opened) {
+    close(0);
+  }
+  return failed;
+}
+
+static int simdinfo_check(void) {
+  int failures = 0;
+#if (defined(__x86_64__) || defined(__i386)) && defined(__GNUC__)
+  // The compiler's own detection (cpuid plus the OS-enabled register state)
+  // as a second opinion
+  simdinfo_t info = simdinfo();
+  __builtin_cpu_init();
+  struct {
+    const char *name;
+    int simdinfo;
+    int compiler;
+  } features[] = {
+      {"sse3", SIMDINFO_SUPPORTS(info, __SSE3__) != 0,
+       __builtin_cpu_supports("sse3") != 0},
+      {"ssse3", SIMDINFO_SUPPORTS(info, __SSSE3__) != 0,
+       __builtin_cpu_supports("ssse3") != 0},
+      {"avx", SIMDINFO_SUPPORTS(info, __AVX__) != 0,
+       __builtin_cpu_supports("avx") != 0},
+      {"avx2", SIMDINFO_SUPPORTS(info, __AVX2__) != 0,
+       __builtin_cpu_supports("avx2") != 0},
+      {"fma", SIMDINFO_SUPPORTS(info, __FMA__) != 0,
+       __builtin_cpu_supports("fma") != 0},
+      {"avx512f", SIMDINFO_SUPPORTS(info, __AVX512F__) != 0,
+       __builtin_cpu_supports("avx512f") != 0},
+      {"avx512bw", SIMDINFO_SUPPORTS(info, __AVX512BW__) != 0,
+       __builtin_cpu_supports("avx512bw") != 0},
+      {"avx512dq", SIMDINFO_SUPPORTS(info, __AVX512DQ__) != 0,
+       __builtin_cpu_supports("avx512dq") != 0},
+      {"avx512vnni", SIMDINFO_SUPPORTS(info, __AVX512VNNI__) != 0,
+       __builtin_cpu_supports("avx512vnni") != 0},
+      {"avx512vbmi", SIMDINFO_SUPPORTS(info, __AVX512VBMI__) != 0,
+       __builtin_cpu_supports("avx512vbmi") != 0},
+  };
+  for (size_t i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+    if (features[i].simdinfo != features[i].compiler) {
+      printf("FAIL simdinfo %s: simdinfo says %d, the compiler runtime %d\n",
+             features[i].name, features[i].simdinfo, features[i].compiler);
+      failures++;
+    }
+  }
+#endif // (__x86_64__ || __i386) && __GNUC__
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 10) : 1;
+  long max_size = argc > 2 ? atol(argv[2]) : DEFAULT_MAX_SIZE;
+  if (max_size <= SMALL_SIZES) {
+    printf("Usage: %s [seed] [max_size > %d]\n", argv[0], SMALL_SIZES);
+    return 1;
+  }
+
+  signal(SIGSEGV, on_fault);
+  signal(SIGBUS, on_fault);
+  int failures = simdinfo_check();
+  // never run kernels the detection might be wrong about
+  if (failures > 0) {
+    printf("simdinfo disagrees with the CPU; not running kernels\n");
+    return 1;
+  }
+
+  vkernel_t listed[VKERNEL_MAX];
+  size_t nl = vkernel_list(listed), nt = 0;
+  target_t targets[VKERNEL_MAX + 4];
+  for (size_t i = 0; i < nl; i++) {
+    if (listed[i].supported) {
+      memset(&targets[nt], 0, sizeof(target_t));
+      targets[nt++].k = listed[i];
+    }
+  }
+  // the dispatched entry points, whichever kernel they pick
+  vkernel_t dispatched[4] = {
+      {"f32_dispatch", "dispatch", VKERNEL_F32, VKERNEL_FAST, 1,
+       {.f32 = vdot_f32}},
+      {"i8_dispatch", "dispatch", VKERNEL_I8, VKERNEL_EXACT, 1,
+       {.i8 = vdot_i8}},
+      {"f16_f32_dispatch", "dispatch", VKERNEL_F16_F32, VKERNEL_FAST, 1,
+       {.half = vdot_f16_f32}},
+      {"bf16_f32_dispatch", "dispatch", VKERNEL_BF16_F32, VKERNEL_FAST, 1,
+       {.half = vdot_bf16_f32}},
+  };
+  for (size_t i = 0; i < 4; i++) {
+    memset(&targets[nt], 0, sizeof(target_t));
+    targets[nt++].k = dispatched[i];
+  }
+
+  conform_t c;
+  c.rng = seed;
+  size_t max = (size_t)max_size;
+  c.decoded = (float *)malloc(4 * max * sizeof(float));
+  if (c.decoded == NULL || region_init(&c.a, max * sizeof(float)) != 0 ||
+      region_init(&c.b, 4 * max * sizeof(float)) != 0) {
+    fprintf(stderr, "Memory allocation failed\n");
+    return 1;
+  }
+  size_t sizes[SMALL_SIZES + 1 + RANDOM_SIZES];
+  size_t nsizes = 0;
+  for (size_t n = 0; n <= SMALL_SIZES; n++) {
+    sizes[nsizes++] = n;
+  }
+  for (size_t i = 0; i < RANDOM_SIZES; i++) {
+    sizes[nsizes++] =
+        SMALL_SIZES + 1 + (size_t)(vref_rand(&c.rng) * (max - SMALL_SIZES));
+  }
+
+  printf("seed %llu, sizes 0..%zu\n", (unsigned long long)seed, max);
+  for (size_t i = 0; i < nt; i++) {
+    target_t *t = &targets[i];
+    for (size_t s = 0; s < nsizes; s++) {
+      check_size(&c, t, sizes[s]);
+    }
+    // special values, at a few sizes around the vector widths
+    size_t special_sizes[] = {1, 7, 8, 9, 15, 16, 17, 31, 33, 63, 65, 1000};
+    for (size_t s = 0; s < sizeof(special_sizes) / sizeof(size_t); s++) {
+      for (int input = INPUT_SUBNORMAL; input < NINPUTS; input++) {
+        // i8 has no special values
+        if (t->k.type != VKERNEL_I8) {
+          check(&c, t, special_sizes[s], 0, 0, input);
+          check(&c, t, special_sizes[s], -1, -1, input);
+        }
+      }
+    }
+    printf("%-20s %-9s %8zu checks  %s\n", t->k.name, t->k.isa, t->checks,
+           t->failures ? "FAILED" : "ok");
+    failures += t->failures > 0;
+  }
+
+  failures += attention_check(&c);
+  failures += scan_check();
+
+  region_free(&c.a);
+  region_free(&c.b);
+  free(c.decoded);
+  if (failures > 0) {
+    printf("%d kernels failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,663 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vhnsw.h"
+#include "vivf.h"
+#include "vjoin.h"
+#include "vpq.h"
+#include "vrerank.h"
+#include "vscan.h"
+#include "vserve.h"
+#include "vknn.h"
+
+// Read whitespace-separated vectors, one per line, all of the same length
+static float *read_vectors(const char *path, size_t *dim, size_t *count) {
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (f == NULL) {
+    perror(path);
+    return NULL;
+  }
+  float *data = NULL;
+  size_t cap = 0, len = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  *dim = 0;
+  *count = 0;
+  while (getline(&line, &line_cap, f) != -1) {
+    size_t n = 0;
+    char *p = line, *end;
+    for (float v = strtof(p, &end); end != p; v = strtof(p, &end)) {
+      if (len == cap) {
+        cap = cap ? 2 * cap : 1024;
+        float *grown = (float *)realloc(data, cap * sizeof(float));
+        if (grown == NULL) {
+          fprintf(stderr, "Memory allocation failed\n");
+          free(data);
+          data = NULL;
+          goto done;
+        }
+        data = grown;
+      }
+      data[len++] = v;
+      n++;
+      p = end;
+    }
+    if (n == 0) {
+      continue;
+    }
+    if (*dim == 0) {
+      *dim = n;
+    } else if (n != *dim) {
+      fprintf(stderr, "%s: line %zu has %zu values, expected %zu\n", path,
+              *count + 1, n, *dim);
+      free(data);
+      data = NULL;
+      goto done;
+    }
+    (*count)++;
+  }
+done:
+  free(line);
+  if (f != stdin) {
+    fclose(f);
+  }
+  return data;
+}
+
+static int parse_dtype(const char *s) {
+  const char *names[] = {"f32", "f16", "bf16", "i8", "b1"};
+  for (int i = 0; i < 5; i++) {
+    if (strcmp(s, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int parse_metric(const char *s) {
+  const char *names[] = {"dot", "cosine", "l2"};
+  for (int i = 0; i < 3; i++) {
+    if (strcmp(s, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int print_results(size_t *idx, float *val, size_t nq, size_t k) {
+  for (size_t q = 0; q < nq; q++) {
+    for (size_t j = 0; j < k && idx[q * k + j] != SIZE_MAX; j++) {
+      printf(j ? " %zu:%g" : "%zu:%g", idx[q * k + j], val[q * k + j]);
+    }
+    printf("\n");
+  }
+  return 0;
+}
+
+static int build(int argc, char *argv[]) {
+  int dtype = argc > 4 ? parse_dtype(argv[4]) : VSTORE_F32;
+  if (dtype < 0) {
+    printf("Invalid dtype\n");
+    return 1;
+  }
+  size_t dim, count;
+  float *x = read_vectors(argv[3], &dim, &count);
+  if (x == NULL) {
+    return 1;
+  }
+  if (vstore_write_f32(argv[2], dtype, x, count, dim, dim,
+                       VQUANTIZE_SYMMETRIC) != 0) {
+    perror(argv[2]);
+    free(x);
+    return 1;
+  }
+  fprintf(stderr, "Wrote %zu vectors of dim %zu\n", count, dim);
+  free(x);
+  return 0;
+}
+
+static int search(int argc, char *argv[]) {
+  int k = atoi(argv[4]);
+  int metric = argc > 5 ? parse_metric(argv[5]) : VKNN_DOT;
+  int threads = argc > 6 ? atoi(argv[6]) : 0;
+  if (k <= 0 || metric < 0 || threads < 0) {
+    printf("Invalid k, metric or thread count\n");
+    return 1;
+  }
+  vstore_t store;
+  if (vstore_open(argv[2], &store) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  size_t dim, nq;
+  float *queries = read_vectors(argv[3], &dim, &nq);
+  if (queries == NULL) {
+    vstore_close(&store);
+    return 1;
+  }
+  if (nq > 0 && dim != store.dim) {
+    printf("Query dim %zu does not match store dim %zu\n", dim, store.dim);
+    free(queries);
+    vstore_close(&store);
+    return 1;
+  }
+  size_t *idx = (size_t *)malloc(nq * (size_t)k * sizeof(size_t) + 1);
+  float *val = (float *)malloc(nq * (size_t)k * sizeof(float) + 1);
+  int status = 1;
+  if (idx == NULL || val == NULL ||
+      vknn_search(&store, queries, nq, (size_t)k, metric, (size_t)threads,
+                  idx, val) != 0) {
+    printf("Search failed\n");
+  } else {
+    print_results(idx, val, nq, (size_t)k);
+    status = 0;
+  }
+  free(idx);
+  free(val);
+  free(queries);
+  vstore_close(&store);
+  return status;
+}
+
+// Like search, but the store is read in chunks instead of mapped
+static int scan(int argc, char *argv[]) {
+  int k = atoi(argv[4]);
+  int metric = argc > 5 ? parse_metric(argv[5]) : VKNN_DOT;
+  int threads = argc > 6 ? atoi(argv[6]) : 0;
+  if (k <= 0 || metric < 0 || threads < 0) {
+    printf("Invalid k, metric or thread count\n");
+    return 1;
+  }
+  // only the header is needed here; vscan_search reads the rows itself
+  vstore_t store;
+  if (vstore_open(argv[2], &store) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  size_t store_dim = store.dim;
+  vstore_close(&store);
+  size_t dim, nq;
+  float *queries = read_vectors(argv[3], &dim, &nq);
+  if (queries == NULL) {
+    return 1;
+  }
+  if (nq > 0 && dim != store_dim) {
+    printf("Query dim %zu does not match store dim %zu\n", dim, store_dim);
+    free(queries);
+    return 1;
+  }
+  size_t *idx = (size_t *)malloc(nq * (size_t)k * sizeof(size_t) + 1);
+  float *val = (float *)malloc(nq * (size_t)k * sizeof(float) + 1);
+  int status = 1;
+  if (idx == NULL || val == NULL ||
+      vscan_search(argv[2], queries, nq, (size_t)k, metric, (size_t)threads,
+                   idx, val) != 0) {
+    perror("Scan failed");
+  } else {
+    print_results(idx, val, nq, (size_t)k);
+    status = 0;
+  }
+  free(idx);
+  free(val);
+  free(queries);
+  return status;
+}
+
+static int ivf_build(int argc, char *argv[]) {
+  int nlist = atoi(argv[4]);
+  int iters = argc > 5 ? atoi(argv[5]) : 10;
+  if (nlist <= 0 || iters < 0) {
+    printf("Invalid nlist or iteration count\n");
+    return 1;
+  }
+  vstore_t store;
+  if (vstore_open(argv[3], &store) != 0) {
+    perror(argv[3]);
+    return 1;
+  }
+  int status = vivf_build(&store, (size_t)nlist, 0, (size_t)iters, 0, argv[2]);
+  if (status != 0) {
+    perror(argv[2]);
+  }
+  vstore_close(&store);
+  return status != 0;
+}
+
+static int ivf_search(int argc, char *argv[]) {
+  int k = atoi(argv[4]);
+  int nprobe = atoi(argv[5]);
+  int metric = argc > 6 ? parse_metric(argv[6]) : VKNN_DOT;
+  int threads = argc > 7 ? atoi(argv[7]) : 0;
+  if (k <= 0 || nprobe <= 0 || metric < 0 || threads < 0) {
+    printf("Invalid k, nprobe, metric or thread count\n");
+    return 1;
+  }
+  vivf_t ivf;
+  if (vivf_open(argv[2], &ivf) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  size_t dim, nq;
+  float *queries = read_vectors(argv[3], &dim, &nq);
+  if (queries == NULL || (nq > 0 && dim != ivf.dim)) {
+    printf("Could not read queries of dim %zu\n", ivf.dim);
+    free(queries);
+    vivf_close(&ivf);
+    return 1;
+  }
+  size_t *idx = (size_t *)malloc(nq * (size_t)k * sizeof(size_t) + 1);
+  float *val = (float *)malloc(nq * (size_t)k * sizeof(float) + 1);
+  int status = 1;
+  if (idx == NULL || val == NULL ||
+      vivf_search(&ivf, queries, nq, (size_t)k, (size_t)nprobe, metric,
+                  (size_t)threads, idx, val) != 0) {
+    printf("Search failed\n");
+  } else {
+    print_results(idx, val, nq, (size_t)k);
+    status = 0;
+  }
+  free(idx);
+  free(val);
+  free(queries);
+  vivf_close(&ivf);
+  return status;
+}
+
+static int hnsw_build(int argc, char *argv[]) {
+  int metric = argc > 4 ? parse_metric(argv[4]) : VKNN_DOT;
+  int m = argc > 5 ? atoi(argv[5]) : VHNSW_DEFAULT_M;
+  int ef = argc > 6 ? atoi(argv[6]) : VHNSW_DEFAULT_EF;
+  int threads = argc > 7 ? atoi(argv[7]) : 0;
+  if (metric < 0 || m < 2 || ef <= 0 || threads < 0) {
+    printf("Invalid metric, m, ef or thread count\n");
+    return 1;
+  }
+  vstore_t store;
+  if (vstore_open(argv[3], &store) != 0) {
+    perror(argv[3]);
+    return 1;
+  }
+  int status = vhnsw_build(&store, metric, (size_t)m, (size_t)ef,
+                           (size_t)threads, argv[2]);
+  if (status != 0) {
+    perror(argv[2]);
+  }
+  vstore_close(&store);
+  return status != 0;
+}
+
+static int hnsw_search(int argc, char *argv[]) {
+  int k = atoi(argv[5]);
+  int ef = argc > 6 ? atoi(argv[6]) : VHNSW_DEFAULT_EF / 2;
+  int threads = argc > 7 ? atoi(argv[7]) : 0;
+  if (k <= 0 || ef < 0 || threads < 0) {
+    printf("Invalid k, ef or thread count\n");
+    return 1;
+  }
+  vstore_t store;
+  vhnsw_t g;
+  if (vstore_open(argv[3], &store) != 0) {
+    perror(argv[3]);
+    return 1;
+  }
+  if (vhnsw_open(argv[2], &store, &g) != 0) {
+    perror(argv[2]);
+    vstore_close(&store);
+    return 1;
+  }
+  size_t dim, nq;
+  float *queries = read_vectors(argv[4], &dim, &nq);
+  if (queries == NULL || (nq > 0 && dim != g.dim)) {
+    printf("Could not read queries of dim %zu\n", g.dim);
+    free(queries);
+    vhnsw_close(&g);
+    vstore_close(&store);
+    return 1;
+  }
+  size_t *idx = (size_t *)malloc(nq * (size_t)k * sizeof(size_t) + 1);
+  float *val = (float *)malloc(nq * (size_t)k * sizeof(float) + 1);
+  int status = 1;
+  if (idx == NULL || val == NULL ||
+      vhnsw_search(&g, queries, nq, (size_t)k, (size_t)ef, (size_t)threads,
+                   idx, val) != 0) {
+    printf("Search failed\n");
+  } else {
+    print_results(idx, val, nq, (size_t)k);
+    status = 0;
+  }
+  free(idx);
+  free(val);
+  free(queries);
+  vhnsw_close(&g);
+  vstore_close(&store);
+  return status;
+}
+
+static int pq_build(int argc, char *argv[]) {
+  int nsub = atoi(argv[4]);
+  int metric = argc > 5 ? parse_metric(argv[5]) : VKNN_DOT;
+  int iters = argc > 6 ? atoi(argv[6]) : 10;
+  if (nsub <= 0 || metric < 0 || iters < 0) {
+    printf("Invalid subspace count, metric or iteration count\n");
+    return 1;
+  }
+  vstore_t store;
+  if (vstore_open(argv[3], &store) != 0) {
+    perror(argv[3]);
+    return 1;
+  }
+  int status = vpq_build(&store, (size_t)nsub, metric, 0, (size_t)iters, 0,
+                         argv[2]);
+  if (status != 0) {
+    perror(argv[2]);
+  }
+  vstore_close(&store);
+  return status != 0;
+}
+
+static int pq_search(int argc, char *argv[]) {
+  int k = atoi(argv[5]);
+  int rerank = argc > 6 ? atoi(argv[6]) : 4 * k;
+  int threads = argc > 7 ? atoi(argv[7]) : 0;
+  if (k <= 0 || rerank < 0 || threads < 0) {
+    printf("Invalid k, rerank or thread count\n");
+    return 1;
+  }
+  vstore_t store;
+  vpq_t pq;
+  if (vstore_open(argv[3], &store) != 0) {
+    perror(argv[3]);
+    return 1;
+  }
+  if (vpq_open(argv[2], &pq) != 0) {
+    perror(argv[2]);
+    vstore_close(&store);
+    return 1;
+  }
+  size_t dim, nq;
+  float *queries = read_vectors(argv[4], &dim, &nq);
+  if (queries == NULL || (nq > 0 && dim != pq.dim)) {
+    printf("Could not read queries of dim %zu\n", pq.dim);
+    free(queries);
+    vpq_close(&pq);
+    vstore_close(&store);
+    return 1;
+  }
+  size_t *idx = (size_t *)malloc(nq * (size_t)k * sizeof(size_t) + 1);
+  float *val = (float *)malloc(nq * (size_t)k * sizeof(float) + 1);
+  int status = 1;
+  if (idx == NULL || val == NULL ||
+      vpq_search(&pq, rerank > 0 ? &store : NULL, queries, nq, (size_t)k,
+                 (size_t)rerank, (size_t)threads, idx, val) != 0) {
+    printf("Search failed\n");
+  } else {
+    print_results(idx, val, nq, (size_t)k);
+    status = 0;
+  }
+  free(idx);
+  free(val);
+  free(queries);
+  vpq_close(&pq);
+  vstore_close(&store);
+  return status;
+}
+
+static int rerank_search(int argc, char *argv[]) {
+  int k = atoi(argv[5]);
+  int oversample = argc > 6 ? atoi(argv[6]) : VRERANK_DEFAULT_OVERSAMPLE;
+  int metric = argc > 7 ? parse_metric(argv[7]) : VKNN_DOT;
+  int threads = argc > 8 ? atoi(argv[8]) : 0;
+  if (k <= 0 || oversample <= 0 || metric < 0 || threads < 0) {
+    printf("Invalid k, oversample, metric or thread count\n");
+    return 1;
+  }
+  vstore_t coarse, full;
+  if (vstore_open(argv[2], &coarse) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  if (vstore_open(argv[3], &full) != 0) {
+    perror(argv[3]);
+    vstore_close(&coarse);
+    return 1;
+  }
+  size_t dim, nq;
+  float *queries = read_vectors(argv[4], &dim, &nq);
+  if (queries == NULL || (nq > 0 && dim != full.dim)) {
+    printf("Could not read queries of dim %zu\n", full.dim);
+    free(queries);
+    vstore_close(&coarse);
+    vstore_close(&full);
+    return 1;
+  }
+  size_t *idx = (size_t *)malloc(nq * (size_t)k * sizeof(size_t) + 1);
+  float *val = (float *)malloc(nq * (size_t)k * sizeof(float) + 1);
+  int status = 1;
+  if (idx == NULL || val == NULL ||
+      vrerank_search(&coarse, &full, queries, nq, (size_t)k,
+                     (size_t)oversample, metric, (size_t)threads, idx,
+                     val) != 0) {
+    printf("Search failed\n");
+  } else {
+    print_results(idx, val, nq, (size_t)k);
+    status = 0;
+  }
+  free(idx);
+  free(val);
+  free(queries);
+  vstore_close(&coarse);
+  vstore_close(&full);
+  return status;
+}
+
+static int write_pairs(void *ctx, vjoin_pair_t *pairs, size_t n) {
+  FILE *f = (FILE *)ctx;
+  for (size_t i = 0; i < n; i++) {
+    fprintf(f, "%llu %llu %g\n", (unsigned long long)pairs[i].i,
+            (unsigned long long)pairs[i].j, pairs[i].score);
+  }
+  if (ferror(f)) {
+    errno = EIO;
+    return -1;
+  }
+  return 0;
+}
+
+static int join(int argc, char *argv[]) {
+  float threshold = strtof(argv[3], NULL);
+  int metric = argc > 5 ? parse_metric(argv[5]) : VKNN_COSINE;
+  int threads = argc > 6 ? atoi(argv[6]) : 0;
+  if (metric < 0 || threads < 0) {
+    printf("Invalid metric or thread count\n");
+    return 1;
+  }
+  vstore_t store;
+  if (vstore_open(argv[2], &store) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  FILE *out = strcmp(argv[4], "-") == 0 ? stdout : fopen(argv[4], "w");
+  if (out == NULL) {
+    perror(argv[4]);
+    vstore_close(&store);
+    return 1;
+  }
+  int status = vjoin_self(&store, threshold, metric, (size_t)threads,
+                          write_pairs, out);
+  if (status != 0) {
+    perror("Join failed");
+  }
+  if (out != stdout && fclose(out) != 0) {
+    perror(argv[4]);
+    status = -1;
+  }
+  vstore_close(&store);
+  return status != 0;
+}
+
+static volatile int serve_stop = 0;
+
+static void on_signal(int sig) {
+  (void)sig;
+  serve_stop = 1;
+}
+
+static int serve(int argc, char *argv[]) {
+  vserve_config_t config;
+  config.metric = argc > 4 ? parse_metric(argv[4]) : VKNN_DOT;
+  int batch = argc > 5 ? atoi(argv[5]) : VSERVE_DEFAULT_BATCH;
+  int delay = argc > 6 ? atoi(argv[6]) : VSERVE_DEFAULT_DELAY_US;
+  int threads = argc > 7 ? atoi(argv[7]) : 0;
+  if (config.metric < 0 || batch <= 0 || delay < 0 || threads < 0) {
+    printf("Invalid metric, batch size, delay or thread count\n");
+    return 1;
+  }
+  config.max_batch = (size_t)batch;
+  config.max_delay_us = (size_t)delay;
+  config.nthreads = (size_t)threads;
+  config.stop = &serve_stop;
+  vstore_t store;
+  if (vstore_open(argv[2], &store) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  // no SA_RESTART: the signal has to interrupt epoll_wait
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  fprintf(stderr, "Serving %zu vectors of dim %zu on %s\n", store.count,
+          store.dim, argv[3]);
+  int status = vserve_run(&store, argv[3], &config);
+  if (status != 0) {
+    perror(argv[3]);
+  }
+  vstore_close(&store);
+  return status != 0;
+}
+
+// Keep up to this many requests in flight on the connection
+#define QUERY_WINDOW 64
+
+static int query(int argc, char *argv[]) {
+  int k = atoi(argv[4]);
+  if (k <= 0) {
+    printf("Invalid k\n");
+    return 1;
+  }
+  size_t dim, nq;
+  float *queries = read_vectors(argv[3], &dim, &nq);
+  if (queries == NULL) {
+    return 1;
+  }
+  int fd = vserve_connect(argv[2]);
+  if (fd < 0) {
+    perror(argv[2]);
+    free(queries);
+    return 1;
+  }
+  size_t *idx = (size_t *)malloc((size_t)k * sizeof(size_t));
+  float *val = (float *)malloc((size_t)k * sizeof(float));
+  int status = idx == NULL || val == NULL;
+  for (size_t sent = 0, q = 0; q < nq && status == 0; q++) {
+    for (; sent < nq && sent < q + QUERY_WINDOW; sent++) {
+      if (vserve_send(fd, queries + sent * dim, dim, (size_t)k) != 0) {
+        perror("send");
+        status = 1;
+        break;
+      }
+    }
+    long count = status ? -1 : vserve_recv(fd, (size_t)k, idx, val);
+    if (count < 0) {
+      perror("Query failed");
+      status = 1;
+      break;
+    }
+    for (long j = 0; j < count; j++) {
+      printf(j ? " %zu:%g" : "%zu:%g", idx[j], val[j]);
+    }
+    printf("\n");
+  }
+  close(fd);
+  free(idx);
+  free(val);
+  free(queries);
+  return status;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc >= 4 && strcmp(argv[1], "build") == 0) {
+    return build(argc, argv);
+  }
+  if (argc >= 5 && strcmp(argv[1], "search") == 0) {
+    return search(argc, argv);
+  }
+  if (argc >= 5 && strcmp(argv[1], "scan") == 0) {
+    return scan(argc, argv);
+  }
+  if (argc >= 5 && strcmp(argv[1], "ivf-build") == 0) {
+    return ivf_build(argc, argv);
+  }
+  if (argc >= 6 && strcmp(argv[1], "ivf-search") == 0) {
+    return ivf_search(argc, argv);
+  }
+  if (argc >= 4 && strcmp(argv[1], "hnsw-build") == 0) {
+    return hnsw_build(argc, argv);
+  }
+  if (argc >= 6 && strcmp(argv[1], "hnsw-search") == 0) {
+    return hnsw_search(argc, argv);
+  }
+  if (argc >= 5 && strcmp(argv[1], "pq-build") == 0) {
+    return pq_build(argc, argv);
+  }
+  if (argc >= 6 && strcmp(argv[1], "pq-search") == 0) {
+    return pq_search(argc, argv);
+  }
+  if (argc >= 6 && strcmp(argv[1], "rerank-search") == 0) {
+    return rerank_search(argc, argv);
+  }
+  if (argc >= 5 && strcmp(argv[1], "join") == 0) {
+    return join(argc, argv);
+  }
+  if (argc >= 4 && strcmp(argv[1], "serve") == 0) {
+    return serve(argc, argv);
+  }
+  if (argc >= 5 && strcmp(argv[1], "query") == 0) {
+    return query(argc, argv);
+  }
+  printf("Usage: %s build <store> <vectors.txt> [f32|f16|bf16|i8|b1]\n", argv[0]);
+  printf("       %s search <store> <queries.txt> <k> [dot|cosine|l2] "
+         "[threads]\n",
+         argv[0]);
+  printf("       %s scan <store> <queries.txt> <k> [dot|cosine|l2] [threads]\n",
+         argv[0]);
+  printf("       %s ivf-build <index> <store> <nlist> [iters]\n", argv[0]);
+  printf("       %s ivf-search <index> <queries.txt> <k> <nprobe> "
+         "[dot|cosine|l2] [threads]\n",
+         argv[0]);
+  printf("       %s hnsw-build <index> <store> [dot|cosine|l2] [m] [ef] "
+         "[threads]\n",
+         argv[0]);
+  printf("       %s hnsw-search <index> <store> <queries.txt> <k> [ef] "
+         "[threads]\n",
+         argv[0]);
+  printf("       %s pq-build <index> <store> <nsub> [dot|cosine|l2] [iters]\n",
+         argv[0]);
+  printf("       %s pq-search <index> <store> <queries.txt> <k> [rerank] "
+         "[threads]\n",
+         argv[0]);
+  printf("       %s rerank-search <coarse> <full> <queries.txt> <k> "
+         "[oversample] [dot|cosine|l2] [threads]\n",
+         argv[0]);
+  printf("       %s join <store> <threshold> <pairs.txt> [dot|cosine|l2] "
+         "[threads]\n",
+         argv[0]);
+  printf("       %s serve <store> <socket> [dot|cosine|l2] [max_batch] "
+         "[max_delay_us] [threads]\n",
+         argv[0]);
+  printf("       %s query <socket> <queries.txt> <k>\n", argv[0]);
+  return 1;
+}
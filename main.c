@@ -1,23 +1,57 @@
+#define _GNU_SOURCE
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "valloc.h"
 #include "vdot.h"
+#include "vtopk.h"
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <size>\n", argv[0]);
-        return 1;
-    }
-    int size = atoi(argv[1]);
+// Vectors read from stdin are scored a block at a time. A reader thread fills
+// one block while the main thread scores the other.
+#define BLOCK_BYTES (1024 * 1024)
+
+enum format_t {
+    FORMAT_TEXT = 0,
+    FORMAT_F32 = 1,
+};
+
+typedef struct block_t {
+    float *data;
+    size_t rows;
+    int full;
+} block_t;
+
+typedef struct stream_t {
+    FILE *in;
+    int format;
+    size_t dim;
+    size_t block_rows;
+    block_t blocks[2];
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} stream_t;
+
+// Huge pages only pay off once a buffer spans several of them
+static int alloc_flags(size_t bytes) {
+    return bytes >= 2 * VALLOC_HUGE_PAGE_SIZE ? VALLOC_THP : 0;
+}
+
+static int self_test(int size) {
     if (size <= 0) {
         printf("Invalid size\n");
         return 1;
     }
     size_t n = (size_t)size;
-    float * a = (float *)malloc(n * sizeof(float));
-    float * b = (float *)malloc(n * sizeof(float));
+    int flags = alloc_flags(n * sizeof(float));
+    float * a = (float *)vdot_alloc(n * sizeof(float), flags);
+    float * b = (float *)vdot_alloc(n * sizeof(float), flags);
 
     if (a == NULL || b == NULL) {
         printf("Memory allocation failed\n");
+        vdot_free(a);
+        vdot_free(b);
         return 1;
     }
 
@@ -29,5 +63,285 @@ int main(int argc, char *argv[]) {
     // 0*0 + 1*1 + 2*2 + ... + (n-1)*(n-1) = n*(n-1)*(2n-1)/6
     float result = vdot_f32(a, b, n);
     printf("Result: %.2f\n", result);
+    vdot_free(a);
+    vdot_free(b);
     return 0;
-}
\ No newline at end of file
+}
+
+// Parse one line of whitespace-separated floats into out (at most max values)
+// and return how many there were; max + 1 means too many
+static size_t parse_line(char *line, float *out, size_t max) {
+    size_t n = 0;
+    char *p = line, *end;
+    for (float v = strtof(p, &end); end != p; v = strtof(p, &end)) {
+        if (n == max) {
+            return max + 1;
+        }
+        out[n++] = v;
+        p = end;
+    }
+    return n;
+}
+
+// Read the query file: one vector per line, all of the same length. Returns
+// NULL, having said why, only on error; a file without queries gives a buffer
+// with count 0.
+static float *read_queries(const char *path, size_t *dim, size_t *count) {
+    *dim = 0;
+    *count = 0;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+    size_t cap = 1;
+    float *data = (float *)malloc(cap * sizeof(float));
+    char *line = NULL;
+    size_t line_cap = 0;
+    if (data == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        fclose(f);
+        return NULL;
+    }
+    while (getline(&line, &line_cap, f) != -1) {
+        size_t room = *dim ? *dim : line_cap;
+        if ((*count + 1) * room > cap) {
+            cap = 2 * (*count + 1) * room;
+            float *grown = (float *)realloc(data, cap * sizeof(float));
+            if (grown == NULL) {
+                fprintf(stderr, "Memory allocation failed\n");
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = grown;
+        }
+        size_t n = parse_line(line, data + *count * room, room);
+        if (n == 0) {
+            continue;
+        }
+        if (*dim == 0) {
+            *dim = n;
+        } else if (n != *dim) {
+            fprintf(stderr, "%s: line %zu does not have %zu values\n", path,
+                    *count + 1, *dim);
+            free(data);
+            data = NULL;
+            break;
+        }
+        (*count)++;
+    }
+    free(line);
+    fclose(f);
+    return data;
+}
+
+// Fill a block from the input; returns the number of rows, 0 at the end
+static size_t read_block(stream_t *s, float *data, char **line,
+                         size_t *line_cap, size_t *line_no) {
+    if (s->format == FORMAT_F32) {
+        size_t got = fread(data, sizeof(float), s->block_rows * s->dim, s->in);
+        if (got % s->dim != 0) {
+            fprintf(stderr, "stdin: input ends inside a vector\n");
+            s->error = 1;
+            return 0;
+        }
+        if (got == 0 && ferror(s->in)) {
+            perror("stdin");
+            s->error = 1;
+        }
+        return got / s->dim;
+    }
+    size_t rows = 0;
+    while (rows < s->block_rows && getline(line, line_cap, s->in) != -1) {
+        (*line_no)++;
+        size_t n = parse_line(*line, data + rows * s->dim, s->dim);
+        if (n == 0) {
+            continue;
+        }
+        if (n != s->dim) {
+            fprintf(stderr, "stdin: line %zu does not have %zu values\n",
+                    *line_no, s->dim);
+            s->error = 1;
+            return 0;
+        }
+        rows++;
+    }
+    return rows;
+}
+
+static void *reader_main(void *arg) {
+    stream_t *s = (stream_t *)arg;
+    char *line = NULL;
+    size_t line_cap = 0, line_no = 0;
+    for (size_t b = 0;; b ^= 1) {
+        block_t *block = &s->blocks[b];
+        pthread_mutex_lock(&s->lock);
+        while (block->full) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+        // the block is ours until it is marked full again
+        size_t rows = read_block(s, block->data, &line, &line_cap, &line_no);
+        pthread_mutex_lock(&s->lock);
+        block->rows = rows;
+        block->full = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        if (rows == 0) {
+            break;
+        }
+    }
+    free(line);
+    return NULL;
+}
+
+static void print_scores(float *scores, size_t rows, size_t nq, int format) {
+    if (format == FORMAT_F32) {
+        fwrite(scores, sizeof(float), rows * nq, stdout);
+        return;
+    }
+    for (size_t i = 0; i < rows; i++) {
+        for (size_t q = 0; q < nq; q++) {
+            printf(q ? " %g" : "%g", scores[i * nq + q]);
+        }
+        printf("\n");
+    }
+}
+
+// Score every vector on stdin against every query. With k = 0 each vector's
+// scores are written as they are computed (a text line, or nq raw floats);
+// otherwise the top k of each query are printed once the input ends.
+static int score(const char *path, int format, size_t k) {
+    size_t dim, nq;
+    float *queries = read_queries(path, &dim, &nq);
+    if (queries == NULL) {
+        return 1;
+    }
+    if (nq == 0) {
+        fprintf(stderr, "%s: no queries\n", path);
+        free(queries);
+        return 1;
+    }
+    stream_t s;
+    s.in = stdin;
+    s.format = format;
+    s.dim = dim;
+    s.block_rows = BLOCK_BYTES / (dim * sizeof(float)) + 1;
+    s.error = 0;
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    size_t block_floats = s.block_rows * dim;
+    size_t buffer_bytes = 2 * block_floats * sizeof(float);
+    float *buffers = (float *)vdot_alloc(buffer_bytes, alloc_flags(buffer_bytes));
+    // the scores and the heaps share one arena block
+    size_t score_bytes = s.block_rows * nq * sizeof(float);
+    size_t arena_bytes = score_bytes + nq * k * (sizeof(size_t) + sizeof(float)) +
+                         nq * sizeof(vtopk_t) + 4 * VALLOC_ALIGN;
+    vdot_arena_t arena;
+    int status = 1;
+    if (vdot_arena_init(&arena, arena_bytes, alloc_flags(arena_bytes)) != 0 ||
+        buffers == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        goto done;
+    }
+    float *scores = (float *)vdot_arena_alloc(&arena, score_bytes);
+    size_t *idx = (size_t *)vdot_arena_alloc(&arena, nq * k * sizeof(size_t));
+    float *val = (float *)vdot_arena_alloc(&arena, nq * k * sizeof(float));
+    vtopk_t *heaps = (vtopk_t *)vdot_arena_alloc(&arena, nq * sizeof(vtopk_t));
+    for (size_t b = 0; b < 2; b++) {
+        s.blocks[b].data = buffers + b * block_floats;
+        s.blocks[b].rows = 0;
+        s.blocks[b].full = 0;
+    }
+    for (size_t q = 0; q < nq; q++) {
+        vtopk_init(&heaps[q], k, idx + q * k, val + q * k);
+    }
+    static char out_buf[1 << 20];
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, reader_main, &s) != 0) {
+        fprintf(stderr, "Could not start the reader thread\n");
+        goto done;
+    }
+    size_t base = 0;
+    for (size_t b = 0;; b ^= 1) {
+        block_t *block = &s.blocks[b];
+        pthread_mutex_lock(&s.lock);
+        while (!block->full) {
+            pthread_cond_wait(&s.cond, &s.lock);
+        }
+        pthread_mutex_unlock(&s.lock);
+        size_t rows = block->rows;
+        if (rows == 0) {
+            break;
+        }
+        if (k == 0) {
+            // scores[i * nq + q]: one row of output per input vector
+            vdot_many_f32(block->data, rows, dim, queries, nq, dim, dim,
+                          scores, nq);
+            print_scores(scores, rows, nq, format);
+        } else {
+            // scores[q * rows + i]: one contiguous run per query's heap
+            vdot_many_f32(queries, nq, dim, block->data, rows, dim, dim,
+                          scores, rows);
+            for (size_t q = 0; q < nq; q++) {
+                vtopk_push_f32(&heaps[q], scores + q * rows, rows, base);
+            }
+        }
+        base += rows;
+        pthread_mutex_lock(&s.lock);
+        block->full = 0;
+        pthread_cond_broadcast(&s.cond);
+        pthread_mutex_unlock(&s.lock);
+    }
+    pthread_join(reader, NULL);
+
+    // a failed read leaves the heaps partial; print nothing rather than that
+    for (size_t q = 0; q < nq && k > 0 && !s.error; q++) {
+        size_t count = vtopk_finish(&heaps[q]);
+        for (size_t j = 0; j < count; j++) {
+            printf(j ? " %zu:%g" : "%zu:%g", idx[q * k + j], val[q * k + j]);
+        }
+        printf("\n");
+    }
+    status = s.error;
+    if (fflush(stdout) != 0) {
+        perror("stdout");
+        status = 1;
+    }
+
+done:
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.cond);
+    free(queries);
+    vdot_free(buffers);
+    vdot_arena_destroy(&arena);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 2) {
+        return self_test(atoi(argv[1]));
+    }
+    if (argc >= 3 && argc <= 5 && strcmp(argv[1], "score") == 0) {
+        int format = FORMAT_TEXT;
+        if (argc > 3 && strcmp(argv[3], "f32") == 0) {
+            format = FORMAT_F32;
+        } else if (argc > 3 && strcmp(argv[3], "text") != 0) {
+            printf("Unknown format %s\n", argv[3]);
+            return 1;
+        }
+        int k = argc > 4 ? atoi(argv[4]) : 0;
+        if (k < 0) {
+            printf("Invalid k\n");
+            return 1;
+        }
+        return score(argv[2], format, (size_t)k);
+    }
+    printf("Usage: %s <size>\n", argv[0]);
+    printf("       %s score <queries.txt> [text|f32] [k] < vectors\n",
+           argv[0]);
+    return 1;
+}
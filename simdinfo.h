@@ -65,6 +65,12 @@
 #include <sys/sysctl.h>
 #endif // __APPLE__
 
+#if defined(_MSC_VER)
+// __cpuidex, _xgetbv
+#include <immintrin.h>
+#include <intrin.h>
+#endif // _MSC_VER
+
 typedef struct simdinfo_t {
   // x86 and x86_64
   unsigned _supports__AVX__;
@@ -73,6 +79,7 @@ typedef struct simdinfo_t {
   unsigned _supports__F16C__;
   unsigned _supports__FMA__;
   unsigned _supports__AVX512F__;
+  unsigned _supports__AVX512BW__;
   unsigned _supports__AVX512BF16__;
   unsigned _supports__AVX512VNNI__;
   unsigned _supports__AVX512VBMI__;
@@ -102,11 +109,12 @@ static inline struct simdinfo_t simdinfo_internal() {
     struct separate_t {
       unsigned eax, ebx, ecx, edx;
     } named;
-  } info1, info7;
+  } info1, info7, info7_1;
 
 #ifdef _MSC_VER
   __cpuidex(info1.array, 1, 0);
   __cpuidex(info7.array, 7, 0);
+  __cpuidex(info7_1.array, 7, 1);
 #else
   __asm__ __volatile__("cpuid"
                        : "=a"(info1.named.eax), "=b"(info1.named.ebx),
@@ -116,20 +124,55 @@ static inline struct simdinfo_t simdinfo_internal() {
                        : "=a"(info7.named.eax), "=b"(info7.named.ebx),
                          "=c"(info7.named.ecx), "=d"(info7.named.edx)
                        : "a"(7), "c"(0));
+  __asm__ __volatile__("cpuid"
+                       : "=a"(info7_1.named.eax), "=b"(info7_1.named.ebx),
+                         "=c"(info7_1.named.ecx), "=d"(info7_1.named.edx)
+                       : "a"(7), "c"(1));
 #endif
+  // leaf 7 reports its highest valid subleaf in eax
+  if (info7.named.eax < 1) {
+    info7_1.named.eax = 0;
+  }
   // source:
   // https://github.com/llvm/llvm-project/blob/50598f0ff44f3a4e75706f8c53f3380fe7faa896/clang/lib/Headers/cpuid.h
 
-  info._supports__AVX__ = (info7.named.ecx & 0x10000000) != 0;
-  info._supports__AVX2__ = (info7.named.ebx & 0x00000020) != 0;
-  info._supports__F16C__ = (info1.named.ecx & 0x20000000) != 0;
-  info._supports__FMA__ = (info1.named.ecx & 0x00001000) != 0;
-  info._supports__AVXVNNI__ = (info7.named.eax & 0x00000010) != 0;
-  info._supports__AVX512F__ = (info7.named.ebx & 0x00010000) != 0;
-  info._supports__AVX512BF16__ = (info7.named.edx & 0x00000020) != 0;
-  info._supports__AVX512VNNI__ = (info7.named.ecx & 0x00000800) != 0;
-  info._supports__AVX512VBMI__ = (info7.named.ecx & 0x00000002) != 0;
-  info._supports__AVX512DQ__ = (info7.named.ebx & 0x00020000) != 0;
+  // The OS must also save the wider registers on context switches (XCR0),
+  // or the instructions cpuid lists fault
+  unsigned long long xcr0 = 0;
+  if (info1.named.ecx & 0x08000000) { // OSXSAVE
+#ifdef _MSC_VER
+    xcr0 = _xgetbv(0);
+#else
+    unsigned xcr0_lo, xcr0_hi;
+    __asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    xcr0 = ((unsigned long long)xcr0_hi << 32) | xcr0_lo;
+#endif
+  }
+  // XMM and YMM state
+  unsigned os_avx = (xcr0 & 0x06) == 0x06;
+  // and opmask, upper ZMM0-15 and ZMM16-31 state
+  unsigned os_avx512 = (xcr0 & 0xe6) == 0xe6;
+
+  // XMM state is saved by any OS that runs SSE code at all
+  info._supports__SSE3__ = (info1.named.ecx & 0x00000001) != 0;
+  info._supports__SSSE3__ = (info1.named.ecx & 0x00000200) != 0;
+  info._supports__AVX__ = os_avx && (info1.named.ecx & 0x10000000) != 0;
+  info._supports__AVX2__ = os_avx && (info7.named.ebx & 0x00000020) != 0;
+  info._supports__F16C__ = os_avx && (info1.named.ecx & 0x20000000) != 0;
+  info._supports__FMA__ = os_avx && (info1.named.ecx & 0x00001000) != 0;
+  info._supports__AVXVNNI__ = os_avx && (info7_1.named.eax & 0x00000010) != 0;
+  info._supports__AVX512F__ =
+      os_avx512 && (info7.named.ebx & 0x00010000) != 0;
+  info._supports__AVX512BW__ =
+      os_avx512 && (info7.named.ebx & 0x40000000) != 0;
+  info._supports__AVX512BF16__ =
+      os_avx512 && (info7_1.named.eax & 0x00000020) != 0;
+  info._supports__AVX512VNNI__ =
+      os_avx512 && (info7.named.ecx & 0x00000800) != 0;
+  info._supports__AVX512VBMI__ =
+      os_avx512 && (info7.named.ecx & 0x00000002) != 0;
+  info._supports__AVX512DQ__ =
+      os_avx512 && (info7.named.ebx & 0x00020000) != 0;
 
   return info;
 
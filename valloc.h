@@ -0,0 +1,206 @@
+/* Aligned, huge-page-backed allocation for vector buffers */
+#ifndef VALLOC_H
+#define VALLOC_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// vdot_alloc returns memory aligned to VALLOC_ALIGN (a cache line, and the
+// widest vector register), so no kernel load splits a line. Large buffers
+// are mapped directly and, on request, backed by huge pages: a scan over
+// hundreds of MiB then walks a few hundred TLB entries instead of tens of
+// thousands.
+//
+// Flags:
+//
+//   VALLOC_HUGE     explicit huge pages (MAP_HUGETLB) when the system has
+//                   some reserved, transparent huge pages otherwise
+//   VALLOC_THP      transparent huge pages only (MADV_HUGEPAGE), with the
+//                   mapping aligned so every 2 MiB of it can be promoted
+//   VALLOC_PAGE     page-aligned, for O_DIRECT reads
+//   VALLOC_NODE(n)  bind the pages to NUMA node n (best effort)
+//
+// Memory from vdot_alloc is released with vdot_free, never free().
+
+#define VALLOC_ALIGN 64
+#define VALLOC_PAGE_SIZE 4096
+#define VALLOC_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+// Below this, and without flags asking for pages, use the heap
+#define VALLOC_MAP_MIN (256 * 1024)
+
+#define VALLOC_HUGE 0x1
+#define VALLOC_THP 0x2
+#define VALLOC_PAGE 0x4
+#define VALLOC_NODE(n) ((((n) + 1) & 0xff) << 8)
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+// Kept just below every pointer vdot_alloc returns
+typedef struct valloc_header_t {
+  void *base;
+  // length of the mapping, or 0 for heap memory
+  size_t mapped;
+  size_t bytes;
+  size_t offset;
+} valloc_header_t;
+
+static inline size_t _valloc_round(size_t x, size_t to) {
+  return (x + to - 1) / to * to;
+}
+
+// Map length bytes so that the start is a multiple of align (a power of two)
+static inline void *_valloc_map_aligned(size_t length, size_t align,
+                                        int extra) {
+  size_t over = length + align;
+  char *p = (char *)mmap(NULL, over, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | extra, -1, 0);
+  if (p == MAP_FAILED) {
+    return NULL;
+  }
+  char *start = (char *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+  if (start > p) {
+    munmap(p, (size_t)(start - p));
+  }
+  size_t tail = (size_t)(p + over - (start + length));
+  if (tail > 0) {
+    munmap(start + length, tail);
+  }
+  return start;
+}
+
+static inline void _valloc_bind(void *p, size_t length, int flags) {
+  int node = ((flags >> 8) & 0xff) - 1;
+  if (node < 0) {
+    return;
+  }
+#ifdef SYS_mbind
+  // raw syscall: binding is a hint, not worth a dependency on libnuma
+  unsigned long mask[4] = {0};
+  if ((size_t)node < 8 * sizeof(mask)) {
+    mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, p, length, MPOL_BIND, mask, 8 * sizeof(mask), 0);
+  }
+#else
+  (void)p;
+  (void)length;
+#endif // SYS_mbind
+}
+
+// Allocate bytes of VALLOC_ALIGN-aligned (page-aligned with VALLOC_PAGE)
+// memory. Mapped memory starts zeroed; heap memory does not. Returns NULL
+// with errno set on failure.
+void *vdot_alloc(size_t bytes, int flags) {
+  size_t align = flags & VALLOC_PAGE ? VALLOC_PAGE_SIZE : VALLOC_ALIGN;
+  // the header sits in the alignment gap in front of the returned pointer
+  size_t offset = align;
+  valloc_header_t h = {NULL, 0, bytes, offset};
+  if (bytes + offset < VALLOC_MAP_MIN && (flags & ~VALLOC_PAGE) == 0) {
+    if (posix_memalign(&h.base, align, offset + bytes) != 0) {
+      errno = ENOMEM;
+      return NULL;
+    }
+  } else {
+    size_t length = _valloc_round(offset + bytes, VALLOC_PAGE_SIZE);
+#ifdef MAP_HUGETLB
+    if (flags & VALLOC_HUGE) {
+      h.mapped = _valloc_round(offset + bytes, VALLOC_HUGE_PAGE_SIZE);
+      h.base = mmap(NULL, h.mapped, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (h.base == MAP_FAILED) {
+        // no reserved huge pages: transparent ones are the next best thing
+        h.base = NULL;
+        flags |= VALLOC_THP;
+      }
+    }
+#else
+    flags |= flags & VALLOC_HUGE ? VALLOC_THP : 0;
+#endif // MAP_HUGETLB
+    if (h.base == NULL && (flags & VALLOC_THP)) {
+      h.mapped = _valloc_round(length, VALLOC_HUGE_PAGE_SIZE);
+      h.base = _valloc_map_aligned(h.mapped, VALLOC_HUGE_PAGE_SIZE, 0);
+#ifdef MADV_HUGEPAGE
+      if (h.base != NULL) {
+        madvise(h.base, h.mapped, MADV_HUGEPAGE);
+      }
+#endif // MADV_HUGEPAGE
+    } else if (h.base == NULL) {
+      h.mapped = length;
+      h.base = _valloc_map_aligned(h.mapped, VALLOC_PAGE_SIZE, 0);
+    }
+    if (h.base == NULL) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    // before the first touch, so the pages are faulted in on the right node
+    _valloc_bind(h.base, h.mapped, flags);
+  }
+  char *p = (char *)h.base + offset;
+  memcpy(p - sizeof(h), &h, sizeof(h));
+  return p;
+}
+
+void vdot_free(void *p) {
+  if (p == NULL) {
+    return;
+  }
+  valloc_header_t h;
+  memcpy(&h, (char *)p - sizeof(h), sizeof(h));
+  if (h.mapped) {
+    munmap(h.base, h.mapped);
+  } else {
+    free(h.base);
+  }
+}
+
+/* Bump-pointer arena */
+
+// Short-lived buffers for one batch (scores, heaps, decoded rows) are carved
+// out of one vdot_alloc block and dropped together with vdot_arena_reset,
+// instead of going through malloc per buffer and per batch. Allocations are
+// VALLOC_ALIGN-aligned. An arena is not thread-safe; give each thread its own.
+typedef struct vdot_arena_t {
+  char *base;
+  size_t size;
+  size_t used;
+} vdot_arena_t;
+
+int vdot_arena_init(vdot_arena_t *arena, size_t bytes, int flags) {
+  arena->base = (char *)vdot_alloc(bytes, flags);
+  arena->size = arena->base ? bytes : 0;
+  arena->used = 0;
+  return arena->base ? 0 : -1;
+}
+
+// bytes from the arena, or NULL with errno = ENOMEM when it is full
+void *vdot_arena_alloc(vdot_arena_t *arena, size_t bytes) {
+  size_t start = _valloc_round(arena->used, VALLOC_ALIGN);
+  if (start > arena->size || bytes > arena->size - start) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  arena->used = start + bytes;
+  return arena->base + start;
+}
+
+// Drop everything allocated so far; arena->used can also be saved and
+// restored to drop only what came after a point
+void vdot_arena_reset(vdot_arena_t *arena) {
+  arena->used = 0;
+}
+
+void vdot_arena_destroy(vdot_arena_t *arena) {
+  vdot_free(arena->base);
+  arena->base = NULL;
+  arena->size = 0;
+  arena->used = 0;
+}
+
+#endif // VALLOC_H
@@ -0,0 +1,347 @@
+/* Fused attention of a query over an f16 / bf16 key-value cache */
+#ifndef VATTENTION_H
+#define VATTENTION_H
+
+#include "simdinfo.h"
+#include "vconvert.h"
+#include "vdot.h"
+#include "vsoftmax.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// out = softmax(scale * q . K^T) V, computed flash-attention style: keys are
+// scored a tile at a time, the softmax state is carried across tiles, and the
+// output accumulator is rescaled whenever the running max grows. Only one
+// tile of scores ever exists, and keys and values are read once, straight
+// from their 16-bit form.
+
+// Keys scored per tile; their scores and weights live on the stack
+#define VATTENTION_TILE 64
+
+/* Fallback scalar implementation */
+
+// acc += w * v, with v widened from 16 bits on the fly
+
+static inline void _vattention_axpy_f16_serial(float *acc, float w,
+                                               uint16_t *v, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    acc[i] += w * vconvert_f16_to_f32_scalar(v[i]);
+  }
+}
+
+static inline void _vattention_axpy_bf16_serial(float *acc, float w,
+                                                uint16_t *v, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    acc[i] += w * vconvert_bf16_to_f32_scalar(v[i]);
+  }
+}
+
+/* x86 */
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+#include <immintrin.h>
+
+#if defined(__F16C__)
+
+static inline void _vattention_axpy_f16_avx2(float *acc, float w, uint16_t *v,
+                                             size_t size) {
+  __m256 vw = _mm256_set1_ps(w);
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m256 x = _mm256_cvtph_ps(_mm_loadu_si128((__m128i *)(v + i)));
+    _mm256_storeu_ps(acc + i, _mm256_fmadd_ps(vw, x, _mm256_loadu_ps(acc + i)));
+  }
+  // left over
+  _vattention_axpy_f16_serial(acc + ssize, w, v + ssize, size - ssize);
+}
+
+#endif // __F16C__
+
+static inline void _vattention_axpy_bf16_avx2(float *acc, float w, uint16_t *v,
+                                              size_t size) {
+  __m256 vw = _mm256_set1_ps(w);
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m256 x = _vdot_bf16_load_avx2(v + i);
+    _mm256_storeu_ps(acc + i, _mm256_fmadd_ps(vw, x, _mm256_loadu_ps(acc + i)));
+  }
+  // left over
+  _vattention_axpy_bf16_serial(acc + ssize, w, v + ssize, size - ssize);
+}
+
+#endif // __AVX2__ && __FMA__
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+static inline void _vattention_axpy_f16_avx512f(float *acc, float w,
+                                                uint16_t *v, size_t size) {
+  __m512 vw = _mm512_set1_ps(w);
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    __m512 x = _mm512_cvtph_ps(_mm256_loadu_si256((__m256i *)(v + i)));
+    _mm512_storeu_ps(acc + i, _mm512_fmadd_ps(vw, x, _mm512_loadu_ps(acc + i)));
+  }
+  // left over
+  _vattention_axpy_f16_serial(acc + ssize, w, v + ssize, size - ssize);
+}
+
+static inline void _vattention_axpy_bf16_avx512f(float *acc, float w,
+                                                 uint16_t *v, size_t size) {
+  __m512 vw = _mm512_set1_ps(w);
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    __m512 x = _vdot_bf16_load_avx512f(v + i);
+    _mm512_storeu_ps(acc + i, _mm512_fmadd_ps(vw, x, _mm512_loadu_ps(acc + i)));
+  }
+  // left over
+  _vattention_axpy_bf16_serial(acc + ssize, w, v + ssize, size - ssize);
+}
+
+#endif // __AVX512F__
+
+/* ARM */
+
+#if defined(__ARM_FEATURE_SVE)
+
+#include <arm_sve.h>
+
+static inline void _vattention_axpy_f16_sve(float *acc, float w, uint16_t *v,
+                                            size_t size) {
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    svfloat16_t h = svreinterpret_f16_u32(svld1uh_u32(pg, v + i));
+    svfloat32_t x = svcvt_f32_f16_x(pg, h);
+    svst1_f32(pg, acc + i, svmla_n_f32_x(pg, svld1_f32(pg, acc + i), x, w));
+  }
+}
+
+static inline void _vattention_axpy_bf16_sve(float *acc, float w, uint16_t *v,
+                                             size_t size) {
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    svuint32_t b = svlsl_n_u32_x(pg, svld1uh_u32(pg, v + i), 16);
+    svfloat32_t x = svreinterpret_f32_u32(b);
+    svst1_f32(pg, acc + i, svmla_n_f32_x(pg, svld1_f32(pg, acc + i), x, w));
+  }
+}
+
+#endif // __ARM_FEATURE_SVE
+
+// float16x4_t conversions and vfmaq_n_f32 are A64 only
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static inline void _vattention_axpy_f16_neon(float *acc, float w, uint16_t *v,
+                                             size_t size) {
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    float16x8_t h = vreinterpretq_f16_u16(vld1q_u16(v + i));
+    vst1q_f32(acc + i, vfmaq_n_f32(vld1q_f32(acc + i),
+                                   vcvt_f32_f16(vget_low_f16(h)), w));
+    vst1q_f32(acc + i + 4,
+              vfmaq_n_f32(vld1q_f32(acc + i + 4), vcvt_high_f32_f16(h), w));
+  }
+  // left over
+  _vattention_axpy_f16_serial(acc + ssize, w, v + ssize, size - ssize);
+}
+
+static inline void _vattention_axpy_bf16_neon(float *acc, float w, uint16_t *v,
+                                              size_t size) {
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    uint16x8_t h = vld1q_u16(v + i);
+    float32x4_t lo = vreinterpretq_f32_u32(vshll_n_u16(vget_low_u16(h), 16));
+    float32x4_t hi = vreinterpretq_f32_u32(vshll_high_n_u16(h, 16));
+    vst1q_f32(acc + i, vfmaq_n_f32(vld1q_f32(acc + i), lo, w));
+    vst1q_f32(acc + i + 4, vfmaq_n_f32(vld1q_f32(acc + i + 4), hi, w));
+  }
+  // left over
+  _vattention_axpy_bf16_serial(acc + ssize, w, v + ssize, size - ssize);
+}
+
+#endif // __ARM_NEON && __aarch64__
+
+typedef void (*vattention_axpy_fn)(float *, float, uint16_t *, size_t);
+
+static inline vattention_axpy_fn _vattention_axpy_f16_dispatch(void) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    return _vattention_axpy_f16_avx512f;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__) && SIMDINFO_SUPPORTS(info, __FMA__) &&
+      SIMDINFO_SUPPORTS(info, __F16C__)) {
+    return _vattention_axpy_f16_avx2;
+  }
+#endif // __AVX2__ && __FMA__ && __F16C__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    return _vattention_axpy_f16_sve;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vattention_axpy_f16_neon;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  return _vattention_axpy_f16_serial;
+}
+
+static inline vattention_axpy_fn _vattention_axpy_bf16_dispatch(void) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    return _vattention_axpy_bf16_avx512f;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__) && defined(__FMA__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__) && SIMDINFO_SUPPORTS(info, __FMA__)) {
+    return _vattention_axpy_bf16_avx2;
+  }
+#endif // __AVX2__ && __FMA__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    return _vattention_axpy_bf16_sve;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vattention_axpy_bf16_neon;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  return _vattention_axpy_bf16_serial;
+}
+
+static inline float _vattention(float *q, uint16_t *k, uint16_t *v, size_t n,
+                                size_t dim, size_t k_stride, size_t v_stride,
+                                float scale, float *out, vdot_half_fn dot,
+                                vattention_axpy_fn axpy) {
+  float scores[VATTENTION_TILE];
+  vsoftmax_state_t state = VSOFTMAX_STATE_INIT;
+  memset(out, 0, dim * sizeof(float));
+  for (size_t t = 0; t < n; t += VATTENTION_TILE) {
+    size_t m = n - t < VATTENTION_TILE ? n - t : VATTENTION_TILE;
+    float tile_max = -INFINITY;
+    for (size_t j = 0; j < m; j++) {
+      scores[j] = scale * dot(q, k + (t + j) * k_stride, dim);
+      if (!(scores[j] < INFINITY)) {
+        // NaN, or +inf, whose weight exp(inf - inf) is NaN as in vsoftmax
+        for (size_t d = 0; d < dim; d++) {
+          out[d] = NAN;
+        }
+        return NAN;
+      }
+      tile_max = scores[j] > tile_max ? scores[j] : tile_max;
+    }
+    if (!(tile_max > state.max)) {
+      tile_max = state.max;
+    } else if (state.max > -INFINITY) {
+      // the running max grew: earlier weights shrink by exp(old - new)
+      float c = expf(state.max - tile_max);
+      for (size_t d = 0; d < dim; d++) {
+        out[d] *= c;
+      }
+      state.sum *= c;
+    }
+    if (tile_max == -INFINITY) {
+      // every key so far is masked out
+      continue;
+    }
+    state.max = tile_max;
+    // weights exp(s - max), with the dispatched softmax kernel doing the exp
+    vsoftmax_state_t unit = {tile_max, 1.0f};
+    vsoftmax_normalize_f32(&unit, scores, scores, m);
+    for (size_t j = 0; j < m; j++) {
+      if (scores[j] > 0.0f) {
+        axpy(out, scores[j], v + (t + j) * v_stride, dim);
+        state.sum += scores[j];
+      }
+    }
+  }
+  if (!(state.sum > 0.0f)) {
+    return -INFINITY;
+  }
+  float inv = 1.0f / state.sum;
+  for (size_t d = 0; d < dim; d++) {
+    out[d] *= inv;
+  }
+  return state.max + logf(state.sum);
+}
+
+// out = softmax(scale * q . k_i) weighted sum of v_i over n cached keys and
+// values of dim f16 values each (raw bit patterns), k_stride and v_stride
+// elements apart. Returns the log-sum-exp of the scaled scores, which
+// vattention_merge needs to combine results over parts of a cache; with no
+// usable key (n = 0, or every score -inf) out is zero and -inf is returned.
+// A NaN or +inf score makes out and the log-sum-exp NaN, and merging a NaN
+// part keeps them NaN.
+float vattention_f16(float *q, uint16_t *k, uint16_t *v, size_t n, size_t dim,
+                     size_t k_stride, size_t v_stride, float scale,
+                     float *out) {
+  return _vattention(q, k, v, n, dim, k_stride, v_stride, scale, out,
+                     _vdot_f16_f32_dispatch(), _vattention_axpy_f16_dispatch());
+}
+
+// vattention_f16 over a bf16 cache
+float vattention_bf16(float *q, uint16_t *k, uint16_t *v, size_t n,
+                      size_t dim, size_t k_stride, size_t v_stride,
+                      float scale, float *out) {
+  return _vattention(q, k, v, n, dim, k_stride, v_stride, scale, out,
+                     _vdot_bf16_f32_dispatch(),
+                     _vattention_axpy_bf16_dispatch());
+}
+
+// Fold the attention output part (log-sum-exp part_lse) computed over one
+// slice of a cache into out (log-sum-exp lse) computed over another, giving
+// the output over both. Returns the combined log-sum-exp.
+float vattention_merge(float *out, float lse, float *part, float part_lse,
+                       size_t dim) {
+  if (part_lse == -INFINITY) {
+    return lse;
+  }
+  if (lse == -INFINITY) {
+    memcpy(out, part, dim * sizeof(float));
+    return part_lse;
+  }
+  float m = lse > part_lse ? lse : part_lse;
+  float a = expf(lse - m), b = expf(part_lse - m);
+  float inv = 1.0f / (a + b);
+  for (size_t d = 0; d < dim; d++) {
+    out[d] = (a * out[d] + b * part[d]) * inv;
+  }
+  return m + logf(a + b);
+}
+
+#endif // VATTENTION_H
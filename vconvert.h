@@ -0,0 +1,913 @@
+/* Precision conversion and int8 quantization of float vectors */
+#ifndef VCONVERT_H
+#define VCONVERT_H
+
+#include "simdinfo.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// f16 and bf16 values are passed around as their raw uint16_t bit patterns so
+// that callers do not depend on compiler support for half precision types.
+
+/* Fallback scalar implementation */
+
+static inline uint32_t _vconvert_f32_bits(float f) {
+  uint32_t w;
+  memcpy(&w, &f, sizeof(w));
+  return w;
+}
+
+static inline float _vconvert_f32_from_bits(uint32_t w) {
+  float f;
+  memcpy(&f, &w, sizeof(f));
+  return f;
+}
+
+// Round to nearest even, with subnormals, infinities and NaN handled the way
+// vcvtps2ph does it
+// https://github.com/Maratyszcza/FP16/blob/master/include/fp16/fp16.h
+static inline uint16_t vconvert_f32_to_f16_scalar(float f) {
+  float base = (fabsf(f) * 0x1.0p+112f) * 0x1.0p-110f;
+  uint32_t w = _vconvert_f32_bits(f);
+  uint32_t shl1_w = w + w;
+  uint32_t sign = w & 0x80000000u;
+  uint32_t bias = shl1_w & 0xFF000000u;
+  if (bias < 0x71000000u) {
+    bias = 0x71000000u;
+  }
+  base = _vconvert_f32_from_bits((bias >> 1) + 0x07800000u) + base;
+  uint32_t bits = _vconvert_f32_bits(base);
+  uint32_t exp_bits = (bits >> 13) & 0x00007C00u;
+  uint32_t mantissa_bits = bits & 0x00000FFFu;
+  uint32_t nonsign = exp_bits + mantissa_bits;
+  return (uint16_t)((sign >> 16) | (shl1_w > 0xFF000000u ? 0x7E00u : nonsign));
+}
+
+static inline float vconvert_f16_to_f32_scalar(uint16_t h) {
+  uint32_t w = (uint32_t)h << 16;
+  uint32_t sign = w & 0x80000000u;
+  uint32_t two_w = w + w;
+  float normalized =
+      _vconvert_f32_from_bits((two_w >> 4) + (0xE0u << 23)) * 0x1.0p-112f;
+  float denormalized =
+      _vconvert_f32_from_bits((two_w >> 17) | (126u << 23)) - 0.5f;
+  uint32_t result = sign | (two_w < (1u << 27) ? _vconvert_f32_bits(denormalized)
+                                               : _vconvert_f32_bits(normalized));
+  return _vconvert_f32_from_bits(result);
+}
+
+static inline uint16_t vconvert_f32_to_bf16_scalar(float f) {
+  uint32_t w = _vconvert_f32_bits(f);
+  if ((w & 0x7FFFFFFFu) > 0x7F800000u) {
+    // keep NaN a (quiet) NaN instead of letting the rounding carry into inf
+    return (uint16_t)((w >> 16) | 0x0040u);
+  }
+  w += 0x7FFFu + ((w >> 16) & 1u);
+  return (uint16_t)(w >> 16);
+}
+
+static inline float vconvert_bf16_to_f32_scalar(uint16_t h) {
+  return _vconvert_f32_from_bits((uint32_t)h << 16);
+}
+
+static inline void _vconvert_f32_to_f16_serial(float *x, uint16_t *out,
+                                               size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    out[i] = vconvert_f32_to_f16_scalar(x[i]);
+  }
+}
+
+static inline void _vconvert_f16_to_f32_serial(uint16_t *x, float *out,
+                                               size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    out[i] = vconvert_f16_to_f32_scalar(x[i]);
+  }
+}
+
+static inline void _vconvert_f32_to_bf16_serial(float *x, uint16_t *out,
+                                                size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    out[i] = vconvert_f32_to_bf16_scalar(x[i]);
+  }
+}
+
+static inline void _vconvert_bf16_to_f32_serial(uint16_t *x, float *out,
+                                                size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    out[i] = vconvert_bf16_to_f32_scalar(x[i]);
+  }
+}
+
+// Quantization maps each group of values to int8 as x ~= scale * q + bias.
+// Symmetric groups have bias = 0 and scale = absmax / 127; asymmetric groups
+// center the [min, max] range, so bias = (max + min) / 2 and
+// scale = (max - min) / 254. A constant group gets scale = 0 and q = 0.
+// Codes stay in [-127, 127] in both modes, so quantized rows can be either
+// operand of vdot_i8, which does not accept -128 in b.
+enum vquantize_mode_t {
+  VQUANTIZE_SYMMETRIC = 0,
+  VQUANTIZE_ASYMMETRIC = 1,
+};
+
+static inline void _vquantize_params(float lo, float hi, int mode,
+                                     float *scale, float *bias) {
+  if (mode == VQUANTIZE_ASYMMETRIC) {
+    *scale = (hi - lo) / 254.0f;
+    *bias = 0.5f * (hi + lo);
+  } else {
+    float absmax = fmaxf(fabsf(lo), fabsf(hi));
+    *scale = absmax / 127.0f;
+    *bias = 0.0f;
+  }
+}
+
+static inline int8_t _vquantize_scalar(float v, float inv_scale, float bias) {
+  float q = nearbyintf((v - bias) * inv_scale);
+  q = q < -127.0f ? -127.0f : q > 127.0f ? 127.0f : q;
+  return (int8_t)q;
+}
+
+static inline void _vquantize_i8_f32_serial(float *x, size_t size, int mode,
+                                            int8_t *out, float *scale,
+                                            float *bias) {
+  float lo = x[0], hi = x[0];
+  for (size_t i = 1; i < size; i++) {
+    lo = x[i] < lo ? x[i] : lo;
+    hi = x[i] > hi ? x[i] : hi;
+  }
+  _vquantize_params(lo, hi, mode, scale, bias);
+  float inv = *scale > 0.0f ? 1.0f / *scale : 0.0f;
+  for (size_t i = 0; i < size; i++) {
+    out[i] = _vquantize_scalar(x[i], inv, *bias);
+  }
+}
+
+static inline void _vdequantize_i8_f32_serial(int8_t *q, size_t size,
+                                              float scale, float bias,
+                                              float *out) {
+  for (size_t i = 0; i < size; i++) {
+    out[i] = scale * (float)q[i] + bias;
+  }
+}
+
+#if defined(__F16C__)
+
+#include <immintrin.h>
+
+static inline void _vconvert_f32_to_f16_f16c(float *x, uint16_t *out,
+                                             size_t size) {
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(x + i),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    _mm_storeu_si128((__m128i *)(out + i), h);
+  }
+  // left over
+  _vconvert_f32_to_f16_serial(x + ssize, out + ssize, size - ssize);
+}
+
+static inline void _vconvert_f16_to_f32_f16c(uint16_t *x, float *out,
+                                             size_t size) {
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m128i h = _mm_loadu_si128((__m128i *)(x + i));
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(h));
+  }
+  // left over
+  _vconvert_f16_to_f32_serial(x + ssize, out + ssize, size - ssize);
+}
+
+#endif // __F16C__
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+// Same rounding as the scalar bf16 conversion, eight lanes at a time
+static inline __m256i _vconvert_bf16_round_avx2(__m256 v) {
+  __m256i w = _mm256_castps_si256(v);
+  __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(w, 16), _mm256_set1_epi32(1));
+  __m256i rounded = _mm256_add_epi32(w, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7FFF)));
+  __m256i quiet = _mm256_or_si256(w, _mm256_set1_epi32(0x00400000));
+  __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+  return _mm256_srli_epi32(_mm256_blendv_epi8(rounded, quiet, nan), 16);
+}
+
+static inline void _vconvert_f32_to_bf16_avx2(float *x, uint16_t *out,
+                                              size_t size) {
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    __m256i lo = _vconvert_bf16_round_avx2(_mm256_loadu_ps(x + i));
+    __m256i hi = _vconvert_bf16_round_avx2(_mm256_loadu_ps(x + i + 8));
+    // packus works within 128-bit lanes, so put the quadwords back in order
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi),
+                                              _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i *)(out + i), packed);
+  }
+  // left over
+  _vconvert_f32_to_bf16_serial(x + ssize, out + ssize, size - ssize);
+}
+
+static inline void _vconvert_bf16_to_f32_avx2(uint16_t *x, float *out,
+                                              size_t size) {
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m256i h = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)(x + i)));
+    _mm256_storeu_ps(out + i, _mm256_castsi256_ps(_mm256_slli_epi32(h, 16)));
+  }
+  // left over
+  _vconvert_bf16_to_f32_serial(x + ssize, out + ssize, size - ssize);
+}
+
+static inline void _vquantize_i8_f32_avx2(float *x, size_t size, int mode,
+                                          int8_t *out, float *scale,
+                                          float *bias) {
+  if (size < 8) {
+    _vquantize_i8_f32_serial(x, size, mode, out, scale, bias);
+    return;
+  }
+  size_t ssize = size - (size % 8);
+  __m256 vlo = _mm256_loadu_ps(x), vhi = vlo;
+  for (size_t i = 8; i < ssize; i += 8) {
+    __m256 v = _mm256_loadu_ps(x + i);
+    vlo = _mm256_min_ps(vlo, v);
+    vhi = _mm256_max_ps(vhi, v);
+  }
+  float lor[8], hir[8];
+  _mm256_storeu_ps(lor, vlo);
+  _mm256_storeu_ps(hir, vhi);
+  float lo = lor[0], hi = hir[0];
+  for (size_t j = 1; j < 8; j++) {
+    lo = lor[j] < lo ? lor[j] : lo;
+    hi = hir[j] > hi ? hir[j] : hi;
+  }
+  for (size_t i = ssize; i < size; i++) {
+    lo = x[i] < lo ? x[i] : lo;
+    hi = x[i] > hi ? x[i] : hi;
+  }
+  _vquantize_params(lo, hi, mode, scale, bias);
+  float inv = *scale > 0.0f ? 1.0f / *scale : 0.0f;
+  __m256 vinv = _mm256_set1_ps(inv);
+  __m256 vbias = _mm256_set1_ps(*bias);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m256 v = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), vbias), vinv);
+    // cvtps rounds to nearest even; both packs saturate, which with the max
+    // is the clamp
+    __m256i q = _mm256_max_epi32(_mm256_cvtps_epi32(v), _mm256_set1_epi32(-127));
+    __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q),
+                                  _mm256_extracti128_si256(q, 1));
+    _mm_storel_epi64((__m128i *)(out + i), _mm_packs_epi16(q16, q16));
+  }
+  // left over
+  for (size_t i = ssize; i < size; i++) {
+    out[i] = _vquantize_scalar(x[i], inv, *bias);
+  }
+}
+
+static inline void _vdequantize_i8_f32_avx2(int8_t *q, size_t size,
+                                            float scale, float bias,
+                                            float *out) {
+  __m256 vscale = _mm256_set1_ps(scale);
+  __m256 vbias = _mm256_set1_ps(bias);
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m256i v = _mm256_cvtepi8_epi32(_mm_loadl_epi64((__m128i *)(q + i)));
+    __m256 f = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(v), vscale), vbias);
+    _mm256_storeu_ps(out + i, f);
+  }
+  // left over
+  _vdequantize_i8_f32_serial(q + ssize, size - ssize, scale, bias, out + ssize);
+}
+
+#endif // __AVX2__
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+static inline void _vconvert_f32_to_f16_avx512f(float *x, uint16_t *out,
+                                                size_t size) {
+  for (size_t i = 0; i < size; i += 16) {
+    __mmask16 active = size - i >= 16 ? 0xffff : (__mmask16)((1u << (size - i)) - 1);
+    __m256i h = _mm512_cvtps_ph(_mm512_maskz_loadu_ps(active, x + i),
+                                _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    uint16_t tmp[16];
+    if (active == 0xffff) {
+      _mm256_storeu_si256((__m256i *)(out + i), h);
+    } else {
+      _mm256_storeu_si256((__m256i *)tmp, h);
+      memcpy(out + i, tmp, (size - i) * sizeof(uint16_t));
+    }
+  }
+}
+
+static inline void _vconvert_f16_to_f32_avx512f(uint16_t *x, float *out,
+                                                size_t size) {
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    __m256i h = _mm256_loadu_si256((__m256i *)(x + i));
+    _mm512_storeu_ps(out + i, _mm512_cvtph_ps(h));
+  }
+  // left over
+  _vconvert_f16_to_f32_serial(x + ssize, out + ssize, size - ssize);
+}
+
+static inline void _vconvert_f32_to_bf16_avx512f(float *x, uint16_t *out,
+                                                 size_t size) {
+  __m512i one = _mm512_set1_epi32(1);
+  __m512i half = _mm512_set1_epi32(0x7FFF);
+  __m512i quiet_bit = _mm512_set1_epi32(0x00400000);
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    __m512 v = _mm512_loadu_ps(x + i);
+    __m512i w = _mm512_castps_si512(v);
+    __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(w, 16), one);
+    __m512i rounded = _mm512_add_epi32(w, _mm512_add_epi32(lsb, half));
+    __mmask16 nan = _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q);
+    rounded = _mm512_mask_or_epi32(rounded, nan, w, quiet_bit);
+    _mm256_storeu_si256((__m256i *)(out + i),
+                        _mm512_cvtepi32_epi16(_mm512_srli_epi32(rounded, 16)));
+  }
+  // left over
+  _vconvert_f32_to_bf16_serial(x + ssize, out + ssize, size - ssize);
+}
+
+static inline void _vconvert_bf16_to_f32_avx512f(uint16_t *x, float *out,
+                                                 size_t size) {
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    __m512i h = _mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i *)(x + i)));
+    _mm512_storeu_ps(out + i, _mm512_castsi512_ps(_mm512_slli_epi32(h, 16)));
+  }
+  // left over
+  _vconvert_bf16_to_f32_serial(x + ssize, out + ssize, size - ssize);
+}
+
+static inline void _vquantize_i8_f32_avx512f(float *x, size_t size, int mode,
+                                             int8_t *out, float *scale,
+                                             float *bias) {
+  __m512 vlo = _mm512_set1_ps(x[0]), vhi = vlo;
+  for (size_t i = 0; i < size; i += 16) {
+    __mmask16 active = size - i >= 16 ? 0xffff : (__mmask16)((1u << (size - i)) - 1);
+    __m512 v = _mm512_mask_loadu_ps(vlo, active, x + i);
+    vlo = _mm512_min_ps(vlo, v);
+    v = _mm512_mask_loadu_ps(vhi, active, x + i);
+    vhi = _mm512_max_ps(vhi, v);
+  }
+  _vquantize_params(_mm512_reduce_min_ps(vlo), _mm512_reduce_max_ps(vhi), mode,
+                    scale, bias);
+  float inv = *scale > 0.0f ? 1.0f / *scale : 0.0f;
+  __m512 vinv = _mm512_set1_ps(inv);
+  __m512 vbias = _mm512_set1_ps(*bias);
+  for (size_t i = 0; i < size; i += 16) {
+    __mmask16 active = size - i >= 16 ? 0xffff : (__mmask16)((1u << (size - i)) - 1);
+    __m512 v = _mm512_sub_ps(_mm512_maskz_loadu_ps(active, x + i), vbias);
+    __m512i q = _mm512_max_epi32(_mm512_cvtps_epi32(_mm512_mul_ps(v, vinv)),
+                                 _mm512_set1_epi32(-127));
+    // vpmovsdb saturates the top at 127
+    _mm512_mask_cvtsepi32_storeu_epi8(out + i, active, q);
+  }
+}
+
+static inline void _vdequantize_i8_f32_avx512f(int8_t *q, size_t size,
+                                               float scale, float bias,
+                                               float *out) {
+  __m512 vscale = _mm512_set1_ps(scale);
+  __m512 vbias = _mm512_set1_ps(bias);
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    __m512i v = _mm512_cvtepi8_epi32(_mm_loadu_si128((__m128i *)(q + i)));
+    __m512 f = _mm512_add_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(v), vscale), vbias);
+    _mm512_storeu_ps(out + i, f);
+  }
+  // left over
+  _vdequantize_i8_f32_serial(q + ssize, size - ssize, scale, bias, out + ssize);
+}
+
+#endif // __AVX512F__
+
+#if defined(__AVX512BF16__) && defined(__AVX512F__)
+
+#include <immintrin.h>
+
+// vcvtne2ps2bf16 converts 32 floats per instruction with round to nearest
+// even. Like all AVX512-BF16 instructions it treats subnormal inputs as zero.
+static inline void _vconvert_f32_to_bf16_avx512bf16(float *x, uint16_t *out,
+                                                    size_t size) {
+  size_t ssize = size - (size % 32);
+  for (size_t i = 0; i < ssize; i += 32) {
+    __m512bh h = _mm512_cvtne2ps_pbh(_mm512_loadu_ps(x + i + 16),
+                                     _mm512_loadu_ps(x + i));
+    _mm512_storeu_si512((void *)(out + i), (__m512i)h);
+  }
+  // left over
+  _vconvert_f32_to_bf16_avx512f(x + ssize, out + ssize, size - ssize);
+}
+
+#endif // __AVX512BF16__ && __AVX512F__
+
+/* ARM */
+
+// float16x4_t conversions (fcvtn / fcvtl) and vcvtnq_s32_f32 are A64 only
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static inline void _vconvert_f32_to_f16_neon(float *x, uint16_t *out,
+                                             size_t size) {
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    float16x8_t h = vcvt_high_f16_f32(vcvt_f16_f32(vld1q_f32(x + i)),
+                                      vld1q_f32(x + i + 4));
+    vst1q_u16(out + i, vreinterpretq_u16_f16(h));
+  }
+  // left over
+  _vconvert_f32_to_f16_serial(x + ssize, out + ssize, size - ssize);
+}
+
+static inline void _vconvert_f16_to_f32_neon(uint16_t *x, float *out,
+                                             size_t size) {
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    float16x8_t h = vreinterpretq_f16_u16(vld1q_u16(x + i));
+    vst1q_f32(out + i, vcvt_f32_f16(vget_low_f16(h)));
+    vst1q_f32(out + i + 4, vcvt_high_f32_f16(h));
+  }
+  // left over
+  _vconvert_f16_to_f32_serial(x + ssize, out + ssize, size - ssize);
+}
+
+static inline uint16x4_t _vconvert_bf16_round_neon(float32x4_t v) {
+  uint32x4_t w = vreinterpretq_u32_f32(v);
+  uint32x4_t lsb = vandq_u32(vshrq_n_u32(w, 16), vdupq_n_u32(1));
+  uint32x4_t rounded = vaddq_u32(w, vaddq_u32(lsb, vdupq_n_u32(0x7FFF)));
+  uint32x4_t quiet = vorrq_u32(w, vdupq_n_u32(0x00400000));
+  uint32x4_t number = vceqq_f32(v, v);
+  return vshrn_n_u32(vbslq_u32(number, rounded, quiet), 16);
+}
+
+static inline void _vconvert_f32_to_bf16_neon(float *x, uint16_t *out,
+                                              size_t size) {
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    uint16x4_t lo = _vconvert_bf16_round_neon(vld1q_f32(x + i));
+    uint16x4_t hi = _vconvert_bf16_round_neon(vld1q_f32(x + i + 4));
+    vst1q_u16(out + i, vcombine_u16(lo, hi));
+  }
+  // left over
+  _vconvert_f32_to_bf16_serial(x + ssize, out + ssize, size - ssize);
+}
+
+static inline void _vconvert_bf16_to_f32_neon(uint16_t *x, float *out,
+                                              size_t size) {
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    uint16x8_t h = vld1q_u16(x + i);
+    vst1q_f32(out + i, vreinterpretq_f32_u32(vshll_n_u16(vget_low_u16(h), 16)));
+    vst1q_f32(out + i + 4, vreinterpretq_f32_u32(vshll_high_n_u16(h, 16)));
+  }
+  // left over
+  _vconvert_bf16_to_f32_serial(x + ssize, out + ssize, size - ssize);
+}
+
+static inline void _vquantize_i8_f32_neon(float *x, size_t size, int mode,
+                                          int8_t *out, float *scale,
+                                          float *bias) {
+  if (size < 8) {
+    _vquantize_i8_f32_serial(x, size, mode, out, scale, bias);
+    return;
+  }
+  size_t ssize = size - (size % 8);
+  float32x4_t vlo = vminq_f32(vld1q_f32(x), vld1q_f32(x + 4));
+  float32x4_t vhi = vmaxq_f32(vld1q_f32(x), vld1q_f32(x + 4));
+  for (size_t i = 8; i < ssize; i += 4) {
+    float32x4_t v = vld1q_f32(x + i);
+    vlo = vminq_f32(vlo, v);
+    vhi = vmaxq_f32(vhi, v);
+  }
+  float lo = vminvq_f32(vlo), hi = vmaxvq_f32(vhi);
+  for (size_t i = ssize; i < size; i++) {
+    lo = x[i] < lo ? x[i] : lo;
+    hi = x[i] > hi ? x[i] : hi;
+  }
+  _vquantize_params(lo, hi, mode, scale, bias);
+  float inv = *scale > 0.0f ? 1.0f / *scale : 0.0f;
+  float32x4_t vbias = vdupq_n_f32(*bias);
+  for (size_t i = 0; i < ssize; i += 8) {
+    float32x4_t a = vmulq_n_f32(vsubq_f32(vld1q_f32(x + i), vbias), inv);
+    float32x4_t b = vmulq_n_f32(vsubq_f32(vld1q_f32(x + i + 4), vbias), inv);
+    // vqmovn saturates, which with the max is the clamp
+    int32x4_t floor = vdupq_n_s32(-127);
+    int16x8_t q16 =
+        vcombine_s16(vqmovn_s32(vmaxq_s32(vcvtnq_s32_f32(a), floor)),
+                     vqmovn_s32(vmaxq_s32(vcvtnq_s32_f32(b), floor)));
+    vst1_s8(out + i, vqmovn_s16(q16));
+  }
+  // left over
+  for (size_t i = ssize; i < size; i++) {
+    out[i] = _vquantize_scalar(x[i], inv, *bias);
+  }
+}
+
+static inline void _vdequantize_i8_f32_neon(int8_t *q, size_t size,
+                                            float scale, float bias,
+                                            float *out) {
+  float32x4_t vbias = vdupq_n_f32(bias);
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    int16x8_t v = vmovl_s8(vld1_s8(q + i));
+    float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(v)));
+    float32x4_t hi = vcvtq_f32_s32(vmovl_high_s16(v));
+    vst1q_f32(out + i, vaddq_f32(vmulq_n_f32(lo, scale), vbias));
+    vst1q_f32(out + i + 4, vaddq_f32(vmulq_n_f32(hi, scale), vbias));
+  }
+  // left over
+  _vdequantize_i8_f32_serial(q + ssize, size - ssize, scale, bias, out + ssize);
+}
+
+#endif // __ARM_NEON && __aarch64__
+
+void vconvert_f32_to_f16(float *x, uint16_t *out, size_t size) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vconvert_f32_to_f16_avx512f(x, out, size);
+    return;
+  }
+#endif // __AVX512F__
+#if defined(__F16C__)
+  if (SIMDINFO_SUPPORTS(info, __F16C__)) {
+    _vconvert_f32_to_f16_f16c(x, out, size);
+    return;
+  }
+#endif // __F16C__
+
+// ARM
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    _vconvert_f32_to_f16_neon(x, out, size);
+    return;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  _vconvert_f32_to_f16_serial(x, out, size);
+}
+
+void vconvert_f16_to_f32(uint16_t *x, float *out, size_t size) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vconvert_f16_to_f32_avx512f(x, out, size);
+    return;
+  }
+#endif // __AVX512F__
+#if defined(__F16C__)
+  if (SIMDINFO_SUPPORTS(info, __F16C__)) {
+    _vconvert_f16_to_f32_f16c(x, out, size);
+    return;
+  }
+#endif // __F16C__
+
+// ARM
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    _vconvert_f16_to_f32_neon(x, out, size);
+    return;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  _vconvert_f16_to_f32_serial(x, out, size);
+}
+
+void vconvert_f32_to_bf16(float *x, uint16_t *out, size_t size) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512BF16__) && defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512BF16__) &&
+      SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vconvert_f32_to_bf16_avx512bf16(x, out, size);
+    return;
+  }
+#endif // __AVX512BF16__ && __AVX512F__
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vconvert_f32_to_bf16_avx512f(x, out, size);
+    return;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    _vconvert_f32_to_bf16_avx2(x, out, size);
+    return;
+  }
+#endif // __AVX2__
+
+// ARM
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    _vconvert_f32_to_bf16_neon(x, out, size);
+    return;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  _vconvert_f32_to_bf16_serial(x, out, size);
+}
+
+void vconvert_bf16_to_f32(uint16_t *x, float *out, size_t size) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vconvert_bf16_to_f32_avx512f(x, out, size);
+    return;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    _vconvert_bf16_to_f32_avx2(x, out, size);
+    return;
+  }
+#endif // __AVX2__
+
+// ARM
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    _vconvert_bf16_to_f32_neon(x, out, size);
+    return;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  _vconvert_bf16_to_f32_serial(x, out, size);
+}
+
+// out[i] = scale * q[i] + bias
+void vdequantize_i8_f32(int8_t *q, size_t size, float scale, float bias,
+                        float *out) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vdequantize_i8_f32_avx512f(q, size, scale, bias, out);
+    return;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    _vdequantize_i8_f32_avx2(q, size, scale, bias, out);
+    return;
+  }
+#endif // __AVX2__
+
+// ARM
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    _vdequantize_i8_f32_neon(q, size, scale, bias, out);
+    return;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  _vdequantize_i8_f32_serial(q, size, scale, bias, out);
+}
+
+// Quantize one group of values to int8, returning its scale and bias. The
+// range is computed and applied in one visit, while the group is in cache.
+void vquantize_i8_f32_group(float *x, size_t size, int mode, int8_t *out,
+                            float *scale, float *bias) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+  if (size == 0) {
+    // an empty group has no range
+    *scale = 0.0f;
+    *bias = 0.0f;
+    return;
+  }
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vquantize_i8_f32_avx512f(x, size, mode, out, scale, bias);
+    return;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    _vquantize_i8_f32_avx2(x, size, mode, out, scale, bias);
+    return;
+  }
+#endif // __AVX2__
+
+// ARM
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    _vquantize_i8_f32_neon(x, size, mode, out, scale, bias);
+    return;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  _vquantize_i8_f32_serial(x, size, mode, out, scale, bias);
+}
+
+// Quantize `rows` rows of `dim` floats to int8 with one (scale, bias) pair per
+// `group` consecutive values of a row; group = 0 or dim gives per-row scales.
+// scales (and biases, which may be NULL in symmetric mode) need
+// rows * ceil(dim / group) entries.
+void vquantize_i8_f32(float *x, size_t rows, size_t dim, size_t group,
+                      int mode, int8_t *out, float *scales, float *biases) {
+  if (dim == 0) {
+    return;
+  }
+  if (group == 0 || group > dim) {
+    group = dim;
+  }
+  size_t groups = (dim + group - 1) / group;
+  for (size_t r = 0; r < rows; r++) {
+    for (size_t g = 0; g < groups; g++) {
+      size_t start = g * group;
+      size_t n = dim - start < group ? dim - start : group;
+      float bias;
+      vquantize_i8_f32_group(x + r * dim + start, n, mode,
+                             out + r * dim + start, &scales[r * groups + g],
+                             &bias);
+      if (biases != NULL) {
+        biases[r * groups + g] = bias;
+      }
+    }
+  }
+}
+
+/* Binary (sign bit) vectors */
+
+// A binary vector packs one bit per value, set when the value is > 0: bit
+// i % 8 of byte i / 8. Bits past the end of the last byte are zero, so two
+// packed vectors can be compared byte for byte.
+
+static inline void _vconvert_f32_to_b1_serial(float *x, uint8_t *out,
+                                              size_t size) {
+  memset(out, 0, (size + 7) / 8);
+  for (size_t i = 0; i < size; i++) {
+    out[i / 8] |= (uint8_t)((x[i] > 0.0f) << (i % 8));
+  }
+}
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+static inline void _vconvert_f32_to_b1_avx2(float *x, uint8_t *out,
+                                            size_t size) {
+  size_t ssize = size - (size % 8);
+  __m256 zero = _mm256_setzero_ps();
+  for (size_t i = 0; i < ssize; i += 8) {
+    // one movemask is exactly one output byte
+    out[i / 8] = (uint8_t)_mm256_movemask_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(x + i), zero, _CMP_GT_OQ));
+  }
+  // left over
+  if (ssize < size) {
+    _vconvert_f32_to_b1_serial(x + ssize, out + ssize / 8, size - ssize);
+  }
+}
+
+#endif // __AVX2__
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+static inline void _vconvert_f32_to_b1_avx512f(float *x, uint8_t *out,
+                                               size_t size) {
+  size_t ssize = size - (size % 16);
+  __m512 zero = _mm512_setzero_ps();
+  for (size_t i = 0; i < ssize; i += 16) {
+    uint16_t bits = (uint16_t)_mm512_cmp_ps_mask(_mm512_loadu_ps(x + i), zero,
+                                                 _CMP_GT_OQ);
+    memcpy(out + i / 8, &bits, 2);
+  }
+  // left over
+  if (ssize < size) {
+    _vconvert_f32_to_b1_serial(x + ssize, out + ssize / 8, size - ssize);
+  }
+}
+
+#endif // __AVX512F__
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static inline void _vconvert_f32_to_b1_neon(float *x, uint8_t *out,
+                                            size_t size) {
+  size_t ssize = size - (size % 8);
+  const uint32_t w[4] = {1, 2, 4, 8};
+  uint32x4_t lo_bits = vld1q_u32(w);
+  uint32x4_t hi_bits = vshlq_n_u32(lo_bits, 4);
+  float32x4_t zero = vdupq_n_f32(0.0f);
+  for (size_t i = 0; i < ssize; i += 8) {
+    // NEON has no movemask: weight each lane's bit and add across
+    uint32x4_t lo = vandq_u32(vcgtq_f32(vld1q_f32(x + i), zero), lo_bits);
+    uint32x4_t hi = vandq_u32(vcgtq_f32(vld1q_f32(x + i + 4), zero), hi_bits);
+    out[i / 8] = (uint8_t)vaddvq_u32(vorrq_u32(lo, hi));
+  }
+  // left over
+  if (ssize < size) {
+    _vconvert_f32_to_b1_serial(x + ssize, out + ssize / 8, size - ssize);
+  }
+}
+
+#endif // __ARM_NEON && __aarch64__
+
+// Pack the signs of size floats into (size + 7) / 8 bytes
+void vconvert_f32_to_b1(float *x, uint8_t *out, size_t size) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vconvert_f32_to_b1_avx512f(x, out, size);
+    return;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    _vconvert_f32_to_b1_avx2(x, out, size);
+    return;
+  }
+#endif // __AVX2__
+
+// ARM
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    _vconvert_f32_to_b1_neon(x, out, size);
+    return;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  _vconvert_f32_to_b1_serial(x, out, size);
+}
+
+// Unpack a binary vector to +1 / -1 floats. Only used to decode stores, so
+// there is no vector path.
+void vconvert_b1_to_f32(uint8_t *x, float *out, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    out[i] = (x[i / 8] >> (i % 8)) & 1 ? 1.0f : -1.0f;
+  }
+}
+
+#endif // VCONVERT_H
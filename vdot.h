@@ -3,17 +3,21 @@
 #define VDOT_H
 
 #include "simdinfo.h"
+#include "vconvert.h"
+#include <stdint.h>
 #include <stdlib.h>
 
 /* Fallback scalar implementation */
 
-// static inline float _vdot_f32_scalar(float *a, float *b, size_t size) {
-//   float sum = 0.0;
-//   for (size_t i = 0; i < size; i++) {
-//     sum += a[i] * b[i];
-//   }
-//   return sum;
-// }
+// Uncompensated, for the compensated kernels to fall back on when the
+// compensation breaks down
+static inline float _vdot_f32_scalar(float *a, float *b, size_t size) {
+  float sum = 0.0;
+  for (size_t i = 0; i < size; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
 
 static inline float _vdot_f32_serial(float *a, float *b, size_t size) {
   // Use Kahan summation algorithm to reduce floating point errors
@@ -26,7 +30,9 @@ static inline float _vdot_f32_serial(float *a, float *b, size_t size) {
     c = (t - sum) - y;
     sum = t;
   }
-  return sum;
+  // Once the sum reaches an infinity the compensation is inf - inf = NaN;
+  // the plain sum has the IEEE result (inf, or NaN for inf - inf)
+  return isnan(sum) ? _vdot_f32_scalar(a, b, size) : sum;
 }
 
 #if defined(__AVX__) || defined(__AVX2__)
@@ -80,7 +86,8 @@ static inline float _vdot_f32_avx(float *a, float *b, size_t size) {
     c = (t - x) - y;
     x = t;
   }
-  return x;
+  // the compensation turns an infinite sum into NaN
+  return isnan(x) ? _vdot_f32_scalar(a, b, size) : x;
 }
 
 #endif // __AVX__ || __AVX2__
@@ -92,22 +99,22 @@ static inline float _vdot_f32_avx(float *a, float *b, size_t size) {
 static inline float vdot_avx512f(float *a, float *b, size_t size) {
   __m512 va, vb, vsum = _mm512_setzero_ps();
 
-  size_t i;
-  for (i = 0; i < size; i += 16) {
-    va = _mm512_load_ps(&a[i]);
-    vb = _mm512_load_ps(&b[i]);
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    va = _mm512_loadu_ps(&a[i]);
+    vb = _mm512_loadu_ps(&b[i]);
     vsum = _mm512_fmadd_ps(va, vb, vsum);
   }
 
-  float sum[8];
-  _mm512_storeu_ps(sum, vsum);
-
-  float dot_product = 0.0f;
-  for (i = 0; i < 8; i++) {
-    dot_product += sum[i];
+  // left over, masked so nothing past the end is read
+  if (ssize < size) {
+    __mmask16 tail = (__mmask16)((1u << (size - ssize)) - 1);
+    va = _mm512_maskz_loadu_ps(tail, &a[ssize]);
+    vb = _mm512_maskz_loadu_ps(tail, &b[ssize]);
+    vsum = _mm512_fmadd_ps(va, vb, vsum);
   }
 
-  return dot_product;
+  return _mm512_reduce_add_ps(vsum);
 }
 
 #endif // __AVX512F__
@@ -202,7 +209,8 @@ static inline float _vdot_f32_neon(float *a, float *b, size_t size) {
     c = (t - x) - y;
     x = t;
   }
-  return x;
+  // the compensation turns an infinite sum into NaN
+  return isnan(x) ? _vdot_f32_scalar(a, b, size) : x;
 }
 
 #endif // __ARM_NEON
@@ -245,4 +253,639 @@ float vdot_f32(float *a, float *b, size_t size) {
   return _vdot_f32_serial(a, b, size);
 }
 
+/* Batched dot products */
+
+// The batch kernels score one query against four rows at a time, so each
+// query load feeds four FMAs. They use plain (uncompensated) accumulation.
+
+static inline void _vdot_batch4_f32_serial(float *q, float *r0, float *r1,
+                                           float *r2, float *r3, size_t size,
+                                           float *out) {
+  float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+  for (size_t i = 0; i < size; i++) {
+    s0 += q[i] * r0[i];
+    s1 += q[i] * r1[i];
+    s2 += q[i] * r2[i];
+    s3 += q[i] * r3[i];
+  }
+  out[0] = s0;
+  out[1] = s1;
+  out[2] = s2;
+  out[3] = s3;
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+#include <immintrin.h>
+
+static inline float _vdot_hsum_avx(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+static inline void _vdot_batch4_f32_avx2(float *q, float *r0, float *r1,
+                                         float *r2, float *r3, size_t size,
+                                         float *out) {
+  __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+  __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m256 vq = _mm256_loadu_ps(q + i);
+    s0 = _mm256_fmadd_ps(vq, _mm256_loadu_ps(r0 + i), s0);
+    s1 = _mm256_fmadd_ps(vq, _mm256_loadu_ps(r1 + i), s1);
+    s2 = _mm256_fmadd_ps(vq, _mm256_loadu_ps(r2 + i), s2);
+    s3 = _mm256_fmadd_ps(vq, _mm256_loadu_ps(r3 + i), s3);
+  }
+  float tail[4];
+  // left over
+  _vdot_batch4_f32_serial(q + ssize, r0 + ssize, r1 + ssize, r2 + ssize,
+                          r3 + ssize, size - ssize, tail);
+  out[0] = _vdot_hsum_avx(s0) + tail[0];
+  out[1] = _vdot_hsum_avx(s1) + tail[1];
+  out[2] = _vdot_hsum_avx(s2) + tail[2];
+  out[3] = _vdot_hsum_avx(s3) + tail[3];
+}
+
+#endif // __AVX2__ && __FMA__
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+static inline void _vdot_batch4_f32_avx512f(float *q, float *r0, float *r1,
+                                            float *r2, float *r3, size_t size,
+                                            float *out) {
+  __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+  __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+  for (size_t i = 0; i < size; i += 16) {
+    __mmask16 active = size - i >= 16 ? 0xffff : (__mmask16)((1u << (size - i)) - 1);
+    __m512 vq = _mm512_maskz_loadu_ps(active, q + i);
+    s0 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(active, r0 + i), s0);
+    s1 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(active, r1 + i), s1);
+    s2 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(active, r2 + i), s2);
+    s3 = _mm512_fmadd_ps(vq, _mm512_maskz_loadu_ps(active, r3 + i), s3);
+  }
+  out[0] = _mm512_reduce_add_ps(s0);
+  out[1] = _mm512_reduce_add_ps(s1);
+  out[2] = _mm512_reduce_add_ps(s2);
+  out[3] = _mm512_reduce_add_ps(s3);
+}
+
+#endif // __AVX512F__
+
+#if defined(__ARM_FEATURE_SVE)
+
+#include <arm_sve.h>
+
+static inline void _vdot_batch4_f32_sve(float *q, float *r0, float *r1,
+                                        float *r2, float *r3, size_t size,
+                                        float *out) {
+  svfloat32_t s0 = svdup_f32(0.0f), s1 = svdup_f32(0.0f);
+  svfloat32_t s2 = svdup_f32(0.0f), s3 = svdup_f32(0.0f);
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    svfloat32_t vq = svld1_f32(pg, &q[i]);
+    s0 = svmla_f32_m(pg, s0, vq, svld1_f32(pg, &r0[i]));
+    s1 = svmla_f32_m(pg, s1, vq, svld1_f32(pg, &r1[i]));
+    s2 = svmla_f32_m(pg, s2, vq, svld1_f32(pg, &r2[i]));
+    s3 = svmla_f32_m(pg, s3, vq, svld1_f32(pg, &r3[i]));
+  }
+  out[0] = svaddv_f32(svptrue_b32(), s0);
+  out[1] = svaddv_f32(svptrue_b32(), s1);
+  out[2] = svaddv_f32(svptrue_b32(), s2);
+  out[3] = svaddv_f32(svptrue_b32(), s3);
+}
+
+#endif // __ARM_FEATURE_SVE
+
+// vaddvq_f32 and vfmaq_f32 are A64 only
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static inline void _vdot_batch4_f32_neon(float *q, float *r0, float *r1,
+                                         float *r2, float *r3, size_t size,
+                                         float *out) {
+  float32x4_t s0 = vdupq_n_f32(0), s1 = vdupq_n_f32(0);
+  float32x4_t s2 = vdupq_n_f32(0), s3 = vdupq_n_f32(0);
+  size_t ssize = size - (size % 4);
+  for (size_t i = 0; i < ssize; i += 4) {
+    float32x4_t vq = vld1q_f32(q + i);
+    s0 = vfmaq_f32(s0, vq, vld1q_f32(r0 + i));
+    s1 = vfmaq_f32(s1, vq, vld1q_f32(r1 + i));
+    s2 = vfmaq_f32(s2, vq, vld1q_f32(r2 + i));
+    s3 = vfmaq_f32(s3, vq, vld1q_f32(r3 + i));
+  }
+  float tail[4];
+  // left over
+  _vdot_batch4_f32_serial(q + ssize, r0 + ssize, r1 + ssize, r2 + ssize,
+                          r3 + ssize, size - ssize, tail);
+  out[0] = vaddvq_f32(s0) + tail[0];
+  out[1] = vaddvq_f32(s1) + tail[1];
+  out[2] = vaddvq_f32(s2) + tail[2];
+  out[3] = vaddvq_f32(s3) + tail[3];
+}
+
+#endif // __ARM_NEON && __aarch64__
+
+typedef void (*vdot_batch4_f32_fn)(float *, float *, float *, float *,
+                                   float *, size_t, float *);
+
+// Pick the four-row kernel once per batch instead of once per group
+static inline vdot_batch4_f32_fn _vdot_batch4_f32_dispatch(void) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    return _vdot_batch4_f32_avx512f;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__) && defined(__FMA__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__) && SIMDINFO_SUPPORTS(info, __FMA__)) {
+    return _vdot_batch4_f32_avx2;
+  }
+#endif // __AVX2__ && __FMA__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    return _vdot_batch4_f32_sve;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vdot_batch4_f32_neon;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  return _vdot_batch4_f32_serial;
+}
+
+// out[i] = query . rows[i] for n rows of size floats, stride floats apart
+void vdot_batch_f32(float *query, float *rows, size_t n, size_t size,
+                    size_t stride, float *out) {
+  vdot_batch4_f32_fn kernel = _vdot_batch4_f32_dispatch();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float *r = rows + i * stride;
+    kernel(query, r, r + stride, r + 2 * stride, r + 3 * stride, size, out + i);
+  }
+  // left over rows: repeat the last one to fill the group of four
+  if (i < n) {
+    float *r[4];
+    float tail[4];
+    for (size_t j = 0; j < 4; j++) {
+      r[j] = rows + (i + j < n ? i + j : n - 1) * stride;
+    }
+    kernel(query, r[0], r[1], r[2], r[3], size, tail);
+    for (size_t j = 0; i + j < n; j++) {
+      out[i + j] = tail[j];
+    }
+  }
+}
+
+/* int8 dot products */
+
+// The int8 kernels accumulate exactly in 32 bits. a may hold any int8 value;
+// b must stay within [-127, 127], as symmetric quantization produces, so the
+// x86 kernels can move b's sign onto a without overflow.
+
+static inline int32_t _vdot_i8_serial(int8_t *a, int8_t *b, size_t size) {
+  int32_t sum = 0;
+  for (size_t i = 0; i < size; i++) {
+    sum += (int32_t)a[i] * (int32_t)b[i];
+  }
+  return sum;
+}
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+static inline int32_t _vdot_i8_avx2(int8_t *a, int8_t *b, size_t size) {
+  __m256i ones = _mm256_set1_epi16(1);
+  __m256i vsum = _mm256_setzero_si256();
+  size_t ssize = size - (size % 32);
+  for (size_t i = 0; i < ssize; i += 32) {
+    __m256i va = _mm256_loadu_si256((__m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((__m256i *)(b + i));
+    // maddubs multiplies unsigned by signed bytes: use |a| and move a's sign
+    // onto b. |a| <= 128 and |b| <= 127 keep the pair sums within int16.
+    __m256i p = _mm256_maddubs_epi16(_mm256_abs_epi8(va),
+                                     _mm256_sign_epi8(vb, va));
+    vsum = _mm256_add_epi32(vsum, _mm256_madd_epi16(p, ones));
+  }
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(vsum),
+                            _mm256_extracti128_si256(vsum, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  // left over
+  return _mm_cvtsi128_si32(s) + _vdot_i8_serial(a + ssize, b + ssize, size - ssize);
+}
+
+#endif // __AVX2__
+
+#if defined(__AVX512BW__)
+
+#include <immintrin.h>
+
+static inline int32_t _vdot_i8_avx512bw(int8_t *a, int8_t *b, size_t size) {
+  __m512i ones = _mm512_set1_epi16(1);
+  __m512i zero = _mm512_setzero_si512();
+  __m512i vsum = _mm512_setzero_si512();
+  for (size_t i = 0; i < size; i += 64) {
+    __mmask64 active = size - i >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << (size - i)) - 1;
+    __m512i va = _mm512_maskz_loadu_epi8(active, a + i);
+    __m512i vb = _mm512_maskz_loadu_epi8(active, b + i);
+    // no vpsignb in AVX-512: negate b where a is negative
+    __m512i sb = _mm512_mask_sub_epi8(vb, _mm512_movepi8_mask(va), zero, vb);
+    __m512i p = _mm512_maddubs_epi16(_mm512_abs_epi8(va), sb);
+    vsum = _mm512_add_epi32(vsum, _mm512_madd_epi16(p, ones));
+  }
+  return _mm512_reduce_add_epi32(vsum);
+}
+
+#endif // __AVX512BW__
+
+#if defined(__ARM_FEATURE_SVE)
+
+#include <arm_sve.h>
+
+static inline int32_t _vdot_i8_sve(int8_t *a, int8_t *b, size_t size) {
+  svint32_t vsum = svdup_s32(0);
+  for (size_t i = 0; i < size; i += svcntb()) {
+    svbool_t pg = svwhilelt_b8(i, size);
+    // inactive lanes load as zero and add nothing
+    vsum = svdot_s32(vsum, svld1_s8(pg, a + i), svld1_s8(pg, b + i));
+  }
+  return (int32_t)svaddv_s32(svptrue_b32(), vsum);
+}
+
+#endif // __ARM_FEATURE_SVE
+
+// vaddvq_s32 is A64 only
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static inline int32_t _vdot_i8_neon(int8_t *a, int8_t *b, size_t size) {
+  int32x4_t vsum = vdupq_n_s32(0);
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    int8x16_t va = vld1q_s8(a + i);
+    int8x16_t vb = vld1q_s8(b + i);
+    vsum = vpadalq_s16(vsum, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+    vsum = vpadalq_s16(vsum, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+  }
+  // left over
+  return vaddvq_s32(vsum) + _vdot_i8_serial(a + ssize, b + ssize, size - ssize);
+}
+
+#endif // __ARM_NEON && __aarch64__
+
+typedef int32_t (*vdot_i8_fn)(int8_t *, int8_t *, size_t);
+
+// Pick the int8 kernel once per scan instead of once per row
+static inline vdot_i8_fn _vdot_i8_dispatch(void) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512BW__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512BW__)) {
+    return _vdot_i8_avx512bw;
+  }
+#endif // __AVX512BW__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    return _vdot_i8_avx2;
+  }
+#endif // __AVX2__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    return _vdot_i8_sve;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vdot_i8_neon;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  return _vdot_i8_serial;
+}
+
+// Exact dot product of two int8 vectors; b must not contain -128
+int32_t vdot_i8(int8_t *a, int8_t *b, size_t size) {
+  return _vdot_i8_dispatch()(a, b, size);
+}
+
+/* Half-precision dot products */
+
+// An f32 vector against a vector of raw f16 or bf16 bit patterns, as held by
+// key caches and f16 / bf16 stores. The 16-bit side is widened in registers,
+// so neither operand is converted in memory. Accumulation is plain FMA.
+
+static inline float _vdot_f16_f32_serial(float *a, uint16_t *b, size_t size) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < size; i++) {
+    sum += a[i] * vconvert_f16_to_f32_scalar(b[i]);
+  }
+  return sum;
+}
+
+static inline float _vdot_bf16_f32_serial(float *a, uint16_t *b, size_t size) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < size; i++) {
+    sum += a[i] * vconvert_bf16_to_f32_scalar(b[i]);
+  }
+  return sum;
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+#include <immintrin.h>
+
+#if defined(__F16C__)
+
+static inline float _vdot_f16_f32_avx2(float *a, uint16_t *b, size_t size) {
+  __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    __m256 b0 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i *)(b + i)));
+    __m256 b1 = _mm256_cvtph_ps(_mm_loadu_si128((__m128i *)(b + i + 8)));
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), b0, s0);
+    s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), b1, s1);
+  }
+  // left over
+  return _vdot_hsum_avx(_mm256_add_ps(s0, s1)) +
+         _vdot_f16_f32_serial(a + ssize, b + ssize, size - ssize);
+}
+
+#endif // __F16C__
+
+static inline __m256 _vdot_bf16_load_avx2(uint16_t *b) {
+  __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)b));
+  return _mm256_castsi256_ps(_mm256_slli_epi32(w, 16));
+}
+
+static inline float _vdot_bf16_f32_avx2(float *a, uint16_t *b, size_t size) {
+  __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _vdot_bf16_load_avx2(b + i), s0);
+    s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8),
+                         _vdot_bf16_load_avx2(b + i + 8), s1);
+  }
+  // left over
+  return _vdot_hsum_avx(_mm256_add_ps(s0, s1)) +
+         _vdot_bf16_f32_serial(a + ssize, b + ssize, size - ssize);
+}
+
+#endif // __AVX2__ && __FMA__
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+// Masked 16-bit loads need AVX512BW, so the tails are left to the serial code
+
+static inline float _vdot_f16_f32_avx512f(float *a, uint16_t *b, size_t size) {
+  __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+  size_t ssize = size - (size % 32);
+  for (size_t i = 0; i < ssize; i += 32) {
+    __m512 b0 = _mm512_cvtph_ps(_mm256_loadu_si256((__m256i *)(b + i)));
+    __m512 b1 = _mm512_cvtph_ps(_mm256_loadu_si256((__m256i *)(b + i + 16)));
+    s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), b0, s0);
+    s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), b1, s1);
+  }
+  if (size - ssize >= 16) {
+    __m512 b0 = _mm512_cvtph_ps(_mm256_loadu_si256((__m256i *)(b + ssize)));
+    s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + ssize), b0, s0);
+    ssize += 16;
+  }
+  // left over
+  return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1)) +
+         _vdot_f16_f32_serial(a + ssize, b + ssize, size - ssize);
+}
+
+static inline __m512 _vdot_bf16_load_avx512f(uint16_t *b) {
+  __m512i w = _mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i *)b));
+  return _mm512_castsi512_ps(_mm512_slli_epi32(w, 16));
+}
+
+static inline float _vdot_bf16_f32_avx512f(float *a, uint16_t *b, size_t size) {
+  __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+  size_t ssize = size - (size % 32);
+  for (size_t i = 0; i < ssize; i += 32) {
+    s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _vdot_bf16_load_avx512f(b + i),
+                         s0);
+    s1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16),
+                         _vdot_bf16_load_avx512f(b + i + 16), s1);
+  }
+  if (size - ssize >= 16) {
+    s0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + ssize),
+                         _vdot_bf16_load_avx512f(b + ssize), s0);
+    ssize += 16;
+  }
+  // left over
+  return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1)) +
+         _vdot_bf16_f32_serial(a + ssize, b + ssize, size - ssize);
+}
+
+#endif // __AVX512F__
+
+#if defined(__ARM_FEATURE_SVE)
+
+#include <arm_sve.h>
+
+// svld1uh_u32 puts each 16-bit value in the low half of a 32-bit lane, which
+// is where fcvt reads a half from; bf16 only needs shifting into the top half
+
+static inline float _vdot_f16_f32_sve(float *a, uint16_t *b, size_t size) {
+  svfloat32_t sum = svdup_f32(0.0f);
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    svfloat16_t h = svreinterpret_f16_u32(svld1uh_u32(pg, b + i));
+    sum = svmla_f32_m(pg, sum, svld1_f32(pg, a + i), svcvt_f32_f16_x(pg, h));
+  }
+  return svaddv_f32(svptrue_b32(), sum);
+}
+
+static inline float _vdot_bf16_f32_sve(float *a, uint16_t *b, size_t size) {
+  svfloat32_t sum = svdup_f32(0.0f);
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    svuint32_t w = svlsl_n_u32_x(pg, svld1uh_u32(pg, b + i), 16);
+    sum = svmla_f32_m(pg, sum, svld1_f32(pg, a + i), svreinterpret_f32_u32(w));
+  }
+  return svaddv_f32(svptrue_b32(), sum);
+}
+
+#endif // __ARM_FEATURE_SVE
+
+// float16x4_t conversions, vaddvq_f32 and vfmaq_f32 are A64 only
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static inline float _vdot_f16_f32_neon(float *a, uint16_t *b, size_t size) {
+  float32x4_t s0 = vdupq_n_f32(0), s1 = vdupq_n_f32(0);
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    float16x8_t h = vreinterpretq_f16_u16(vld1q_u16(b + i));
+    s0 = vfmaq_f32(s0, vld1q_f32(a + i), vcvt_f32_f16(vget_low_f16(h)));
+    s1 = vfmaq_f32(s1, vld1q_f32(a + i + 4), vcvt_high_f32_f16(h));
+  }
+  // left over
+  return vaddvq_f32(vaddq_f32(s0, s1)) +
+         _vdot_f16_f32_serial(a + ssize, b + ssize, size - ssize);
+}
+
+static inline float _vdot_bf16_f32_neon(float *a, uint16_t *b, size_t size) {
+  float32x4_t s0 = vdupq_n_f32(0), s1 = vdupq_n_f32(0);
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    uint16x8_t h = vld1q_u16(b + i);
+    float32x4_t lo = vreinterpretq_f32_u32(vshll_n_u16(vget_low_u16(h), 16));
+    float32x4_t hi = vreinterpretq_f32_u32(vshll_high_n_u16(h, 16));
+    s0 = vfmaq_f32(s0, vld1q_f32(a + i), lo);
+    s1 = vfmaq_f32(s1, vld1q_f32(a + i + 4), hi);
+  }
+  // left over
+  return vaddvq_f32(vaddq_f32(s0, s1)) +
+         _vdot_bf16_f32_serial(a + ssize, b + ssize, size - ssize);
+}
+
+#endif // __ARM_NEON && __aarch64__
+
+typedef float (*vdot_half_fn)(float *, uint16_t *, size_t);
+
+// Pick the f16 kernel once per scan instead of once per row
+static inline vdot_half_fn _vdot_f16_f32_dispatch(void) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    return _vdot_f16_f32_avx512f;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__) && SIMDINFO_SUPPORTS(info, __FMA__) &&
+      SIMDINFO_SUPPORTS(info, __F16C__)) {
+    return _vdot_f16_f32_avx2;
+  }
+#endif // __AVX2__ && __FMA__ && __F16C__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    return _vdot_f16_f32_sve;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vdot_f16_f32_neon;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  return _vdot_f16_f32_serial;
+}
+
+// Pick the bf16 kernel once per scan instead of once per row
+static inline vdot_half_fn _vdot_bf16_f32_dispatch(void) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    return _vdot_bf16_f32_avx512f;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__) && defined(__FMA__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__) && SIMDINFO_SUPPORTS(info, __FMA__)) {
+    return _vdot_bf16_f32_avx2;
+  }
+#endif // __AVX2__ && __FMA__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    return _vdot_bf16_f32_sve;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vdot_bf16_f32_neon;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  return _vdot_bf16_f32_serial;
+}
+
+// a . b for f32 a and f16 b (raw bit patterns)
+float vdot_f16_f32(float *a, uint16_t *b, size_t size) {
+  return _vdot_f16_f32_dispatch()(a, b, size);
+}
+
+// a . b for f32 a and bf16 b (raw bit patterns)
+float vdot_bf16_f32(float *a, uint16_t *b, size_t size) {
+  return _vdot_bf16_f32_dispatch()(a, b, size);
+}
+
+/* Many-vs-many dot products */
+
+// Rows of b scored per tile by vdot_many_f32, sized so a tile stays in L2
+// while every row of a runs over it
+#define VDOT_MANY_TILE_BYTES (256 * 1024)
+
+// out[i * out_stride + j] = a_i . b_j for na rows of a (a_stride floats
+// apart) and nb rows of b (b_stride floats apart), each of size floats
+void vdot_many_f32(float *a, size_t na, size_t a_stride, float *b, size_t nb,
+                   size_t b_stride, size_t size, float *out,
+                   size_t out_stride) {
+  size_t tile = VDOT_MANY_TILE_BYTES / (size * sizeof(float) + 1);
+  tile = tile < 4 ? 4 : tile - tile % 4;
+  for (size_t j = 0; j < nb; j += tile) {
+    size_t n = nb - j < tile ? nb - j : tile;
+    for (size_t i = 0; i < na; i++) {
+      vdot_batch_f32(a + i * a_stride, b + j * b_stride, n, size, b_stride,
+                     out + i * out_stride + j);
+    }
+  }
+}
+
 #endif // VDOT_H
\ No newline at end of file
@@ -0,0 +1,492 @@
+/* CPython bindings for the dispatched kernels in vdot.h and vtopk.h */
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "vdot.h"
+#include "vtopk.h"
+
+// Inputs are read in place through the buffer protocol (numpy arrays,
+// array.array, memoryview, ...): float32, with contiguous rows. Results come
+// back as memoryviews over fresh bytearrays, or are written into out= when
+// it is given, so numpy.asarray() on either side never copies.
+//
+// The GIL is released around any call that touches at least this many
+// floats; below that, releasing and re-taking it costs more than the kernel.
+#define VDOT_PY_RELEASE_GIL (16 * 1024)
+
+typedef struct matrix_t {
+    Py_buffer view;
+    float *data;
+    Py_ssize_t rows;
+    Py_ssize_t cols;
+    // floats between consecutive rows
+    Py_ssize_t stride;
+} matrix_t;
+
+static int is_f32(Py_buffer *view) {
+    const char *f = view->format ? view->format : "B";
+    if (f[0] == '<' || f[0] == '=' || f[0] == '@') {
+        f++;
+    }
+    return view->itemsize == 4 && strcmp(f, "f") == 0;
+}
+
+// Get a float32 vector or matrix out of obj. A 1-D buffer is one row, or rows
+// of dim floats when dim is non-zero. Rows may be strided (e.g. a numpy
+// slice), but each row has to be contiguous.
+static int get_matrix(PyObject *obj, const char *name, Py_ssize_t dim,
+                      int writable, matrix_t *m) {
+    int flags = PyBUF_STRIDES | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0);
+    if (PyObject_GetBuffer(obj, &m->view, flags) != 0) {
+        return -1;
+    }
+    Py_buffer *v = &m->view;
+    m->data = (float *)v->buf;
+    if (!is_f32(v)) {
+        PyErr_Format(PyExc_TypeError, "%s: expected float32 data, got '%s'",
+                     name, v->format ? v->format : "B");
+    } else if (v->ndim == 1 && v->strides[0] == 4) {
+        m->cols = dim ? dim : v->shape[0];
+        m->rows = m->cols ? v->shape[0] / m->cols : 0;
+        m->stride = m->cols;
+        if (m->rows * m->cols == v->shape[0]) {
+            return 0;
+        }
+        PyErr_Format(PyExc_ValueError,
+                     "%s: length %zd is not a multiple of %zd", name,
+                     v->shape[0], m->cols);
+    } else if (v->ndim == 2 && v->strides[1] == 4 && v->strides[0] % 4 == 0 &&
+               v->strides[0] >= 0) {
+        m->rows = v->shape[0];
+        m->cols = v->shape[1];
+        m->stride = v->strides[0] / 4;
+        if (dim == 0 || dim == m->cols) {
+            return 0;
+        }
+        PyErr_Format(PyExc_ValueError, "%s: rows have %zd values, expected %zd",
+                     name, m->cols, dim);
+    } else {
+        PyErr_Format(PyExc_ValueError,
+                     "%s: expected a 1-D or 2-D buffer with contiguous rows",
+                     name);
+    }
+    PyBuffer_Release(v);
+    return -1;
+}
+
+// A memoryview of the given format and shape over a new bytearray, with its
+// data pointer in *data
+static PyObject *new_result(const char *format, Py_ssize_t itemsize,
+                            Py_ssize_t rows, Py_ssize_t cols, int ndim,
+                            void **data) {
+    PyObject *bytes = PyByteArray_FromStringAndSize(NULL, rows * cols * itemsize);
+    if (bytes == NULL) {
+        return NULL;
+    }
+    *data = PyByteArray_AS_STRING(bytes);
+    PyObject *flat = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (flat == NULL) {
+        return NULL;
+    }
+    if (rows * cols == 0) {
+        // memoryview cannot take a shape with zeros; leave an empty one flat
+        PyObject *view = PyObject_CallMethod(flat, "cast", "s", format);
+        Py_DECREF(flat);
+        return view;
+    }
+    PyObject *shape = ndim == 2 ? Py_BuildValue("(nn)", rows, cols)
+                                : Py_BuildValue("(n)", rows * cols);
+    PyObject *view = shape ? PyObject_CallMethod(flat, "cast", "sO", format,
+                                                 shape)
+                           : NULL;
+    Py_XDECREF(shape);
+    Py_DECREF(flat);
+    return view;
+}
+
+// Either the caller's out= (checked against rows x cols) or a new result
+static PyObject *get_output(PyObject *out, Py_ssize_t rows, Py_ssize_t cols,
+                            int ndim, matrix_t *m) {
+    if (out == NULL || out == Py_None) {
+        void *data;
+        PyObject *result = new_result("f", 4, rows, cols, ndim, &data);
+        m->view.obj = NULL;
+        m->data = (float *)data;
+        m->stride = cols;
+        return result;
+    }
+    if (get_matrix(out, "out", cols, 1, m) != 0) {
+        return NULL;
+    }
+    if (m->rows != rows || m->cols != cols) {
+        PyErr_Format(PyExc_ValueError, "out: expected %zd x %zd floats", rows,
+                     cols);
+        PyBuffer_Release(&m->view);
+        return NULL;
+    }
+    Py_INCREF(out);
+    return out;
+}
+
+static void release(matrix_t *m) {
+    if (m->view.obj != NULL) {
+        PyBuffer_Release(&m->view);
+    }
+}
+
+PyDoc_STRVAR(dot_doc,
+"dot(a, b) -> float\n\n"
+"Dot product of two float32 vectors of the same length.");
+
+// The call most sensitive to overhead: METH_FASTCALL skips the argument tuple
+static PyObject *py_dot(PyObject *self, PyObject *const *args,
+                        Py_ssize_t nargs) {
+    if (nargs != 2) {
+        PyErr_Format(PyExc_TypeError, "dot() takes 2 arguments (%zd given)",
+                     nargs);
+        return NULL;
+    }
+    PyObject *a_obj = args[0], *b_obj = args[1];
+    matrix_t a, b;
+    if (get_matrix(a_obj, "a", 0, 0, &a) != 0) {
+        return NULL;
+    }
+    if (get_matrix(b_obj, "b", 0, 0, &b) != 0) {
+        release(&a);
+        return NULL;
+    }
+    if (a.rows > 1 || b.rows > 1 || a.cols != b.cols) {
+        PyErr_SetString(PyExc_ValueError,
+                        "a and b must be vectors of the same length");
+        release(&a);
+        release(&b);
+        return NULL;
+    }
+    float result;
+    if (a.cols >= VDOT_PY_RELEASE_GIL) {
+        Py_BEGIN_ALLOW_THREADS
+        result = vdot_f32(a.data, b.data, (size_t)a.cols);
+        Py_END_ALLOW_THREADS
+    } else {
+        result = vdot_f32(a.data, b.data, (size_t)a.cols);
+    }
+    release(&a);
+    release(&b);
+    return PyFloat_FromDouble(result);
+}
+
+PyDoc_STRVAR(dot_batch_doc,
+"dot_batch(query, rows, out=None) -> memoryview\n\n"
+"query . rows[i] for every row of the n x dim matrix rows, as n floats.");
+
+static PyObject *py_dot_batch(PyObject *self, PyObject *args, PyObject *kw) {
+    static char *names[] = {"query", "rows", "out", NULL};
+    PyObject *q_obj, *rows_obj, *out_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|O:dot_batch", names, &q_obj,
+                                     &rows_obj, &out_obj)) {
+        return NULL;
+    }
+    matrix_t q, rows, out;
+    if (get_matrix(q_obj, "query", 0, 0, &q) != 0) {
+        return NULL;
+    }
+    if (q.rows != 1 || get_matrix(rows_obj, "rows", q.cols, 0, &rows) != 0) {
+        if (q.rows != 1) {
+            PyErr_SetString(PyExc_ValueError, "query: expected one vector");
+        }
+        release(&q);
+        return NULL;
+    }
+    PyObject *result = get_output(out_obj, 1, rows.rows, 1, &out);
+    if (result != NULL) {
+        if (rows.rows * rows.cols >= VDOT_PY_RELEASE_GIL) {
+            Py_BEGIN_ALLOW_THREADS
+            vdot_batch_f32(q.data, rows.data, (size_t)rows.rows,
+                           (size_t)rows.cols, (size_t)rows.stride, out.data);
+            Py_END_ALLOW_THREADS
+        } else {
+            vdot_batch_f32(q.data, rows.data, (size_t)rows.rows,
+                           (size_t)rows.cols, (size_t)rows.stride, out.data);
+        }
+        release(&out);
+    }
+    release(&q);
+    release(&rows);
+    return result;
+}
+
+PyDoc_STRVAR(dot_many_doc,
+"dot_many(a, b, out=None) -> memoryview\n\n"
+"The na x nb matrix of a[i] . b[j] for the rows of a and b.");
+
+static PyObject *py_dot_many(PyObject *self, PyObject *args, PyObject *kw) {
+    static char *names[] = {"a", "b", "out", NULL};
+    PyObject *a_obj, *b_obj, *out_obj = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kw, "OO|O:dot_many", names, &a_obj,
+                                     &b_obj, &out_obj)) {
+        return NULL;
+    }
+    matrix_t a, b, out;
+    if (get_matrix(a_obj, "a", 0, 0, &a) != 0) {
+        return NULL;
+    }
+    if (get_matrix(b_obj, "b", a.cols, 0, &b) != 0) {
+        release(&a);
+        return NULL;
+    }
+    PyObject *result = get_output(out_obj, a.rows, b.rows, 2, &out);
+    if (result != NULL) {
+        if ((a.rows + b.rows) * a.cols >= VDOT_PY_RELEASE_GIL) {
+            Py_BEGIN_ALLOW_THREADS
+            vdot_many_f32(a.data, (size_t)a.rows, (size_t)a.stride, b.data,
+                          (size_t)b.rows, (size_t)b.stride, (size_t)a.cols,
+                          out.data, (size_t)out.stride);
+            Py_END_ALLOW_THREADS
+        } else {
+            vdot_many_f32(a.data, (size_t)a.rows, (size_t)a.stride, b.data,
+                          (size_t)b.rows, (size_t)b.stride, (size_t)a.cols,
+                          out.data, (size_t)out.stride);
+        }
+        release(&out);
+    }
+    release(&a);
+    release(&b);
+    return result;
+}
+
+// The (idx, val) pair, trimmed to count results for a single query
+static PyObject *topk_result(PyObject *idx, PyObject *val, size_t count,
+                             int single) {
+    if (single) {
+        PyObject *i = PySequence_GetSlice(idx, 0, (Py_ssize_t)count);
+        PyObject *v = PySequence_GetSlice(val, 0, (Py_ssize_t)count);
+        Py_DECREF(idx);
+        Py_DECREF(val);
+        if (i == NULL || v == NULL) {
+            Py_XDECREF(i);
+            Py_XDECREF(v);
+            return NULL;
+        }
+        idx = i;
+        val = v;
+    }
+    PyObject *pair = PyTuple_Pack(2, idx, val);
+    Py_DECREF(idx);
+    Py_DECREF(val);
+    return pair;
+}
+
+// Top-k over every value of m, indexed as if its rows were packed
+static size_t matrix_topk(matrix_t *m, size_t k, size_t *idx, float *val) {
+    size_t cols = (size_t)m->cols;
+    if (m->stride == m->cols) {
+        return vtopk_f32(m->data, (size_t)m->rows * cols, k, idx, val);
+    }
+    vtopk_t t;
+    vtopk_init(&t, k, idx, val);
+    for (Py_ssize_t i = 0; i < m->rows; i++) {
+        vtopk_push_f32(&t, m->data + i * m->stride, cols, (size_t)i * cols);
+    }
+    return vtopk_finish(&t);
+}
+
+PyDoc_STRVAR(topk_doc,
+"topk(scores, k) -> (idx, val)\n\n"
+"The k largest of a float32 vector, best first. NaNs are skipped, so fewer\n"
+"than k may come back. idx is a memoryview of size_t ('N'). A matrix is\n"
+"searched as a whole, with idx counting row * cols + col.");
+
+static PyObject *py_topk(PyObject *self, PyObject *args) {
+    PyObject *s_obj;
+    Py_ssize_t k;
+    if (!PyArg_ParseTuple(args, "On:topk", &s_obj, &k)) {
+        return NULL;
+    }
+    if (k < 0) {
+        PyErr_SetString(PyExc_ValueError, "k must not be negative");
+        return NULL;
+    }
+    matrix_t s;
+    if (get_matrix(s_obj, "scores", 0, 0, &s) != 0) {
+        return NULL;
+    }
+    size_t *idx;
+    float *val;
+    PyObject *idx_obj = new_result("N", sizeof(size_t), 1, k, 1, (void **)&idx);
+    PyObject *val_obj = new_result("f", 4, 1, k, 1, (void **)&val);
+    if (idx_obj == NULL || val_obj == NULL) {
+        Py_XDECREF(idx_obj);
+        Py_XDECREF(val_obj);
+        release(&s);
+        return NULL;
+    }
+    size_t n = (size_t)(s.rows * s.cols), count;
+    if (n >= VDOT_PY_RELEASE_GIL) {
+        Py_BEGIN_ALLOW_THREADS
+        count = matrix_topk(&s, (size_t)k, idx, val);
+        Py_END_ALLOW_THREADS
+    } else {
+        count = matrix_topk(&s, (size_t)k, idx, val);
+    }
+    release(&s);
+    return topk_result(idx_obj, val_obj, count, 1);
+}
+
+// Top-k of every query against rows, scored a tile at a time
+static void dot_topk(matrix_t *q, matrix_t *rows, size_t k, float *scores,
+                     size_t tile, size_t *idx, float *val) {
+    for (Py_ssize_t i = 0; i < q->rows; i++) {
+        vtopk_t t;
+        vtopk_init(&t, k, idx + i * k, val + i * k);
+        float *query = q->data + i * q->stride;
+        for (size_t j = 0; j < (size_t)rows->rows; j += tile) {
+            size_t n = (size_t)rows->rows - j < tile ? (size_t)rows->rows - j
+                                                     : tile;
+            vdot_batch_f32(query, rows->data + j * rows->stride, n,
+                           (size_t)rows->cols, (size_t)rows->stride, scores);
+            vtopk_push_f32(&t, scores, n, j);
+        }
+        size_t count = vtopk_finish(&t);
+        // rows that ran out (k > n, or NaN scores) are marked like vknn's
+        for (size_t j = count; j < k; j++) {
+            idx[i * k + j] = SIZE_MAX;
+            val[i * k + j] = NAN;
+        }
+    }
+}
+
+PyDoc_STRVAR(dot_topk_doc,
+"dot_topk(queries, rows, k) -> (idx, val)\n\n"
+"The k rows with the largest dot product with each query, best first.\n"
+"For a single query vector idx and val hold up to k results; for a matrix of\n"
+"queries they are nq x k, padded with SIZE_MAX / NaN when rows run out.");
+
+static PyObject *py_dot_topk(PyObject *self, PyObject *args) {
+    PyObject *q_obj, *rows_obj;
+    Py_ssize_t k;
+    if (!PyArg_ParseTuple(args, "OOn:dot_topk", &q_obj, &rows_obj, &k)) {
+        return NULL;
+    }
+    if (k < 0) {
+        PyErr_SetString(PyExc_ValueError, "k must not be negative");
+        return NULL;
+    }
+    matrix_t q, rows;
+    if (get_matrix(q_obj, "queries", 0, 0, &q) != 0) {
+        return NULL;
+    }
+    if (get_matrix(rows_obj, "rows", q.cols, 0, &rows) != 0) {
+        release(&q);
+        return NULL;
+    }
+    int ndim = q.view.ndim == 2 ? 2 : 1;
+    size_t *idx;
+    float *val;
+    PyObject *idx_obj = new_result("N", sizeof(size_t), q.rows, k, ndim,
+                                   (void **)&idx);
+    PyObject *val_obj = new_result("f", 4, q.rows, k, ndim, (void **)&val);
+    size_t tile = VTOPK_BLOCK;
+    float *scores = (float *)PyMem_RawMalloc(tile * sizeof(float));
+    if (idx_obj == NULL || val_obj == NULL || scores == NULL) {
+        Py_XDECREF(idx_obj);
+        Py_XDECREF(val_obj);
+        PyMem_RawFree(scores);
+        release(&q);
+        release(&rows);
+        return scores == NULL ? PyErr_NoMemory() : NULL;
+    }
+    if (q.rows * rows.rows * rows.cols >= VDOT_PY_RELEASE_GIL) {
+        Py_BEGIN_ALLOW_THREADS
+        dot_topk(&q, &rows, (size_t)k, scores, tile, idx, val);
+        Py_END_ALLOW_THREADS
+    } else {
+        dot_topk(&q, &rows, (size_t)k, scores, tile, idx, val);
+    }
+    size_t count = 0;
+    while (q.rows == 1 && count < (size_t)k && idx[count] != SIZE_MAX) {
+        count++;
+    }
+    PyMem_RawFree(scores);
+    release(&q);
+    release(&rows);
+    return topk_result(idx_obj, val_obj, count, ndim == 1);
+}
+
+PyDoc_STRVAR(simdinfo_doc,
+"simdinfo() -> dict\n\n"
+"The CPU features the kernels dispatch on, as detected at import.");
+
+static PyObject *simdinfo_snapshot;
+
+static PyObject *py_simdinfo(PyObject *self, PyObject *unused) {
+    return PyDict_Copy(simdinfo_snapshot);
+}
+
+static PyObject *make_simdinfo(void) {
+    simdinfo_t info = simdinfo();
+    struct {
+        const char *name;
+        unsigned value;
+    } features[] = {
+        {"AVX", SIMDINFO_SUPPORTS(info, __AVX__)},
+        {"AVX2", SIMDINFO_SUPPORTS(info, __AVX2__)},
+        {"AVXVNNI", SIMDINFO_SUPPORTS(info, __AVXVNNI__)},
+        {"F16C", SIMDINFO_SUPPORTS(info, __F16C__)},
+        {"FMA", SIMDINFO_SUPPORTS(info, __FMA__)},
+        {"AVX512F", SIMDINFO_SUPPORTS(info, __AVX512F__)},
+        {"AVX512BW", SIMDINFO_SUPPORTS(info, __AVX512BW__)},
+        {"AVX512BF16", SIMDINFO_SUPPORTS(info, __AVX512BF16__)},
+        {"AVX512VNNI", SIMDINFO_SUPPORTS(info, __AVX512VNNI__)},
+        {"AVX512VBMI", SIMDINFO_SUPPORTS(info, __AVX512VBMI__)},
+        {"AVX512DQ", SIMDINFO_SUPPORTS(info, __AVX512DQ__)},
+        {"SSE3", SIMDINFO_SUPPORTS(info, __SSE3__)},
+        {"SSSE3", SIMDINFO_SUPPORTS(info, __SSSE3__)},
+        {"ARM_NEON", SIMDINFO_SUPPORTS(info, __ARM_NEON)},
+        {"ARM_FEATURE_FMA", SIMDINFO_SUPPORTS(info, __ARM_FEATURE_FMA)},
+        {"ARM_FEATURE_MATMUL_INT8",
+         SIMDINFO_SUPPORTS(info, __ARM_FEATURE_MATMUL_INT8)},
+        {"ARM_FEATURE_FP16_VECTOR_ARITHMETIC",
+         SIMDINFO_SUPPORTS(info, __ARM_FEATURE_FP16_VECTOR_ARITHMETIC)},
+        {"ARM_FEATURE_SVE", SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)},
+        {"ARM_FEATURE_SVE2", SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE2)},
+    };
+    PyObject *dict = PyDict_New();
+    for (size_t i = 0; dict != NULL && i < sizeof(features) / sizeof(features[0]);
+         i++) {
+        if (PyDict_SetItemString(dict, features[i].name,
+                                 features[i].value ? Py_True : Py_False) != 0) {
+            Py_CLEAR(dict);
+        }
+    }
+    return dict;
+}
+
+static PyMethodDef vdot_methods[] = {
+    {"dot", (PyCFunction)(void (*)(void))py_dot, METH_FASTCALL, dot_doc},
+    {"dot_batch", (PyCFunction)(void (*)(void))py_dot_batch,
+     METH_VARARGS | METH_KEYWORDS, dot_batch_doc},
+    {"dot_many", (PyCFunction)(void (*)(void))py_dot_many,
+     METH_VARARGS | METH_KEYWORDS, dot_many_doc},
+    {"topk", py_topk, METH_VARARGS, topk_doc},
+    {"dot_topk", py_dot_topk, METH_VARARGS, dot_topk_doc},
+    {"simdinfo", py_simdinfo, METH_NOARGS, simdinfo_doc},
+    {NULL, NULL, 0, NULL},
+};
+
+static struct PyModuleDef vdot_module = {
+    PyModuleDef_HEAD_INIT,
+    "vdot",
+    "SIMD dot products over float32 buffers, dispatched on the running CPU.",
+    -1,
+    vdot_methods,
+};
+
+PyMODINIT_FUNC PyInit_vdot(void) {
+    if (simdinfo_snapshot == NULL) {
+        simdinfo_snapshot = make_simdinfo();
+        if (simdinfo_snapshot == NULL) {
+            return NULL;
+        }
+    }
+    return PyModule_Create(&vdot_module);
+}
@@ -0,0 +1,171 @@
+/* Hamming distance between packed bit vectors */
+#ifndef VHAMMING_H
+#define VHAMMING_H
+
+#include "simdinfo.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Fallback scalar implementation */
+
+static inline uint64_t _vhamming_serial(uint8_t *a, uint8_t *b, size_t size) {
+  uint64_t count = 0;
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    uint64_t wa, wb;
+    memcpy(&wa, a + i, 8);
+    memcpy(&wb, b + i, 8);
+    count += (uint64_t)__builtin_popcountll(wa ^ wb);
+  }
+  // left over
+  for (size_t i = ssize; i < size; i++) {
+    count += (uint64_t)__builtin_popcount((unsigned)(a[i] ^ b[i]));
+  }
+  return count;
+}
+
+/* x86 */
+
+// Without a vector popcount instruction, count bits with a 16-entry nibble
+// table in pshufb and sum the bytes with psadbw
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+static inline uint64_t _vhamming_avx2(uint8_t *a, uint8_t *b, size_t size) {
+  __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3,
+                                   3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3,
+                                   2, 3, 3, 4);
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i vsum = _mm256_setzero_si256();
+  size_t ssize = size - (size % 32);
+  for (size_t i = 0; i < ssize; i += 32) {
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)(a + i)),
+                                 _mm256_loadu_si256((__m256i *)(b + i)));
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(x, nibble));
+    __m256i hi = _mm256_shuffle_epi8(
+        table, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+    vsum = _mm256_add_epi64(
+        vsum, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+  }
+  uint64_t count = (uint64_t)_mm256_extract_epi64(vsum, 0) +
+                   (uint64_t)_mm256_extract_epi64(vsum, 1) +
+                   (uint64_t)_mm256_extract_epi64(vsum, 2) +
+                   (uint64_t)_mm256_extract_epi64(vsum, 3);
+  // left over
+  return count + _vhamming_serial(a + ssize, b + ssize, size - ssize);
+}
+
+#endif // __AVX2__
+
+#if defined(__AVX512BW__)
+
+#include <immintrin.h>
+
+static inline uint64_t _vhamming_avx512bw(uint8_t *a, uint8_t *b,
+                                          size_t size) {
+  __m512i table = _mm512_broadcast_i32x4(
+      _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+  __m512i nibble = _mm512_set1_epi8(0x0f);
+  __m512i vsum = _mm512_setzero_si512();
+  for (size_t i = 0; i < size; i += 64) {
+    __mmask64 active = size - i >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << (size - i)) - 1;
+    __m512i x = _mm512_xor_si512(_mm512_maskz_loadu_epi8(active, a + i),
+                                 _mm512_maskz_loadu_epi8(active, b + i));
+    __m512i lo = _mm512_shuffle_epi8(table, _mm512_and_si512(x, nibble));
+    __m512i hi = _mm512_shuffle_epi8(
+        table, _mm512_and_si512(_mm512_srli_epi16(x, 4), nibble));
+    vsum = _mm512_add_epi64(
+        vsum, _mm512_sad_epu8(_mm512_add_epi8(lo, hi), _mm512_setzero_si512()));
+  }
+  return (uint64_t)_mm512_reduce_add_epi64(vsum);
+}
+
+#endif // __AVX512BW__
+
+/* ARM */
+
+#if defined(__ARM_FEATURE_SVE)
+
+#include <arm_sve.h>
+
+static inline uint64_t _vhamming_sve(uint8_t *a, uint8_t *b, size_t size) {
+  svuint32_t vsum = svdup_u32(0);
+  svuint8_t ones = svdup_u8(1);
+  for (size_t i = 0; i < size; i += svcntb()) {
+    svbool_t pg = svwhilelt_b8(i, size);
+    svuint8_t x = sveor_u8_z(pg, svld1_u8(pg, a + i), svld1_u8(pg, b + i));
+    // udot against ones sums each group of four byte counts into a word
+    vsum = svdot_u32(vsum, svcnt_u8_z(pg, x), ones);
+  }
+  return svaddv_u32(svptrue_b32(), vsum);
+}
+
+#endif // __ARM_FEATURE_SVE
+
+// vaddvq_u32 is A64 only
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static inline uint64_t _vhamming_neon(uint8_t *a, uint8_t *b, size_t size) {
+  uint32x4_t vsum = vdupq_n_u32(0);
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    uint8x16_t x = veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+    vsum = vpadalq_u16(vsum, vpaddlq_u8(vcntq_u8(x)));
+  }
+  // left over
+  return vaddvq_u32(vsum) + _vhamming_serial(a + ssize, b + ssize, size - ssize);
+}
+
+#endif // __ARM_NEON && __aarch64__
+
+typedef uint64_t (*vhamming_fn)(uint8_t *, uint8_t *, size_t);
+
+// Pick the kernel once per scan instead of once per row
+static inline vhamming_fn _vhamming_dispatch(void) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512BW__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512BW__)) {
+    return _vhamming_avx512bw;
+  }
+#endif // __AVX512BW__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    return _vhamming_avx2;
+  }
+#endif // __AVX2__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    return _vhamming_sve;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vhamming_neon;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  return _vhamming_serial;
+}
+
+// Number of differing bits between two bit vectors of size bytes
+uint64_t vhamming(uint8_t *a, uint8_t *b, size_t size) {
+  return _vhamming_dispatch()(a, b, size);
+}
+
+#endif // VHAMMING_H
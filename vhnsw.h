@@ -0,0 +1,770 @@
+/* Hierarchical navigable small world (HNSW) graph index */
+#ifndef VHNSW_H
+#define VHNSW_H
+
+#include "vdot.h"
+#include "vknn.h"
+#include "vstore.h"
+#include "vthread.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// An HNSW index file holds only the graph; the vectors stay in the vstore it
+// was built from and are read in place. Layout:
+//
+//   [0, 128)           vhnsw_header_t
+//   [levels_offset)    count uint8, top level of each node
+//   [norms_offset)     count floats, squared norm of each node
+//   [index_offset)     count uint64, first upper-layer block of each node
+//   [layer0_offset)    count link lists of 1 + 2m uint32
+//   [upper_offset)     nblocks link lists of 1 + m uint32
+//
+// A link list is a neighbor count followed by that many node ids. Node i owns
+// blocks [index[i], index[i] + levels[i]) for layers 1..levels[i], so every
+// list sits at a fixed offset and the graph is usable straight from the map.
+
+#define VHNSW_MAGIC "VHNSW\0\0\0"
+#define VHNSW_VERSION 1
+#define VHNSW_MAX_LEVEL 16
+#define VHNSW_DEFAULT_M 16
+#define VHNSW_DEFAULT_EF 200
+// Nodes per thread below which construction stays on one thread
+#define VHNSW_MIN_NODES 256
+
+typedef struct vhnsw_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t metric;
+  uint64_t dim;
+  uint64_t count;
+  uint64_t m;
+  uint64_t max_level;
+  uint64_t entry;
+  uint64_t nblocks;
+  uint64_t levels_offset;
+  uint64_t norms_offset;
+  uint64_t index_offset;
+  uint64_t layer0_offset;
+  uint64_t upper_offset;
+  uint64_t padding[3];
+} vhnsw_header_t;
+
+typedef struct vhnsw_t {
+  int fd;
+  unsigned char *map;
+  size_t map_size;
+  int metric;
+  size_t dim;
+  size_t count;
+  size_t m;
+  size_t max_level;
+  size_t entry;
+  uint8_t *levels;
+  float *norms;
+  uint64_t *index;
+  uint32_t *layer0;
+  uint32_t *upper;
+  vstore_t *store;
+  // per-node locks and the entry point lock, only while building
+  pthread_mutex_t *locks;
+  pthread_mutex_t lock;
+} vhnsw_t;
+
+static inline void _vhnsw_layout(vhnsw_header_t *h, size_t dim, size_t count,
+                                 size_t m, size_t nblocks) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, VHNSW_MAGIC, sizeof(h->magic));
+  h->version = VHNSW_VERSION;
+  h->dim = dim;
+  h->count = count;
+  h->m = m;
+  h->nblocks = nblocks;
+  h->levels_offset = sizeof(vhnsw_header_t);
+  h->norms_offset = _vstore_round_up(h->levels_offset + count, VSTORE_ALIGN);
+  h->index_offset = _vstore_round_up(h->norms_offset + count * sizeof(float), VSTORE_ALIGN);
+  h->layer0_offset = _vstore_round_up(h->index_offset + count * sizeof(uint64_t), VSTORE_ALIGN);
+  h->upper_offset = _vstore_round_up(h->layer0_offset + count * (2 * m + 1) * sizeof(uint32_t), VSTORE_ALIGN);
+}
+
+static inline size_t _vhnsw_file_size(vhnsw_header_t *h) {
+  return h->upper_offset + h->nblocks * (h->m + 1) * sizeof(uint32_t);
+}
+
+static inline int _vhnsw_map(vhnsw_t *g, int fd, size_t size, int prot) {
+  void *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  vhnsw_header_t *h = (vhnsw_header_t *)map;
+  g->fd = fd;
+  g->map = (unsigned char *)map;
+  g->map_size = size;
+  g->metric = (int)h->metric;
+  g->dim = (size_t)h->dim;
+  g->count = (size_t)h->count;
+  g->m = (size_t)h->m;
+  g->max_level = (size_t)h->max_level;
+  g->entry = (size_t)h->entry;
+  g->levels = g->map + h->levels_offset;
+  g->norms = (float *)(g->map + h->norms_offset);
+  g->index = (uint64_t *)(g->map + h->index_offset);
+  g->layer0 = (uint32_t *)(g->map + h->layer0_offset);
+  g->upper = (uint32_t *)(g->map + h->upper_offset);
+  g->locks = NULL;
+  return 0;
+}
+
+void vhnsw_close(vhnsw_t *g) {
+  if (g->map != NULL) {
+    munmap(g->map, g->map_size);
+  }
+  if (g->fd >= 0) {
+    close(g->fd);
+  }
+  g->map = NULL;
+  g->fd = -1;
+}
+
+// Link list of node id on a layer: a count, then the neighbor ids
+static inline uint32_t *_vhnsw_links(vhnsw_t *g, size_t id, size_t level) {
+  if (level == 0) {
+    return g->layer0 + id * (2 * g->m + 1);
+  }
+  return g->upper + (g->index[id] + level - 1) * (g->m + 1);
+}
+
+static inline size_t _vhnsw_max_links(vhnsw_t *g, size_t level) {
+  return level == 0 ? 2 * g->m : g->m;
+}
+
+static inline void _vhnsw_lock(vhnsw_t *g, size_t id) {
+  if (g->locks != NULL) {
+    pthread_mutex_lock(&g->locks[id]);
+  }
+}
+
+static inline void _vhnsw_unlock(vhnsw_t *g, size_t id) {
+  if (g->locks != NULL) {
+    pthread_mutex_unlock(&g->locks[id]);
+  }
+}
+
+// f32 view of a node's vector: the mapped row itself for an f32 store,
+// otherwise the row decoded into buf (dim floats)
+static inline float *_vhnsw_row(vhnsw_t *g, size_t id, float *buf) {
+  if (g->store->dtype == VSTORE_F32) {
+    return vstore_row_f32(g->store, id);
+  }
+  vstore_decode_f32(g->store, id, 1, buf);
+  return buf;
+}
+
+// Pull the first cache lines of a node's vector toward L1 ahead of scoring it
+static inline void _vhnsw_prefetch(vhnsw_t *g, size_t id) {
+  unsigned char *row = (unsigned char *)vstore_row(g->store, id);
+  size_t bytes = g->store->stride < 256 ? g->store->stride : 256;
+  for (size_t off = 0; off < bytes; off += 64) {
+    __builtin_prefetch(row + off);
+  }
+}
+
+// Distances are negated vknn scores, so smaller is always nearer
+static inline float _vhnsw_dist(int metric, float dot, float na, float nb) {
+  float score;
+  vknn_scores(metric, &dot, 1, na, &nb, &score);
+  return -score;
+}
+
+/* Search state */
+
+typedef struct vhnsw_pair_t {
+  float dist;
+  uint32_t id;
+} vhnsw_pair_t;
+
+// Binary max-heap on dist
+typedef struct vhnsw_heap_t {
+  vhnsw_pair_t *data;
+  size_t size;
+  size_t cap;
+} vhnsw_heap_t;
+
+static inline int _vhnsw_heap_push(vhnsw_heap_t *h, float dist, uint32_t id) {
+  if (h->size == h->cap) {
+    size_t cap = h->cap ? 2 * h->cap : 64;
+    vhnsw_pair_t *grown = (vhnsw_pair_t *)realloc(h->data, cap * sizeof(vhnsw_pair_t));
+    if (grown == NULL) {
+      return -1;
+    }
+    h->data = grown;
+    h->cap = cap;
+  }
+  size_t i = h->size++;
+  while (i > 0 && h->data[(i - 1) / 2].dist < dist) {
+    h->data[i] = h->data[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  h->data[i].dist = dist;
+  h->data[i].id = id;
+  return 0;
+}
+
+static inline vhnsw_pair_t _vhnsw_heap_pop(vhnsw_heap_t *h) {
+  vhnsw_pair_t top = h->data[0];
+  vhnsw_pair_t last = h->data[--h->size];
+  size_t i = 0;
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= h->size) {
+      break;
+    }
+    if (c + 1 < h->size && h->data[c + 1].dist > h->data[c].dist) {
+      c++;
+    }
+    if (h->data[c].dist <= last.dist) {
+      break;
+    }
+    h->data[i] = h->data[c];
+    i = c;
+  }
+  if (h->size > 0) {
+    h->data[i] = last;
+  }
+  return top;
+}
+
+// Per-thread buffers for graph traversal
+typedef struct vhnsw_scratch_t {
+  uint32_t *visited;
+  uint32_t tag;
+  vhnsw_heap_t cand;   // candidates to expand, keyed on -dist
+  vhnsw_heap_t res;    // best ef found so far, keyed on dist
+  vhnsw_pair_t *sorted;
+  uint32_t *links;
+  uint32_t *ids;
+  uint32_t *sel;
+  float *dots;
+  float *dists;
+  float *norms;
+  float *rows;         // 4 decoded rows for the batch kernel
+  float *keep;         // decoded rows of kept neighbors
+  float **kept_rows;
+  float *query;
+  float *base;
+  vdot_batch4_f32_fn kernel;
+} vhnsw_scratch_t;
+
+static inline void _vhnsw_scratch_free(vhnsw_scratch_t *s) {
+  free(s->visited);
+  free(s->cand.data);
+  free(s->res.data);
+  free(s->sorted);
+  free(s->links);
+  free(s->rows);
+  free(s->kept_rows);
+}
+
+static inline int _vhnsw_scratch_init(vhnsw_t *g, vhnsw_scratch_t *s,
+                                      size_t ef) {
+  size_t dim = g->dim, links = 2 * g->m + 4;
+  memset(s, 0, sizeof(*s));
+  s->visited = (uint32_t *)calloc(g->count, sizeof(uint32_t));
+  s->sorted = (vhnsw_pair_t *)malloc((ef + links) * sizeof(vhnsw_pair_t));
+  s->links = (uint32_t *)malloc(3 * links * sizeof(uint32_t) + 3 * links * sizeof(float));
+  s->rows = (float *)malloc((4 + links + 2) * dim * sizeof(float));
+  s->kept_rows = (float **)malloc(links * sizeof(float *));
+  if (s->visited == NULL || s->sorted == NULL || s->links == NULL ||
+      s->rows == NULL || s->kept_rows == NULL) {
+    _vhnsw_scratch_free(s);
+    return -1;
+  }
+  s->ids = s->links + links;
+  s->sel = s->ids + links;
+  s->dots = (float *)(s->sel + links);
+  s->dists = s->dots + links;
+  s->norms = s->dists + links;
+  s->keep = s->rows + 4 * dim;
+  s->query = s->keep + links * dim;
+  s->base = s->query + dim;
+  s->kernel = _vdot_batch4_f32_dispatch();
+  return 0;
+}
+
+// dists[j] = distance from q (squared norm qn) to node ids[j], four nodes per
+// kernel call
+static inline void _vhnsw_dists(vhnsw_t *g, vhnsw_scratch_t *s, float *q,
+                                float qn, uint32_t *ids, size_t n,
+                                float *dists) {
+  size_t dim = g->dim;
+  for (size_t j = 0; j < n; j += 4) {
+    float *r[4];
+    // left over nodes: repeat the last one to fill the group of four
+    for (size_t t = 0; t < 4; t++) {
+      r[t] = _vhnsw_row(g, ids[j + t < n ? j + t : n - 1], s->rows + t * dim);
+    }
+    s->kernel(q, r[0], r[1], r[2], r[3], dim, s->dots + j);
+  }
+  for (size_t j = 0; j < n; j++) {
+    s->norms[j] = g->norms[ids[j]];
+  }
+  vknn_scores(g->metric, s->dots, n, qn, s->norms, dists);
+  for (size_t j = 0; j < n; j++) {
+    dists[j] = -dists[j];
+  }
+}
+
+// Best-first search of one layer from a single entry point, leaving the ef
+// nearest nodes found in s->res. Returns 0, or -1 if a heap cannot grow.
+static inline int _vhnsw_search_layer(vhnsw_t *g, vhnsw_scratch_t *s,
+                                      float *q, float qn, uint32_t ep,
+                                      float ep_dist, size_t ef, size_t level) {
+  if (++s->tag == 0) {
+    memset(s->visited, 0, g->count * sizeof(uint32_t));
+    s->tag = 1;
+  }
+  size_t max = _vhnsw_max_links(g, level);
+  s->cand.size = 0;
+  s->res.size = 0;
+  s->visited[ep] = s->tag;
+  if (_vhnsw_heap_push(&s->cand, -ep_dist, ep) != 0 ||
+      _vhnsw_heap_push(&s->res, ep_dist, ep) != 0) {
+    return -1;
+  }
+  while (s->cand.size > 0) {
+    vhnsw_pair_t c = s->cand.data[0];
+    if (-c.dist > s->res.data[0].dist && s->res.size >= ef) {
+      break;
+    }
+    _vhnsw_heap_pop(&s->cand);
+    if (s->cand.size > 0) {
+      // the next candidate's links are read on the following iteration
+      __builtin_prefetch(_vhnsw_links(g, s->cand.data[0].id, level));
+    }
+
+    _vhnsw_lock(g, c.id);
+    uint32_t *links = _vhnsw_links(g, c.id, level);
+    size_t n = links[0] < max ? links[0] : max;
+    memcpy(s->links, links + 1, n * sizeof(uint32_t));
+    _vhnsw_unlock(g, c.id);
+
+    size_t fresh = 0;
+    for (size_t j = 0; j < n; j++) {
+      uint32_t id = s->links[j];
+      if (id >= g->count || s->visited[id] == s->tag) {
+        continue;
+      }
+      s->visited[id] = s->tag;
+      s->ids[fresh++] = id;
+      _vhnsw_prefetch(g, id);
+    }
+    if (fresh == 0) {
+      continue;
+    }
+    _vhnsw_dists(g, s, q, qn, s->ids, fresh, s->dists);
+    for (size_t j = 0; j < fresh; j++) {
+      float d = s->dists[j];
+      if (s->res.size < ef || d < s->res.data[0].dist) {
+        if (_vhnsw_heap_push(&s->cand, -d, s->ids[j]) != 0 ||
+            _vhnsw_heap_push(&s->res, d, s->ids[j]) != 0) {
+          return -1;
+        }
+        if (s->res.size > ef) {
+          _vhnsw_heap_pop(&s->res);
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// Drain s->res into s->sorted, nearest first
+static inline size_t _vhnsw_drain(vhnsw_scratch_t *s) {
+  size_t n = s->res.size;
+  for (size_t j = n; j > 0; j--) {
+    s->sorted[j - 1] = _vhnsw_heap_pop(&s->res);
+  }
+  return n;
+}
+
+// Neighbor selection heuristic: walking candidates nearest first, keep one
+// only if it is closer to the base node than to every neighbor already kept,
+// so links spread out in different directions. Writes at most max ids to out.
+static inline size_t _vhnsw_select(vhnsw_t *g, vhnsw_scratch_t *s,
+                                   vhnsw_pair_t *cand, size_t n, size_t max,
+                                   size_t self, uint32_t *out) {
+  size_t kept = 0;
+  for (size_t i = 0; i < n && kept < max; i++) {
+    uint32_t id = cand[i].id;
+    if (id == self) {
+      continue;
+    }
+    float *row = _vhnsw_row(g, id, s->keep + kept * g->dim);
+    int good = 1;
+    for (size_t j = 0; j < kept && good; j++) {
+      float dot = vdot_f32(row, s->kept_rows[j], g->dim);
+      good = _vhnsw_dist(g->metric, dot, g->norms[id], g->norms[out[j]]) >= cand[i].dist;
+    }
+    if (good) {
+      s->kept_rows[kept] = row;
+      out[kept++] = id;
+    }
+  }
+  return kept;
+}
+
+// Add a link from nb to id on a layer. A full list is re-pruned with the
+// selection heuristic over its old links plus the new one.
+static inline void _vhnsw_connect(vhnsw_t *g, vhnsw_scratch_t *s, size_t nb,
+                                  size_t id, size_t level) {
+  size_t max = _vhnsw_max_links(g, level);
+  _vhnsw_lock(g, nb);
+  uint32_t *links = _vhnsw_links(g, nb, level);
+  size_t n = links[0] < max ? links[0] : max;
+  for (size_t j = 0; j < n; j++) {
+    if (links[1 + j] == id) {
+      _vhnsw_unlock(g, nb);
+      return;
+    }
+  }
+  if (n < max) {
+    links[1 + n] = (uint32_t)id;
+    links[0] = (uint32_t)(n + 1);
+    _vhnsw_unlock(g, nb);
+    return;
+  }
+  memcpy(s->ids, links + 1, n * sizeof(uint32_t));
+  s->ids[n++] = (uint32_t)id;
+  float *base = _vhnsw_row(g, nb, s->base);
+  _vhnsw_dists(g, s, base, g->norms[nb], s->ids, n, s->dists);
+  // insertion sort: lists are short
+  for (size_t j = 0; j < n; j++) {
+    vhnsw_pair_t p = {s->dists[j], s->ids[j]};
+    size_t k = j;
+    for (; k > 0 && s->sorted[k - 1].dist > p.dist; k--) {
+      s->sorted[k] = s->sorted[k - 1];
+    }
+    s->sorted[k] = p;
+  }
+  links[0] = (uint32_t)_vhnsw_select(g, s, s->sorted, n, max, nb, links + 1);
+  _vhnsw_unlock(g, nb);
+}
+
+static inline int _vhnsw_insert(vhnsw_t *g, vhnsw_scratch_t *s, size_t id,
+                                size_t ef) {
+  size_t level = g->levels[id];
+  float *q = _vhnsw_row(g, id, s->query);
+  float qn = g->norms[id];
+
+  // a node that raises the top of the graph holds the entry lock throughout
+  pthread_mutex_lock(&g->lock);
+  uint32_t ep = (uint32_t)g->entry;
+  size_t top = g->max_level;
+  int hold = level > top;
+  if (!hold) {
+    pthread_mutex_unlock(&g->lock);
+  }
+
+  int status = 0;
+  float ep_dist;
+  _vhnsw_dists(g, s, q, qn, &ep, 1, &ep_dist);
+  for (size_t l = top; l > level && status == 0; l--) {
+    status = _vhnsw_search_layer(g, s, q, qn, ep, ep_dist, 1, l);
+    ep = s->res.data[0].id;
+    ep_dist = s->res.data[0].dist;
+  }
+  for (size_t l = level < top ? level : top; status == 0; l--) {
+    status = _vhnsw_search_layer(g, s, q, qn, ep, ep_dist, ef, l);
+    if (status != 0) {
+      break;
+    }
+    size_t n = _vhnsw_drain(s);
+    ep = s->sorted[0].id;
+    ep_dist = s->sorted[0].dist;
+    size_t nsel = _vhnsw_select(g, s, s->sorted, n, g->m, id, s->sel);
+    _vhnsw_lock(g, id);
+    uint32_t *links = _vhnsw_links(g, id, l);
+    memcpy(links + 1, s->sel, nsel * sizeof(uint32_t));
+    links[0] = (uint32_t)nsel;
+    _vhnsw_unlock(g, id);
+    for (size_t j = 0; j < nsel; j++) {
+      _vhnsw_connect(g, s, s->sel[j], id, l);
+    }
+    if (l == 0) {
+      break;
+    }
+  }
+
+  if (hold) {
+    if (status == 0) {
+      g->entry = id;
+      g->max_level = level;
+    }
+    pthread_mutex_unlock(&g->lock);
+  }
+  return status;
+}
+
+typedef struct vhnsw_build_t {
+  vhnsw_t *g;
+  size_t ef;
+  int failed;
+} vhnsw_build_t;
+
+static inline void _vhnsw_build(void *ctx, size_t begin, size_t end) {
+  vhnsw_build_t *job = (vhnsw_build_t *)ctx;
+  vhnsw_scratch_t s;
+  if (_vhnsw_scratch_init(job->g, &s, job->ef) != 0) {
+    job->failed = 1;
+    return;
+  }
+  // node 0 is the initial entry point and is already in the graph
+  for (size_t i = begin; i < end && !job->failed; i++) {
+    if (_vhnsw_insert(job->g, &s, i + 1, job->ef) != 0) {
+      job->failed = 1;
+    }
+  }
+  _vhnsw_scratch_free(&s);
+}
+
+// Build an HNSW graph over every row of store with up to m links per node on
+// the upper layers (2m on the bottom one), searching ef_construction
+// candidates per insertion. Nodes are inserted by nthreads threads (0 = all
+// CPUs) straight into the mapped index file. Returns 0, or -1 with errno set.
+int vhnsw_build(vstore_t *store, int metric, size_t m, size_t ef_construction,
+                size_t nthreads, const char *path) {
+  size_t dim = store->dim, count = store->count;
+  if (count == 0 || count > UINT32_MAX || m < 2 || metric < VKNN_DOT ||
+      metric > VKNN_L2) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (ef_construction < m) {
+    ef_construction = m;
+  }
+
+  // levels are drawn up front so every link list has a fixed home
+  uint8_t *levels = (uint8_t *)malloc(count);
+  uint64_t *index = (uint64_t *)malloc(count * sizeof(uint64_t));
+  pthread_mutex_t *locks = (pthread_mutex_t *)malloc(count * sizeof(pthread_mutex_t));
+  float *chunk = (float *)malloc(VKNN_TILE_BYTES + dim * sizeof(float));
+  if (levels == NULL || index == NULL || locks == NULL || chunk == NULL) {
+    free(levels);
+    free(index);
+    free(locks);
+    free(chunk);
+    errno = ENOMEM;
+    return -1;
+  }
+  double ml = 1.0 / log((double)m);
+  uint64_t rng = 0x9E3779B97F4A7C15ull;
+  size_t nblocks = 0, max_level = 0;
+  for (size_t i = 0; i < count; i++) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    double u = (double)((rng * 0x2545F4914F6CDD1Dull) >> 11) * 0x1.0p-53;
+    double l = -log(1.0 - u) * ml;
+    levels[i] = (uint8_t)(l < VHNSW_MAX_LEVEL ? l : VHNSW_MAX_LEVEL);
+    index[i] = nblocks;
+    nblocks += levels[i];
+    max_level = levels[i] > max_level ? levels[i] : max_level;
+  }
+
+  vhnsw_header_t h;
+  _vhnsw_layout(&h, dim, count, m, nblocks);
+  h.metric = (uint32_t)metric;
+  vhnsw_t g;
+  g.map = NULL;
+  int status = -1;
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, (off_t)_vhnsw_file_size(&h)) != 0 ||
+      pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+      _vhnsw_map(&g, fd, _vhnsw_file_size(&h), PROT_READ | PROT_WRITE) != 0) {
+    int err = errno;
+    if (fd >= 0) {
+      close(fd);
+      unlink(path);
+    }
+    free(levels);
+    free(index);
+    free(locks);
+    free(chunk);
+    errno = err;
+    return -1;
+  }
+  g.store = store;
+  memcpy(g.levels, levels, count);
+  memcpy(g.index, index, count * sizeof(uint64_t));
+  size_t tile = vknn_tile_rows(dim);
+  for (size_t r = 0; r < count; r += tile) {
+    size_t n = count - r < tile ? count - r : tile;
+    size_t stride;
+    float *rows = vstore_rows_f32(store, r, n, chunk, &stride);
+    for (size_t i = 0; i < n; i++) {
+      g.norms[r + i] = vdot_f32(rows + i * stride, rows + i * stride, dim);
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    pthread_mutex_init(&locks[i], NULL);
+  }
+  pthread_mutex_init(&g.lock, NULL);
+  g.locks = locks;
+  g.entry = 0;
+  g.max_level = levels[0];
+  vstore_advise(store, 0, count, VSTORE_RANDOM);
+  vhnsw_build_t job = {&g, ef_construction, 0};
+  vthread_parallel_for(count - 1, nthreads, VHNSW_MIN_NODES, _vhnsw_build, &job);
+  for (size_t i = 0; i < count; i++) {
+    pthread_mutex_destroy(&locks[i]);
+  }
+  pthread_mutex_destroy(&g.lock);
+  g.locks = NULL;
+
+  if (job.failed) {
+    errno = ENOMEM;
+  } else {
+    vhnsw_header_t *mh = (vhnsw_header_t *)g.map;
+    mh->entry = g.entry;
+    mh->max_level = g.max_level;
+    status = 0;
+  }
+  int err = errno;
+  vhnsw_close(&g);
+  if (status != 0) {
+    unlink(path);
+  }
+  free(levels);
+  free(index);
+  free(locks);
+  free(chunk);
+  errno = err;
+  return status;
+}
+
+// Map an index read-only on top of the store it was built from. Returns 0,
+// or -1 with errno set (EINVAL for a bad file or a store that does not match).
+int vhnsw_open(const char *path, vstore_t *store, vhnsw_t *g) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  vhnsw_header_t h, expect;
+  if (fstat(fd, &st) != 0 ||
+      pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  _vhnsw_layout(&expect, (size_t)h.dim, (size_t)h.count, (size_t)h.m,
+                (size_t)h.nblocks);
+  expect.metric = h.metric;
+  expect.max_level = h.max_level;
+  expect.entry = h.entry;
+  if (memcmp(&h, &expect, sizeof(h)) != 0 || h.metric > VKNN_L2 ||
+      h.m < 2 || h.count == 0 || h.entry >= h.count ||
+      h.max_level > VHNSW_MAX_LEVEL || h.dim != store->dim ||
+      h.count != store->count || _vhnsw_file_size(&h) > (size_t)st.st_size) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  if (_vhnsw_map(g, fd, (size_t)st.st_size, PROT_READ) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  g->store = store;
+  int valid = 1;
+  for (size_t i = 0; i < g->count && valid; i++) {
+    valid = g->levels[i] <= g->max_level &&
+            g->index[i] + g->levels[i] <= h.nblocks;
+  }
+  if (!valid) {
+    vhnsw_close(g);
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+typedef struct vhnsw_job_t {
+  vhnsw_t *g;
+  float *queries;
+  size_t k;
+  size_t ef;
+  size_t *out_idx;
+  float *out_val;
+  int failed;
+} vhnsw_job_t;
+
+static inline void _vhnsw_search(void *ctx, size_t begin, size_t end) {
+  vhnsw_job_t *job = (vhnsw_job_t *)ctx;
+  vhnsw_t *g = job->g;
+  vhnsw_scratch_t s;
+  if (_vhnsw_scratch_init(g, &s, job->ef) != 0) {
+    job->failed = 1;
+    return;
+  }
+  for (size_t q = begin; q < end && !job->failed; q++) {
+    float *query = job->queries + q * g->dim;
+    size_t *idx = job->out_idx + q * job->k;
+    float *val = job->out_val + q * job->k;
+    float qn = vdot_f32(query, query, g->dim);
+    uint32_t ep = (uint32_t)g->entry;
+    float ep_dist;
+    _vhnsw_dists(g, &s, query, qn, &ep, 1, &ep_dist);
+    int status = 0;
+    for (size_t l = g->max_level; l > 0 && status == 0; l--) {
+      status = _vhnsw_search_layer(g, &s, query, qn, ep, ep_dist, 1, l);
+      ep = s.res.data[0].id;
+      ep_dist = s.res.data[0].dist;
+    }
+    if (status != 0 ||
+        _vhnsw_search_layer(g, &s, query, qn, ep, ep_dist, job->ef, 0) != 0) {
+      job->failed = 1;
+      break;
+    }
+    size_t n = _vhnsw_drain(&s);
+    size_t j = 0;
+    for (; j < n && j < job->k; j++) {
+      idx[j] = s.sorted[j].id;
+      val[j] = vknn_report(g->metric, -s.sorted[j].dist);
+    }
+    for (; j < job->k; j++) {
+      idx[j] = SIZE_MAX;
+      val[j] = NAN;
+    }
+  }
+  _vhnsw_scratch_free(&s);
+}
+
+// Approximate top-k of each of nq queries under the metric the index was
+// built with, keeping ef candidates on the bottom layer (raised to k if
+// smaller). Queries are spread over nthreads threads (0 = all CPUs). Output
+// is laid out as for vknn_search. Returns 0, or -1 with errno set.
+int vhnsw_search(vhnsw_t *g, float *queries, size_t nq, size_t k, size_t ef,
+                 size_t nthreads, size_t *out_idx, float *out_val) {
+  if (ef < k) {
+    ef = k;
+  }
+  vhnsw_job_t job = {g, queries, k, ef, out_idx, out_val, 0};
+  vthread_parallel_for(nq, nthreads, 1, _vhnsw_search, &job);
+  if (job.failed) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+#endif // VHNSW_H
@@ -0,0 +1,419 @@
+/* Inverted-file (IVF-flat) approximate nearest-neighbor index */
+#ifndef VIVF_H
+#define VIVF_H
+
+#include "vdot.h"
+#include "vkmeans.h"
+#include "vknn.h"
+#include "vstore.h"
+#include "vthread.h"
+#include "vtopk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// An IVF index is two files. `path` holds the coarse quantizer and the list
+// layout:
+//
+//   [0, 128)             vivf_header_t
+//   [centroids_offset)   nlist * dim floats
+//   [offsets_offset)     nlist + 1 uint64, list l is rows [off[l], off[l+1])
+//   [ids_offset)         count uint64, original row id of each list row
+//   [norms_offset)       count floats, squared norm of each list row
+//
+// `path`.lists is a vstore holding the rows themselves, in list order and in
+// the dtype of the source store, so each posting list is one contiguous run
+// of aligned rows.
+
+#define VIVF_MAGIC "VIVF\0\0\0\0"
+#define VIVF_VERSION 1
+// Rows sampled for training per list when the caller does not say
+#define VIVF_TRAIN_PER_LIST 64
+// Rows decoded and assigned at a time while building
+#define VIVF_BUILD_CHUNK 4096
+
+typedef struct vivf_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t dim;
+  uint64_t nlist;
+  uint64_t count;
+  uint64_t centroids_offset;
+  uint64_t offsets_offset;
+  uint64_t ids_offset;
+  uint64_t norms_offset;
+  uint64_t padding[7];
+} vivf_header_t;
+
+typedef struct vivf_t {
+  int fd;
+  unsigned char *map;
+  size_t map_size;
+  size_t dim;
+  size_t nlist;
+  size_t count;
+  float *centroids;
+  float *cnorms;
+  uint64_t *offsets;
+  uint64_t *ids;
+  float *norms;
+  vstore_t lists;
+} vivf_t;
+
+static inline int vivf_lists_path(const char *path, char *out, size_t size) {
+  int n = snprintf(out, size, "%s.lists", path);
+  if (n < 0 || (size_t)n >= size) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+static inline void _vivf_layout(vivf_header_t *h, size_t dim, size_t nlist,
+                                size_t count) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, VIVF_MAGIC, sizeof(h->magic));
+  h->version = VIVF_VERSION;
+  h->dim = dim;
+  h->nlist = nlist;
+  h->count = count;
+  h->centroids_offset = sizeof(vivf_header_t);
+  h->offsets_offset = _vstore_round_up(h->centroids_offset + nlist * dim * sizeof(float), VSTORE_ALIGN);
+  h->ids_offset = _vstore_round_up(h->offsets_offset + (nlist + 1) * sizeof(uint64_t), VSTORE_ALIGN);
+  h->norms_offset = _vstore_round_up(h->ids_offset + count * sizeof(uint64_t), VSTORE_ALIGN);
+}
+
+static inline size_t _vivf_file_size(vivf_header_t *h) {
+  return h->norms_offset + h->count * sizeof(float);
+}
+
+static inline int _vivf_map(vivf_t *ivf, int fd, size_t size, int prot) {
+  void *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  vivf_header_t *h = (vivf_header_t *)map;
+  ivf->fd = fd;
+  ivf->map = (unsigned char *)map;
+  ivf->map_size = size;
+  ivf->dim = (size_t)h->dim;
+  ivf->nlist = (size_t)h->nlist;
+  ivf->count = (size_t)h->count;
+  ivf->centroids = (float *)(ivf->map + h->centroids_offset);
+  ivf->offsets = (uint64_t *)(ivf->map + h->offsets_offset);
+  ivf->ids = (uint64_t *)(ivf->map + h->ids_offset);
+  ivf->norms = (float *)(ivf->map + h->norms_offset);
+  ivf->cnorms = NULL;
+  ivf->lists.map = NULL;
+  ivf->lists.fd = -1;
+  return 0;
+}
+
+void vivf_close(vivf_t *ivf) {
+  if (ivf->map != NULL) {
+    munmap(ivf->map, ivf->map_size);
+  }
+  if (ivf->fd >= 0) {
+    close(ivf->fd);
+  }
+  vstore_close(&ivf->lists);
+  free(ivf->cnorms);
+  ivf->map = NULL;
+  ivf->fd = -1;
+  ivf->cnorms = NULL;
+}
+
+// Map an index and its list store read-only. Returns 0, or -1 with errno set.
+int vivf_open(const char *path, vivf_t *ivf) {
+  char lists_path[4096];
+  if (vivf_lists_path(path, lists_path, sizeof(lists_path)) != 0) {
+    return -1;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  vivf_header_t h;
+  if (fstat(fd, &st) != 0 ||
+      pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  vivf_header_t expect;
+  _vivf_layout(&expect, (size_t)h.dim, (size_t)h.nlist, (size_t)h.count);
+  if (memcmp(h.magic, VIVF_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != VIVF_VERSION || h.nlist == 0 ||
+      memcmp(&h, &expect, sizeof(h)) != 0 ||
+      _vivf_file_size(&h) > (size_t)st.st_size) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  if (_vivf_map(ivf, fd, (size_t)st.st_size, PROT_READ) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  int valid = ivf->offsets[ivf->nlist] == ivf->count;
+  for (size_t l = 0; l < ivf->nlist && valid; l++) {
+    valid = ivf->offsets[l] <= ivf->offsets[l + 1];
+  }
+  if (!valid || vstore_open(lists_path, &ivf->lists) != 0 ||
+      ivf->lists.dim != ivf->dim || ivf->lists.count != ivf->count) {
+    vivf_close(ivf);
+    errno = EINVAL;
+    return -1;
+  }
+  ivf->cnorms = (float *)malloc((ivf->nlist + 1) * sizeof(float));
+  if (ivf->cnorms == NULL) {
+    vivf_close(ivf);
+    errno = ENOMEM;
+    return -1;
+  }
+  vkmeans_norms(ivf->centroids, ivf->nlist, ivf->dim, ivf->cnorms);
+  return 0;
+}
+
+// Build an IVF index with nlist lists over every row of store. The coarse
+// quantizer is trained with `iters` rounds of k-means on train_size rows
+// spread evenly over the store (0 = VIVF_TRAIN_PER_LIST per list); then every
+// row is assigned to its nearest centroid and copied into `path`.lists in
+// list order. Returns 0, or -1 with errno set.
+int vivf_build(vstore_t *store, size_t nlist, size_t train_size, size_t iters,
+               size_t nthreads, const char *path) {
+  size_t dim = store->dim, count = store->count;
+  char lists_path[4096];
+  if (vivf_lists_path(path, lists_path, sizeof(lists_path)) != 0) {
+    return -1;
+  }
+  if (nlist == 0 || nlist > count || nlist > UINT32_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (train_size == 0) {
+    train_size = nlist * VIVF_TRAIN_PER_LIST;
+  }
+  if (train_size > count) {
+    train_size = count;
+  }
+  if (train_size < nlist) {
+    train_size = nlist;
+  }
+
+  float *train = (float *)malloc(train_size * dim * sizeof(float) + 1);
+  float *centroids = (float *)malloc(nlist * dim * sizeof(float) + 1);
+  float *cnorms = (float *)malloc(nlist * sizeof(float));
+  float *chunk = (float *)malloc(VIVF_BUILD_CHUNK * dim * sizeof(float) + 1);
+  uint32_t *assign = (uint32_t *)malloc(count * sizeof(uint32_t) + 1);
+  float *norms = (float *)malloc(count * sizeof(float) + 1);
+  uint64_t *fill = (uint64_t *)calloc(nlist + 1, sizeof(uint64_t));
+  int fd = -1;
+  vivf_t ivf;
+  ivf.map = NULL;
+  vstore_t lists;
+  lists.map = NULL;
+  lists.fd = -1;
+  // files this build made, removed again if it fails
+  int created = 0, lists_created = 0;
+  int status = -1;
+  if (train == NULL || centroids == NULL || cnorms == NULL || chunk == NULL ||
+      assign == NULL || norms == NULL || fill == NULL) {
+    errno = ENOMEM;
+    goto done;
+  }
+
+  for (size_t i = 0; i < train_size; i++) {
+    vstore_decode_f32(store, count * i / train_size, 1, train + i * dim);
+  }
+  if (vkmeans_train(train, train_size, dim, dim, nlist, iters, nthreads, 1,
+                    centroids) != 0) {
+    goto done;
+  }
+  vkmeans_norms(centroids, nlist, dim, cnorms);
+
+  for (size_t r = 0; r < count; r += VIVF_BUILD_CHUNK) {
+    size_t n = count - r < VIVF_BUILD_CHUNK ? count - r : VIVF_BUILD_CHUNK;
+    size_t stride;
+    float *rows = vstore_rows_f32(store, r, n, chunk, &stride);
+    if (vkmeans_assign(rows, n, dim, stride, centroids, cnorms, nlist,
+                       nthreads, assign + r, NULL) != 0) {
+      goto done;
+    }
+    for (size_t i = 0; i < n; i++) {
+      norms[r + i] = vdot_f32(rows + i * stride, rows + i * stride, dim);
+    }
+  }
+
+  vivf_header_t h;
+  _vivf_layout(&h, dim, nlist, count);
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  created = fd >= 0;
+  if (fd < 0 || ftruncate(fd, (off_t)_vivf_file_size(&h)) != 0 ||
+      pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+      _vivf_map(&ivf, fd, _vivf_file_size(&h), PROT_READ | PROT_WRITE) != 0) {
+    goto done;
+  }
+  fd = -1;
+  memcpy(ivf.centroids, centroids, nlist * dim * sizeof(float));
+  // counting sort of rows by list
+  for (size_t i = 0; i < count; i++) {
+    fill[assign[i] + 1]++;
+  }
+  for (size_t l = 0; l < nlist; l++) {
+    fill[l + 1] += fill[l];
+  }
+  memcpy(ivf.offsets, fill, (nlist + 1) * sizeof(uint64_t));
+  if (vstore_create(lists_path, store->dtype, dim, count, &lists) != 0) {
+    goto done;
+  }
+  lists_created = 1;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t pos = fill[assign[i]]++;
+    ivf.ids[pos] = i;
+    ivf.norms[pos] = norms[i];
+    memcpy(vstore_row(&lists, pos), vstore_row(store, i), store->stride);
+    if (store->scales != NULL) {
+      lists.scales[pos] = store->scales[i];
+      lists.biases[pos] = store->biases[i];
+    }
+  }
+  status = 0;
+
+done:
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (ivf.map != NULL) {
+    int err = errno;
+    vivf_close(&ivf);
+    errno = err;
+  }
+  if (lists.map != NULL) {
+    vstore_close(&lists);
+  }
+  if (status != 0) {
+    // a partial index must not look like a valid one
+    int err = errno;
+    if (created) {
+      unlink(path);
+    }
+    if (lists_created) {
+      unlink(lists_path);
+    }
+    errno = err;
+  }
+  free(train);
+  free(centroids);
+  free(cnorms);
+  free(chunk);
+  free(assign);
+  free(norms);
+  free(fill);
+  return status;
+}
+
+typedef struct vivf_job_t {
+  vivf_t *ivf;
+  float *queries;
+  size_t k;
+  size_t nprobe;
+  int metric;
+  size_t *out_idx;
+  float *out_val;
+  int failed;
+} vivf_job_t;
+
+static inline void _vivf_search(void *ctx, size_t begin, size_t end) {
+  vivf_job_t *job = (vivf_job_t *)ctx;
+  vivf_t *ivf = job->ivf;
+  size_t dim = ivf->dim;
+  size_t tile = vknn_tile_rows(dim);
+  size_t nlist = ivf->nlist;
+  size_t scratch_floats = tile * dim + 2 * tile + 2 * nlist + job->nprobe;
+  float *scratch = (float *)malloc(scratch_floats * sizeof(float));
+  size_t *probes = (size_t *)malloc(job->nprobe * sizeof(size_t) + 1);
+  if (scratch == NULL || probes == NULL) {
+    free(scratch);
+    free(probes);
+    job->failed = 1;
+    return;
+  }
+  float *dots = scratch + tile * dim;
+  float *scores = dots + tile;
+  float *cdots = scores + tile;
+  float *cscores = cdots + nlist;
+  float *probe_val = cscores + nlist;
+
+  for (size_t q = begin; q < end; q++) {
+    float *query = job->queries + q * dim;
+    size_t *idx = job->out_idx + q * job->k;
+    float *val = job->out_val + q * job->k;
+    float qnorm2 = vdot_f32(query, query, dim);
+
+    // pick the nprobe lists whose centroids score best under the metric
+    vdot_batch_f32(query, ivf->centroids, nlist, dim, dim, cdots);
+    vknn_scores(job->metric, cdots, nlist, qnorm2, ivf->cnorms, cscores);
+    size_t np = vtopk_f32(cscores, nlist, job->nprobe, probes, probe_val);
+
+    vtopk_t t;
+    vtopk_init(&t, job->k, idx, val);
+    for (size_t p = 0; p < np; p++) {
+      size_t lbegin = (size_t)ivf->offsets[probes[p]];
+      size_t lend = (size_t)ivf->offsets[probes[p] + 1];
+      for (size_t r = lbegin; r < lend; r += tile) {
+        size_t n = lend - r < tile ? lend - r : tile;
+        size_t stride;
+        float *rows = vstore_rows_f32(&ivf->lists, r, n, scratch, &stride);
+        vdot_batch_f32(query, rows, n, dim, stride, dots);
+        vknn_scores(job->metric, dots, n, qnorm2, ivf->norms + r, scores);
+        vtopk_push_f32(&t, scores, n, r);
+      }
+    }
+    size_t count = vtopk_finish(&t);
+    for (size_t j = 0; j < count; j++) {
+      idx[j] = (size_t)ivf->ids[idx[j]];
+      val[j] = vknn_report(job->metric, val[j]);
+    }
+    for (size_t j = count; j < job->k; j++) {
+      idx[j] = SIZE_MAX;
+      val[j] = NAN;
+    }
+  }
+  free(scratch);
+  free(probes);
+}
+
+// Approximate top-k of each of nq queries, scanning the nprobe lists whose
+// centroids score best. Queries are spread over nthreads threads (0 = all
+// CPUs). Output is laid out as for vknn_search. Returns 0, or -1 with errno
+// set.
+int vivf_search(vivf_t *ivf, float *queries, size_t nq, size_t k,
+                size_t nprobe, int metric, size_t nthreads, size_t *out_idx,
+                float *out_val) {
+  if (nprobe == 0) {
+    nprobe = 1;
+  }
+  if (nprobe > ivf->nlist) {
+    nprobe = ivf->nlist;
+  }
+  vivf_job_t job = {ivf, queries, k, nprobe, metric, out_idx, out_val, 0};
+  vthread_parallel_for(nq, nthreads, 1, _vivf_search, &job);
+  if (job.failed) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+#endif // VIVF_H
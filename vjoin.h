@@ -0,0 +1,368 @@
+/* All-pairs similarity join over a vector store */
+#ifndef VJOIN_H
+#define VJOIN_H
+
+#include "vdot.h"
+#include "vknn.h"
+#include "vnormalize.h"
+#include "vstore.h"
+#include "vthread.h"
+#include "vtopk.h"
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every pair of rows i < j whose score passes a threshold is reported: cosine
+// or dot product above it, or squared L2 distance below it. Rows are sorted
+// by their projection p = x . u onto the unit mean direction u, which splits
+// each row into p u plus a residual of norm r. Rows are then cut into tiles
+// and the Gram block of every pair of tiles is computed with vdot_many_f32,
+// unless the tiles' (p, r) ranges prove no pair in it can pass:
+//
+//   dot:    a . b <= pa pb + ra rb
+//   cosine: the same on unit rows, cos(a, b) <= cos(acos(pa) - acos(pb))
+//   l2:     |a - b|^2 >= (pa - pb)^2 + (ra - rb)^2
+//
+// Bounds carry a slack of 1e-3 of the tiles' largest squared norm against
+// rounding. Each Gram row is then compress-stored against the threshold with
+// vtopk_filter_f32, and the survivors are handed to the caller in batches.
+
+// f32 bytes of one tile of rows, and a cap on its rows so a Gram block of
+// two tiles stays in L2
+#define VJOIN_TILE_BYTES (64 * 1024)
+#define VJOIN_MAX_TILE_ROWS 256
+// Pairs buffered per thread before they are passed to the callback
+#define VJOIN_BUFFER 4096
+
+typedef struct vjoin_pair_t {
+  uint64_t i;
+  uint64_t j;
+  float score;
+} vjoin_pair_t;
+
+// Receives a batch of pairs; calls are serialized. A non-zero return, with
+// errno set, stops the join.
+typedef int (*vjoin_emit_fn)(void *ctx, vjoin_pair_t *pairs, size_t n);
+
+typedef struct vjoin_tile_t {
+  float plo;
+  float phi;
+  float rlo;
+  float rhi;
+  float nmax;
+} vjoin_tile_t;
+
+typedef struct vjoin_key_t {
+  float p;
+  float r;
+  size_t id;
+} vjoin_key_t;
+
+typedef struct vjoin_job_t {
+  vstore_t *store;
+  int metric;
+  float threshold;
+  vjoin_key_t *keys;
+  vjoin_tile_t *tiles;
+  size_t tile;
+  size_t ntiles;
+  size_t nslots;
+  vjoin_emit_fn emit;
+  void *ctx;
+  pthread_mutex_t lock;
+  int failed;
+  int error;
+} vjoin_job_t;
+
+static inline size_t _vjoin_tile_rows(size_t dim) {
+  size_t rows = VJOIN_TILE_BYTES / (dim * sizeof(float) + 1);
+  rows = rows < 4 ? 4 : rows;
+  return rows > VJOIN_MAX_TILE_ROWS ? VJOIN_MAX_TILE_ROWS : rows;
+}
+
+static inline int _vjoin_cmp_key(const void *a, const void *b) {
+  float x = ((const vjoin_key_t *)a)->p, y = ((const vjoin_key_t *)b)->p;
+  return x < y ? -1 : x > y;
+}
+
+// Whether some pair of rows from tiles a <= b may pass the threshold
+static inline int _vjoin_tiles_may_pass(vjoin_job_t *job, vjoin_tile_t *a,
+                                        vjoin_tile_t *b) {
+  switch (job->metric) {
+  case VKNN_COSINE: {
+    // tiles are in increasing p, so the closest angles are a's top and b's
+    // bottom. Zero rows score 0, which the bound only misses below 0.
+    if (job->threshold < 0.0f) {
+      return 1;
+    }
+    float gap = acosf(fmaxf(fminf(a->phi, 1.0f), -1.0f)) -
+                acosf(fmaxf(fminf(b->plo, 1.0f), -1.0f));
+    return gap <= 0.0f || cosf(gap) + 1e-3f > job->threshold;
+  }
+  case VKNN_L2: {
+    float dp = fmaxf(0.0f, fmaxf(b->plo - a->phi, a->plo - b->phi));
+    float dr = fmaxf(0.0f, fmaxf(b->rlo - a->rhi, a->rlo - b->rhi));
+    float n = a->nmax + b->nmax;
+    return dp * dp + dr * dr - 1e-3f * n * n < job->threshold;
+  }
+  default: {
+    float pp = fmaxf(fmaxf(a->plo * b->plo, a->plo * b->phi),
+                     fmaxf(a->phi * b->plo, a->phi * b->phi));
+    return pp + a->rhi * b->rhi + 1e-3f * a->nmax * b->nmax > job->threshold;
+  }
+  }
+}
+
+// Decode the rows of tile t, in sorted order, into out (dim floats apart),
+// with their squared norms in norms
+static inline size_t _vjoin_gather(vjoin_job_t *job, size_t t, float *out,
+                                   float *norms) {
+  vstore_t *store = job->store;
+  size_t dim = store->dim;
+  size_t begin = t * job->tile;
+  size_t n = store->count - begin < job->tile ? store->count - begin : job->tile;
+  for (size_t i = 0; i < n; i++) {
+    size_t stride;
+    float *dst = out + i * dim;
+    float *row = vstore_rows_f32(store, job->keys[begin + i].id, 1, dst, &stride);
+    if (row != dst) {
+      memcpy(dst, row, dim * sizeof(float));
+    }
+    if (job->metric == VKNN_COSINE) {
+      vnormalize_row_f32(dst, dim);
+    }
+    norms[i] = vdot_f32(dst, dst, dim);
+  }
+  return n;
+}
+
+static inline int _vjoin_flush(vjoin_job_t *job, vjoin_pair_t *pairs,
+                               size_t n) {
+  if (n == 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&job->lock);
+  if (!job->failed && job->emit(job->ctx, pairs, n) != 0) {
+    job->failed = 1;
+    job->error = errno;
+  }
+  int failed = job->failed;
+  pthread_mutex_unlock(&job->lock);
+  return failed;
+}
+
+static inline void _vjoin_slot(vjoin_job_t *job, size_t slot) {
+  size_t dim = job->store->dim;
+  size_t tile = job->tile;
+  float *buf = (float *)malloc((2 * tile * dim + tile * tile + 5 * tile) *
+                               sizeof(float));
+  vjoin_pair_t *pairs = (vjoin_pair_t *)malloc(VJOIN_BUFFER * sizeof(vjoin_pair_t));
+  uint32_t *hit_idx = (uint32_t *)malloc(tile * sizeof(uint32_t));
+  if (buf == NULL || pairs == NULL || hit_idx == NULL) {
+    free(buf);
+    free(pairs);
+    free(hit_idx);
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    job->error = ENOMEM;
+    pthread_mutex_unlock(&job->lock);
+    return;
+  }
+  float *a = buf;
+  float *b = a + tile * dim;
+  float *gram = b + tile * dim;
+  float *anorm = gram + tile * tile;
+  float *bnorm = anorm + tile;
+  float *scores = bnorm + tile;
+  float *hit_val = scores + tile;
+  float threshold =
+      job->metric == VKNN_L2 ? -job->threshold : job->threshold;
+  size_t count = 0;
+  int stop = 0;
+  // tile rows are dealt round-robin so every slot gets a share of the long
+  // and the short rows of the triangle
+  for (size_t ta = slot; ta < job->ntiles && !stop; ta += job->nslots) {
+    size_t na = _vjoin_gather(job, ta, a, anorm);
+    for (size_t tb = ta; tb < job->ntiles && !stop; tb++) {
+      if (!_vjoin_tiles_may_pass(job, &job->tiles[ta], &job->tiles[tb])) {
+        if (job->metric == VKNN_COSINE) {
+          // the angle gap only grows with tb
+          break;
+        }
+        continue;
+      }
+      size_t nb = ta == tb ? na : _vjoin_gather(job, tb, b, bnorm);
+      float *rows = ta == tb ? a : b;
+      float *norms = ta == tb ? anorm : bnorm;
+      vdot_many_f32(a, na, dim, rows, nb, dim, dim, gram, nb);
+      for (size_t i = 0; i < na && !stop; i++) {
+        size_t start = ta == tb ? i + 1 : 0;
+        if (start >= nb) {
+          continue;
+        }
+        float *row = gram + i * nb + start;
+        if (job->metric == VKNN_L2) {
+          vknn_scores(VKNN_L2, row, nb - start, anorm[i], norms + start,
+                      scores);
+          row = scores;
+        }
+        size_t hits = vtopk_filter_f32(row, nb - start, threshold, hit_val,
+                                       hit_idx);
+        size_t id = job->keys[ta * tile + i].id;
+        for (size_t h = 0; h < hits && !stop; h++) {
+          size_t other = job->keys[tb * tile + start + hit_idx[h]].id;
+          pairs[count].i = id < other ? id : other;
+          pairs[count].j = id < other ? other : id;
+          pairs[count].score = vknn_report(job->metric, hit_val[h]);
+          if (++count == VJOIN_BUFFER) {
+            stop = _vjoin_flush(job, pairs, count);
+            count = 0;
+          }
+        }
+      }
+    }
+  }
+  if (!stop) {
+    _vjoin_flush(job, pairs, count);
+  }
+  free(buf);
+  free(pairs);
+  free(hit_idx);
+}
+
+static inline void _vjoin_run(void *ctx, size_t begin, size_t end) {
+  for (size_t slot = begin; slot < end; slot++) {
+    _vjoin_slot((vjoin_job_t *)ctx, slot);
+  }
+}
+
+// Sort keys: every row's projection on the unit mean direction and the norm
+// of what is left. Cosine joins work on unit rows.
+static inline int _vjoin_keys(vstore_t *store, int metric, vjoin_key_t *keys) {
+  size_t dim = store->dim;
+  size_t tile = _vjoin_tile_rows(dim);
+  float *scratch = (float *)malloc((tile + 1) * dim * sizeof(float));
+  double *mean = (double *)calloc(dim, sizeof(double));
+  float *u = (float *)malloc(dim * sizeof(float));
+  if (scratch == NULL || mean == NULL || u == NULL) {
+    free(scratch);
+    free(mean);
+    free(u);
+    return -1;
+  }
+  float *row = scratch + tile * dim;
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t r = 0; r < store->count; r += tile) {
+      size_t n = store->count - r < tile ? store->count - r : tile;
+      size_t stride;
+      float *rows = vstore_rows_f32(store, r, n, scratch, &stride);
+      for (size_t i = 0; i < n; i++) {
+        memcpy(row, rows + i * stride, dim * sizeof(float));
+        if (metric == VKNN_COSINE) {
+          vnormalize_row_f32(row, dim);
+        }
+        if (pass == 0) {
+          for (size_t d = 0; d < dim; d++) {
+            mean[d] += row[d];
+          }
+        } else {
+          // the residual is formed explicitly: norm2 - p^2 cancels badly
+          float p = vdot_f32(row, u, dim);
+          float r2 = 0.0f;
+          for (size_t d = 0; d < dim; d++) {
+            float e = row[d] - p * u[d];
+            r2 += e * e;
+          }
+          keys[r + i].p = p;
+          keys[r + i].r = sqrtf(r2);
+          keys[r + i].id = r + i;
+        }
+      }
+    }
+    if (pass == 0) {
+      for (size_t d = 0; d < dim; d++) {
+        u[d] = (float)mean[d];
+      }
+      if (!(vdot_f32(u, u, dim) > 0.0f)) {
+        // no mean direction: any axis gives valid bounds
+        memset(u, 0, dim * sizeof(float));
+        u[0] = 1.0f;
+      }
+      vnormalize_row_f32(u, dim);
+    }
+  }
+  qsort(keys, store->count, sizeof(vjoin_key_t), _vjoin_cmp_key);
+  free(scratch);
+  free(mean);
+  free(u);
+  return 0;
+}
+
+// Report every pair i < j of store rows whose score under metric passes
+// threshold: cosine similarity or dot product greater than it, or squared L2
+// distance less than it. Pairs reach emit in batches, in no particular order,
+// with scores in the metric's natural units. Tiles are spread over nthreads
+// threads (0 = all CPUs). Returns 0, or -1 with errno set (ENOMEM, or the
+// errno left by a failing emit).
+int vjoin_self(vstore_t *store, float threshold, int metric, size_t nthreads,
+               vjoin_emit_fn emit, void *ctx) {
+  size_t dim = store->dim;
+  if (store->count < 2 || dim == 0) {
+    return 0;
+  }
+  if (nthreads == 0) {
+    nthreads = vthread_count();
+  }
+  size_t tile = _vjoin_tile_rows(dim);
+  size_t ntiles = (store->count + tile - 1) / tile;
+  vjoin_key_t *keys = (vjoin_key_t *)malloc(store->count * sizeof(vjoin_key_t));
+  vjoin_tile_t *tiles = (vjoin_tile_t *)malloc(ntiles * sizeof(vjoin_tile_t));
+  if (keys == NULL || tiles == NULL || _vjoin_keys(store, metric, keys) != 0) {
+    free(keys);
+    free(tiles);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (size_t t = 0; t < ntiles; t++) {
+    size_t end = (t + 1) * tile < store->count ? (t + 1) * tile : store->count;
+    vjoin_tile_t *s = &tiles[t];
+    s->plo = keys[t * tile].p;
+    s->phi = keys[end - 1].p;
+    s->rlo = s->rhi = keys[t * tile].r;
+    s->nmax = 0.0f;
+    for (size_t i = t * tile; i < end; i++) {
+      s->rlo = fminf(s->rlo, keys[i].r);
+      s->rhi = fmaxf(s->rhi, keys[i].r);
+      s->nmax = fmaxf(s->nmax, sqrtf(keys[i].p * keys[i].p + keys[i].r * keys[i].r));
+    }
+  }
+  size_t nslots = nthreads < ntiles ? nthreads : ntiles;
+  vjoin_job_t job;
+  job.store = store;
+  job.metric = metric;
+  job.threshold = threshold;
+  job.keys = keys;
+  job.tiles = tiles;
+  job.tile = tile;
+  job.ntiles = ntiles;
+  job.nslots = nslots;
+  job.emit = emit;
+  job.ctx = ctx;
+  job.failed = 0;
+  job.error = 0;
+  pthread_mutex_init(&job.lock, NULL);
+  vthread_parallel_for(nslots, nslots, 1, _vjoin_run, &job);
+  pthread_mutex_destroy(&job.lock);
+  free(keys);
+  free(tiles);
+  if (job.failed) {
+    errno = job.error;
+    return -1;
+  }
+  return 0;
+}
+
+#endif // VJOIN_H
@@ -0,0 +1,177 @@
+/* Table of the compiled dot product kernels */
+#ifndef VKERNELS_H
+#define VKERNELS_H
+
+#include "simdinfo.h"
+#include "vdot.h"
+#include <stddef.h>
+
+// The public entry points (vdot_f32, vdot_batch_f32, ...) each run the best
+// kernel for the CPU. Benchmarks and conformance tests need the others too:
+// vkernel_list names every kernel this translation unit compiled, whether or
+// not the running CPU can execute it.
+
+enum vkernel_type_t {
+  // float (*)(float *a, float *b, size_t size)
+  VKERNEL_F32 = 0,
+  // vdot_batch4_f32_fn: one query against four rows
+  VKERNEL_BATCH4_F32 = 1,
+  // vdot_i8_fn
+  VKERNEL_I8 = 2,
+  // vdot_half_fn, f16 / bf16 second operand
+  VKERNEL_F16_F32 = 3,
+  VKERNEL_BF16_F32 = 4,
+};
+
+enum vkernel_mode_t {
+  // plain (FMA) accumulation
+  VKERNEL_FAST = 0,
+  // Kahan-compensated accumulation
+  VKERNEL_COMPENSATED = 1,
+  // integer accumulation, no rounding
+  VKERNEL_EXACT = 2,
+};
+
+#define VKERNEL_MAX 32
+
+typedef float (*vkernel_f32_fn)(float *, float *, size_t);
+
+typedef struct vkernel_t {
+  // "<type>_<isa>", e.g. "f32_avx512f"
+  const char *name;
+  const char *isa;
+  int type;
+  int mode;
+  // whether the running CPU has the instructions the kernel uses
+  int supported;
+  union {
+    vkernel_f32_fn f32;
+    vdot_batch4_f32_fn batch4;
+    vdot_i8_fn i8;
+    vdot_half_fn half;
+  } fn;
+} vkernel_t;
+
+static inline const char *vkernel_type_name(int type) {
+  const char *names[] = {"f32", "batch4_f32", "i8", "f16_f32", "bf16_f32"};
+  return type >= 0 && type <= VKERNEL_BF16_F32 ? names[type] : "?";
+}
+
+static inline const char *vkernel_mode_name(int mode) {
+  const char *names[] = {"fast", "compensated", "exact"};
+  return mode >= 0 && mode <= VKERNEL_EXACT ? names[mode] : "?";
+}
+
+#define _VKERNEL_ADD(field, kname, kisa, ktype, kmode, ksupported, kfn)         \
+  do {                                                                         \
+    vkernel_t *k = &out[n++];                                                  \
+    k->name = kname;                                                           \
+    k->isa = kisa;                                                             \
+    k->type = ktype;                                                           \
+    k->mode = kmode;                                                           \
+    k->supported = (ksupported) != 0;                                          \
+    k->fn.field = kfn;                                                         \
+  } while (0)
+
+// Fill out (room for VKERNEL_MAX) with every compiled kernel, serial ones
+// first, and return how many there are
+size_t vkernel_list(vkernel_t *out) {
+  simdinfo_t info = simdinfo();
+  size_t n = 0;
+  (void)info;
+
+  _VKERNEL_ADD(f32, "f32_serial", "serial", VKERNEL_F32, VKERNEL_COMPENSATED,
+               1, _vdot_f32_serial);
+  _VKERNEL_ADD(batch4, "batch4_f32_serial", "serial", VKERNEL_BATCH4_F32,
+               VKERNEL_FAST, 1, _vdot_batch4_f32_serial);
+  _VKERNEL_ADD(i8, "i8_serial", "serial", VKERNEL_I8, VKERNEL_EXACT, 1,
+               _vdot_i8_serial);
+  _VKERNEL_ADD(half, "f16_f32_serial", "serial", VKERNEL_F16_F32, VKERNEL_FAST,
+               1, _vdot_f16_f32_serial);
+  _VKERNEL_ADD(half, "bf16_f32_serial", "serial", VKERNEL_BF16_F32,
+               VKERNEL_FAST, 1, _vdot_bf16_f32_serial);
+
+// x86
+#if defined(__AVX__) || defined(__AVX2__)
+  _VKERNEL_ADD(f32, "f32_avx", "avx", VKERNEL_F32, VKERNEL_COMPENSATED,
+               SIMDINFO_SUPPORTS(info, __AVX__) ||
+                   SIMDINFO_SUPPORTS(info, __AVX2__),
+               _vdot_f32_avx);
+#endif // __AVX__ || __AVX2__
+#if defined(__AVX2__) && defined(__FMA__)
+  _VKERNEL_ADD(batch4, "batch4_f32_avx2", "avx2", VKERNEL_BATCH4_F32,
+               VKERNEL_FAST,
+               SIMDINFO_SUPPORTS(info, __AVX2__) &&
+                   SIMDINFO_SUPPORTS(info, __FMA__),
+               _vdot_batch4_f32_avx2);
+  _VKERNEL_ADD(half, "bf16_f32_avx2", "avx2", VKERNEL_BF16_F32, VKERNEL_FAST,
+               SIMDINFO_SUPPORTS(info, __AVX2__) &&
+                   SIMDINFO_SUPPORTS(info, __FMA__),
+               _vdot_bf16_f32_avx2);
+#endif // __AVX2__ && __FMA__
+#if defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+  _VKERNEL_ADD(half, "f16_f32_avx2", "avx2", VKERNEL_F16_F32, VKERNEL_FAST,
+               SIMDINFO_SUPPORTS(info, __AVX2__) &&
+                   SIMDINFO_SUPPORTS(info, __FMA__) &&
+                   SIMDINFO_SUPPORTS(info, __F16C__),
+               _vdot_f16_f32_avx2);
+#endif // __AVX2__ && __FMA__ && __F16C__
+#if defined(__AVX2__)
+  _VKERNEL_ADD(i8, "i8_avx2", "avx2", VKERNEL_I8, VKERNEL_EXACT,
+               SIMDINFO_SUPPORTS(info, __AVX2__), _vdot_i8_avx2);
+#endif // __AVX2__
+#if defined(__AVX512F__)
+  _VKERNEL_ADD(f32, "f32_avx512f", "avx512f", VKERNEL_F32, VKERNEL_FAST,
+               SIMDINFO_SUPPORTS(info, __AVX512F__), vdot_avx512f);
+  _VKERNEL_ADD(batch4, "batch4_f32_avx512f", "avx512f", VKERNEL_BATCH4_F32,
+               VKERNEL_FAST, SIMDINFO_SUPPORTS(info, __AVX512F__),
+               _vdot_batch4_f32_avx512f);
+  _VKERNEL_ADD(half, "f16_f32_avx512f", "avx512f", VKERNEL_F16_F32,
+               VKERNEL_FAST, SIMDINFO_SUPPORTS(info, __AVX512F__),
+               _vdot_f16_f32_avx512f);
+  _VKERNEL_ADD(half, "bf16_f32_avx512f", "avx512f", VKERNEL_BF16_F32,
+               VKERNEL_FAST, SIMDINFO_SUPPORTS(info, __AVX512F__),
+               _vdot_bf16_f32_avx512f);
+#endif // __AVX512F__
+#if defined(__AVX512BW__)
+  _VKERNEL_ADD(i8, "i8_avx512bw", "avx512bw", VKERNEL_I8, VKERNEL_EXACT,
+               SIMDINFO_SUPPORTS(info, __AVX512BW__), _vdot_i8_avx512bw);
+#endif // __AVX512BW__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  _VKERNEL_ADD(f32, "f32_sve", "sve", VKERNEL_F32, VKERNEL_FAST,
+               SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE), vdot_sve);
+  _VKERNEL_ADD(batch4, "batch4_f32_sve", "sve", VKERNEL_BATCH4_F32,
+               VKERNEL_FAST, SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE),
+               _vdot_batch4_f32_sve);
+  _VKERNEL_ADD(i8, "i8_sve", "sve", VKERNEL_I8, VKERNEL_EXACT,
+               SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE), _vdot_i8_sve);
+  _VKERNEL_ADD(half, "f16_f32_sve", "sve", VKERNEL_F16_F32, VKERNEL_FAST,
+               SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE), _vdot_f16_f32_sve);
+  _VKERNEL_ADD(half, "bf16_f32_sve", "sve", VKERNEL_BF16_F32, VKERNEL_FAST,
+               SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE),
+               _vdot_bf16_f32_sve);
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON)
+  _VKERNEL_ADD(f32, "f32_neon", "neon", VKERNEL_F32, VKERNEL_COMPENSATED,
+               SIMDINFO_SUPPORTS(info, __ARM_NEON), _vdot_f32_neon);
+#endif // __ARM_NEON
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  _VKERNEL_ADD(batch4, "batch4_f32_neon", "neon", VKERNEL_BATCH4_F32,
+               VKERNEL_FAST, SIMDINFO_SUPPORTS(info, __ARM_NEON),
+               _vdot_batch4_f32_neon);
+  _VKERNEL_ADD(i8, "i8_neon", "neon", VKERNEL_I8, VKERNEL_EXACT,
+               SIMDINFO_SUPPORTS(info, __ARM_NEON), _vdot_i8_neon);
+  _VKERNEL_ADD(half, "f16_f32_neon", "neon", VKERNEL_F16_F32, VKERNEL_FAST,
+               SIMDINFO_SUPPORTS(info, __ARM_NEON), _vdot_f16_f32_neon);
+  _VKERNEL_ADD(half, "bf16_f32_neon", "neon", VKERNEL_BF16_F32, VKERNEL_FAST,
+               SIMDINFO_SUPPORTS(info, __ARM_NEON), _vdot_bf16_f32_neon);
+#endif // __ARM_NEON && __aarch64__
+
+  return n;
+}
+
+#undef _VKERNEL_ADD
+
+#endif // VKERNELS_H
@@ -0,0 +1,379 @@
+/* k-means clustering */
+#ifndef VKMEANS_H
+#define VKMEANS_H
+
+#include "vdot.h"
+#include "vthread.h"
+#include "vtopk.h"
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Points per thread below which assignment stays on one thread
+#define VKMEANS_MIN_POINTS 256
+// Assignment scores a block of points against every centroid at once; the
+// block is sized so its distance matrix stays near this many bytes
+#define VKMEANS_BLOCK_BYTES (256 * 1024)
+
+// xorshift64*: small, fast and good enough for picking sample points
+static inline uint64_t vkmeans_rand(uint64_t *state) {
+  uint64_t x = *state ? *state : 0x9E3779B97F4A7C15ull;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1Dull;
+}
+
+// Uniform double in [0, 1)
+static inline double _vkmeans_uniform(uint64_t *state) {
+  return (double)(vkmeans_rand(state) >> 11) * 0x1.0p-53;
+}
+
+static inline void vkmeans_norms(float *centroids, size_t k, size_t dim,
+                                 float *cnorms) {
+  for (size_t c = 0; c < k; c++) {
+    cnorms[c] = vdot_f32(centroids + c * dim, centroids + c * dim, dim);
+  }
+}
+
+/* Assignment */
+
+typedef struct vkmeans_assign_t {
+  float *x;
+  size_t dim;
+  size_t stride;
+  float *centroids;
+  float *cnorms;
+  size_t k;
+  uint32_t *assign;
+  float *dist;
+  int failed;
+} vkmeans_assign_t;
+
+static inline void _vkmeans_assign(void *ctx, size_t begin, size_t end) {
+  vkmeans_assign_t *job = (vkmeans_assign_t *)ctx;
+  size_t k = job->k;
+  size_t block = VKMEANS_BLOCK_BYTES / (k * sizeof(float));
+  block = block < 1 ? 1 : block;
+  float *dots = (float *)malloc(block * k * sizeof(float));
+  if (dots == NULL) {
+    job->failed = 1;
+    return;
+  }
+  for (size_t i0 = begin; i0 < end; i0 += block) {
+    size_t n = end - i0 < block ? end - i0 : block;
+    float *x = job->x + i0 * job->stride;
+    vdot_many_f32(x, n, job->stride, job->centroids, k, job->dim, job->dim,
+                  dots, k);
+    for (size_t r = 0; r < n; r++) {
+      // ||x - c||^2 = ||x||^2 - 2 x.c + ||c||^2, and ||x||^2 is the same for
+      // every centroid, so only the last two terms decide the argmin
+      float *row = dots + r * k;
+      for (size_t c = 0; c < k; c++) {
+        row[c] = job->cnorms[c] - 2.0f * row[c];
+      }
+      size_t best = vargmin_f32(row, k);
+      best = best == SIZE_MAX ? 0 : best;
+      job->assign[i0 + r] = (uint32_t)best;
+      if (job->dist != NULL) {
+        float *p = x + r * job->stride;
+        float d = row[best] + vdot_f32(p, p, job->dim);
+        job->dist[i0 + r] = d > 0.0f ? d : 0.0f;
+      }
+    }
+  }
+  free(dots);
+}
+
+// Nearest centroid (squared L2) of each of n points, stride floats apart.
+// cnorms holds the centroids' squared norms; dist, if not NULL, receives the
+// squared distance to the chosen centroid. Returns 0, or -1 with errno set.
+int vkmeans_assign(float *x, size_t n, size_t dim, size_t stride,
+                   float *centroids, float *cnorms, size_t k, size_t nthreads,
+                   uint32_t *assign, float *dist) {
+  vkmeans_assign_t job = {x, dim, stride, centroids, cnorms, k, assign, dist, 0};
+  vthread_parallel_for(n, nthreads, VKMEANS_MIN_POINTS, _vkmeans_assign, &job);
+  if (job.failed) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+/* k-means++ seeding */
+
+typedef struct vkmeans_seed_t {
+  float *x;
+  size_t dim;
+  size_t stride;
+  float *xnorms;
+  float *center;
+  float cnorm;
+  float *dots;
+  float *mind;
+} vkmeans_seed_t;
+
+// Lower each point's squared distance to its nearest center so far with the
+// distance to the newest center
+static inline void _vkmeans_seed(void *ctx, size_t begin, size_t end) {
+  vkmeans_seed_t *job = (vkmeans_seed_t *)ctx;
+  vdot_batch_f32(job->center, job->x + begin * job->stride, end - begin,
+                 job->dim, job->stride, job->dots + begin);
+  for (size_t i = begin; i < end; i++) {
+    float d = job->xnorms[i] + job->cnorm - 2.0f * job->dots[i];
+    d = d > 0.0f ? d : 0.0f;
+    job->mind[i] = d < job->mind[i] ? d : job->mind[i];
+  }
+}
+
+// k-means++: the first center is a uniform pick, each next one a point drawn
+// with probability proportional to its squared distance to the nearest
+// center already chosen. Returns 0, or -1 with errno set.
+static inline int _vkmeans_plusplus(float *x, size_t n, size_t dim,
+                                    size_t stride, size_t k, size_t nthreads,
+                                    uint64_t *rng, float *centroids) {
+  float *buf = (float *)malloc(3 * n * sizeof(float));
+  if (buf == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  vkmeans_seed_t job = {x, dim, stride, buf, NULL, 0.0f, buf + n, buf + 2 * n};
+  for (size_t i = 0; i < n; i++) {
+    job.xnorms[i] = vdot_f32(x + i * stride, x + i * stride, dim);
+    job.mind[i] = INFINITY;
+  }
+  size_t pick = (size_t)(vkmeans_rand(rng) % n);
+  for (size_t c = 0; c < k; c++) {
+    float *center = centroids + c * dim;
+    memcpy(center, x + pick * stride, dim * sizeof(float));
+    if (c + 1 == k) {
+      break;
+    }
+    job.center = center;
+    job.cnorm = job.xnorms[pick];
+    vthread_parallel_for(n, nthreads, VKMEANS_MIN_POINTS, _vkmeans_seed, &job);
+    double total = 0.0;
+    for (size_t i = 0; i < n; i++) {
+      total += job.mind[i];
+    }
+    if (!(total > 0.0)) {
+      // every point already sits on a center
+      pick = (size_t)(vkmeans_rand(rng) % n);
+      continue;
+    }
+    double target = _vkmeans_uniform(rng) * total, acc = 0.0;
+    pick = n - 1;
+    for (size_t i = 0; i < n; i++) {
+      acc += job.mind[i];
+      if (acc > target) {
+        pick = i;
+        break;
+      }
+    }
+  }
+  free(buf);
+  return 0;
+}
+
+/* Centroid updates */
+
+// Counting sort of point indices by centroid: the points of centroid c are
+// order[start[c] .. start[c + 1])
+static inline void _vkmeans_group(uint32_t *assign, size_t n, size_t k,
+                                  size_t *start, uint32_t *order) {
+  memset(start, 0, (k + 1) * sizeof(size_t));
+  for (size_t i = 0; i < n; i++) {
+    start[assign[i] + 1]++;
+  }
+  for (size_t c = 0; c < k; c++) {
+    start[c + 1] += start[c];
+  }
+  for (size_t i = 0; i < n; i++) {
+    order[start[assign[i]]++] = (uint32_t)i;
+  }
+  for (size_t c = k; c > 0; c--) {
+    start[c] = start[c - 1];
+  }
+  start[0] = 0;
+}
+
+typedef struct vkmeans_update_t {
+  float *x;
+  size_t dim;
+  size_t stride;
+  size_t *start;
+  uint32_t *order;
+  float *centroids;
+  // running point counts for mini-batch updates, NULL for a Lloyd step
+  size_t *counts;
+  int failed;
+} vkmeans_update_t;
+
+// Update centroids [begin, end). Centroids are split across threads, so each
+// one is written by exactly one thread and the result does not depend on the
+// thread count.
+static inline void _vkmeans_update(void *ctx, size_t begin, size_t end) {
+  vkmeans_update_t *job = (vkmeans_update_t *)ctx;
+  size_t dim = job->dim;
+  double *sum = (double *)malloc(dim * sizeof(double));
+  if (sum == NULL) {
+    job->failed = 1;
+    return;
+  }
+  for (size_t c = begin; c < end; c++) {
+    float *cen = job->centroids + c * dim;
+    size_t lo = job->start[c], hi = job->start[c + 1];
+    if (job->counts != NULL) {
+      // mini-batch: each point pulls the centroid toward it with a step of
+      // 1 / (points seen so far)
+      for (size_t j = lo; j < hi; j++) {
+        float *p = job->x + (size_t)job->order[j] * job->stride;
+        float eta = 1.0f / (float)(++job->counts[c]);
+        for (size_t d = 0; d < dim; d++) {
+          cen[d] += eta * (p[d] - cen[d]);
+        }
+      }
+      continue;
+    }
+    if (lo == hi) {
+      continue;
+    }
+    memset(sum, 0, dim * sizeof(double));
+    for (size_t j = lo; j < hi; j++) {
+      float *p = job->x + (size_t)job->order[j] * job->stride;
+      for (size_t d = 0; d < dim; d++) {
+        sum[d] += p[d];
+      }
+    }
+    for (size_t d = 0; d < dim; d++) {
+      cen[d] = (float)(sum[d] / (double)(hi - lo));
+    }
+  }
+  free(sum);
+}
+
+/* Training */
+
+// Lloyd's k-means on n points of dim floats (stride floats apart), writing k
+// centroids of dim floats. Centroids are seeded with k-means++; a centroid
+// that loses all its points is moved to a random point. Assignment and
+// updates run on nthreads threads (0 = all CPUs). Returns 0, or -1 with
+// errno set.
+int vkmeans_train(float *x, size_t n, size_t dim, size_t stride, size_t k,
+                  size_t iters, size_t nthreads, uint64_t seed,
+                  float *centroids) {
+  if (k == 0 || n < k || n > UINT32_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint64_t rng = seed;
+  if (_vkmeans_plusplus(x, n, dim, stride, k, nthreads, &rng, centroids) != 0) {
+    return -1;
+  }
+
+  float *cnorms = (float *)malloc(k * sizeof(float));
+  uint32_t *assign = (uint32_t *)malloc(2 * n * sizeof(uint32_t));
+  size_t *start = (size_t *)malloc((k + 1) * sizeof(size_t));
+  int status = 0;
+  if (cnorms == NULL || assign == NULL || start == NULL) {
+    errno = ENOMEM;
+    status = -1;
+  }
+  for (size_t it = 0; it < iters && status == 0; it++) {
+    vkmeans_norms(centroids, k, dim, cnorms);
+    if (vkmeans_assign(x, n, dim, stride, centroids, cnorms, k, nthreads,
+                       assign, NULL) != 0) {
+      status = -1;
+      break;
+    }
+    uint32_t *order = assign + n;
+    _vkmeans_group(assign, n, k, start, order);
+    vkmeans_update_t job = {x, dim, stride, start, order, centroids, NULL, 0};
+    vthread_parallel_for(k, nthreads, 1, _vkmeans_update, &job);
+    if (job.failed) {
+      errno = ENOMEM;
+      status = -1;
+      break;
+    }
+    for (size_t c = 0; c < k; c++) {
+      if (start[c] == start[c + 1]) {
+        size_t pick = (size_t)(vkmeans_rand(&rng) % n);
+        memcpy(centroids + c * dim, x + pick * stride, dim * sizeof(float));
+      }
+    }
+  }
+  free(cnorms);
+  free(assign);
+  free(start);
+  return status;
+}
+
+// Mini-batch k-means: `steps` rounds, each assigning `batch` points drawn at
+// random and moving every centroid toward its new points with a per-centroid
+// learning rate of 1 / (points it has seen). Each step costs batch * k dot
+// products regardless of n, which makes this the option for very large
+// training sets. Seeding is k-means++ on an evenly spaced sample of
+// max(batch, 4k) points. Returns 0, or -1 with errno set.
+int vkmeans_train_minibatch(float *x, size_t n, size_t dim, size_t stride,
+                            size_t k, size_t batch, size_t steps,
+                            size_t nthreads, uint64_t seed, float *centroids) {
+  if (k == 0 || n < k || batch == 0 || n > UINT32_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  size_t nseed = batch > 4 * k ? batch : 4 * k;
+  nseed = nseed < n ? nseed : n;
+  size_t rows = batch > nseed ? batch : nseed;
+  float *sample = (float *)malloc(rows * dim * sizeof(float));
+  float *cnorms = (float *)malloc(k * sizeof(float));
+  uint32_t *assign = (uint32_t *)malloc(2 * batch * sizeof(uint32_t));
+  size_t *start = (size_t *)malloc((k + 1) * sizeof(size_t));
+  size_t *counts = (size_t *)calloc(k, sizeof(size_t));
+  uint64_t rng = seed;
+  int status = 0;
+  if (sample == NULL || cnorms == NULL || assign == NULL || start == NULL ||
+      counts == NULL) {
+    errno = ENOMEM;
+    status = -1;
+  }
+  if (status == 0) {
+    for (size_t i = 0; i < nseed; i++) {
+      memcpy(sample + i * dim, x + (n * i / nseed) * stride,
+             dim * sizeof(float));
+    }
+    status = _vkmeans_plusplus(sample, nseed, dim, dim, k, nthreads, &rng,
+                               centroids);
+  }
+  for (size_t step = 0; step < steps && status == 0; step++) {
+    for (size_t i = 0; i < batch; i++) {
+      size_t pick = (size_t)(vkmeans_rand(&rng) % n);
+      memcpy(sample + i * dim, x + pick * stride, dim * sizeof(float));
+    }
+    vkmeans_norms(centroids, k, dim, cnorms);
+    if (vkmeans_assign(sample, batch, dim, dim, centroids, cnorms, k,
+                       nthreads, assign, NULL) != 0) {
+      status = -1;
+      break;
+    }
+    uint32_t *order = assign + batch;
+    _vkmeans_group(assign, batch, k, start, order);
+    vkmeans_update_t job = {sample, dim, dim, start, order, centroids, counts, 0};
+    vthread_parallel_for(k, nthreads, 1, _vkmeans_update, &job);
+    if (job.failed) {
+      errno = ENOMEM;
+      status = -1;
+    }
+  }
+  free(sample);
+  free(cnorms);
+  free(assign);
+  free(start);
+  free(counts);
+  return status;
+}
+
+#endif // VKMEANS_H
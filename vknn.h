@@ -0,0 +1,215 @@
+/* Exact k-nearest-neighbor search over a vector store */
+#ifndef VKNN_H
+#define VKNN_H
+
+#include "vdot.h"
+#include "vstore.h"
+#include "vthread.h"
+#include "vtopk.h"
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+enum vknn_metric_t {
+  VKNN_DOT = 0,
+  VKNN_COSINE = 1,
+  VKNN_L2 = 2,
+};
+
+// Rows are scored a tile at a time; a tile of decoded f32 rows is sized to
+// stay in L2 while every query of the batch runs over it
+#define VKNN_TILE_BYTES (128 * 1024)
+// Upper bound on the per-thread top-k buffers of one query batch
+#define VKNN_BATCH_BYTES (64 * 1024 * 1024)
+
+static inline size_t vknn_tile_rows(size_t dim) {
+  size_t rows = VKNN_TILE_BYTES / (dim * sizeof(float) + 1);
+  rows = rows - rows % 4;
+  return rows < 4 ? 4 : rows;
+}
+
+// Turn dot products into scores where larger is better: the dot product
+// itself, the cosine similarity, or the negated squared L2 distance. norms
+// holds the rows' squared norms and is unused for VKNN_DOT.
+static inline void vknn_scores(int metric, float *dots, size_t n,
+                               float qnorm2, float *norms, float *out) {
+  switch (metric) {
+  case VKNN_COSINE:
+    for (size_t i = 0; i < n; i++) {
+      float denom = sqrtf(qnorm2 * norms[i]);
+      out[i] = denom > 0.0f ? dots[i] / denom : 0.0f;
+    }
+    break;
+  case VKNN_L2:
+    for (size_t i = 0; i < n; i++) {
+      float d = qnorm2 - 2.0f * dots[i] + norms[i];
+      out[i] = d > 0.0f ? -d : -0.0f;
+    }
+    break;
+  default:
+    for (size_t i = 0; i < n; i++) {
+      out[i] = dots[i];
+    }
+    break;
+  }
+}
+
+// Scores are reported as the metric's natural value: L2 results are squared
+// distances (smallest first), everything else is a similarity (largest first)
+static inline float vknn_report(int metric, float score) {
+  return metric == VKNN_L2 ? -score : score;
+}
+
+typedef struct vknn_job_t {
+  vstore_t *store;
+  float *queries;
+  size_t nq;
+  size_t k;
+  int metric;
+  float *qnorm2;
+  size_t nslots;
+  size_t *slot_idx;
+  float *slot_val;
+  size_t *slot_count;
+  int failed;
+} vknn_job_t;
+
+static inline void _vknn_scan_slot(vknn_job_t *job, size_t slot) {
+  vstore_t *store = job->store;
+  size_t dim = store->dim;
+  size_t tile = vknn_tile_rows(dim);
+  size_t begin = store->count * slot / job->nslots;
+  size_t end = store->count * (slot + 1) / job->nslots;
+  float *scratch = (float *)malloc((tile * dim + 3 * tile) * sizeof(float));
+  vtopk_t *heaps = (vtopk_t *)malloc(job->nq * sizeof(vtopk_t));
+  if (scratch == NULL || heaps == NULL) {
+    free(scratch);
+    free(heaps);
+    job->failed = 1;
+    return;
+  }
+  float *norms = scratch + tile * dim;
+  float *dots = norms + tile;
+  float *scores = dots + tile;
+  size_t base = slot * job->nq * job->k;
+  for (size_t q = 0; q < job->nq; q++) {
+    vtopk_init(&heaps[q], job->k, job->slot_idx + base + q * job->k,
+               job->slot_val + base + q * job->k);
+  }
+  for (size_t r = begin; r < end; r += tile) {
+    size_t n = end - r < tile ? end - r : tile;
+    size_t stride;
+    float *rows = vstore_rows_f32(store, r, n, scratch, &stride);
+    if (job->metric != VKNN_DOT) {
+      for (size_t i = 0; i < n; i++) {
+        norms[i] = vdot_f32(rows + i * stride, rows + i * stride, dim);
+      }
+    }
+    for (size_t q = 0; q < job->nq; q++) {
+      vdot_batch_f32(job->queries + q * dim, rows, n, dim, stride, dots);
+      vknn_scores(job->metric, dots, n, job->qnorm2[q], norms, scores);
+      vtopk_push_f32(&heaps[q], scores, n, r);
+    }
+  }
+  for (size_t q = 0; q < job->nq; q++) {
+    job->slot_count[slot * job->nq + q] = heaps[q].count;
+  }
+  free(scratch);
+  free(heaps);
+}
+
+static inline void _vknn_scan(void *ctx, size_t begin, size_t end) {
+  for (size_t slot = begin; slot < end; slot++) {
+    _vknn_scan_slot((vknn_job_t *)ctx, slot);
+  }
+}
+
+// Exact top-k of every query (nq rows of store->dim floats) against all rows
+// of the store. Rows are split across nthreads threads (0 = all CPUs), each
+// keeping per-query top-k buffers that are merged at the end. Results for
+// query q go to out_idx / out_val [q * k, q * k + k), best first; slots past
+// the number of rows are filled with SIZE_MAX / NaN. Returns 0, or -1 with
+// errno set.
+int vknn_search(vstore_t *store, float *queries, size_t nq, size_t k,
+                int metric, size_t nthreads, size_t *out_idx,
+                float *out_val) {
+  size_t dim = store->dim;
+  if (nthreads == 0) {
+    nthreads = vthread_count();
+  }
+  size_t nslots = nthreads;
+  size_t tile = vknn_tile_rows(dim);
+  if (nslots > (store->count + tile - 1) / tile) {
+    nslots = (store->count + tile - 1) / tile;
+  }
+  if (nslots == 0) {
+    nslots = 1;
+  }
+  size_t per_query = nslots * (k + 1) * (sizeof(size_t) + sizeof(float));
+  size_t batch = VKNN_BATCH_BYTES / per_query;
+  batch = batch < 1 ? 1 : batch > nq ? nq : batch;
+
+  float *qnorm2 = (float *)malloc((batch + 1) * sizeof(float));
+  size_t *slot_idx = (size_t *)malloc((nslots * batch * k + 1) * sizeof(size_t));
+  float *slot_val = (float *)malloc((nslots * batch * k + 1) * sizeof(float));
+  size_t *slot_count = (size_t *)malloc((nslots * batch + 1) * sizeof(size_t));
+  if (qnorm2 == NULL || slot_idx == NULL || slot_val == NULL ||
+      slot_count == NULL) {
+    free(qnorm2);
+    free(slot_idx);
+    free(slot_val);
+    free(slot_count);
+    errno = ENOMEM;
+    return -1;
+  }
+  if (nq <= batch) {
+    // a single pass over the store: let the kernel read ahead
+    vstore_advise(store, 0, store->count, VSTORE_SEQUENTIAL);
+  }
+
+  int failed = 0;
+  for (size_t q0 = 0; q0 < nq && !failed; q0 += batch) {
+    size_t nb = nq - q0 < batch ? nq - q0 : batch;
+    float *qs = queries + q0 * dim;
+    for (size_t q = 0; q < nb; q++) {
+      qnorm2[q] = vdot_f32(qs + q * dim, qs + q * dim, dim);
+    }
+    vknn_job_t job = {store,  qs,       nb,         k, metric, qnorm2,
+                      nslots, slot_idx, slot_val, slot_count, 0};
+    vthread_parallel_for(nslots, nslots, 1, _vknn_scan, &job);
+    failed = job.failed;
+
+    for (size_t q = 0; q < nb && !failed; q++) {
+      size_t *idx = out_idx + (q0 + q) * k;
+      float *val = out_val + (q0 + q) * k;
+      vtopk_t t;
+      vtopk_init(&t, k, idx, val);
+      for (size_t s = 0; s < nslots; s++) {
+        size_t base = (s * nb + q) * k;
+        for (size_t j = 0; j < slot_count[s * nb + q]; j++) {
+          vtopk_push1(&t, slot_val[base + j], slot_idx[base + j]);
+        }
+      }
+      size_t count = vtopk_finish(&t);
+      for (size_t j = 0; j < count; j++) {
+        val[j] = vknn_report(metric, val[j]);
+      }
+      for (size_t j = count; j < k; j++) {
+        idx[j] = SIZE_MAX;
+        val[j] = NAN;
+      }
+    }
+  }
+  free(qnorm2);
+  free(slot_idx);
+  free(slot_val);
+  free(slot_count);
+  if (failed) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+#endif // VKNN_H
@@ -0,0 +1,221 @@
+/* In-place L2 normalization of vector batches */
+#ifndef VNORMALIZE_H
+#define VNORMALIZE_H
+
+#include "simdinfo.h"
+#include "vdot.h"
+#include "vthread.h"
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+
+// Rows per thread below which splitting the batch is not worth a thread
+#define VNORMALIZE_MIN_ROWS 64
+
+// Each kernel scales one row by 1 / sqrt(norm2), where norm2 is the row's
+// squared norm from vdot_f32. The reciprocal square root estimates overflow
+// for a subnormal norm2 and give 0 for an infinite one, so the kernels only
+// ever see a normal norm2: rows whose squares overflow or underflow are first
+// rescaled by a power of two. Zero rows and rows holding inf or NaN are left
+// untouched.
+
+/* Fallback scalar implementation */
+
+static inline void _vnormalize_row_f32_serial(float *x, size_t size,
+                                              float norm2) {
+  float inv = 1.0f / sqrtf(norm2);
+  for (size_t i = 0; i < size; i++) {
+    x[i] *= inv;
+  }
+}
+
+#if defined(__AVX__) || defined(__AVX2__)
+
+#include <immintrin.h>
+
+static inline void _vnormalize_row_f32_avx(float *x, size_t size,
+                                           float norm2) {
+  // rsqrtss is good to 12 bits; one Newton step brings it to ~23
+  __m128 a = _mm_set_ss(norm2);
+  __m128 y = _mm_rsqrt_ss(a);
+  __m128 ay2 = _mm_mul_ss(_mm_mul_ss(a, y), y);
+  y = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), y),
+                 _mm_sub_ss(_mm_set_ss(3.0f), ay2));
+  __m256 inv = _mm256_set1_ps(_mm_cvtss_f32(y));
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    _mm256_storeu_ps(x + i, _mm256_mul_ps(_mm256_loadu_ps(x + i), inv));
+  }
+  // left over
+  float s = _mm_cvtss_f32(y);
+  for (size_t i = ssize; i < size; i++) {
+    x[i] *= s;
+  }
+}
+
+#endif // __AVX__ || __AVX2__
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+static inline void _vnormalize_row_f32_avx512f(float *x, size_t size,
+                                               float norm2) {
+  // rsqrt14 is good to 14 bits; one Newton step gives full precision
+  __m128 a = _mm_set_ss(norm2);
+  __m128 y = _mm_rsqrt14_ss(a, a);
+  __m128 ay2 = _mm_mul_ss(_mm_mul_ss(a, y), y);
+  y = _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), y),
+                 _mm_sub_ss(_mm_set_ss(3.0f), ay2));
+  __m512 inv = _mm512_set1_ps(_mm_cvtss_f32(y));
+  for (size_t i = 0; i < size; i += 16) {
+    __mmask16 active = size - i >= 16 ? 0xffff : (__mmask16)((1u << (size - i)) - 1);
+    __m512 v = _mm512_maskz_loadu_ps(active, x + i);
+    _mm512_mask_storeu_ps(x + i, active, _mm512_mul_ps(v, inv));
+  }
+}
+
+#endif // __AVX512F__
+
+/* ARM */
+
+#if defined(__ARM_FEATURE_SVE)
+
+#include <arm_sve.h>
+
+static inline void _vnormalize_row_f32_sve(float *x, size_t size,
+                                           float norm2) {
+  // frsqrte is good to 8 bits; frsqrts does one Newton step, so take two
+  svbool_t all = svptrue_b32();
+  svfloat32_t a = svdup_f32(norm2);
+  svfloat32_t inv = svrsqrte_f32(a);
+  inv = svmul_f32_x(all, inv, svrsqrts_f32(svmul_f32_x(all, a, inv), inv));
+  inv = svmul_f32_x(all, inv, svrsqrts_f32(svmul_f32_x(all, a, inv), inv));
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    svfloat32_t v = svld1_f32(pg, &x[i]);
+    svst1_f32(pg, &x[i], svmul_f32_x(pg, v, inv));
+  }
+}
+
+#endif // __ARM_FEATURE_SVE
+
+#if defined(__ARM_NEON)
+
+#include <arm_neon.h>
+
+static inline void _vnormalize_row_f32_neon(float *x, size_t size,
+                                            float norm2) {
+  // frsqrte is good to 8 bits; frsqrts does one Newton step, so take two
+  float32x4_t a = vdupq_n_f32(norm2);
+  float32x4_t inv = vrsqrteq_f32(a);
+  inv = vmulq_f32(inv, vrsqrtsq_f32(vmulq_f32(a, inv), inv));
+  inv = vmulq_f32(inv, vrsqrtsq_f32(vmulq_f32(a, inv), inv));
+  size_t ssize = size - (size % 4);
+  for (size_t i = 0; i < ssize; i += 4) {
+    vst1q_f32(x + i, vmulq_f32(vld1q_f32(x + i), inv));
+  }
+  // left over
+  float s = vgetq_lane_f32(inv, 0);
+  for (size_t i = ssize; i < size; i++) {
+    x[i] *= s;
+  }
+}
+
+#endif // __ARM_NEON
+
+// Scale x by 2^-e, with e the exponent of its largest magnitude, and return
+// its new squared norm; 0 for a zero row or one that is not finite
+static inline float _vnormalize_rescale(float *x, size_t size) {
+  float max = 0.0f;
+  for (size_t i = 0; i < size; i++) {
+    if (!isfinite(x[i])) {
+      return 0.0f;
+    }
+    max = fabsf(x[i]) > max ? fabsf(x[i]) : max;
+  }
+  if (max == 0.0f) {
+    return 0.0f;
+  }
+  // ldexpf rather than a multiply: 2^-e itself may not be a float
+  int e = ilogbf(max);
+  for (size_t i = 0; i < size; i++) {
+    x[i] = ldexpf(x[i], -e);
+  }
+  return vdot_f32(x, x, size);
+}
+
+// Scale one row of size floats to unit L2 norm, in place
+void vnormalize_row_f32(float *x, size_t size) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+  float norm2 = vdot_f32(x, x, size);
+  if (!(norm2 >= FLT_MIN && norm2 <= FLT_MAX)) {
+    // the largest value is now in [1, 2), so norm2 is in [1, 4 * size)
+    norm2 = _vnormalize_rescale(x, size);
+    if (!(norm2 > 0.0f)) {
+      return;
+    }
+  }
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vnormalize_row_f32_avx512f(x, size, norm2);
+    return;
+  }
+#endif // __AVX512F__
+#if defined(__AVX__) || defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX__) || SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    _vnormalize_row_f32_avx(x, size, norm2);
+    return;
+  }
+#endif // __AVX__ || __AVX2__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    _vnormalize_row_f32_sve(x, size, norm2);
+    return;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    _vnormalize_row_f32_neon(x, size, norm2);
+    return;
+  }
+#endif // __ARM_NEON
+
+  // Default
+  // Fall back to serial implementation
+  _vnormalize_row_f32_serial(x, size, norm2);
+}
+
+typedef struct vnormalize_batch_t {
+  float *x;
+  size_t dim;
+  size_t stride;
+} vnormalize_batch_t;
+
+static inline void _vnormalize_rows(void *ctx, size_t begin, size_t end) {
+  vnormalize_batch_t *batch = (vnormalize_batch_t *)ctx;
+  for (size_t r = begin; r < end; r++) {
+    vnormalize_row_f32(batch->x + r * batch->stride, batch->dim);
+  }
+}
+
+// Normalize `rows` row-major vectors of dim floats, stride floats apart, in
+// place. Each row is read once for its norm and once to scale it while it is
+// still in cache. Rows are split across nthreads threads (0 = all CPUs).
+void vnormalize_f32(float *x, size_t rows, size_t dim, size_t stride,
+                    size_t nthreads) {
+  vnormalize_batch_t batch = {x, dim, stride};
+  vthread_parallel_for(rows, nthreads, VNORMALIZE_MIN_ROWS, _vnormalize_rows,
+                       &batch);
+}
+
+#endif // VNORMALIZE_H
@@ -0,0 +1,649 @@
+/* Product quantization with 4-bit fast-scan distance tables */
+#ifndef VPQ_H
+#define VPQ_H
+
+#include "simdinfo.h"
+#include "vdot.h"
+#include "vkmeans.h"
+#include "vknn.h"
+#include "vnormalize.h"
+#include "vstore.h"
+#include "vthread.h"
+#include "vtopk.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Each vector is split into nsub subvectors of dsub = dim / nsub floats, and
+// each subvector is replaced by the 4-bit index of its nearest of 16
+// centroids. Codes are stored in blocks of 32 vectors:
+//
+//   block b, subspace m: 16 bytes at codes + (b * nsub_pad + m) * 16, byte j
+//   holding the code of vector 32b + j in its low nibble and of vector
+//   32b + j + 16 in its high nibble
+//
+// so a 16-entry table lookup (pshufb, tbl) scores 16 vectors of one subspace
+// per register lane. nsub is padded to a multiple of 4 with all-zero codes
+// so the 512-bit kernel always loads whole registers. The index file is:
+//
+//   [0, 128)             vpq_header_t
+//   [centroids_offset)   nsub * 16 * dsub floats
+//   [codes_offset)       ceil(count / 32) * nsub_pad * 16 bytes
+//
+// A VKNN_COSINE index trains on and encodes unit-normalized rows, and scales
+// each query's tables by 1 / |query|, so the ADC estimate is of the cosine
+// itself rather than of the raw dot product.
+
+#define VPQ_MAGIC "VPQ\0\0\0\0\0"
+// 2: cosine indexes hold codes of normalized rows
+#define VPQ_VERSION 2
+#define VPQ_KSUB 16
+#define VPQ_BLOCK 32
+#define VPQ_SUB_ALIGN 4
+// Per-subspace tables are quantized to 8 bits and summed in 16 bits, which
+// holds for up to 257 subspaces
+#define VPQ_MAX_SUB 256
+// Rows sampled for training when the caller does not say
+#define VPQ_TRAIN_SIZE 65536
+// Rows decoded and encoded at a time while building
+#define VPQ_BUILD_CHUNK 4096
+
+typedef struct vpq_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t metric;
+  uint64_t dim;
+  uint64_t count;
+  uint64_t nsub;
+  uint64_t nsub_pad;
+  uint64_t dsub;
+  uint64_t centroids_offset;
+  uint64_t codes_offset;
+  uint64_t padding[7];
+} vpq_header_t;
+
+typedef struct vpq_t {
+  int fd;
+  unsigned char *map;
+  size_t map_size;
+  int metric;
+  size_t dim;
+  size_t count;
+  size_t nsub;
+  size_t nsub_pad;
+  size_t dsub;
+  float *centroids;
+  float *cnorms;
+  uint8_t *codes;
+} vpq_t;
+
+static inline size_t vpq_blocks(size_t count) {
+  return (count + VPQ_BLOCK - 1) / VPQ_BLOCK;
+}
+
+static inline void _vpq_layout(vpq_header_t *h, size_t dim, size_t count,
+                               size_t nsub) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, VPQ_MAGIC, sizeof(h->magic));
+  h->version = VPQ_VERSION;
+  h->dim = dim;
+  h->count = count;
+  h->nsub = nsub;
+  h->nsub_pad = _vstore_round_up(nsub, VPQ_SUB_ALIGN);
+  h->dsub = nsub ? dim / nsub : 0;
+  h->centroids_offset = sizeof(vpq_header_t);
+  h->codes_offset = _vstore_round_up(h->centroids_offset + dim * VPQ_KSUB * sizeof(float), VSTORE_ALIGN);
+}
+
+static inline size_t _vpq_file_size(vpq_header_t *h) {
+  return h->codes_offset + vpq_blocks(h->count) * h->nsub_pad * VPQ_KSUB;
+}
+
+static inline int _vpq_map(vpq_t *pq, int fd, size_t size, int prot) {
+  void *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  vpq_header_t *h = (vpq_header_t *)map;
+  pq->fd = fd;
+  pq->map = (unsigned char *)map;
+  pq->map_size = size;
+  pq->metric = (int)h->metric;
+  pq->dim = (size_t)h->dim;
+  pq->count = (size_t)h->count;
+  pq->nsub = (size_t)h->nsub;
+  pq->nsub_pad = (size_t)h->nsub_pad;
+  pq->dsub = (size_t)h->dsub;
+  pq->centroids = (float *)(pq->map + h->centroids_offset);
+  pq->codes = pq->map + h->codes_offset;
+  pq->cnorms = NULL;
+  return 0;
+}
+
+void vpq_close(vpq_t *pq) {
+  if (pq->map != NULL) {
+    munmap(pq->map, pq->map_size);
+  }
+  if (pq->fd >= 0) {
+    close(pq->fd);
+  }
+  free(pq->cnorms);
+  pq->map = NULL;
+  pq->fd = -1;
+  pq->cnorms = NULL;
+}
+
+// Store the 4-bit code of vector i for subspace m
+static inline void vpq_set_code(vpq_t *pq, size_t i, size_t m, uint8_t code) {
+  size_t j = i % VPQ_BLOCK;
+  uint8_t *b = pq->codes + ((i / VPQ_BLOCK) * pq->nsub_pad + m) * VPQ_KSUB + j % 16;
+  *b = j < 16 ? (uint8_t)((*b & 0xf0) | code) : (uint8_t)((*b & 0x0f) | (code << 4));
+}
+
+static inline uint8_t vpq_code(vpq_t *pq, size_t i, size_t m) {
+  size_t j = i % VPQ_BLOCK;
+  uint8_t b = pq->codes[((i / VPQ_BLOCK) * pq->nsub_pad + m) * VPQ_KSUB + j % 16];
+  return j < 16 ? b & 0x0f : b >> 4;
+}
+
+/* Fast-scan kernels */
+
+// Each kernel sums the 8-bit table entries selected by one block's codes over
+// nsub_pad subspaces: out[j] = sum_m lut[m * 16 + code(j, m)] for the block's
+// 32 vectors.
+
+static inline void _vpq_scan_serial(uint8_t *codes, uint8_t *lut,
+                                    size_t nsub_pad, uint16_t *out) {
+  for (size_t j = 0; j < VPQ_BLOCK; j++) {
+    out[j] = 0;
+  }
+  for (size_t m = 0; m < nsub_pad; m++) {
+    uint8_t *c = codes + m * VPQ_KSUB;
+    uint8_t *t = lut + m * VPQ_KSUB;
+    for (size_t j = 0; j < 16; j++) {
+      out[j] += t[c[j] & 0x0f];
+      out[j + 16] += t[c[j] >> 4];
+    }
+  }
+}
+
+#if defined(__AVX2__)
+// Fold two lanes of 16-bit sums of even and odd vectors into 16 outputs
+static inline void _vpq_store_avx2(__m256i even, __m256i odd, uint16_t *out) {
+  __m128i e = _mm_add_epi16(_mm256_castsi256_si128(even),
+                            _mm256_extracti128_si256(even, 1));
+  __m128i o = _mm_add_epi16(_mm256_castsi256_si128(odd),
+                            _mm256_extracti128_si256(odd, 1));
+  _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(e, o));
+  _mm_storeu_si128((__m128i *)(out + 8), _mm_unpackhi_epi16(e, o));
+}
+
+// One vpshufb looks up 32 codes: 16 vectors of subspace m in the low lane and
+// the same 16 vectors of subspace m + 1 in the high lane
+static inline void _vpq_scan_avx2(uint8_t *codes, uint8_t *lut,
+                                  size_t nsub_pad, uint16_t *out) {
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i low_byte = _mm256_set1_epi16(0x00ff);
+  __m256i lo_even = _mm256_setzero_si256(), lo_odd = _mm256_setzero_si256();
+  __m256i hi_even = _mm256_setzero_si256(), hi_odd = _mm256_setzero_si256();
+  for (size_t m = 0; m < nsub_pad; m += 2) {
+    __m256i c = _mm256_loadu_si256((__m256i *)(codes + m * VPQ_KSUB));
+    __m256i t = _mm256_loadu_si256((__m256i *)(lut + m * VPQ_KSUB));
+    __m256i lo = _mm256_shuffle_epi8(t, _mm256_and_si256(c, nibble));
+    __m256i hi = _mm256_shuffle_epi8(
+        t, _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble));
+    // widen to 16 bits by splitting even and odd bytes
+    lo_even = _mm256_add_epi16(lo_even, _mm256_and_si256(lo, low_byte));
+    lo_odd = _mm256_add_epi16(lo_odd, _mm256_srli_epi16(lo, 8));
+    hi_even = _mm256_add_epi16(hi_even, _mm256_and_si256(hi, low_byte));
+    hi_odd = _mm256_add_epi16(hi_odd, _mm256_srli_epi16(hi, 8));
+  }
+  _vpq_store_avx2(lo_even, lo_odd, out);
+  _vpq_store_avx2(hi_even, hi_odd, out + 16);
+}
+#endif // __AVX2__
+
+#if defined(__AVX512BW__)
+// As the AVX2 kernel with four subspaces per register: 64 codes per vpshufb
+static inline void _vpq_scan_avx512bw(uint8_t *codes, uint8_t *lut,
+                                      size_t nsub_pad, uint16_t *out) {
+  __m512i nibble = _mm512_set1_epi8(0x0f);
+  __m512i low_byte = _mm512_set1_epi16(0x00ff);
+  __m512i lo_even = _mm512_setzero_si512(), lo_odd = _mm512_setzero_si512();
+  __m512i hi_even = _mm512_setzero_si512(), hi_odd = _mm512_setzero_si512();
+  for (size_t m = 0; m < nsub_pad; m += 4) {
+    __m512i c = _mm512_loadu_si512((__m512i *)(codes + m * VPQ_KSUB));
+    __m512i t = _mm512_loadu_si512((__m512i *)(lut + m * VPQ_KSUB));
+    __m512i lo = _mm512_shuffle_epi8(t, _mm512_and_si512(c, nibble));
+    __m512i hi = _mm512_shuffle_epi8(
+        t, _mm512_and_si512(_mm512_srli_epi16(c, 4), nibble));
+    lo_even = _mm512_add_epi16(lo_even, _mm512_and_si512(lo, low_byte));
+    lo_odd = _mm512_add_epi16(lo_odd, _mm512_srli_epi16(lo, 8));
+    hi_even = _mm512_add_epi16(hi_even, _mm512_and_si512(hi, low_byte));
+    hi_odd = _mm512_add_epi16(hi_odd, _mm512_srli_epi16(hi, 8));
+  }
+  _vpq_store_avx2(_mm256_add_epi16(_mm512_castsi512_si256(lo_even),
+                                   _mm512_extracti64x4_epi64(lo_even, 1)),
+                  _mm256_add_epi16(_mm512_castsi512_si256(lo_odd),
+                                   _mm512_extracti64x4_epi64(lo_odd, 1)),
+                  out);
+  _vpq_store_avx2(_mm256_add_epi16(_mm512_castsi512_si256(hi_even),
+                                   _mm512_extracti64x4_epi64(hi_even, 1)),
+                  _mm256_add_epi16(_mm512_castsi512_si256(hi_odd),
+                                   _mm512_extracti64x4_epi64(hi_odd, 1)),
+                  out + 16);
+}
+#endif // __AVX512BW__
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+// Two tbl lookups per subspace cover all 32 vectors of the block
+static inline void _vpq_scan_neon(uint8_t *codes, uint8_t *lut,
+                                  size_t nsub_pad, uint16_t *out) {
+  uint8x16_t nibble = vdupq_n_u8(0x0f);
+  uint16x8_t a0 = vdupq_n_u16(0), a1 = vdupq_n_u16(0);
+  uint16x8_t a2 = vdupq_n_u16(0), a3 = vdupq_n_u16(0);
+  for (size_t m = 0; m < nsub_pad; m++) {
+    uint8x16_t c = vld1q_u8(codes + m * VPQ_KSUB);
+    uint8x16_t t = vld1q_u8(lut + m * VPQ_KSUB);
+    uint8x16_t lo = vqtbl1q_u8(t, vandq_u8(c, nibble));
+    uint8x16_t hi = vqtbl1q_u8(t, vshrq_n_u8(c, 4));
+    a0 = vaddw_u8(a0, vget_low_u8(lo));
+    a1 = vaddw_u8(a1, vget_high_u8(lo));
+    a2 = vaddw_u8(a2, vget_low_u8(hi));
+    a3 = vaddw_u8(a3, vget_high_u8(hi));
+  }
+  vst1q_u16(out, a0);
+  vst1q_u16(out + 8, a1);
+  vst1q_u16(out + 16, a2);
+  vst1q_u16(out + 24, a3);
+}
+#endif // __ARM_NEON && __aarch64__
+
+typedef void (*vpq_scan_fn)(uint8_t *, uint8_t *, size_t, uint16_t *);
+
+// Pick the block kernel once per query instead of once per block
+static inline vpq_scan_fn _vpq_scan_dispatch(void) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512BW__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512BW__)) {
+    return _vpq_scan_avx512bw;
+  }
+#endif // __AVX512BW__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    return _vpq_scan_avx2;
+  }
+#endif // __AVX2__
+
+// ARM
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vpq_scan_neon;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  return _vpq_scan_serial;
+}
+
+/* Training and encoding */
+
+// Train 16 centroids per subspace with k-means on n points (stride floats
+// apart); centroids receives nsub * 16 * (dim / nsub) floats. Returns 0, or
+// -1 with errno set.
+int vpq_train(float *x, size_t n, size_t dim, size_t stride, size_t nsub,
+              size_t iters, size_t nthreads, float *centroids) {
+  if (nsub == 0 || dim % nsub != 0 || n < VPQ_KSUB) {
+    errno = EINVAL;
+    return -1;
+  }
+  size_t dsub = dim / nsub;
+  for (size_t m = 0; m < nsub; m++) {
+    if (vkmeans_train(x + m * dsub, n, dsub, stride, VPQ_KSUB, iters,
+                      nthreads, m + 1, centroids + m * VPQ_KSUB * dsub) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Encode n rows (stride floats apart) as vectors first, first + 1, ... of pq.
+// Rows are encoded as given, so for a cosine index they must already be
+// normalized. assign is scratch for n codes. Returns 0, or -1 with errno set.
+int vpq_encode(vpq_t *pq, float *x, size_t n, size_t stride, size_t first,
+               size_t nthreads, uint32_t *assign) {
+  size_t dsub = pq->dsub;
+  for (size_t m = 0; m < pq->nsub; m++) {
+    float *cen = pq->centroids + m * VPQ_KSUB * dsub;
+    if (vkmeans_assign(x + m * dsub, n, dsub, stride, cen,
+                       pq->cnorms + m * VPQ_KSUB, VPQ_KSUB, nthreads, assign,
+                       NULL) != 0) {
+      return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+      vpq_set_code(pq, first + i, m, (uint8_t)assign[i]);
+    }
+  }
+  return 0;
+}
+
+// Build a PQ index of every row of store with nsub subspaces (dim must be a
+// multiple of nsub). Codebooks are trained with `iters` rounds of k-means on
+// train_size rows spread evenly over the store (0 = VPQ_TRAIN_SIZE). Returns
+// 0, or -1 with errno set.
+int vpq_build(vstore_t *store, size_t nsub, int metric, size_t train_size,
+              size_t iters, size_t nthreads, const char *path) {
+  size_t dim = store->dim, count = store->count;
+  if (nsub == 0 || nsub > VPQ_MAX_SUB || dim % nsub != 0 ||
+      count < VPQ_KSUB || metric < VKNN_DOT || metric > VKNN_L2) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (train_size == 0) {
+    train_size = VPQ_TRAIN_SIZE;
+  }
+  if (train_size > count) {
+    train_size = count;
+  }
+  if (train_size < VPQ_KSUB) {
+    train_size = VPQ_KSUB;
+  }
+
+  vpq_header_t h;
+  _vpq_layout(&h, dim, count, nsub);
+  h.metric = (uint32_t)metric;
+  float *train = (float *)malloc(train_size * dim * sizeof(float));
+  float *chunk = (float *)malloc(VPQ_BUILD_CHUNK * dim * sizeof(float));
+  uint32_t *assign = (uint32_t *)malloc(VPQ_BUILD_CHUNK * sizeof(uint32_t));
+  vpq_t pq;
+  pq.map = NULL;
+  int fd = -1, status = -1;
+  if (train == NULL || chunk == NULL || assign == NULL) {
+    errno = ENOMEM;
+    goto done;
+  }
+  for (size_t i = 0; i < train_size; i++) {
+    vstore_decode_f32(store, count * i / train_size, 1, train + i * dim);
+  }
+  if (metric == VKNN_COSINE) {
+    vnormalize_f32(train, train_size, dim, dim, nthreads);
+  }
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, (off_t)_vpq_file_size(&h)) != 0 ||
+      pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+      _vpq_map(&pq, fd, _vpq_file_size(&h), PROT_READ | PROT_WRITE) != 0) {
+    goto done;
+  }
+  fd = -1;
+  pq.cnorms = (float *)malloc(nsub * VPQ_KSUB * sizeof(float));
+  if (pq.cnorms == NULL) {
+    errno = ENOMEM;
+    goto done;
+  }
+  if (vpq_train(train, train_size, dim, dim, nsub, iters, nthreads,
+                pq.centroids) != 0) {
+    goto done;
+  }
+  vkmeans_norms(pq.centroids, nsub * VPQ_KSUB, pq.dsub, pq.cnorms);
+  for (size_t r = 0; r < count; r += VPQ_BUILD_CHUNK) {
+    size_t n = count - r < VPQ_BUILD_CHUNK ? count - r : VPQ_BUILD_CHUNK;
+    size_t stride;
+    float *rows = vstore_rows_f32(store, r, n, chunk, &stride);
+    if (metric == VKNN_COSINE) {
+      // normalized in scratch: f32 rows are the read-only store itself
+      if (rows != chunk) {
+        vstore_decode_f32(store, r, n, chunk);
+        rows = chunk;
+        stride = dim;
+      }
+      vnormalize_f32(rows, n, dim, stride, nthreads);
+    }
+    if (vpq_encode(&pq, rows, n, stride, r, nthreads, assign) != 0) {
+      goto done;
+    }
+  }
+  status = 0;
+
+done:
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (pq.map != NULL) {
+    int err = errno;
+    vpq_close(&pq);
+    errno = err;
+  }
+  if (status != 0) {
+    unlink(path);
+  }
+  free(train);
+  free(chunk);
+  free(assign);
+  return status;
+}
+
+// Map an index read-only. Returns 0, or -1 with errno set.
+int vpq_open(const char *path, vpq_t *pq) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  vpq_header_t h, expect;
+  if (fstat(fd, &st) != 0 ||
+      pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  _vpq_layout(&expect, (size_t)h.dim, (size_t)h.count, (size_t)h.nsub);
+  expect.metric = h.metric;
+  if (memcmp(&h, &expect, sizeof(h)) != 0 || h.metric > VKNN_L2 ||
+      h.nsub == 0 || h.nsub > VPQ_MAX_SUB || h.dim % h.nsub != 0 ||
+      _vpq_file_size(&h) > (size_t)st.st_size) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  if (_vpq_map(pq, fd, (size_t)st.st_size, PROT_READ) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  pq->cnorms = (float *)malloc(pq->nsub * VPQ_KSUB * sizeof(float));
+  if (pq->cnorms == NULL) {
+    vpq_close(pq);
+    errno = ENOMEM;
+    return -1;
+  }
+  vkmeans_norms(pq->centroids, pq->nsub * VPQ_KSUB, pq->dsub, pq->cnorms);
+  return 0;
+}
+
+/* Search */
+
+// Build the distance tables of one query: lut receives 8-bit entries for
+// every (subspace, centroid) pair so that the estimated distance of a vector
+// is *bias + sum / *scale, where sum is what the scan kernels return.
+// Distances are squared L2 for VKNN_L2, the negated cosine for VKNN_COSINE
+// and the negated dot product for VKNN_DOT.
+void vpq_lut(vpq_t *pq, float *query, float *table, uint8_t *lut, float *scale,
+             float *bias) {
+  size_t dsub = pq->dsub;
+  float range = 0.0f;
+  *bias = 0.0f;
+  // the codes are of unit rows; dividing by |query| makes the dot a cosine
+  float qscale = 1.0f;
+  if (pq->metric == VKNN_COSINE) {
+    float qn = vdot_f32(query, query, pq->dim);
+    qscale = qn > 0.0f ? 1.0f / sqrtf(qn) : 1.0f;
+  }
+  for (size_t m = 0; m < pq->nsub; m++) {
+    float *q = query + m * dsub;
+    float *t = table + m * VPQ_KSUB;
+    vdot_batch_f32(q, pq->centroids + m * VPQ_KSUB * dsub, VPQ_KSUB, dsub,
+                   dsub, t);
+    float qn = pq->metric == VKNN_L2 ? vdot_f32(q, q, dsub) : 0.0f;
+    float lo = INFINITY, hi = -INFINITY;
+    for (size_t c = 0; c < VPQ_KSUB; c++) {
+      t[c] = pq->metric == VKNN_L2 ? qn - 2.0f * t[c] + pq->cnorms[m * VPQ_KSUB + c]
+                                   : -qscale * t[c];
+      lo = t[c] < lo ? t[c] : lo;
+      hi = t[c] > hi ? t[c] : hi;
+    }
+    *bias += lo;
+    range = hi - lo > range ? hi - lo : range;
+  }
+  *scale = range > 0.0f ? 255.0f / range : 1.0f;
+  memset(lut, 0, pq->nsub_pad * VPQ_KSUB);
+  for (size_t m = 0; m < pq->nsub; m++) {
+    float *t = table + m * VPQ_KSUB;
+    float lo = t[0];
+    for (size_t c = 1; c < VPQ_KSUB; c++) {
+      lo = t[c] < lo ? t[c] : lo;
+    }
+    for (size_t c = 0; c < VPQ_KSUB; c++) {
+      lut[m * VPQ_KSUB + c] = (uint8_t)lrintf((t[c] - lo) * *scale);
+    }
+  }
+}
+
+typedef struct vpq_job_t {
+  vpq_t *pq;
+  vstore_t *store;
+  float *queries;
+  size_t k;
+  size_t rerank;
+  size_t *out_idx;
+  float *out_val;
+  int failed;
+} vpq_job_t;
+
+static inline void _vpq_search(void *ctx, size_t begin, size_t end) {
+  vpq_job_t *job = (vpq_job_t *)ctx;
+  vpq_t *pq = job->pq;
+  size_t dim = pq->dim, nkeep = job->rerank;
+  float *table = (float *)malloc((pq->nsub * VPQ_KSUB + dim + nkeep) * sizeof(float));
+  uint8_t *lut = (uint8_t *)malloc(pq->nsub_pad * VPQ_KSUB);
+  size_t *cand = (size_t *)malloc(nkeep * sizeof(size_t));
+  if (table == NULL || lut == NULL || cand == NULL) {
+    free(table);
+    free(lut);
+    free(cand);
+    job->failed = 1;
+    return;
+  }
+  float *row = table + pq->nsub * VPQ_KSUB;
+  float *cand_val = row + dim;
+  vpq_scan_fn scan = _vpq_scan_dispatch();
+  size_t nblocks = vpq_blocks(pq->count);
+  size_t block_bytes = pq->nsub_pad * VPQ_KSUB;
+
+  for (size_t q = begin; q < end; q++) {
+    float *query = job->queries + q * dim;
+    size_t *idx = job->out_idx + q * job->k;
+    float *val = job->out_val + q * job->k;
+    float scale, bias;
+    vpq_lut(pq, query, table, lut, &scale, &bias);
+
+    // ADC scan: keep the nkeep codes with the smallest estimated distance
+    vtopk_t t;
+    vtopk_init(&t, nkeep, cand, cand_val);
+    for (size_t b = 0; b < nblocks; b++) {
+      uint16_t sums[VPQ_BLOCK];
+      float scores[VPQ_BLOCK];
+      if (b + 1 < nblocks) {
+        __builtin_prefetch(pq->codes + (b + 1) * block_bytes);
+      }
+      scan(pq->codes + b * block_bytes, lut, pq->nsub_pad, sums);
+      size_t n = pq->count - b * VPQ_BLOCK;
+      n = n < VPQ_BLOCK ? n : VPQ_BLOCK;
+      for (size_t j = 0; j < n; j++) {
+        scores[j] = -(float)sums[j];
+      }
+      vtopk_push_f32(&t, scores, n, b * VPQ_BLOCK);
+    }
+    size_t ncand = vtopk_finish(&t);
+
+    vtopk_init(&t, job->k, idx, val);
+    if (job->store == NULL) {
+      // no vectors to rerank against: report the ADC estimates
+      for (size_t j = 0; j < ncand && j < job->k; j++) {
+        vtopk_push1(&t, cand_val[j] / scale - bias, cand[j]);
+      }
+    } else {
+      float qn = vdot_f32(query, query, dim);
+      for (size_t j = 0; j < ncand; j++) {
+        size_t stride;
+        float *r = vstore_rows_f32(job->store, cand[j], 1, row, &stride);
+        float dot = vdot_f32(query, r, dim);
+        float norm = pq->metric == VKNN_DOT ? 0.0f : vdot_f32(r, r, dim);
+        float score;
+        vknn_scores(pq->metric, &dot, 1, qn, &norm, &score);
+        vtopk_push1(&t, score, cand[j]);
+      }
+    }
+    size_t count = vtopk_finish(&t);
+    for (size_t j = 0; j < count; j++) {
+      val[j] = vknn_report(pq->metric, val[j]);
+    }
+    for (size_t j = count; j < job->k; j++) {
+      idx[j] = SIZE_MAX;
+      val[j] = NAN;
+    }
+  }
+  free(table);
+  free(lut);
+  free(cand);
+}
+
+// Approximate top-k of each of nq queries: an ADC scan over every code picks
+// the rerank best estimates (raised to k if smaller), which are then scored
+// exactly against the rows of store with vdot_f32. With store NULL the ADC
+// estimates are reported as they are. Queries are spread over nthreads
+// threads (0 = all CPUs). Output is laid out as for vknn_search. Returns 0,
+// or -1 with errno set.
+int vpq_search(vpq_t *pq, vstore_t *store, float *queries, size_t nq,
+               size_t k, size_t rerank, size_t nthreads, size_t *out_idx,
+               float *out_val) {
+  if (store != NULL && (store->dim != pq->dim || store->count != pq->count)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (rerank < k) {
+    rerank = k;
+  }
+  vpq_job_t job = {pq, store, queries, k, rerank, out_idx, out_val, 0};
+  vthread_parallel_for(nq, nthreads, 1, _vpq_search, &job);
+  if (job.failed) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+#endif // VPQ_H
@@ -0,0 +1,156 @@
+/* Reference dot products and ill-conditioned test inputs */
+#ifndef VREF_H
+#define VREF_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Accuracy and conformance checks compare kernels against vref_dot_f32. The
+// product of two floats is exact in a double, and the products are summed in
+// double-double (about 106 bits), so the reference is correct to well below
+// a float ulp unless the dot product is conditioned past ~1e16.
+//
+// vref_gen_dot builds inputs with a chosen condition number
+//
+//   cond(x, y) = 2 * sum |x_i * y_i| / |sum x_i * y_i|
+//
+// following GenDot from Ogita, Rump and Oishi, "Accurate Sum and Dot
+// Product" (SIAM J. Sci. Comput. 26(6), 2005): half of the entries get
+// random exponents up to log2(cond) / 2, and the other half are chosen to
+// cancel the running sum, with exponents shrinking to 0.
+
+typedef struct vref_dd_t {
+  double hi;
+  double lo;
+} vref_dd_t;
+
+// hi + lo == a + b exactly (Knuth's TwoSum)
+static inline void _vref_two_sum(double a, double b, double *hi, double *lo) {
+  double s = a + b;
+  double bb = s - a;
+  *lo = (a - (s - bb)) + (b - bb);
+  *hi = s;
+}
+
+static inline void vref_dd_add(vref_dd_t *acc, double x) {
+  double hi, lo;
+  _vref_two_sum(acc->hi, x, &hi, &lo);
+  lo += acc->lo;
+  // renormalize so hi holds the rounded sum
+  _vref_two_sum(hi, lo, &acc->hi, &acc->lo);
+}
+
+// sum of a[i] * b[i], correctly rounded to double for all practical inputs
+double vref_dot_f32(const float *a, const float *b, size_t size) {
+  vref_dd_t acc = {0.0, 0.0};
+  // TwoSum turns an infinite sum into NaN (inf - inf); the plain sum has
+  // the IEEE result for infinities and NaN
+  double plain = 0.0;
+  for (size_t i = 0; i < size; i++) {
+    double p = (double)a[i] * (double)b[i];
+    vref_dd_add(&acc, p);
+    plain += p;
+  }
+  return isfinite(plain) ? acc.hi + acc.lo : plain;
+}
+
+// cond(a, b), INFINITY when the dot product is 0
+double vref_cond_f32(const float *a, const float *b, size_t size) {
+  double abs_sum = 0.0;
+  for (size_t i = 0; i < size; i++) {
+    abs_sum += fabs((double)a[i] * (double)b[i]);
+  }
+  double dot = vref_dot_f32(a, b, size);
+  return dot != 0.0 ? 2.0 * abs_sum / fabs(dot) : INFINITY;
+}
+
+// xorshift64*, uniform in [0, 1)
+static inline double vref_rand(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return (double)((*state * 0x2545f4914f6cdd1dULL) >> 11) * 0x1.0p-53;
+}
+
+// Rounds a float to a narrower type and back, e.g. through f16
+typedef float (*vref_round_fn)(float);
+
+static inline double _vref_gen_dot(float *x, float *y, size_t size, double b,
+                                   uint64_t seed, vref_round_fn round_y) {
+  uint64_t s = seed * 2 + 1;
+  size_t half = size / 2;
+  // A narrow y has neither the range nor the precision for its share of
+  // the exponents: x takes all of them and y stays near 1
+  int ex = round_y ? 2 : 1, ey = round_y ? 0 : 1;
+  // first half: random exponents, the largest at both ends of the range
+  for (size_t i = 0; i < half; i++) {
+    double e = round(vref_rand(&s) * b / 2);
+    if (i == 0) {
+      e = round(b / 2) + 1;
+    } else if (i == half - 1) {
+      e = 0.0;
+    }
+    x[i] = (float)ldexp(2 * vref_rand(&s) - 1, ex * (int)e);
+    y[i] = (float)ldexp(2 * vref_rand(&s) - 1, ey * (int)e);
+    y[i] = round_y ? round_y(y[i]) : y[i];
+  }
+  vref_dd_t acc = {0.0, 0.0};
+  for (size_t i = 0; i < half; i++) {
+    vref_dd_add(&acc, (double)x[i] * (double)y[i]);
+  }
+  // second half: y cancels the sum so far, down to exponent 0
+  for (size_t i = half; i < size; i++) {
+    double e = round(b / 2 * (double)(size - 1 - i) / (double)(size - 1 - half));
+    // |x| >= 2^(e - 1), so the y that cancels stays in range
+    double r = vref_rand(&s);
+    x[i] = (float)ldexp(r < 0.5 ? -0.5 - r : r, ex * (int)e);
+    double target = ldexp(2 * vref_rand(&s) - 1, (int)e);
+    y[i] = (float)((target - (acc.hi + acc.lo)) / x[i]);
+    y[i] = round_y ? round_y(y[i]) : y[i];
+    vref_dd_add(&acc, (double)x[i] * (double)y[i]);
+  }
+  // shuffle the pairs so the cancellation is not in summation order
+  for (size_t i = size - 1; i > 0; i--) {
+    size_t j = (size_t)(vref_rand(&s) * (double)(i + 1));
+    float t = x[i];
+    x[i] = x[j];
+    x[j] = t;
+    t = y[i];
+    y[i] = y[j];
+    y[j] = t;
+  }
+  return vref_cond_f32(x, y, size);
+}
+
+// Fill x and y (size >= 6) with a dot product of condition number about cond
+// and return the condition number actually reached. With round_y, every y is
+// representable in the narrower type round_y rounds to. GenDot overshoots by a
+// factor that grows with size, so the exponent range is corrected from the
+// condition number each attempt reaches. Below about size / 2 the target
+// cannot be met: that many terms of exponent 0 already sum to more.
+double vref_gen_dot(float *x, float *y, size_t size, double cond,
+                    uint64_t seed, vref_round_fn round_y) {
+  double b = log2(cond);
+  double got = 0.0;
+  for (int attempt = 0; attempt < 6; attempt++) {
+    got = _vref_gen_dot(x, y, size, b < 0 ? 0 : b, seed, round_y);
+    if (got <= 2 * cond && got >= cond / 2) {
+      break;
+    }
+    b -= log2(got / cond);
+  }
+  return got;
+}
+
+// Distance from r to x in units of the float ulp at r
+double vref_ulps(double x, double r) {
+  float rf = (float)r;
+  if (isinf(rf)) {
+    return x == r ? 0.0 : INFINITY;
+  }
+  double ulp = (double)nextafterf(fabsf(rf), INFINITY) - (double)fabsf(rf);
+  return fabs(x - r) / ulp;
+}
+
+#endif // VREF_H
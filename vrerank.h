@@ -0,0 +1,339 @@
+/* Two-stage search: quantized coarse scan, exact rerank of the survivors */
+#ifndef VRERANK_H
+#define VRERANK_H
+
+#include "vconvert.h"
+#include "vdot.h"
+#include "vhamming.h"
+#include "vknn.h"
+#include "vstore.h"
+#include "vthread.h"
+#include "vtopk.h"
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// The coarse store holds the same rows as the full store in a compact dtype:
+// int8 (VSTORE_I8) or sign bits (VSTORE_B1). Every query is scored against
+// all coarse rows, the best k * oversample of them survive, and only those
+// rows are read back from the full store and scored exactly.
+//
+// int8 rows are x ~= s * r + b and the query is quantized symmetrically to
+// q ~= t * p, so x . q ~= s * t * (r . p) + b * sum(q) with r . p computed
+// exactly in int32. Binary rows score -hamming(x, q) whatever the metric.
+
+// Coarse rows per tile; their norms are computed once per tile and reused by
+// every query of the batch
+#define VRERANK_TILE_BYTES (64 * 1024)
+#define VRERANK_DEFAULT_OVERSAMPLE 8
+
+typedef struct vrerank_job_t {
+  vstore_t *coarse;
+  vstore_t *full;
+  float *queries;
+  size_t nq;
+  int metric;
+  float *qnorm2;
+  int8_t *qcodes;
+  float *qscale;
+  float *qsum;
+  uint8_t *qbits;
+  size_t kk;
+  size_t nslots;
+  size_t *slot_idx;
+  float *slot_val;
+  size_t *slot_count;
+  size_t k;
+  size_t *cand_idx;
+  size_t *cand_count;
+  size_t *out_idx;
+  float *out_val;
+  int failed;
+} vrerank_job_t;
+
+static inline size_t _vrerank_tile_rows(vstore_t *coarse) {
+  size_t rows = VRERANK_TILE_BYTES / coarse->stride;
+  return rows < 1 ? 1 : rows;
+}
+
+// Squared norm of an int8 row as stored, s^2 r.r + 2 s b sum(r) + b^2 dim.
+// r may hold -128, so this stays scalar rather than going through vdot_i8.
+static inline float _vrerank_i8_norm2(int8_t *r, size_t dim, float s,
+                                      float b) {
+  int64_t sum = 0, sumsq = 0;
+  for (size_t i = 0; i < dim; i++) {
+    sum += r[i];
+    sumsq += (int32_t)r[i] * r[i];
+  }
+  return s * s * (float)sumsq + 2.0f * s * b * (float)sum +
+         b * b * (float)dim;
+}
+
+static inline void _vrerank_scan_slot(vrerank_job_t *job, size_t slot) {
+  vstore_t *coarse = job->coarse;
+  size_t dim = coarse->dim;
+  size_t bytes = vstore_row_bytes(VSTORE_B1, dim);
+  size_t tile = _vrerank_tile_rows(coarse);
+  size_t begin = coarse->count * slot / job->nslots;
+  size_t end = coarse->count * (slot + 1) / job->nslots;
+  float *scratch = (float *)malloc(3 * tile * sizeof(float));
+  vtopk_t *heaps = (vtopk_t *)malloc(job->nq * sizeof(vtopk_t));
+  if (scratch == NULL || heaps == NULL) {
+    free(scratch);
+    free(heaps);
+    job->failed = 1;
+    return;
+  }
+  float *norms = scratch;
+  float *dots = norms + tile;
+  float *scores = dots + tile;
+  vdot_i8_fn dot_i8 = _vdot_i8_dispatch();
+  vhamming_fn hamming = _vhamming_dispatch();
+  size_t base = slot * job->nq * job->kk;
+  for (size_t q = 0; q < job->nq; q++) {
+    vtopk_init(&heaps[q], job->kk, job->slot_idx + base + q * job->kk,
+               job->slot_val + base + q * job->kk);
+  }
+  for (size_t r = begin; r < end; r += tile) {
+    size_t n = end - r < tile ? end - r : tile;
+    if (coarse->dtype == VSTORE_I8 && job->metric != VKNN_DOT) {
+      for (size_t i = 0; i < n; i++) {
+        norms[i] = _vrerank_i8_norm2(vstore_row_i8(coarse, r + i), dim,
+                                     coarse->scales[r + i],
+                                     coarse->biases[r + i]);
+      }
+    }
+    for (size_t q = 0; q < job->nq; q++) {
+      if (coarse->dtype == VSTORE_B1) {
+        uint8_t *bits = job->qbits + q * bytes;
+        for (size_t i = 0; i < n; i++) {
+          scores[i] = -(float)hamming(vstore_row_b1(coarse, r + i), bits, bytes);
+        }
+      } else {
+        int8_t *codes = job->qcodes + q * dim;
+        float t = job->qscale[q];
+        for (size_t i = 0; i < n; i++) {
+          int32_t d = dot_i8(vstore_row_i8(coarse, r + i), codes, dim);
+          dots[i] = coarse->scales[r + i] * t * (float)d +
+                    coarse->biases[r + i] * job->qsum[q];
+        }
+        vknn_scores(job->metric, dots, n, job->qnorm2[q], norms, scores);
+      }
+      vtopk_push_f32(&heaps[q], scores, n, r);
+    }
+  }
+  for (size_t q = 0; q < job->nq; q++) {
+    job->slot_count[slot * job->nq + q] = heaps[q].count;
+  }
+  free(scratch);
+  free(heaps);
+}
+
+static inline void _vrerank_scan(void *ctx, size_t begin, size_t end) {
+  for (size_t slot = begin; slot < end; slot++) {
+    _vrerank_scan_slot((vrerank_job_t *)ctx, slot);
+  }
+}
+
+static inline int _vrerank_cmp_idx(const void *a, const void *b) {
+  size_t x = *(const size_t *)a, y = *(const size_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Ask the kernel to start reading the full rows of a candidate list. Rows are
+// sorted so that neighbouring candidates share one madvise call.
+static inline void _vrerank_advise(vstore_t *full, size_t *idx, size_t n) {
+  qsort(idx, n, sizeof(size_t), _vrerank_cmp_idx);
+  size_t rows_per_page = VSTORE_PAGE / full->stride + 1;
+  size_t i = 0;
+  while (i < n) {
+    size_t j = i + 1;
+    while (j < n && idx[j] - idx[j - 1] <= rows_per_page) {
+      j++;
+    }
+    vstore_advise(full, idx[i], idx[j - 1] + 1, VSTORE_WILLNEED);
+    i = j;
+  }
+}
+
+static inline void _vrerank_prefetch(vstore_t *full, size_t i) {
+  char *row = (char *)vstore_row(full, i);
+  for (size_t off = 0; off < full->stride; off += 64) {
+    __builtin_prefetch(row + off);
+  }
+}
+
+static inline void _vrerank_refine(void *ctx, size_t begin, size_t end) {
+  vrerank_job_t *job = (vrerank_job_t *)ctx;
+  vstore_t *full = job->full;
+  size_t dim = full->dim;
+  float *scratch = (float *)malloc(dim * sizeof(float));
+  if (scratch == NULL) {
+    job->failed = 1;
+    return;
+  }
+  for (size_t q = begin; q < end; q++) {
+    float *query = job->queries + q * dim;
+    size_t *cand = job->cand_idx + q * job->kk;
+    size_t n = job->cand_count[q];
+    size_t *idx = job->out_idx + q * job->k;
+    float *val = job->out_val + q * job->k;
+    vtopk_t t;
+    vtopk_init(&t, job->k, idx, val);
+    for (size_t j = 0; j < n; j++) {
+      if (j + 1 < n) {
+        _vrerank_prefetch(full, cand[j + 1]);
+      }
+      size_t stride;
+      float *row = vstore_rows_f32(full, cand[j], 1, scratch, &stride);
+      float dot = vdot_f32(query, row, dim);
+      float norm = job->metric != VKNN_DOT ? vdot_f32(row, row, dim) : 0.0f;
+      float score;
+      vknn_scores(job->metric, &dot, 1, job->qnorm2[q], &norm, &score);
+      vtopk_push1(&t, score, cand[j]);
+    }
+    size_t count = vtopk_finish(&t);
+    for (size_t j = 0; j < count; j++) {
+      val[j] = vknn_report(job->metric, val[j]);
+    }
+    for (size_t j = count; j < job->k; j++) {
+      idx[j] = SIZE_MAX;
+      val[j] = NAN;
+    }
+  }
+  free(scratch);
+}
+
+// Top-k of every query (nq rows of full->dim floats) under metric, found by
+// scanning the int8 or binary coarse store and rescoring its best
+// k * oversample rows against the full store, which must hold the same rows.
+// The full rows of a query batch's candidates are madvise'd before the rerank
+// starts, so page-ins overlap with the rescoring of earlier queries. Both
+// phases run on nthreads threads (0 = all CPUs); results are laid out as for
+// vknn_search. Returns 0, or -1 with errno set.
+int vrerank_search(vstore_t *coarse, vstore_t *full, float *queries,
+                   size_t nq, size_t k, size_t oversample, int metric,
+                   size_t nthreads, size_t *out_idx, float *out_val) {
+  if ((coarse->dtype != VSTORE_I8 && coarse->dtype != VSTORE_B1) ||
+      coarse->dim != full->dim || coarse->count != full->count) {
+    errno = EINVAL;
+    return -1;
+  }
+  size_t dim = full->dim;
+  size_t bytes = vstore_row_bytes(VSTORE_B1, dim);
+  if (nthreads == 0) {
+    nthreads = vthread_count();
+  }
+  if (oversample == 0) {
+    oversample = 1;
+  }
+  size_t kk = k * oversample;
+  size_t tile = _vrerank_tile_rows(coarse);
+  size_t nslots = nthreads;
+  if (nslots > (coarse->count + tile - 1) / tile) {
+    nslots = (coarse->count + tile - 1) / tile;
+  }
+  if (nslots == 0) {
+    nslots = 1;
+  }
+  size_t per_query = (nslots + 1) * (kk + 1) * (sizeof(size_t) + sizeof(float));
+  size_t batch = VKNN_BATCH_BYTES / per_query;
+  batch = batch < 1 ? 1 : batch > nq ? nq : batch;
+
+  float *qf = (float *)malloc((3 * batch + 1) * sizeof(float));
+  int8_t *qcodes = (int8_t *)malloc(batch * dim + 1);
+  uint8_t *qbits = (uint8_t *)malloc(batch * bytes + 1);
+  size_t *slot_idx = (size_t *)malloc((nslots * batch * kk + 1) * sizeof(size_t));
+  float *slot_val = (float *)malloc((nslots * batch * kk + 1) * sizeof(float));
+  size_t *slot_count = (size_t *)malloc((nslots * batch + 1) * sizeof(size_t));
+  size_t *cand_idx = (size_t *)malloc((batch * kk + 1) * sizeof(size_t));
+  float *cand_val = (float *)malloc((batch * kk + 1) * sizeof(float));
+  size_t *cand_count = (size_t *)malloc((batch + 1) * sizeof(size_t));
+  if (qf == NULL || qcodes == NULL || qbits == NULL || slot_idx == NULL ||
+      slot_val == NULL || slot_count == NULL || cand_idx == NULL ||
+      cand_val == NULL || cand_count == NULL) {
+    free(qf);
+    free(qcodes);
+    free(qbits);
+    free(slot_idx);
+    free(slot_val);
+    free(slot_count);
+    free(cand_idx);
+    free(cand_val);
+    free(cand_count);
+    errno = ENOMEM;
+    return -1;
+  }
+  float *qnorm2 = qf;
+  float *qscale = qf + batch;
+  float *qsum = qf + 2 * batch;
+  if (nq <= batch) {
+    vstore_advise(coarse, 0, coarse->count, VSTORE_SEQUENTIAL);
+  }
+  vstore_advise(full, 0, full->count, VSTORE_RANDOM);
+
+  int failed = 0;
+  for (size_t q0 = 0; q0 < nq && !failed; q0 += batch) {
+    size_t nb = nq - q0 < batch ? nq - q0 : batch;
+    float *qs = queries + q0 * dim;
+    for (size_t q = 0; q < nb; q++) {
+      float *query = qs + q * dim;
+      qnorm2[q] = vdot_f32(query, query, dim);
+      qsum[q] = 0.0f;
+      for (size_t i = 0; i < dim; i++) {
+        qsum[q] += query[i];
+      }
+      if (coarse->dtype == VSTORE_B1) {
+        vconvert_f32_to_b1(query, qbits + q * bytes, dim);
+      } else {
+        float bias;
+        vquantize_i8_f32_group(query, dim, VQUANTIZE_SYMMETRIC,
+                               qcodes + q * dim, &qscale[q], &bias);
+      }
+    }
+    vrerank_job_t job = {coarse,   full,       qs,         nb,
+                         metric,   qnorm2,     qcodes,     qscale,
+                         qsum,     qbits,      kk,         nslots,
+                         slot_idx, slot_val,   slot_count, k,
+                         cand_idx, cand_count, out_idx + q0 * k,
+                         out_val + q0 * k,     0};
+    vthread_parallel_for(nslots, nslots, 1, _vrerank_scan, &job);
+    if (job.failed) {
+      failed = 1;
+      break;
+    }
+
+    // merge the slots' survivors; only the ids matter from here on
+    for (size_t q = 0; q < nb; q++) {
+      vtopk_t t;
+      vtopk_init(&t, kk, cand_idx + q * kk, cand_val + q * kk);
+      for (size_t s = 0; s < nslots; s++) {
+        size_t base = (s * nb + q) * kk;
+        for (size_t j = 0; j < slot_count[s * nb + q]; j++) {
+          vtopk_push1(&t, slot_val[base + j], slot_idx[base + j]);
+        }
+      }
+      cand_count[q] = t.count;
+      _vrerank_advise(full, cand_idx + q * kk, t.count);
+    }
+    vthread_parallel_for(nb, nthreads, 1, _vrerank_refine, &job);
+    failed = job.failed;
+  }
+  free(qf);
+  free(qcodes);
+  free(qbits);
+  free(slot_idx);
+  free(slot_val);
+  free(slot_count);
+  free(cand_idx);
+  free(cand_val);
+  free(cand_count);
+  if (failed) {
+    errno = ENOMEM;
+    return -1;
+  }
+  return 0;
+}
+
+#endif // VRERANK_H
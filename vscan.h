@@ -0,0 +1,575 @@
+/* Out-of-core exact k-NN scan with asynchronous chunked reads */
+#ifndef VSCAN_H
+#define VSCAN_H
+
+#include "valloc.h"
+#include "vknn.h"
+#include "vstore.h"
+#include "vthread.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// vknn_search scans a mapped store, so on a store larger than RAM every tile
+// starts with page faults and the dot kernels wait on the disk one page at a
+// time. vscan_search reads the rows instead, in large chunks into
+// VSCAN_BUFFERS page-aligned buffers: while one chunk is scored, the reads of
+// the next ones are already in flight. Reads go through io_uring with
+// O_DIRECT (no page cache to fill and evict); where io_uring is unavailable
+// a reader thread issues plain preads ahead of the scan instead.
+
+// Bytes of rows per read; large enough for the disk to stream, small enough
+// that the chunks in flight stay a small fraction of memory
+#define VSCAN_CHUNK_BYTES (8 * 1024 * 1024)
+// Chunks in memory at once: one being scored, the rest being read
+#define VSCAN_BUFFERS 3
+
+typedef struct vscan_reader_t {
+  // O_DIRECT where the file system allows it; buffered copies fill in short
+  // or failed direct reads
+  int fd;
+  int fd_buffered;
+  size_t stride;
+  size_t count;
+  size_t chunk_rows;
+  size_t nchunks;
+  // file offset of row 0, rounded down to a page, and the bytes before it
+  off_t base;
+  size_t lead;
+  size_t buffer_bytes;
+  unsigned char *buffers[VSCAN_BUFFERS];
+  ssize_t result[VSCAN_BUFFERS];
+  int ready[VSCAN_BUFFERS];
+  // a read targets the buffer; it cannot be reused or freed until it is done
+  int inflight[VSCAN_BUFFERS];
+  // io_uring
+  int ring_fd;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_bytes;
+  size_t cq_ring_bytes;
+  struct io_uring_sqe *sqes;
+  size_t sqes_bytes;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  // reader thread, when there is no ring
+  pthread_t thread;
+  int thread_started;
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} vscan_reader_t;
+
+static inline size_t _vscan_chunk_size(vscan_reader_t *r, size_t c) {
+  size_t first = c * r->chunk_rows;
+  size_t rows = r->count - first < r->chunk_rows ? r->count - first
+                                                 : r->chunk_rows;
+  return r->lead + rows * r->stride;
+}
+
+static inline off_t _vscan_chunk_offset(vscan_reader_t *r, size_t c) {
+  return r->base + (off_t)(c * r->chunk_rows * r->stride);
+}
+
+// Read whatever a direct read left out, through the page cache
+static inline ssize_t _vscan_complete(vscan_reader_t *r, size_t c, size_t b,
+                                      ssize_t got) {
+  size_t want = _vscan_chunk_size(r, c);
+  size_t done = got > 0 ? (size_t)got : 0;
+  while (done < want) {
+    ssize_t n = pread(r->fd_buffered, r->buffers[b] + done, want - done,
+                      _vscan_chunk_offset(r, c) + (off_t)done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return n < 0 ? -errno : -EIO;
+    }
+    done += (size_t)n;
+  }
+  return (ssize_t)done;
+}
+
+static inline int _vscan_ring_setup(vscan_reader_t *r) {
+#ifdef SYS_io_uring_setup
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = (int)syscall(SYS_io_uring_setup, VSCAN_BUFFERS, &p);
+  if (fd < 0) {
+    return -1;
+  }
+  r->ring_fd = fd;
+  r->sq_ring_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_bytes = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && r->cq_ring_bytes > r->sq_ring_bytes) {
+    r->sq_ring_bytes = r->cq_ring_bytes;
+  }
+  r->sq_ring = mmap(NULL, r->sq_ring_bytes, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) {
+    r->sq_ring = NULL;
+    return -1;
+  }
+  if (single) {
+    r->cq_ring = r->sq_ring;
+  } else {
+    r->cq_ring = mmap(NULL, r->cq_ring_bytes, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      r->cq_ring = NULL;
+      return -1;
+    }
+  }
+  r->sqes_bytes = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_bytes,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, fd,
+                                        IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    return -1;
+  }
+  unsigned char *sq = (unsigned char *)r->sq_ring;
+  unsigned char *cq = (unsigned char *)r->cq_ring;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+#else
+  (void)r;
+  errno = ENOSYS;
+  return -1;
+#endif // SYS_io_uring_setup
+}
+
+static inline int _vscan_ring_enter(vscan_reader_t *r, unsigned submit,
+                                    unsigned wait) {
+  for (;;) {
+    long n = syscall(SYS_io_uring_enter, r->ring_fd, submit, wait,
+                     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n >= 0 || errno != EINTR) {
+      return n < 0 ? -1 : 0;
+    }
+  }
+}
+
+// Queue the read of chunk c into buffer b
+static inline int _vscan_ring_submit(vscan_reader_t *r, size_t c, size_t b) {
+  unsigned tail = *r->sq_tail;
+  unsigned index = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = r->fd;
+  sqe->off = (uint64_t)_vscan_chunk_offset(r, c);
+  sqe->addr = (uint64_t)(uintptr_t)r->buffers[b];
+  // direct reads take whole pages; past the end of the file they come up short
+  sqe->len = (uint32_t)_valloc_round(_vscan_chunk_size(r, c), VALLOC_PAGE_SIZE);
+  sqe->user_data = b;
+  r->sq_array[index] = index;
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  if (_vscan_ring_enter(r, 1, 0) != 0) {
+    return -1;
+  }
+  r->inflight[b] = 1;
+  return 0;
+}
+
+// Reap completions until buffer b is filled
+static inline int _vscan_ring_wait(vscan_reader_t *r, size_t b) {
+  while (!r->ready[b]) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+      if (_vscan_ring_enter(r, 0, 1) != 0) {
+        return -1;
+      }
+      continue;
+    }
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    size_t done = (size_t)cqe->user_data;
+    r->result[done] = cqe->res;
+    r->ready[done] = 1;
+    r->inflight[done] = 0;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+static inline void *_vscan_thread_main(void *arg) {
+  vscan_reader_t *r = (vscan_reader_t *)arg;
+  for (size_t c = 0; c < r->nchunks; c++) {
+    size_t b = c % VSCAN_BUFFERS;
+    pthread_mutex_lock(&r->lock);
+    while (r->ready[b] && !r->stop) {
+      pthread_cond_wait(&r->cond, &r->lock);
+    }
+    int stop = r->stop;
+    pthread_mutex_unlock(&r->lock);
+    if (stop) {
+      break;
+    }
+    // the buffer is ours until it is marked ready again
+    ssize_t got = _vscan_complete(r, c, b, 0);
+    pthread_mutex_lock(&r->lock);
+    r->result[b] = got;
+    r->ready[b] = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+  }
+  return NULL;
+}
+
+// Start reading from chunk 0
+static inline int _vscan_start(vscan_reader_t *r) {
+  for (size_t b = 0; b < VSCAN_BUFFERS; b++) {
+    r->ready[b] = 0;
+  }
+  if (r->ring_fd >= 0) {
+    for (size_t c = 0; c < VSCAN_BUFFERS && c < r->nchunks; c++) {
+      if (_vscan_ring_submit(r, c, c) != 0) {
+        return -1;
+      }
+    }
+    return 0;
+  }
+  r->stop = 0;
+  if (pthread_create(&r->thread, NULL, _vscan_thread_main, r) != 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  r->thread_started = 1;
+  return 0;
+}
+
+// Wait for chunk c and return its first row, or NULL with errno set
+static inline unsigned char *_vscan_wait(vscan_reader_t *r, size_t c) {
+  size_t b = c % VSCAN_BUFFERS;
+  ssize_t got;
+  if (r->ring_fd >= 0) {
+    if (_vscan_ring_wait(r, b) != 0) {
+      return NULL;
+    }
+    if (r->result[b] == -EINVAL && r->fd != r->fd_buffered) {
+      // the file system takes O_DIRECT at open but not for reads; the reads
+      // already queued keep their own reference to the file
+      close(r->fd);
+      r->fd = r->fd_buffered;
+    }
+    // a failed or short read is finished by pread
+    got = _vscan_complete(r, c, b, r->result[b]);
+  } else {
+    pthread_mutex_lock(&r->lock);
+    while (!r->ready[b]) {
+      pthread_cond_wait(&r->cond, &r->lock);
+    }
+    got = r->result[b];
+    pthread_mutex_unlock(&r->lock);
+  }
+  if (got < 0) {
+    errno = (int)-got;
+    return NULL;
+  }
+  return r->buffers[b] + r->lead;
+}
+
+// Hand chunk c's buffer back for the read of chunk c + VSCAN_BUFFERS
+static inline int _vscan_release(vscan_reader_t *r, size_t c) {
+  size_t b = c % VSCAN_BUFFERS;
+  if (r->ring_fd >= 0) {
+    r->ready[b] = 0;
+    return c + VSCAN_BUFFERS < r->nchunks
+               ? _vscan_ring_submit(r, c + VSCAN_BUFFERS, b)
+               : 0;
+  }
+  pthread_mutex_lock(&r->lock);
+  r->ready[b] = 0;
+  pthread_cond_broadcast(&r->cond);
+  pthread_mutex_unlock(&r->lock);
+  return 0;
+}
+
+// Stop reading: drain the reads still in flight, or stop the reader thread
+static inline void _vscan_finish(vscan_reader_t *r) {
+  if (r->ring_fd >= 0) {
+    for (size_t b = 0; b < VSCAN_BUFFERS; b++) {
+      if (r->inflight[b] && _vscan_ring_wait(r, b) != 0) {
+        // the ring is unusable: leak the buffers rather than free them under
+        // a read that may still land
+        r->buffers[b] = NULL;
+      }
+    }
+    return;
+  }
+  if (r->thread_started) {
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    r->thread_started = 0;
+  }
+}
+
+static inline void _vscan_close(vscan_reader_t *r) {
+  if (r->sqes != NULL) {
+    munmap(r->sqes, r->sqes_bytes);
+  }
+  if (r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+    munmap(r->cq_ring, r->cq_ring_bytes);
+  }
+  if (r->sq_ring != NULL) {
+    munmap(r->sq_ring, r->sq_ring_bytes);
+  }
+  if (r->ring_fd >= 0) {
+    close(r->ring_fd);
+  }
+  if (r->fd >= 0 && r->fd != r->fd_buffered) {
+    close(r->fd);
+  }
+  if (r->fd_buffered >= 0) {
+    close(r->fd_buffered);
+  }
+  for (size_t b = 0; b < VSCAN_BUFFERS; b++) {
+    vdot_free(r->buffers[b]);
+  }
+  pthread_mutex_destroy(&r->lock);
+  pthread_cond_destroy(&r->cond);
+}
+
+static inline int _vscan_open(vscan_reader_t *r, const char *path,
+                              vstore_t *store) {
+  memset(r, 0, sizeof(*r));
+  r->fd = -1;
+  r->fd_buffered = -1;
+  r->ring_fd = -1;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+  if (store->stride == 0) {
+    // rows of dim 0 cannot be chunked
+    errno = EINVAL;
+    return -1;
+  }
+  r->fd_buffered = open(path, O_RDONLY | O_CLOEXEC);
+  if (r->fd_buffered < 0) {
+    return -1;
+  }
+  r->stride = store->stride;
+  r->count = store->count;
+  // whole pages per chunk: stride is a multiple of 64, so 64 rows are
+  r->chunk_rows = VSCAN_CHUNK_BYTES / r->stride;
+  r->chunk_rows = r->chunk_rows < 64 ? 64 : r->chunk_rows - r->chunk_rows % 64;
+  r->nchunks = (r->count + r->chunk_rows - 1) / r->chunk_rows;
+  size_t data_offset = (size_t)(store->data - store->map);
+  r->lead = data_offset % VALLOC_PAGE_SIZE;
+  r->base = (off_t)(data_offset - r->lead);
+  r->buffer_bytes = _valloc_round(r->lead + r->chunk_rows * r->stride,
+                                  VALLOC_PAGE_SIZE);
+  for (size_t b = 0; b < VSCAN_BUFFERS; b++) {
+    r->buffers[b] = (unsigned char *)vdot_alloc(r->buffer_bytes, VALLOC_PAGE);
+    if (r->buffers[b] == NULL) {
+      return -1;
+    }
+  }
+  r->fd = r->fd_buffered;
+#ifdef O_DIRECT
+  int fd = open(path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+  if (fd >= 0) {
+    r->fd = fd;
+  }
+#endif // O_DIRECT
+  if (_vscan_ring_setup(r) != 0 && r->ring_fd >= 0) {
+    // a ring that could not be mapped is no ring at all
+    close(r->ring_fd);
+    r->ring_fd = -1;
+  }
+  if (r->ring_fd < 0) {
+    // the reader thread reads through the page cache; tell it to read ahead
+    posix_fadvise(r->fd_buffered, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  return 0;
+}
+
+typedef struct vscan_job_t {
+  // the chunk being scored, as a store of its own rows
+  vstore_t view;
+  size_t first;
+  float *queries;
+  size_t nq;
+  int metric;
+  float *qnorm2;
+  size_t nslots;
+  vtopk_t *heaps;
+  float *scratch;
+} vscan_job_t;
+
+static inline void _vscan_score(void *ctx, size_t begin, size_t end) {
+  vscan_job_t *job = (vscan_job_t *)ctx;
+  size_t dim = job->view.dim;
+  size_t tile = vknn_tile_rows(dim);
+  for (size_t slot = begin; slot < end; slot++) {
+    float *scratch = job->scratch + slot * (tile * dim + 3 * tile);
+    float *norms = scratch + tile * dim;
+    float *dots = norms + tile;
+    float *scores = dots + tile;
+    vtopk_t *heaps = job->heaps + slot * job->nq;
+    size_t lo = job->view.count * slot / job->nslots;
+    size_t hi = job->view.count * (slot + 1) / job->nslots;
+    for (size_t r = lo; r < hi; r += tile) {
+      size_t n = hi - r < tile ? hi - r : tile;
+      size_t stride;
+      float *rows = vstore_rows_f32(&job->view, r, n, scratch, &stride);
+      if (job->metric != VKNN_DOT) {
+        for (size_t i = 0; i < n; i++) {
+          norms[i] = vdot_f32(rows + i * stride, rows + i * stride, dim);
+        }
+      }
+      for (size_t q = 0; q < job->nq; q++) {
+        vdot_batch_f32(job->queries + q * dim, rows, n, dim, stride, dots);
+        vknn_scores(job->metric, dots, n, job->qnorm2[q], norms, scores);
+        vtopk_push_f32(&heaps[q], scores, n, job->first + r);
+      }
+    }
+  }
+}
+
+// vknn_search over the store file at path, reading it in chunks instead of
+// mapping its rows, for stores that do not fit in memory. Same arguments and
+// results as vknn_search. Returns 0, or -1 with errno set (EINVAL for a store
+// of dim 0).
+int vscan_search(const char *path, float *queries, size_t nq, size_t k,
+                 int metric, size_t nthreads, size_t *out_idx,
+                 float *out_val) {
+  vstore_t store;
+  // the map is only used for the header and the per-row scales
+  if (vstore_open(path, &store) != 0) {
+    return -1;
+  }
+  size_t dim = store.dim;
+  if (nthreads == 0) {
+    nthreads = vthread_count();
+  }
+  size_t tile = vknn_tile_rows(dim);
+  vscan_reader_t reader;
+  if (_vscan_open(&reader, path, &store) != 0) {
+    int err = errno;
+    _vscan_close(&reader);
+    vstore_close(&store);
+    errno = err;
+    return -1;
+  }
+  int failed = 0;
+  int err = ENOMEM;
+  size_t nslots = nthreads;
+  if (nslots > (reader.chunk_rows + tile - 1) / tile) {
+    nslots = (reader.chunk_rows + tile - 1) / tile;
+  }
+  size_t per_query = nslots * (k + 1) * (sizeof(size_t) + sizeof(float));
+  size_t batch = VKNN_BATCH_BYTES / per_query;
+  batch = batch < 1 ? 1 : batch > nq ? nq : batch;
+
+  float *qnorm2 = (float *)malloc((batch + 1) * sizeof(float));
+  size_t *slot_idx = (size_t *)malloc((nslots * batch * k + 1) * sizeof(size_t));
+  float *slot_val = (float *)malloc((nslots * batch * k + 1) * sizeof(float));
+  vtopk_t *heaps = (vtopk_t *)malloc((nslots * batch + 1) * sizeof(vtopk_t));
+  float *scratch =
+      (float *)malloc(nslots * (tile * dim + 3 * tile) * sizeof(float) + 1);
+  if (qnorm2 == NULL || slot_idx == NULL || slot_val == NULL ||
+      heaps == NULL || scratch == NULL) {
+    failed = 1;
+  }
+
+  // every batch of queries is one pass over the file
+  for (size_t q0 = 0; q0 < nq && !failed; q0 += batch) {
+    size_t nb = nq - q0 < batch ? nq - q0 : batch;
+    float *qs = queries + q0 * dim;
+    for (size_t q = 0; q < nb; q++) {
+      qnorm2[q] = vdot_f32(qs + q * dim, qs + q * dim, dim);
+    }
+    for (size_t h = 0; h < nslots * nb; h++) {
+      vtopk_init(&heaps[h], k, slot_idx + h * k, slot_val + h * k);
+    }
+    vscan_job_t job = {store, 0,      qs,    nb,     metric,
+                       qnorm2, nslots, heaps, scratch};
+    if (_vscan_start(&reader) != 0) {
+      err = errno;
+      failed = 1;
+      break;
+    }
+    for (size_t c = 0; c < reader.nchunks; c++) {
+      unsigned char *rows = _vscan_wait(&reader, c);
+      if (rows == NULL) {
+        err = errno;
+        failed = 1;
+        break;
+      }
+      job.first = c * reader.chunk_rows;
+      job.view.data = rows;
+      job.view.count = store.count - job.first < reader.chunk_rows
+                           ? store.count - job.first
+                           : reader.chunk_rows;
+      job.view.scales = store.scales ? store.scales + job.first : NULL;
+      job.view.biases = store.biases ? store.biases + job.first : NULL;
+      vthread_parallel_for(nslots, nslots, 1, _vscan_score, &job);
+      if (_vscan_release(&reader, c) != 0) {
+        err = errno;
+        failed = 1;
+        break;
+      }
+    }
+    _vscan_finish(&reader);
+
+    for (size_t q = 0; q < nb && !failed; q++) {
+      size_t *idx = out_idx + (q0 + q) * k;
+      float *val = out_val + (q0 + q) * k;
+      vtopk_t t;
+      vtopk_init(&t, k, idx, val);
+      for (size_t s = 0; s < nslots; s++) {
+        vtopk_t *h = &heaps[s * nb + q];
+        for (size_t j = 0; j < h->count; j++) {
+          vtopk_push1(&t, h->val[j], h->idx[j]);
+        }
+      }
+      size_t count = vtopk_finish(&t);
+      for (size_t j = 0; j < count; j++) {
+        val[j] = vknn_report(metric, val[j]);
+      }
+      for (size_t j = count; j < k; j++) {
+        idx[j] = SIZE_MAX;
+        val[j] = NAN;
+      }
+    }
+  }
+  free(qnorm2);
+  free(slot_idx);
+  free(slot_val);
+  free(heaps);
+  free(scratch);
+  _vscan_close(&reader);
+  vstore_close(&store);
+  if (failed) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+#endif // VSCAN_H
@@ -0,0 +1,589 @@
+/* Similarity search over a Unix domain socket, with request micro-batching */
+#ifndef VSERVE_H
+#define VSERVE_H
+
+#include "vknn.h"
+#include "vstore.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Protocol, over a SOCK_STREAM Unix socket. A client sends requests
+//
+//   vserve_request_t, then dim floats of query
+//
+// and gets one response per request, in request order:
+//
+//   vserve_response_t, then count vserve_hit_t, best first
+//
+// status is 0 or an errno value (EINVAL for a dim that does not match the
+// store or a k of 0 or above VSERVE_MAX_K), in which case count is 0. A
+// client may pipeline any number of requests on one connection.
+//
+// The server mmaps the store once and runs one event loop. Requests from all
+// connections are queued into a batch that is searched with a single
+// vknn_search call, so each tile of the store is scored against every queued
+// query while it is in cache. A batch runs when it holds max_batch queries or
+// when its oldest query has waited max_delay_us, whichever comes first.
+
+#define VSERVE_MAX_K 1024
+// Requests announcing a larger dim close the connection instead of being read
+#define VSERVE_MAX_DIM 65536
+#define VSERVE_DEFAULT_BATCH 64
+#define VSERVE_DEFAULT_DELAY_US 1000
+// Stop reading a connection's requests while this much output is unsent
+#define VSERVE_OUT_LIMIT (1 << 20)
+
+typedef struct vserve_request_t {
+  uint32_t k;
+  uint32_t dim;
+} vserve_request_t;
+
+typedef struct vserve_response_t {
+  uint32_t count;
+  uint32_t status;
+} vserve_response_t;
+
+typedef struct vserve_hit_t {
+  uint64_t idx;
+  float score;
+  uint32_t reserved;
+} vserve_hit_t;
+
+typedef struct vserve_config_t {
+  int metric;
+  size_t max_batch;
+  size_t max_delay_us;
+  size_t nthreads;
+  // the loop returns once this becomes non-zero (e.g. from a signal handler)
+  volatile int *stop;
+} vserve_config_t;
+
+typedef struct vserve_conn_t {
+  int fd;
+  int closed;
+  uint32_t events;
+  // requests of this connection in the current batch
+  size_t queued;
+  unsigned char *in;
+  size_t in_len;
+  size_t in_cap;
+  unsigned char *out;
+  size_t out_len;
+  size_t out_cap;
+  struct vserve_conn_t *prev;
+  struct vserve_conn_t *next;
+} vserve_conn_t;
+
+typedef struct vserve_entry_t {
+  vserve_conn_t *conn;
+  uint32_t k;
+  uint32_t status;
+} vserve_entry_t;
+
+typedef struct vserve_t {
+  vstore_t *store;
+  vserve_config_t config;
+  int epfd;
+  int listen_fd;
+  int timer_fd;
+  // open connections, and closed ones to free once the current events are
+  // handled (a later event of the same epoll_wait may still point at them)
+  vserve_conn_t *live;
+  vserve_conn_t *dead;
+  vserve_entry_t *entries;
+  size_t nentries;
+  float *queries;
+  size_t nqueries;
+  size_t *idx;
+  float *val;
+} vserve_t;
+
+static inline int _vserve_reserve(unsigned char **buf, size_t *cap,
+                                  size_t need) {
+  if (need <= *cap) {
+    return 0;
+  }
+  size_t grown = *cap ? *cap : 4096;
+  while (grown < need) {
+    grown *= 2;
+  }
+  unsigned char *p = (unsigned char *)realloc(*buf, grown);
+  if (p == NULL) {
+    return -1;
+  }
+  *buf = p;
+  *cap = grown;
+  return 0;
+}
+
+// Close the connection; it is freed once none of its requests are queued
+static inline void _vserve_release(vserve_t *s, vserve_conn_t *c) {
+  if (!c->closed) {
+    epoll_ctl(s->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->closed = 1;
+  }
+  if (c->queued > 0 || c->prev == c) {
+    return;
+  }
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+  } else {
+    s->live = c->next;
+  }
+  if (c->next != NULL) {
+    c->next->prev = c->prev;
+  }
+  // prev pointing at itself marks a connection already on the dead list
+  c->prev = c;
+  c->next = s->dead;
+  s->dead = c;
+}
+
+static inline void _vserve_free(vserve_conn_t *c) {
+  while (c != NULL) {
+    vserve_conn_t *next = c->next;
+    free(c->in);
+    free(c->out);
+    free(c);
+    c = next;
+  }
+}
+
+// Stop reading from a client that does not read its answers, and wait for
+// the socket to drain while there is output left
+static inline void _vserve_watch(vserve_t *s, vserve_conn_t *c) {
+  uint32_t events = (c->out_len < VSERVE_OUT_LIMIT ? EPOLLIN : 0) |
+                    (c->out_len > 0 ? EPOLLOUT : 0);
+  if (events != c->events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+  }
+}
+
+// Write out as much of the connection's output as the socket takes
+static inline void _vserve_write(vserve_t *s, vserve_conn_t *c) {
+  size_t off = 0;
+  while (off < c->out_len) {
+    ssize_t n = send(c->fd, c->out + off, c->out_len - off, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      _vserve_release(s, c);
+      return;
+    }
+    off += (size_t)n;
+  }
+  memmove(c->out, c->out + off, c->out_len - off);
+  c->out_len -= off;
+  _vserve_watch(s, c);
+}
+
+static inline void _vserve_arm(vserve_t *s, size_t us) {
+  struct itimerspec t;
+  memset(&t, 0, sizeof(t));
+  t.it_value.tv_sec = (time_t)(us / 1000000);
+  t.it_value.tv_nsec = (long)(us % 1000000) * 1000;
+  if (us == 0) {
+    // a zero it_value disarms the timer, so fire as soon as possible instead
+    t.it_value.tv_nsec = 1;
+  }
+  timerfd_settime(s->timer_fd, 0, &t, NULL);
+}
+
+// Search the queued queries and append every response to its connection
+static inline void _vserve_flush(vserve_t *s) {
+  if (s->nentries == 0) {
+    return;
+  }
+  struct itimerspec off;
+  memset(&off, 0, sizeof(off));
+  timerfd_settime(s->timer_fd, 0, &off, NULL);
+
+  size_t kmax = 0;
+  for (size_t e = 0; e < s->nentries; e++) {
+    if (s->entries[e].status == 0 && s->entries[e].k > kmax) {
+      kmax = s->entries[e].k;
+    }
+  }
+  int failed = 0;
+  if (s->nqueries > 0) {
+    failed = vknn_search(s->store, s->queries, s->nqueries, kmax,
+                         s->config.metric, s->config.nthreads, s->idx,
+                         s->val) != 0;
+  }
+  size_t q = 0;
+  for (size_t e = 0; e < s->nentries; e++) {
+    vserve_entry_t *entry = &s->entries[e];
+    vserve_conn_t *c = entry->conn;
+    size_t *idx = s->idx + q * kmax;
+    float *val = s->val + q * kmax;
+    vserve_response_t r = {0, entry->status};
+    if (entry->status == 0) {
+      q++;
+      if (failed) {
+        r.status = ENOMEM;
+      }
+      while (!failed && r.count < entry->k && idx[r.count] != SIZE_MAX) {
+        r.count++;
+      }
+    }
+    if (c->closed) {
+      continue;
+    }
+    size_t need = c->out_len + sizeof(r) + r.count * sizeof(vserve_hit_t);
+    if (_vserve_reserve(&c->out, &c->out_cap, need) != 0) {
+      _vserve_release(s, c);
+      continue;
+    }
+    memcpy(c->out + c->out_len, &r, sizeof(r));
+    c->out_len += sizeof(r);
+    for (size_t j = 0; j < r.count; j++) {
+      vserve_hit_t hit = {idx[j], val[j], 0};
+      memcpy(c->out + c->out_len, &hit, sizeof(hit));
+      c->out_len += sizeof(hit);
+    }
+  }
+  // a connection's last entry in the batch is answered: send everything
+  for (size_t e = 0; e < s->nentries; e++) {
+    vserve_conn_t *c = s->entries[e].conn;
+    if (--c->queued > 0) {
+      continue;
+    }
+    if (c->closed) {
+      _vserve_release(s, c);
+    } else {
+      _vserve_write(s, c);
+    }
+  }
+  s->nentries = 0;
+  s->nqueries = 0;
+}
+
+// Queue every complete request in the connection's input buffer. Returns -1
+// when the connection has to be dropped.
+static inline int _vserve_parse(vserve_t *s, vserve_conn_t *c) {
+  size_t dim = s->store->dim;
+  size_t off = 0;
+  while (c->in_len - off >= sizeof(vserve_request_t)) {
+    vserve_request_t r;
+    memcpy(&r, c->in + off, sizeof(r));
+    if (r.dim > VSERVE_MAX_DIM) {
+      return -1;
+    }
+    size_t size = sizeof(r) + (size_t)r.dim * sizeof(float);
+    if (c->in_len - off < size) {
+      break;
+    }
+    // a bad request still takes its place in the batch, so that answers go
+    // out in request order
+    vserve_entry_t *entry = &s->entries[s->nentries++];
+    entry->conn = c;
+    entry->k = r.k;
+    entry->status = 0;
+    if (r.dim != dim || r.k == 0 || r.k > VSERVE_MAX_K) {
+      entry->status = EINVAL;
+    } else {
+      memcpy(s->queries + s->nqueries * dim, c->in + off + sizeof(r),
+             dim * sizeof(float));
+      s->nqueries++;
+    }
+    c->queued++;
+    off += size;
+    if (s->nentries == 1) {
+      _vserve_arm(s, s->config.max_delay_us);
+    }
+    if (s->nentries == s->config.max_batch) {
+      _vserve_flush(s);
+      if (c->closed) {
+        return -1;
+      }
+    }
+  }
+  memmove(c->in, c->in + off, c->in_len - off);
+  c->in_len -= off;
+  return 0;
+}
+
+static inline void _vserve_read(vserve_t *s, vserve_conn_t *c) {
+  while (c->out_len < VSERVE_OUT_LIMIT) {
+    if (_vserve_reserve(&c->in, &c->in_cap, c->in_len + 65536) != 0) {
+      _vserve_release(s, c);
+      return;
+    }
+    ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (n <= 0) {
+      _vserve_release(s, c);
+      return;
+    }
+    c->in_len += (size_t)n;
+    if (_vserve_parse(s, c) != 0) {
+      _vserve_release(s, c);
+      return;
+    }
+  }
+  _vserve_watch(s, c);
+}
+
+static inline void _vserve_accept(vserve_t *s) {
+  for (;;) {
+    // accept4 needs _GNU_SOURCE, which this header cannot rely on
+    int fd = accept(s->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      return;
+    }
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+      close(fd);
+      continue;
+    }
+    vserve_conn_t *c = (vserve_conn_t *)calloc(1, sizeof(vserve_conn_t));
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (c == NULL || epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      free(c);
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->events = EPOLLIN;
+    c->next = s->live;
+    if (s->live != NULL) {
+      s->live->prev = c;
+    }
+    s->live = c;
+  }
+}
+
+static inline int _vserve_listen(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  // a socket file left behind by a previous run would make bind fail
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+// Serve searches of store on the Unix socket at path until *config->stop
+// becomes non-zero (or forever if stop is NULL). The socket file is created,
+// replacing any stale one, and removed on return. Returns 0, or -1 with errno
+// set if the socket or the event loop could not be set up.
+int vserve_run(vstore_t *store, const char *path, vserve_config_t *config) {
+  vserve_t s;
+  memset(&s, 0, sizeof(s));
+  s.store = store;
+  s.config = *config;
+  if (s.config.max_batch == 0) {
+    s.config.max_batch = 1;
+  }
+  size_t batch = s.config.max_batch;
+  s.entries = (vserve_entry_t *)malloc(batch * sizeof(vserve_entry_t));
+  s.queries = (float *)malloc(batch * store->dim * sizeof(float) + 1);
+  s.idx = (size_t *)malloc(batch * VSERVE_MAX_K * sizeof(size_t));
+  s.val = (float *)malloc(batch * VSERVE_MAX_K * sizeof(float));
+  s.epfd = epoll_create1(EPOLL_CLOEXEC);
+  s.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  s.listen_fd = _vserve_listen(path);
+  int err = errno;
+  int ok = s.epfd >= 0 && s.timer_fd >= 0 && s.listen_fd >= 0;
+  if (s.entries == NULL || s.queries == NULL || s.idx == NULL ||
+      s.val == NULL) {
+    err = ENOMEM;
+    ok = 0;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = &s.listen_fd;
+  if (ok && epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.listen_fd, &ev) != 0) {
+    err = errno;
+    ok = 0;
+  }
+  ev.data.ptr = &s.timer_fd;
+  if (ok && epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.timer_fd, &ev) != 0) {
+    err = errno;
+    ok = 0;
+  }
+  // the store is scanned in full for every batch; keep it resident
+  vstore_advise(store, 0, store->count, VSTORE_WILLNEED);
+
+  struct epoll_event events[64];
+  while (ok && (config->stop == NULL || !*config->stop)) {
+    int n = epoll_wait(s.epfd, events, 64, -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err = errno;
+      ok = 0;
+      break;
+    }
+    for (int i = 0; i < n; i++) {
+      void *p = events[i].data.ptr;
+      if (p == &s.listen_fd) {
+        _vserve_accept(&s);
+      } else if (p == &s.timer_fd) {
+        uint64_t ticks;
+        if (read(s.timer_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+          _vserve_flush(&s);
+        }
+      } else {
+        vserve_conn_t *c = (vserve_conn_t *)p;
+        if (!c->closed && (events[i].events & EPOLLOUT)) {
+          _vserve_write(&s, c);
+        }
+        if (!c->closed && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+          _vserve_read(&s, c);
+        }
+      }
+    }
+    _vserve_free(s.dead);
+    s.dead = NULL;
+  }
+  // answer whatever is still queued before shutting down, as far as the
+  // sockets take it without blocking
+  _vserve_flush(&s);
+  while (s.live != NULL) {
+    _vserve_release(&s, s.live);
+  }
+  _vserve_free(s.dead);
+  if (s.listen_fd >= 0) {
+    close(s.listen_fd);
+    unlink(path);
+  }
+  if (s.timer_fd >= 0) {
+    close(s.timer_fd);
+  }
+  if (s.epfd >= 0) {
+    close(s.epfd);
+  }
+  free(s.entries);
+  free(s.queries);
+  free(s.idx);
+  free(s.val);
+  if (!ok) {
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+/* Client */
+
+// Connect to a server; returns the socket, or -1 with errno set
+int vserve_connect(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+static inline int _vserve_io(int fd, void *buf, size_t size, int writing) {
+  unsigned char *p = (unsigned char *)buf;
+  while (size > 0) {
+    ssize_t n = writing ? send(fd, p, size, MSG_NOSIGNAL) : recv(fd, p, size, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n == 0) {
+        errno = ECONNRESET;
+      }
+      return -1;
+    }
+    p += n;
+    size -= (size_t)n;
+  }
+  return 0;
+}
+
+// Send one query; vserve_recv reads its answer. Requests can be pipelined by
+// sending several before receiving.
+int vserve_send(int fd, float *query, size_t dim, size_t k) {
+  vserve_request_t r = {(uint32_t)k, (uint32_t)dim};
+  if (_vserve_io(fd, &r, sizeof(r), 1) != 0 ||
+      _vserve_io(fd, query, dim * sizeof(float), 1) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// Receive the next answer into out_idx / out_val (room for k results, as
+// sent) and return the number of results, or -1 with errno set (to the
+// server's status for a rejected request)
+long vserve_recv(int fd, size_t k, size_t *out_idx, float *out_val) {
+  vserve_response_t r;
+  if (_vserve_io(fd, &r, sizeof(r), 0) != 0) {
+    return -1;
+  }
+  for (uint32_t j = 0; j < r.count; j++) {
+    vserve_hit_t hit;
+    if (_vserve_io(fd, &hit, sizeof(hit), 0) != 0) {
+      return -1;
+    }
+    if (j < k) {
+      out_idx[j] = (size_t)hit.idx;
+      out_val[j] = hit.score;
+    }
+  }
+  if (r.status != 0) {
+    errno = (int)r.status;
+    return -1;
+  }
+  return r.count < k ? (long)r.count : (long)k;
+}
+
+#endif // VSERVE_H
@@ -0,0 +1,451 @@
+/* Softmax and log-sum-exp over float vectors */
+#ifndef VSOFTMAX_H
+#define VSOFTMAX_H
+
+#include "simdinfo.h"
+#include <math.h>
+#include <stdlib.h>
+
+// Running state of an online softmax: the largest value seen so far and the
+// sum of exp(x - max) over all values seen so far. Feeding scores in chunks
+// through vsoftmax_update_f32 gives the same result as a single call over the
+// concatenated scores, so callers never need to keep all of them around.
+typedef struct vsoftmax_state_t {
+  float max;
+  float sum;
+} vsoftmax_state_t;
+
+#define VSOFTMAX_STATE_INIT {-INFINITY, 0.0f}
+
+// A NaN score makes the state NaN, and with it the log-sum-exp and every
+// softmax output, on every code path.
+
+// Fold a partial (max, sum) pair into the running state
+static inline void _vsoftmax_merge(vsoftmax_state_t *state, float m, float s) {
+  if (m == -INFINITY) {
+    return;
+  }
+  if (m <= state->max) {
+    state->sum += s * expf(m - state->max);
+  } else {
+    state->sum = state->sum * expf(state->max - m) + s;
+    state->max = m;
+  }
+}
+
+/* Fallback scalar implementation */
+
+static inline void _vsoftmax_update_f32_serial(vsoftmax_state_t *state,
+                                               float *x, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    _vsoftmax_merge(state, x[i], 1.0f);
+  }
+}
+
+static inline void _vsoftmax_normalize_f32_serial(float *x, float *out,
+                                                  size_t size, float max,
+                                                  float scale) {
+  for (size_t i = 0; i < size; i++) {
+    out[i] = expf(x[i] - max) * scale;
+  }
+}
+
+// The vector exp kernels below are only ever called with x - max, so they are
+// written for x <= 0. Anything below about -87.3 (including -inf and NaN,
+// which show up for masked logits) flushes to zero.
+//
+// exp(x) = 2^n * exp(r) with n = round(x / ln2) and r = x - n * ln2 in
+// [-ln2/2, ln2/2]; exp(r) uses the Cephes expf polynomial and ln2 is split in
+// two so that r is computed without cancellation.
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+#include <immintrin.h>
+
+static inline __m256 _vexp_f32_avx2(__m256 x) {
+  // max returns its second operand for NaN, which clamps NaN away
+  x = _mm256_max_ps(x, _mm256_set1_ps(-88.0f));
+  __m256 keep = _mm256_cmp_ps(x, _mm256_set1_ps(-87.3f), _CMP_GE_OQ);
+  __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)),
+                             _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+  r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+  __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+  p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+  __m256i e = _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127));
+  __m256 pow2n = _mm256_castsi256_ps(_mm256_slli_epi32(e, 23));
+  return _mm256_and_ps(_mm256_mul_ps(p, pow2n), keep);
+}
+
+static inline void _vsoftmax_update_f32_avx2(vsoftmax_state_t *state,
+                                             float *x, size_t size) {
+  // Each lane keeps its own running (max, sum). For every new value exactly
+  // one side of the update is exp(0) = 1, so one exp per element is enough:
+  //   v > m:  sum = sum * exp(m - v) + 1, m = v
+  //   v <= m: sum = sum + exp(v - m)
+  __m256 m = _mm256_set1_ps(-INFINITY);
+  __m256 s = _mm256_setzero_ps();
+  __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256 one = _mm256_set1_ps(1.0f);
+  // the exp clamps NaN away, so NaN lanes are tracked on the side
+  __m256 nan = _mm256_setzero_ps();
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m256 v = _mm256_loadu_ps(x + i);
+    __m256 e = _vexp_f32_avx2(_mm256_or_ps(_mm256_sub_ps(v, m), sign));
+    __m256 gt = _mm256_cmp_ps(v, m, _CMP_GT_OQ);
+    s = _mm256_blendv_ps(_mm256_add_ps(s, e), _mm256_fmadd_ps(s, e, one), gt);
+    m = _mm256_blendv_ps(m, v, gt);
+    nan = _mm256_or_ps(nan, _mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+  }
+  float mr[8], sr[8];
+  _mm256_storeu_ps(mr, m);
+  _mm256_storeu_ps(sr, s);
+  for (size_t j = 0; j < 8; j++) {
+    _vsoftmax_merge(state, mr[j], sr[j]);
+  }
+  if (_mm256_movemask_ps(nan)) {
+    _vsoftmax_merge(state, NAN, NAN);
+  }
+  // left over
+  _vsoftmax_update_f32_serial(state, x + ssize, size - ssize);
+}
+
+static inline void _vsoftmax_normalize_f32_avx2(float *x, float *out,
+                                                size_t size, float max,
+                                                float scale) {
+  __m256 vmax = _mm256_set1_ps(max);
+  __m256 vscale = _mm256_set1_ps(scale);
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m256 v = _mm256_sub_ps(_mm256_loadu_ps(x + i), vmax);
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_vexp_f32_avx2(v), vscale));
+  }
+  // left over
+  _vsoftmax_normalize_f32_serial(x + ssize, out + ssize, size - ssize, max,
+                                 scale);
+}
+
+#endif // __AVX2__ && __FMA__
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+static inline __m512 _vexp_f32_avx512f(__m512 x) {
+  // vscalefps applies 2^n directly and underflows gracefully, so the only
+  // clamp needed is the one that turns -inf and NaN into a finite input
+  x = _mm512_max_ps(x, _mm512_set1_ps(-104.0f));
+  __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504f)),
+                                  _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+  r = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), r);
+  __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+  p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), _mm512_add_ps(r, _mm512_set1_ps(1.0f)));
+  return _mm512_scalef_ps(p, n);
+}
+
+static inline void _vsoftmax_update_f32_avx512f(vsoftmax_state_t *state,
+                                                float *x, size_t size) {
+  // Same per-lane update as the AVX2 kernel, with the tail handled by a
+  // masked load that leaves inactive lanes untouched
+  __m512 m = _mm512_set1_ps(-INFINITY);
+  __m512 s = _mm512_setzero_ps();
+  __m512 one = _mm512_set1_ps(1.0f);
+  __mmask16 nan = 0;
+  for (size_t i = 0; i < size; i += 16) {
+    __mmask16 active = size - i >= 16 ? 0xffff : (__mmask16)((1u << (size - i)) - 1);
+    __m512 v = _mm512_mask_loadu_ps(m, active, x + i);
+    nan |= _mm512_mask_cmp_ps_mask(active, v, v, _CMP_UNORD_Q);
+    __m512 d = _mm512_sub_ps(v, m);
+    __m512 e = _vexp_f32_avx512f(_mm512_min_ps(d, _mm512_sub_ps(_mm512_setzero_ps(), d)));
+    __mmask16 gt = _mm512_mask_cmp_ps_mask(active, v, m, _CMP_GT_OQ);
+    s = _mm512_mask_add_ps(s, active & ~gt, s, e);
+    s = _mm512_mask_fmadd_ps(s, gt, e, one);
+    m = _mm512_mask_mov_ps(m, gt, v);
+  }
+  float mr[16], sr[16];
+  _mm512_storeu_ps(mr, m);
+  _mm512_storeu_ps(sr, s);
+  for (size_t j = 0; j < 16; j++) {
+    _vsoftmax_merge(state, mr[j], sr[j]);
+  }
+  if (nan) {
+    _vsoftmax_merge(state, NAN, NAN);
+  }
+}
+
+static inline void _vsoftmax_normalize_f32_avx512f(float *x, float *out,
+                                                   size_t size, float max,
+                                                   float scale) {
+  __m512 vmax = _mm512_set1_ps(max);
+  __m512 vscale = _mm512_set1_ps(scale);
+  for (size_t i = 0; i < size; i += 16) {
+    __mmask16 active = size - i >= 16 ? 0xffff : (__mmask16)((1u << (size - i)) - 1);
+    __m512 v = _mm512_sub_ps(_mm512_maskz_loadu_ps(active, x + i), vmax);
+    _mm512_mask_storeu_ps(out + i, active,
+                          _mm512_mul_ps(_vexp_f32_avx512f(v), vscale));
+  }
+}
+
+#endif // __AVX512F__
+
+/* ARM */
+
+#if defined(__ARM_FEATURE_SVE)
+
+#include <arm_sve.h>
+
+static inline svfloat32_t _vexp_f32_sve(svbool_t pg, svfloat32_t x) {
+  // FEXPA looks up 2^(i/64) from the low 6 bits of its input and takes the
+  // exponent from bits [13:6]. Adding 1.5*2^17 + 127 rounds x/ln2 to a
+  // multiple of 1/64 and leaves exactly that bit pattern in the mantissa,
+  // so r shrinks to [-ln2/128, ln2/128] and a cubic is enough for exp(r) - 1.
+  x = svmaxnm_n_f32_x(pg, x, -88.0f);
+  svbool_t flush = svcmplt_n_f32(pg, x, -87.3f);
+  svfloat32_t shift = svdup_f32(0x1.803f8p17f);
+  svfloat32_t z = svmla_n_f32_x(pg, shift, x, 1.44269504f);
+  svfloat32_t n = svsub_f32_x(pg, z, shift);
+  svfloat32_t r = svmls_n_f32_x(pg, x, n, 0x1.62e4p-1f);
+  r = svmls_n_f32_x(pg, r, n, 0x1.7f7d1cp-20f);
+  svfloat32_t scale = svexpa_f32(svreinterpret_u32_f32(z));
+  svfloat32_t p = svmla_n_f32_x(pg, svdup_f32(0.5f), r, 1.0f / 6.0f);
+  p = svmla_f32_x(pg, r, svmul_f32_x(pg, r, r), p);
+  svfloat32_t y = svmla_f32_x(pg, scale, scale, p);
+  return svsel_f32(flush, svdup_f32(0.0f), y);
+}
+
+static inline void _vsoftmax_update_f32_sve(vsoftmax_state_t *state, float *x,
+                                            size_t size) {
+  svfloat32_t m = svdup_f32(-INFINITY);
+  svfloat32_t s = svdup_f32(0.0f);
+  svbool_t nan = svpfalse_b();
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    svfloat32_t v = svld1_f32(pg, &x[i]);
+    nan = svorr_b_z(svptrue_b32(), nan, svcmpuo_f32(pg, v, v));
+    svfloat32_t d = svabs_f32_x(pg, svsub_f32_x(pg, v, m));
+    svfloat32_t e = _vexp_f32_sve(pg, svneg_f32_x(pg, d));
+    svbool_t gt = svcmpgt_f32(pg, v, m);
+    s = svsel_f32(gt, svmla_f32_x(pg, svdup_f32(1.0f), s, e),
+                  svadd_f32_m(pg, s, e));
+    m = svsel_f32(gt, v, m);
+  }
+  // SVE vectors hold at most 2048 bits
+  float mr[64], sr[64];
+  svst1_f32(svptrue_b32(), mr, m);
+  svst1_f32(svptrue_b32(), sr, s);
+  for (size_t j = 0; j < svcntw(); j++) {
+    _vsoftmax_merge(state, mr[j], sr[j]);
+  }
+  if (svptest_any(svptrue_b32(), nan)) {
+    _vsoftmax_merge(state, NAN, NAN);
+  }
+}
+
+static inline void _vsoftmax_normalize_f32_sve(float *x, float *out,
+                                               size_t size, float max,
+                                               float scale) {
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    svfloat32_t v = svsub_n_f32_x(pg, svld1_f32(pg, &x[i]), max);
+    svst1_f32(pg, &out[i], svmul_n_f32_x(pg, _vexp_f32_sve(pg, v), scale));
+  }
+}
+
+#endif // __ARM_FEATURE_SVE
+
+// vrndnq_f32 and vmaxnmq_f32 are A64 only
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static inline float32x4_t _vexp_f32_neon(float32x4_t x) {
+  // maxnm returns the number when the other operand is NaN
+  x = vmaxnmq_f32(x, vdupq_n_f32(-88.0f));
+  uint32x4_t keep = vcgeq_f32(x, vdupq_n_f32(-87.3f));
+  float32x4_t n = vrndnq_f32(vmulq_n_f32(x, 1.44269504f));
+  float32x4_t r = vfmsq_f32(x, n, vdupq_n_f32(0.693359375f));
+  r = vfmsq_f32(r, n, vdupq_n_f32(-2.12194440e-4f));
+  float32x4_t p = vdupq_n_f32(1.9875691500e-4f);
+  p = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), p, r);
+  p = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), p, r);
+  p = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), p, r);
+  p = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), p, r);
+  p = vfmaq_f32(vdupq_n_f32(5.0000001201e-1f), p, r);
+  p = vfmaq_f32(vaddq_f32(r, vdupq_n_f32(1.0f)), p, vmulq_f32(r, r));
+  int32x4_t e = vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127));
+  float32x4_t pow2n = vreinterpretq_f32_s32(vshlq_n_s32(e, 23));
+  float32x4_t y = vmulq_f32(p, pow2n);
+  return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(y), keep));
+}
+
+static inline void _vsoftmax_update_f32_neon(vsoftmax_state_t *state,
+                                             float *x, size_t size) {
+  float32x4_t m = vdupq_n_f32(-INFINITY);
+  float32x4_t s = vdupq_n_f32(0);
+  float32x4_t one = vdupq_n_f32(1.0f);
+  // lanes that saw a NaN; v == v is false only for NaN
+  uint32x4_t nan = vdupq_n_u32(0);
+  size_t ssize = size - (size % 4);
+  for (size_t i = 0; i < ssize; i += 4) {
+    float32x4_t v = vld1q_f32(x + i);
+    nan = vorrq_u32(nan, vmvnq_u32(vceqq_f32(v, v)));
+    float32x4_t e = _vexp_f32_neon(vnegq_f32(vabdq_f32(v, m)));
+    uint32x4_t gt = vcgtq_f32(v, m);
+    s = vbslq_f32(gt, vfmaq_f32(one, s, e), vaddq_f32(s, e));
+    m = vbslq_f32(gt, v, m);
+  }
+  float32_t mr[4], sr[4];
+  vst1q_f32(mr, m);
+  vst1q_f32(sr, s);
+  for (size_t j = 0; j < 4; j++) {
+    _vsoftmax_merge(state, mr[j], sr[j]);
+  }
+  if (vmaxvq_u32(nan)) {
+    _vsoftmax_merge(state, NAN, NAN);
+  }
+  // left over
+  _vsoftmax_update_f32_serial(state, x + ssize, size - ssize);
+}
+
+static inline void _vsoftmax_normalize_f32_neon(float *x, float *out,
+                                                size_t size, float max,
+                                                float scale) {
+  float32x4_t vmax = vdupq_n_f32(max);
+  size_t ssize = size - (size % 4);
+  for (size_t i = 0; i < ssize; i += 4) {
+    float32x4_t v = vsubq_f32(vld1q_f32(x + i), vmax);
+    vst1q_f32(out + i, vmulq_n_f32(_vexp_f32_neon(v), scale));
+  }
+  // left over
+  _vsoftmax_normalize_f32_serial(x + ssize, out + ssize, size - ssize, max,
+                                 scale);
+}
+
+#endif // __ARM_NEON && __aarch64__
+
+// Fold x[0..size) into an online softmax state in a single pass
+void vsoftmax_update_f32(vsoftmax_state_t *state, float *x, size_t size) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vsoftmax_update_f32_avx512f(state, x, size);
+    return;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__) && defined(__FMA__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__) && SIMDINFO_SUPPORTS(info, __FMA__)) {
+    _vsoftmax_update_f32_avx2(state, x, size);
+    return;
+  }
+#endif // __AVX2__ && __FMA__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    _vsoftmax_update_f32_sve(state, x, size);
+    return;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    _vsoftmax_update_f32_neon(state, x, size);
+    return;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  _vsoftmax_update_f32_serial(state, x, size);
+}
+
+// out[i] = exp(x[i] - state.max) / state.sum; out may alias x. A state that
+// saw no finite score (every x is -inf, e.g. a fully masked row) gives all
+// zeros.
+void vsoftmax_normalize_f32(vsoftmax_state_t *state, float *x, float *out,
+                            size_t size) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+  float max = state->max;
+  float scale = 1.0f / state->sum;
+  if (max == -INFINITY) {
+    for (size_t i = 0; i < size; i++) {
+      out[i] = 0.0f;
+    }
+    return;
+  }
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    _vsoftmax_normalize_f32_avx512f(x, out, size, max, scale);
+    return;
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__) && defined(__FMA__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__) && SIMDINFO_SUPPORTS(info, __FMA__)) {
+    _vsoftmax_normalize_f32_avx2(x, out, size, max, scale);
+    return;
+  }
+#endif // __AVX2__ && __FMA__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    _vsoftmax_normalize_f32_sve(x, out, size, max, scale);
+    return;
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    _vsoftmax_normalize_f32_neon(x, out, size, max, scale);
+    return;
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  _vsoftmax_normalize_f32_serial(x, out, size, max, scale);
+}
+
+// log(sum(exp(x[i]))) in a single pass over x
+float vlogsumexp_f32(float *x, size_t size) {
+  vsoftmax_state_t state = VSOFTMAX_STATE_INIT;
+  vsoftmax_update_f32(&state, x, size);
+  if (state.max == -INFINITY) {
+    return -INFINITY;
+  }
+  return state.max + logf(state.sum);
+}
+
+// Softmax of x into out: one pass for max and sum, one pass to write out.
+// All zeros when every x is -inf, all NaN when any x is NaN.
+void vsoftmax_f32(float *x, float *out, size_t size) {
+  vsoftmax_state_t state = VSOFTMAX_STATE_INIT;
+  vsoftmax_update_f32(&state, x, size);
+  vsoftmax_normalize_f32(&state, x, out, size);
+}
+
+#endif // VSOFTMAX_H
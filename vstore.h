@@ -0,0 +1,336 @@
+/* Memory-mapped vector store */
+#ifndef VSTORE_H
+#define VSTORE_H
+
+#include "vconvert.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk layout (little-endian):
+//
+//   [0, 64)              vstore_header_t
+//   [scales_offset, ...) count floats, per-row scale (int8 only)
+//   [biases_offset, ...) count floats, per-row bias (int8 only)
+//   [data_offset, ...)   count rows, row_stride bytes apart
+//
+// data_offset is a multiple of the page size and row_stride a multiple of 64,
+// so once the file is mapped every row starts on a cache line and can be
+// handed to the dot kernels without a copy. int8 rows decode as
+// x ~= scale * q + bias, as produced by vquantize_i8_f32; binary rows hold
+// one sign bit per value (vconvert_f32_to_b1) and decode as +1 / -1.
+
+#define VSTORE_MAGIC "VSTORE\0\0"
+#define VSTORE_VERSION 1
+#define VSTORE_ALIGN 64
+#define VSTORE_PAGE 4096
+
+enum vstore_dtype_t {
+  VSTORE_F32 = 0,
+  VSTORE_F16 = 1,
+  VSTORE_BF16 = 2,
+  VSTORE_I8 = 3,
+  VSTORE_B1 = 4,
+};
+
+typedef struct vstore_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t dtype;
+  uint64_t dim;
+  uint64_t count;
+  uint64_t row_stride;
+  uint64_t data_offset;
+  uint64_t scales_offset;
+  uint64_t biases_offset;
+} vstore_header_t;
+
+typedef struct vstore_t {
+  int fd;
+  unsigned char *map;
+  size_t map_size;
+  int dtype;
+  size_t dim;
+  size_t count;
+  size_t stride;
+  unsigned char *data;
+  float *scales;
+  float *biases;
+} vstore_t;
+
+static inline size_t vstore_dtype_size(int dtype) {
+  switch (dtype) {
+  case VSTORE_F32:
+    return 4;
+  case VSTORE_F16:
+  case VSTORE_BF16:
+    return 2;
+  case VSTORE_I8:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static inline int _vstore_valid_dtype(int dtype) {
+  return dtype >= VSTORE_F32 && dtype <= VSTORE_B1;
+}
+
+// Bytes taken by the dim values of one row, before padding
+static inline size_t vstore_row_bytes(int dtype, size_t dim) {
+  return dtype == VSTORE_B1 ? (dim + 7) / 8 : dim * vstore_dtype_size(dtype);
+}
+
+static inline size_t _vstore_round_up(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+static inline void *vstore_row(vstore_t *store, size_t i) {
+  return store->data + i * store->stride;
+}
+
+static inline float *vstore_row_f32(vstore_t *store, size_t i) {
+  return (float *)vstore_row(store, i);
+}
+
+static inline uint16_t *vstore_row_u16(vstore_t *store, size_t i) {
+  return (uint16_t *)vstore_row(store, i);
+}
+
+static inline int8_t *vstore_row_i8(vstore_t *store, size_t i) {
+  return (int8_t *)vstore_row(store, i);
+}
+
+static inline uint8_t *vstore_row_b1(vstore_t *store, size_t i) {
+  return (uint8_t *)vstore_row(store, i);
+}
+
+// Fill in the header fields of an empty store of the given shape
+static inline void _vstore_layout(vstore_header_t *h, int dtype, size_t dim,
+                                  size_t count) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, VSTORE_MAGIC, sizeof(h->magic));
+  h->version = VSTORE_VERSION;
+  h->dtype = (uint32_t)dtype;
+  h->dim = dim;
+  h->count = count;
+  h->row_stride = _vstore_round_up(vstore_row_bytes(dtype, dim), VSTORE_ALIGN);
+  size_t offset = VSTORE_ALIGN;
+  if (dtype == VSTORE_I8) {
+    h->scales_offset = offset;
+    offset = _vstore_round_up(offset + count * sizeof(float), VSTORE_ALIGN);
+    h->biases_offset = offset;
+    offset = _vstore_round_up(offset + count * sizeof(float), VSTORE_ALIGN);
+  }
+  h->data_offset = _vstore_round_up(offset, VSTORE_PAGE);
+}
+
+static inline int _vstore_map(vstore_t *store, int fd, size_t size, int prot) {
+  void *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  vstore_header_t *h = (vstore_header_t *)map;
+  store->fd = fd;
+  store->map = (unsigned char *)map;
+  store->map_size = size;
+  store->dtype = (int)h->dtype;
+  store->dim = (size_t)h->dim;
+  store->count = (size_t)h->count;
+  store->stride = (size_t)h->row_stride;
+  store->data = store->map + h->data_offset;
+  store->scales = h->scales_offset ? (float *)(store->map + h->scales_offset) : NULL;
+  store->biases = h->biases_offset ? (float *)(store->map + h->biases_offset) : NULL;
+  return 0;
+}
+
+// An optional table of count floats at offset has to fit inside the file
+static inline int _vstore_valid_floats(uint64_t offset, uint64_t count,
+                                       size_t size) {
+  return offset == 0 || (offset % sizeof(float) == 0 && offset <= size &&
+                         count <= (size - offset) / sizeof(float));
+}
+
+// Map an existing store read-only. Returns 0, or -1 with errno set (EINVAL
+// for a file that is not a valid store).
+int vstore_open(const char *path, vstore_t *store) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  vstore_header_t h;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return -1;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size < sizeof(h) || pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  int valid = memcmp(h.magic, VSTORE_MAGIC, sizeof(h.magic)) == 0 &&
+              h.version == VSTORE_VERSION && _vstore_valid_dtype((int)h.dtype) &&
+              h.row_stride >= vstore_row_bytes((int)h.dtype, h.dim) &&
+              h.row_stride % VSTORE_ALIGN == 0 &&
+              h.data_offset % VSTORE_ALIGN == 0 && h.data_offset <= size &&
+              (h.row_stride == 0 || h.count <= (size - h.data_offset) / h.row_stride) &&
+              _vstore_valid_floats(h.scales_offset, h.count, size) &&
+              _vstore_valid_floats(h.biases_offset, h.count, size) &&
+              (h.dtype != VSTORE_I8 || (h.scales_offset != 0 && h.biases_offset != 0));
+  if (!valid) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  if (_vstore_map(store, fd, size, PROT_READ) != 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+// Create (or truncate) a store of count rows and map it read-write so the
+// caller can fill rows, scales and biases in place. Close it to flush.
+int vstore_create(const char *path, int dtype, size_t dim, size_t count,
+                  vstore_t *store) {
+  if (!_vstore_valid_dtype(dtype)) {
+    errno = EINVAL;
+    return -1;
+  }
+  vstore_header_t h;
+  _vstore_layout(&h, dtype, dim, count);
+  size_t size = h.data_offset + count * h.row_stride;
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  if (ftruncate(fd, (off_t)size) != 0 ||
+      pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+      _vstore_map(store, fd, size, PROT_READ | PROT_WRITE) != 0) {
+    int err = errno;
+    close(fd);
+    unlink(path);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+void vstore_close(vstore_t *store) {
+  if (store->map != NULL) {
+    munmap(store->map, store->map_size);
+  }
+  if (store->fd >= 0) {
+    close(store->fd);
+  }
+  store->map = NULL;
+  store->fd = -1;
+}
+
+// Write count rows of dim floats (src_stride floats apart) as a new store of
+// the given dtype. int8 rows get per-row scales in the given quantize mode.
+int vstore_write_f32(const char *path, int dtype, float *x, size_t count,
+                     size_t dim, size_t src_stride, int mode) {
+  vstore_t store;
+  if (vstore_create(path, dtype, dim, count, &store) != 0) {
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    float *src = x + i * src_stride;
+    switch (dtype) {
+    case VSTORE_F32:
+      memcpy(vstore_row(&store, i), src, dim * sizeof(float));
+      break;
+    case VSTORE_F16:
+      vconvert_f32_to_f16(src, vstore_row_u16(&store, i), dim);
+      break;
+    case VSTORE_BF16:
+      vconvert_f32_to_bf16(src, vstore_row_u16(&store, i), dim);
+      break;
+    case VSTORE_I8:
+      vquantize_i8_f32(src, 1, dim, dim, mode, vstore_row_i8(&store, i),
+                       &store.scales[i], &store.biases[i]);
+      break;
+    case VSTORE_B1:
+      vconvert_f32_to_b1(src, vstore_row_b1(&store, i), dim);
+      break;
+    }
+  }
+  vstore_close(&store);
+  return 0;
+}
+
+// Decode n rows starting at row begin into out as dense f32 rows of dim
+void vstore_decode_f32(vstore_t *store, size_t begin, size_t n, float *out) {
+  for (size_t i = 0; i < n; i++) {
+    float *dst = out + i * store->dim;
+    switch (store->dtype) {
+    case VSTORE_F32:
+      memcpy(dst, vstore_row(store, begin + i), store->dim * sizeof(float));
+      break;
+    case VSTORE_F16:
+      vconvert_f16_to_f32(vstore_row_u16(store, begin + i), dst, store->dim);
+      break;
+    case VSTORE_BF16:
+      vconvert_bf16_to_f32(vstore_row_u16(store, begin + i), dst, store->dim);
+      break;
+    case VSTORE_I8:
+      vdequantize_i8_f32(vstore_row_i8(store, begin + i), store->dim,
+                         store->scales[begin + i], store->biases[begin + i],
+                         dst);
+      break;
+    case VSTORE_B1:
+      vconvert_b1_to_f32(vstore_row_b1(store, begin + i), dst, store->dim);
+      break;
+    }
+  }
+}
+
+// f32 view of n rows starting at row begin: the mapped rows themselves for an
+// f32 store, otherwise the rows decoded into scratch (n * dim floats). The
+// distance between rows, in floats, is returned in stride.
+static inline float *vstore_rows_f32(vstore_t *store, size_t begin, size_t n,
+                                     float *scratch, size_t *stride) {
+  if (store->dtype == VSTORE_F32) {
+    *stride = store->stride / sizeof(float);
+    return vstore_row_f32(store, begin);
+  }
+  vstore_decode_f32(store, begin, n, scratch);
+  *stride = store->dim;
+  return scratch;
+}
+
+enum vstore_advice_t {
+  VSTORE_SEQUENTIAL = MADV_SEQUENTIAL,
+  VSTORE_RANDOM = MADV_RANDOM,
+  VSTORE_WILLNEED = MADV_WILLNEED,
+  VSTORE_DONTNEED = MADV_DONTNEED,
+};
+
+// madvise the pages holding rows [begin, end). Use VSTORE_SEQUENTIAL before
+// a full scan so the kernel reads ahead aggressively and drops pages behind
+// the scan, and VSTORE_RANDOM for graph or IVF probing.
+int vstore_advise(vstore_t *store, size_t begin, size_t end, int advice) {
+  if (end > store->count) {
+    end = store->count;
+  }
+  if (begin >= end) {
+    return 0;
+  }
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t lo = (size_t)(store->data - store->map) + begin * store->stride;
+  size_t hi = (size_t)(store->data - store->map) + end * store->stride;
+  lo = lo / page * page;
+  return madvise(store->map + lo, hi - lo, advice);
+}
+
+#endif // VSTORE_H
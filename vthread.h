@@ -0,0 +1,81 @@
+/* Splitting loops across threads */
+#ifndef VTHREAD_H
+#define VTHREAD_H
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Body of a parallel loop: handles items [begin, end) of the range
+typedef void (*vthread_fn_t)(void *ctx, size_t begin, size_t end);
+
+typedef struct vthread_task_t {
+  vthread_fn_t fn;
+  void *ctx;
+  size_t begin;
+  size_t end;
+} vthread_task_t;
+
+static inline size_t vthread_count(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t)n : 1;
+}
+
+static inline void *_vthread_main(void *arg) {
+  vthread_task_t *task = (vthread_task_t *)arg;
+  task->fn(task->ctx, task->begin, task->end);
+  return NULL;
+}
+
+// Run fn over [0, n) split into contiguous ranges, one per thread, with the
+// calling thread taking the first range. nthreads = 0 uses every online CPU;
+// ranges are never smaller than min_chunk items, so small loops stay on the
+// calling thread. If a thread cannot be started its range runs inline.
+void vthread_parallel_for(size_t n, size_t nthreads, size_t min_chunk,
+                          vthread_fn_t fn, void *ctx) {
+  if (nthreads == 0) {
+    nthreads = vthread_count();
+  }
+  if (min_chunk == 0) {
+    min_chunk = 1;
+  }
+  if (nthreads > n / min_chunk) {
+    nthreads = n / min_chunk;
+  }
+  if (nthreads <= 1) {
+    fn(ctx, 0, n);
+    return;
+  }
+  vthread_task_t *tasks = (vthread_task_t *)malloc(nthreads * sizeof(vthread_task_t));
+  pthread_t *threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+  int *started = (int *)calloc(nthreads, sizeof(int));
+  if (tasks == NULL || threads == NULL || started == NULL) {
+    free(tasks);
+    free(threads);
+    free(started);
+    fn(ctx, 0, n);
+    return;
+  }
+  for (size_t t = 0; t < nthreads; t++) {
+    tasks[t].fn = fn;
+    tasks[t].ctx = ctx;
+    tasks[t].begin = n * t / nthreads;
+    tasks[t].end = n * (t + 1) / nthreads;
+  }
+  for (size_t t = 1; t < nthreads; t++) {
+    started[t] = pthread_create(&threads[t], NULL, _vthread_main, &tasks[t]) == 0;
+  }
+  fn(ctx, tasks[0].begin, tasks[0].end);
+  for (size_t t = 1; t < nthreads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    } else {
+      fn(ctx, tasks[t].begin, tasks[t].end);
+    }
+  }
+  free(tasks);
+  free(threads);
+  free(started);
+}
+
+#endif // VTHREAD_H
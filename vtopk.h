@@ -0,0 +1,632 @@
+/* Top-k selection over score arrays */
+#ifndef VTOPK_H
+#define VTOPK_H
+
+#include "simdinfo.h"
+#include "vdot.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Scores are filtered and pushed into the heap in blocks of this many values
+#define VTOPK_BLOCK 256
+
+/* Threshold filter */
+
+// The filter kernels write every x[i] > threshold (and its index i) to the
+// front of out_val / out_idx and return how many survived. NaN never passes.
+// Both outputs must have room for `size` elements.
+
+static inline size_t _vtopk_filter_f32_serial(float *x, size_t size,
+                                              float threshold, float *out_val,
+                                              uint32_t *out_idx) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; i++) {
+    if (x[i] > threshold) {
+      out_val[count] = x[i];
+      out_idx[count] = (uint32_t)i;
+      count++;
+    }
+  }
+  return count;
+}
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+// For each 8-bit compare mask, the lane numbers of its set bits packed one per
+// byte from the low end: the permutation that moves survivors to the front
+static const uint64_t _vtopk_compress_lut[256] = {
+    0x0000000000000000ull, 0x0000000000000000ull, 0x0000000000000001ull,
+    0x0000000000000100ull, 0x0000000000000002ull, 0x0000000000000200ull,
+    0x0000000000000201ull, 0x0000000000020100ull, 0x0000000000000003ull,
+    0x0000000000000300ull, 0x0000000000000301ull, 0x0000000000030100ull,
+    0x0000000000000302ull, 0x0000000000030200ull, 0x0000000000030201ull,
+    0x0000000003020100ull, 0x0000000000000004ull, 0x0000000000000400ull,
+    0x0000000000000401ull, 0x0000000000040100ull, 0x0000000000000402ull,
+    0x0000000000040200ull, 0x0000000000040201ull, 0x0000000004020100ull,
+    0x0000000000000403ull, 0x0000000000040300ull, 0x0000000000040301ull,
+    0x0000000004030100ull, 0x0000000000040302ull, 0x0000000004030200ull,
+    0x0000000004030201ull, 0x0000000403020100ull, 0x0000000000000005ull,
+    0x0000000000000500ull, 0x0000000000000501ull, 0x0000000000050100ull,
+    0x0000000000000502ull, 0x0000000000050200ull, 0x0000000000050201ull,
+    0x0000000005020100ull, 0x0000000000000503ull, 0x0000000000050300ull,
+    0x0000000000050301ull, 0x0000000005030100ull, 0x0000000000050302ull,
+    0x0000000005030200ull, 0x0000000005030201ull, 0x0000000503020100ull,
+    0x0000000000000504ull, 0x0000000000050400ull, 0x0000000000050401ull,
+    0x0000000005040100ull, 0x0000000000050402ull, 0x0000000005040200ull,
+    0x0000000005040201ull, 0x0000000504020100ull, 0x0000000000050403ull,
+    0x0000000005040300ull, 0x0000000005040301ull, 0x0000000504030100ull,
+    0x0000000005040302ull, 0x0000000504030200ull, 0x0000000504030201ull,
+    0x0000050403020100ull, 0x0000000000000006ull, 0x0000000000000600ull,
+    0x0000000000000601ull, 0x0000000000060100ull, 0x0000000000000602ull,
+    0x0000000000060200ull, 0x0000000000060201ull, 0x0000000006020100ull,
+    0x0000000000000603ull, 0x0000000000060300ull, 0x0000000000060301ull,
+    0x0000000006030100ull, 0x0000000000060302ull, 0x0000000006030200ull,
+    0x0000000006030201ull, 0x0000000603020100ull, 0x0000000000000604ull,
+    0x0000000000060400ull, 0x0000000000060401ull, 0x0000000006040100ull,
+    0x0000000000060402ull, 0x0000000006040200ull, 0x0000000006040201ull,
+    0x0000000604020100ull, 0x0000000000060403ull, 0x0000000006040300ull,
+    0x0000000006040301ull, 0x0000000604030100ull, 0x0000000006040302ull,
+    0x0000000604030200ull, 0x0000000604030201ull, 0x0000060403020100ull,
+    0x0000000000000605ull, 0x0000000000060500ull, 0x0000000000060501ull,
+    0x0000000006050100ull, 0x0000000000060502ull, 0x0000000006050200ull,
+    0x0000000006050201ull, 0x0000000605020100ull, 0x0000000000060503ull,
+    0x0000000006050300ull, 0x0000000006050301ull, 0x0000000605030100ull,
+    0x0000000006050302ull, 0x0000000605030200ull, 0x0000000605030201ull,
+    0x0000060503020100ull, 0x0000000000060504ull, 0x0000000006050400ull,
+    0x0000000006050401ull, 0x0000000605040100ull, 0x0000000006050402ull,
+    0x0000000605040200ull, 0x0000000605040201ull, 0x0000060504020100ull,
+    0x0000000006050403ull, 0x0000000605040300ull, 0x0000000605040301ull,
+    0x0000060504030100ull, 0x0000000605040302ull, 0x0000060504030200ull,
+    0x0000060504030201ull, 0x0006050403020100ull, 0x0000000000000007ull,
+    0x0000000000000700ull, 0x0000000000000701ull, 0x0000000000070100ull,
+    0x0000000000000702ull, 0x0000000000070200ull, 0x0000000000070201ull,
+    0x0000000007020100ull, 0x0000000000000703ull, 0x0000000000070300ull,
+    0x0000000000070301ull, 0x0000000007030100ull, 0x0000000000070302ull,
+    0x0000000007030200ull, 0x0000000007030201ull, 0x0000000703020100ull,
+    0x0000000000000704ull, 0x0000000000070400ull, 0x0000000000070401ull,
+    0x0000000007040100ull, 0x0000000000070402ull, 0x0000000007040200ull,
+    0x0000000007040201ull, 0x0000000704020100ull, 0x0000000000070403ull,
+    0x0000000007040300ull, 0x0000000007040301ull, 0x0000000704030100ull,
+    0x0000000007040302ull, 0x0000000704030200ull, 0x0000000704030201ull,
+    0x0000070403020100ull, 0x0000000000000705ull, 0x0000000000070500ull,
+    0x0000000000070501ull, 0x0000000007050100ull, 0x0000000000070502ull,
+    0x0000000007050200ull, 0x0000000007050201ull, 0x0000000705020100ull,
+    0x0000000000070503ull, 0x0000000007050300ull, 0x0000000007050301ull,
+    0x0000000705030100ull, 0x0000000007050302ull, 0x0000000705030200ull,
+    0x0000000705030201ull, 0x0000070503020100ull, 0x0000000000070504ull,
+    0x0000000007050400ull, 0x0000000007050401ull, 0x0000000705040100ull,
+    0x0000000007050402ull, 0x0000000705040200ull, 0x0000000705040201ull,
+    0x0000070504020100ull, 0x0000000007050403ull, 0x0000000705040300ull,
+    0x0000000705040301ull, 0x0000070504030100ull, 0x0000000705040302ull,
+    0x0000070504030200ull, 0x0000070504030201ull, 0x0007050403020100ull,
+    0x0000000000000706ull, 0x0000000000070600ull, 0x0000000000070601ull,
+    0x0000000007060100ull, 0x0000000000070602ull, 0x0000000007060200ull,
+    0x0000000007060201ull, 0x0000000706020100ull, 0x0000000000070603ull,
+    0x0000000007060300ull, 0x0000000007060301ull, 0x0000000706030100ull,
+    0x0000000007060302ull, 0x0000000706030200ull, 0x0000000706030201ull,
+    0x0000070603020100ull, 0x0000000000070604ull, 0x0000000007060400ull,
+    0x0000000007060401ull, 0x0000000706040100ull, 0x0000000007060402ull,
+    0x0000000706040200ull, 0x0000000706040201ull, 0x0000070604020100ull,
+    0x0000000007060403ull, 0x0000000706040300ull, 0x0000000706040301ull,
+    0x0000070604030100ull, 0x0000000706040302ull, 0x0000070604030200ull,
+    0x0000070604030201ull, 0x0007060403020100ull, 0x0000000000070605ull,
+    0x0000000007060500ull, 0x0000000007060501ull, 0x0000000706050100ull,
+    0x0000000007060502ull, 0x0000000706050200ull, 0x0000000706050201ull,
+    0x0000070605020100ull, 0x0000000007060503ull, 0x0000000706050300ull,
+    0x0000000706050301ull, 0x0000070605030100ull, 0x0000000706050302ull,
+    0x0000070605030200ull, 0x0000070605030201ull, 0x0007060503020100ull,
+    0x0000000007060504ull, 0x0000000706050400ull, 0x0000000706050401ull,
+    0x0000070605040100ull, 0x0000000706050402ull, 0x0000070605040200ull,
+    0x0000070605040201ull, 0x0007060504020100ull, 0x0000000706050403ull,
+    0x0000070605040300ull, 0x0000070605040301ull, 0x0007060504030100ull,
+    0x0000070605040302ull, 0x0007060504030200ull, 0x0007060504030201ull,
+    0x0706050403020100ull,
+};
+
+static inline size_t _vtopk_filter_f32_avx2(float *x, size_t size,
+                                            float threshold, float *out_val,
+                                            uint32_t *out_idx) {
+  __m256 th = _mm256_set1_ps(threshold);
+  __m256i idx = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i step = _mm256_set1_epi32(8);
+  size_t count = 0;
+  size_t ssize = size - (size % 8);
+  for (size_t i = 0; i < ssize; i += 8) {
+    __m256 v = _mm256_loadu_ps(x + i);
+    int mask = _mm256_movemask_ps(_mm256_cmp_ps(v, th, _CMP_GT_OQ));
+    if (mask != 0) {
+      // The full 8-lane store only ever runs ahead of the input position,
+      // so it stays inside the caller's `size` elements
+      __m256i perm = _mm256_cvtepu8_epi32(
+          _mm_cvtsi64_si128((long long)_vtopk_compress_lut[mask]));
+      _mm256_storeu_ps(out_val + count, _mm256_permutevar8x32_ps(v, perm));
+      _mm256_storeu_si256((__m256i *)(out_idx + count),
+                          _mm256_permutevar8x32_epi32(idx, perm));
+      count += __builtin_popcount(mask);
+    }
+    idx = _mm256_add_epi32(idx, step);
+  }
+  // left over
+  for (size_t i = ssize; i < size; i++) {
+    if (x[i] > threshold) {
+      out_val[count] = x[i];
+      out_idx[count] = (uint32_t)i;
+      count++;
+    }
+  }
+  return count;
+}
+
+#endif // __AVX2__
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+static inline size_t _vtopk_filter_f32_avx512f(float *x, size_t size,
+                                               float threshold, float *out_val,
+                                               uint32_t *out_idx) {
+  __m512 th = _mm512_set1_ps(threshold);
+  __m512i idx = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+                                  13, 14, 15);
+  __m512i step = _mm512_set1_epi32(16);
+  size_t count = 0;
+  for (size_t i = 0; i < size; i += 16) {
+    __mmask16 active = size - i >= 16 ? 0xffff : (__mmask16)((1u << (size - i)) - 1);
+    __m512 v = _mm512_maskz_loadu_ps(active, x + i);
+    __mmask16 mask = _mm512_mask_cmp_ps_mask(active, v, th, _CMP_GT_OQ);
+    _mm512_mask_compressstoreu_ps(out_val + count, mask, v);
+    _mm512_mask_compressstoreu_epi32(out_idx + count, mask, idx);
+    count += __builtin_popcount(mask);
+    idx = _mm512_add_epi32(idx, step);
+  }
+  return count;
+}
+
+#endif // __AVX512F__
+
+/* ARM */
+
+#if defined(__ARM_FEATURE_SVE)
+
+#include <arm_sve.h>
+
+static inline size_t _vtopk_filter_f32_sve(float *x, size_t size,
+                                           float threshold, float *out_val,
+                                           uint32_t *out_idx) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    svfloat32_t v = svld1_f32(pg, &x[i]);
+    svbool_t mask = svcmpgt_n_f32(pg, v, threshold);
+    uint64_t n = svcntp_b32(pg, mask);
+    svbool_t head = svwhilelt_b32((uint64_t)0, n);
+    svst1_f32(head, &out_val[count], svcompact_f32(mask, v));
+    svst1_u32(head, &out_idx[count],
+              svcompact_u32(mask, svindex_u32((uint32_t)i, 1)));
+    count += n;
+  }
+  return count;
+}
+
+#endif // __ARM_FEATURE_SVE
+
+// vmaxvq_u32 is A64 only
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static inline size_t _vtopk_filter_f32_neon(float *x, size_t size,
+                                            float threshold, float *out_val,
+                                            uint32_t *out_idx) {
+  // NEON has no compress store, so test 16 values at a time and only fall
+  // back to scalar for groups that contain a survivor
+  float32x4_t th = vdupq_n_f32(threshold);
+  size_t count = 0;
+  size_t ssize = size - (size % 16);
+  for (size_t i = 0; i < ssize; i += 16) {
+    uint32x4_t m0 = vcgtq_f32(vld1q_f32(x + i), th);
+    uint32x4_t m1 = vcgtq_f32(vld1q_f32(x + i + 4), th);
+    uint32x4_t m2 = vcgtq_f32(vld1q_f32(x + i + 8), th);
+    uint32x4_t m3 = vcgtq_f32(vld1q_f32(x + i + 12), th);
+    uint32x4_t any = vorrq_u32(vorrq_u32(m0, m1), vorrq_u32(m2, m3));
+    if (vmaxvq_u32(any) != 0) {
+      for (size_t j = i; j < i + 16; j++) {
+        if (x[j] > threshold) {
+          out_val[count] = x[j];
+          out_idx[count] = (uint32_t)j;
+          count++;
+        }
+      }
+    }
+  }
+  // left over
+  for (size_t i = ssize; i < size; i++) {
+    if (x[i] > threshold) {
+      out_val[count] = x[i];
+      out_idx[count] = (uint32_t)i;
+      count++;
+    }
+  }
+  return count;
+}
+
+#endif // __ARM_NEON && __aarch64__
+
+// Compress-store every x[i] > threshold to the front of out_val, with the
+// matching i in out_idx. Returns the number of survivors. size must fit in
+// 32 bits and both outputs need room for size elements.
+size_t vtopk_filter_f32(float *x, size_t size, float threshold, float *out_val,
+                        uint32_t *out_idx) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    return _vtopk_filter_f32_avx512f(x, size, threshold, out_val, out_idx);
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    return _vtopk_filter_f32_avx2(x, size, threshold, out_val, out_idx);
+  }
+#endif // __AVX2__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    return _vtopk_filter_f32_sve(x, size, threshold, out_val, out_idx);
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vtopk_filter_f32_neon(x, size, threshold, out_val, out_idx);
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  return _vtopk_filter_f32_serial(x, size, threshold, out_val, out_idx);
+}
+
+/* Argmin */
+
+// Each kernel finds the smallest value in one pass and its first position in
+// a second; both passes skip NaN, so the result is SIZE_MAX only when there
+// is nothing but NaN.
+
+static inline size_t _vargmin_f32_serial(float *x, size_t size) {
+  float best = INFINITY;
+  for (size_t i = 0; i < size; i++) {
+    best = x[i] < best ? x[i] : best;
+  }
+  for (size_t i = 0; i < size; i++) {
+    if (x[i] == best) {
+      return i;
+    }
+  }
+  return SIZE_MAX;
+}
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+static inline size_t _vargmin_f32_avx2(float *x, size_t size) {
+  size_t ssize = size - (size % 8);
+  // minps returns its second operand when either is NaN, so NaN never wins
+  __m256 vmin = _mm256_set1_ps(INFINITY);
+  for (size_t i = 0; i < ssize; i += 8) {
+    vmin = _mm256_min_ps(_mm256_loadu_ps(x + i), vmin);
+  }
+  __m128 h = _mm_min_ps(_mm256_castps256_ps128(vmin),
+                        _mm256_extractf128_ps(vmin, 1));
+  h = _mm_min_ps(h, _mm_movehl_ps(h, h));
+  h = _mm_min_ss(h, _mm_shuffle_ps(h, h, 1));
+  float best = _mm_cvtss_f32(h);
+  // left over
+  for (size_t i = ssize; i < size; i++) {
+    best = x[i] < best ? x[i] : best;
+  }
+  __m256 vbest = _mm256_set1_ps(best);
+  for (size_t i = 0; i < ssize; i += 8) {
+    int mask = _mm256_movemask_ps(
+        _mm256_cmp_ps(_mm256_loadu_ps(x + i), vbest, _CMP_EQ_OQ));
+    if (mask != 0) {
+      return i + (size_t)__builtin_ctz((unsigned)mask);
+    }
+  }
+  for (size_t i = ssize; i < size; i++) {
+    if (x[i] == best) {
+      return i;
+    }
+  }
+  return SIZE_MAX;
+}
+
+#endif // __AVX2__
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+static inline size_t _vargmin_f32_avx512f(float *x, size_t size) {
+  __m512 vmin = _mm512_set1_ps(INFINITY);
+  for (size_t i = 0; i < size; i += 16) {
+    __mmask16 m = size - i >= 16 ? (__mmask16)0xffff
+                                 : (__mmask16)((1u << (size - i)) - 1);
+    // masked-off lanes load +inf; NaN lanes keep the running minimum
+    __m512 v = _mm512_mask_loadu_ps(_mm512_set1_ps(INFINITY), m, x + i);
+    vmin = _mm512_min_ps(v, vmin);
+  }
+  __m512 vbest = _mm512_set1_ps(_mm512_reduce_min_ps(vmin));
+  for (size_t i = 0; i < size; i += 16) {
+    __mmask16 m = size - i >= 16 ? (__mmask16)0xffff
+                                 : (__mmask16)((1u << (size - i)) - 1);
+    __m512 v = _mm512_maskz_loadu_ps(m, x + i);
+    __mmask16 eq = _mm512_mask_cmp_ps_mask(m, v, vbest, _CMP_EQ_OQ);
+    if (eq != 0) {
+      return i + (size_t)__builtin_ctz((unsigned)eq);
+    }
+  }
+  return SIZE_MAX;
+}
+
+#endif // __AVX512F__
+
+#if defined(__ARM_FEATURE_SVE)
+
+#include <arm_sve.h>
+
+static inline size_t _vargmin_f32_sve(float *x, size_t size) {
+  // fminnm ignores a NaN operand
+  svfloat32_t vmin = svdup_n_f32(INFINITY);
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    vmin = svminnm_f32_m(pg, vmin, svld1_f32(pg, &x[i]));
+  }
+  float best = svminnmv_f32(svptrue_b32(), vmin);
+  for (size_t i = 0; i < size; i += svcntw()) {
+    svbool_t pg = svwhilelt_b32(i, size);
+    svbool_t eq = svcmpeq_n_f32(pg, svld1_f32(pg, &x[i]), best);
+    if (svptest_any(pg, eq)) {
+      return i + svcntp_b32(pg, svbrkb_z(pg, eq));
+    }
+  }
+  return SIZE_MAX;
+}
+
+#endif // __ARM_FEATURE_SVE
+
+// vminnmq_f32 and vminnmvq_f32 are A64 only
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+#include <arm_neon.h>
+
+static inline size_t _vargmin_f32_neon(float *x, size_t size) {
+  size_t ssize = size - (size % 4);
+  float32x4_t vmin = vdupq_n_f32(INFINITY);
+  for (size_t i = 0; i < ssize; i += 4) {
+    vmin = vminnmq_f32(vmin, vld1q_f32(x + i));
+  }
+  float best = vminnmvq_f32(vmin);
+  // left over
+  for (size_t i = ssize; i < size; i++) {
+    best = x[i] < best ? x[i] : best;
+  }
+  float32x4_t vbest = vdupq_n_f32(best);
+  for (size_t i = 0; i < ssize; i += 4) {
+    if (vmaxvq_u32(vceqq_f32(vld1q_f32(x + i), vbest)) != 0) {
+      for (size_t j = i;; j++) {
+        if (x[j] == best) {
+          return j;
+        }
+      }
+    }
+  }
+  for (size_t i = ssize; i < size; i++) {
+    if (x[i] == best) {
+      return i;
+    }
+  }
+  return SIZE_MAX;
+}
+
+#endif // __ARM_NEON && __aarch64__
+
+// Index of the smallest of size floats (the first one on ties), ignoring
+// NaN. Returns SIZE_MAX if there is no such value.
+size_t vargmin_f32(float *x, size_t size) {
+#ifdef VDOT_STATIC_DISPATCH
+#undef SIMDINFO_SUPPORTS
+#define SIMDINFO_SUPPORTS(info, feature) (1)
+#else
+  simdinfo_t info = simdinfo();
+#endif
+
+// x86
+#if defined(__AVX512F__)
+  if (SIMDINFO_SUPPORTS(info, __AVX512F__)) {
+    return _vargmin_f32_avx512f(x, size);
+  }
+#endif // __AVX512F__
+#if defined(__AVX2__)
+  if (SIMDINFO_SUPPORTS(info, __AVX2__)) {
+    return _vargmin_f32_avx2(x, size);
+  }
+#endif // __AVX2__
+
+// ARM
+#if defined(__ARM_FEATURE_SVE)
+  if (SIMDINFO_SUPPORTS(info, __ARM_FEATURE_SVE)) {
+    return _vargmin_f32_sve(x, size);
+  }
+#endif // __ARM_FEATURE_SVE
+#if defined(__ARM_NEON) && defined(__aarch64__)
+  if (SIMDINFO_SUPPORTS(info, __ARM_NEON)) {
+    return _vargmin_f32_neon(x, size);
+  }
+#endif // __ARM_NEON && __aarch64__
+
+  // Default
+  // Fall back to serial implementation
+  return _vargmin_f32_serial(x, size);
+}
+
+/* Heap */
+
+// Streaming top-k: a min-heap of the k best (value, index) pairs seen so far,
+// stored in caller-provided arrays. The root is the current k-th best, which
+// is the threshold new scores have to beat. Ties keep the lower index.
+typedef struct vtopk_t {
+  size_t k;
+  size_t count;
+  float *val;
+  size_t *idx;
+} vtopk_t;
+
+static inline void vtopk_init(vtopk_t *t, size_t k, size_t *idx, float *val) {
+  t->k = k;
+  t->count = 0;
+  t->val = val;
+  t->idx = idx;
+}
+
+// Scores that are not above this value can never enter the heap
+static inline float vtopk_threshold(vtopk_t *t) {
+  return t->count < t->k ? -INFINITY : t->val[0];
+}
+
+static inline int _vtopk_worse(float va, size_t ia, float vb, size_t ib) {
+  return va < vb || (va == vb && ia > ib);
+}
+
+static inline void _vtopk_sift_down(vtopk_t *t, size_t n, size_t i) {
+  float v = t->val[i];
+  size_t id = t->idx[i];
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= n) {
+      break;
+    }
+    if (c + 1 < n && _vtopk_worse(t->val[c + 1], t->idx[c + 1], t->val[c], t->idx[c])) {
+      c++;
+    }
+    if (!_vtopk_worse(t->val[c], t->idx[c], v, id)) {
+      break;
+    }
+    t->val[i] = t->val[c];
+    t->idx[i] = t->idx[c];
+    i = c;
+  }
+  t->val[i] = v;
+  t->idx[i] = id;
+}
+
+static inline void _vtopk_sift_up(vtopk_t *t, size_t i) {
+  float v = t->val[i];
+  size_t id = t->idx[i];
+  while (i > 0) {
+    size_t p = (i - 1) / 2;
+    if (!_vtopk_worse(v, id, t->val[p], t->idx[p])) {
+      break;
+    }
+    t->val[i] = t->val[p];
+    t->idx[i] = t->idx[p];
+    i = p;
+  }
+  t->val[i] = v;
+  t->idx[i] = id;
+}
+
+// Offer a single (value, index) pair
+static inline void vtopk_push1(vtopk_t *t, float val, size_t idx) {
+  if (t->count < t->k) {
+    if (isnan(val)) {
+      return;
+    }
+    t->val[t->count] = val;
+    t->idx[t->count] = idx;
+    _vtopk_sift_up(t, t->count++);
+  } else if (t->k > 0 && _vtopk_worse(t->val[0], t->idx[0], val, idx)) {
+    t->val[0] = val;
+    t->idx[0] = idx;
+    _vtopk_sift_down(t, t->k, 0);
+  }
+}
+
+// Offer scores[0..size), which carry indices base..base+size. Once the heap
+// is full only the survivors of the SIMD threshold filter touch the heap.
+void vtopk_push_f32(vtopk_t *t, float *scores, size_t size, size_t base) {
+  size_t i = 0;
+  while (t->count < t->k && i < size) {
+    vtopk_push1(t, scores[i], base + i);
+    i++;
+  }
+  if (t->count < t->k) {
+    return;
+  }
+  float buf_val[VTOPK_BLOCK];
+  uint32_t buf_idx[VTOPK_BLOCK];
+  while (i < size) {
+    size_t n = size - i < VTOPK_BLOCK ? size - i : VTOPK_BLOCK;
+    size_t count = vtopk_filter_f32(scores + i, n, t->val[0], buf_val, buf_idx);
+    for (size_t j = 0; j < count; j++) {
+      vtopk_push1(t, buf_val[j], base + i + buf_idx[j]);
+    }
+    i += n;
+  }
+}
+
+// Sort the heap in place, best first, and return the number of results
+size_t vtopk_finish(vtopk_t *t) {
+  for (size_t n = t->count; n > 1; n--) {
+    float v = t->val[0];
+    size_t id = t->idx[0];
+    t->val[0] = t->val[n - 1];
+    t->idx[0] = t->idx[n - 1];
+    t->val[n - 1] = v;
+    t->idx[n - 1] = id;
+    _vtopk_sift_down(t, n - 1, 0);
+  }
+  return t->count;
+}
+
+// The k largest of scores[0..size), best first, into out_idx / out_val.
+// Returns min(k, number of non-NaN scores).
+size_t vtopk_f32(float *scores, size_t size, size_t k, size_t *out_idx,
+                 float *out_val) {
+  vtopk_t t;
+  vtopk_init(&t, k, out_idx, out_val);
+  vtopk_push_f32(&t, scores, size, 0);
+  return vtopk_finish(&t);
+}
+
+// Top-k of query . rows[i] over n_rows rows of dim floats, stride floats
+// apart. Scores are produced and filtered a block at a time, so the full
+// score array is never materialized.
+size_t vdot_topk_f32(float *query, float *rows, size_t n_rows, size_t dim,
+                     size_t stride, size_t k, size_t *out_idx,
+                     float *out_val) {
+  vtopk_t t;
+  vtopk_init(&t, k, out_idx, out_val);
+  float scores[VTOPK_BLOCK];
+  for (size_t i = 0; i < n_rows; i += VTOPK_BLOCK) {
+    size_t n = n_rows - i < VTOPK_BLOCK ? n_rows - i : VTOPK_BLOCK;
+    for (size_t j = 0; j < n; j++) {
+      scores[j] = vdot_f32(query, rows + (i + j) * stride, dim);
+    }
+    vtopk_push_f32(&t, scores, n, i);
+  }
+  return vtopk_finish(&t);
+}
+
+#endif // VTOPK_H